@@ -0,0 +1,420 @@
+// Throughput benchmark: generates a synthetic corpus of WAV, FLAC and MP3
+// files, then converts it with the runner at several worker counts, and
+// reports files and megabytes per second, and the percentiles of the time
+// per file. Then it compares the transcodes piped from decoder to encoder
+// with the ones through a WAV on disk, in time and bytes written. The stub tools built beside it stand in for flac and lame unless
+// real ones are given, so the scheduling and the I/O are measured apart from
+// the codecs. Same arguments, same corpus.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Runner.h"
+#include "Sys.h"
+using std::string;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+const int EXIT_FAILED_FILES = 1, EXIT_USAGE = 2;
+
+void printUsage()
+{
+	fputs(
+		"Usage: flac-lame-bench [options]\n"
+		"\n"
+		"  --files N             files of each source format, WAV, FLAC and MP3 (default 8)\n"
+		"  --secs MIN[-MAX]      duration of each file, spread at random in between (default 10-60)\n"
+		"  --rates R[,R...]      sample rates, taken in turns (default 44100,48000)\n"
+		"  --threads N[,N...]    worker counts to run at (default 1, 2, 4... up to the cores)\n"
+		"  --targets T[,T...]    mp3, flac, wav (default all); each converts the other formats\n"
+		"  --flac PATH           real flac tool, instead of the stub\n"
+		"  --lame PATH           real lame tool, instead of the stub\n"
+		"  --stub-speed X        stubs keep a core busy for the audio length divided by X;\n"
+		"                        default 0, only their I/O\n"
+		"  --seed N              of the corpus (default 1)\n"
+		"  --dir DIR             where the corpus and outputs go, created if needed and\n"
+		"                        kept; default is a temporary folder, removed at the end\n",
+		stdout);
+}
+
+struct bench_options final {
+	size_t   numFiles = 8;
+	double   minSecs = 10, maxSecs = 60;
+	vector<unsigned> rates = {44100, 48000};
+	vector<size_t>   threads;
+	vector<Runner::target> targets = {Runner::target::MP3, Runner::target::FLAC, Runner::target::WAV};
+	wstring  flac = Sys::fromUtf8(STUB_FLAC_PATH), lame = Sys::fromUtf8(STUB_LAME_PATH);
+	unsigned seed = 1;
+	wstring  dir;
+};
+
+vector<string> split(const string& list)
+{
+	vector<string> items;
+	for (size_t beg = 0; beg <= list.size(); ) {
+		size_t end = list.find(',', beg);
+		if (end == string::npos) end = list.size();
+		items.emplace_back(list.substr(beg, end - beg));
+		beg = end + 1;
+	}
+	return items;
+}
+
+double toNumber(const string& opt, const string& text)
+{
+	try {
+		size_t used = 0;
+		double v = std::stod(text, &used);
+		if (used == text.size() && v >= 0) return v;
+	} catch (const std::exception&) { }
+	throw std::invalid_argument("Invalid number for " + opt + ": " + text);
+}
+
+const char* targetName(Runner::target t)
+{
+	return t == Runner::target::MP3 ? "mp3" : t == Runner::target::FLAC ? "flac" : "wav";
+}
+
+// A tone gliding up, with some noise, so real encoders have work alike on
+// each file; seeded per file.
+void writeWav(const wstring& path, unsigned sampleRate, double secs, unsigned seed)
+{
+	const unsigned CHANNELS = 2;
+	uint32_t numFrames = static_cast<uint32_t>(secs * sampleRate);
+	uint32_t dataSz = numFrames * CHANNELS * 2;
+	vector<uint8_t> buf;
+	auto put = [&buf](uint32_t v, unsigned numBytes) {
+		for (unsigned i = 0; i < numBytes; ++i) buf.emplace_back(static_cast<uint8_t>(v >> (8 * i)));
+	};
+	for (char c : string("RIFF")) buf.emplace_back(c);
+	put(36 + dataSz, 4);
+	for (char c : string("WAVEfmt ")) buf.emplace_back(c);
+	put(16, 4);
+	put(1, 2);
+	put(CHANNELS, 2);
+	put(sampleRate, 4);
+	put(sampleRate * CHANNELS * 2, 4);
+	put(CHANNELS * 2, 2);
+	put(16, 2);
+	for (char c : string("data")) buf.emplace_back(c);
+	put(dataSz, 4);
+
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<int> noise(-800, 800);
+	double freq = 110 + seed % 200;
+	for (uint32_t f = 0; f < numFrames; ++f) {
+		double t = static_cast<double>(f) / sampleRate;
+		double tone = 12000 * std::sin(2 * 3.14159265358979 * freq * t * (1 + t / 60));
+		for (unsigned c = 0; c < CHANNELS; ++c) {
+			put(static_cast<uint16_t>(static_cast<int16_t>(tone * (c ? 0.8 : 1) + noise(rng))), 2);
+		}
+	}
+
+	FILE* fp = Sys::openFile(path, "wb");
+	if (!fp || fwrite(buf.data(), 1, buf.size(), fp) != buf.size() || fclose(fp)) {
+		throw std::runtime_error("Failed to write " + Sys::toUtf8(path));
+	}
+}
+
+Runner::runnin_options baseOptions(const bench_options& bopts)
+{
+	Runner::runnin_options opts;
+	opts.convOpts.flac = bopts.flac;
+	opts.convOpts.lame = bopts.lame;
+	opts.useCache = false; // each run converts everything again
+	return opts;
+}
+
+void setTarget(Runner::runnin_options& opts, Runner::target t)
+{
+	opts.targetType = t;
+	opts.isVbr = true;
+	opts.quality = t == Runner::target::MP3 ? L"4" : t == Runner::target::FLAC ? L"8" : L"";
+}
+
+struct run_result final {
+	size_t   numConverted = 0, numFailed = 0;
+	double   secs = 0;
+	uint64_t bytesIn = 0;
+	double   p50 = 0, p95 = 0, p99 = 0;
+	string   firstError;
+};
+
+run_result runBatch(const Runner::runnin_options& opts)
+{
+	if (!Sys::isDir(opts.destFolder)) Sys::createDir(opts.destFolder);
+	std::mutex errMtx;
+	run_result r;
+	Runner runner(opts);
+	runner.start([&](const Runner::file_result& res) {
+		if (res.error.empty()) return;
+		std::lock_guard<std::mutex> lk(errMtx);
+		if (r.firstError.empty()) r.firstError = res.error;
+	});
+	runner.wait();
+	r.numConverted = runner.numConverted();
+	r.numFailed = runner.numFailed();
+	r.secs = runner.elapsedSecs();
+	r.bytesIn = runner.bytesConverted();
+	if (r.numConverted) {
+		r.p50 = runner.latencySecs(50);
+		r.p95 = runner.latencySecs(95);
+		r.p99 = runner.latencySecs(99);
+	}
+	return r;
+}
+
+// Of this process and the tools it waited for, as the kernel counts them
+// going to the disks, so a scratch WAV deleted right away still counts; 0
+// where it isn't told.
+uint64_t diskBytesWritten()
+{
+#ifdef __linux__
+	FILE* fp = fopen("/proc/self/io", "r");
+	if (!fp) return 0;
+	char line[128];
+	unsigned long long n = 0;
+	while (fgets(line, sizeof(line), fp) && sscanf(line, "write_bytes: %llu", &n) != 1) { }
+	fclose(fp);
+	return n;
+#else
+	return 0;
+#endif
+}
+
+// WAVs written here; the FLAC and MP3 sources are converted from more of
+// them by the same tools the runs use, so a stub corpus suits the stubs.
+vector<wstring> makeCorpus(const bench_options& bopts, vector<wstring>& flacs, vector<wstring>& mp3s)
+{
+	wstring wavDir = Sys::joinPath(bopts.dir, L"corpus-wav"), seedDir = Sys::joinPath(bopts.dir, L"corpus-seed");
+	for (const wstring& d : {wavDir, seedDir}) {
+		if (!Sys::isDir(d)) Sys::createDir(d);
+	}
+	std::mt19937 rng(bopts.seed);
+	std::uniform_real_distribution<double> secs(bopts.minSecs, bopts.maxSecs);
+	vector<wstring> wavs, seeds[2];
+	for (size_t i = 0; i < bopts.numFiles * 3; ++i) {
+		wchar_t name[32];
+		swprintf(name, 32, L"%03zu.wav", i);
+		wstring path = Sys::joinPath(i < bopts.numFiles ? wavDir : seedDir, name);
+		writeWav(path, bopts.rates[i % bopts.rates.size()], secs(rng), bopts.seed * 1000 + static_cast<unsigned>(i));
+		(i < bopts.numFiles ? wavs : seeds[i < bopts.numFiles * 2 ? 0 : 1]).emplace_back(path);
+	}
+
+	Runner::target targets[] = {Runner::target::FLAC, Runner::target::MP3};
+	const wchar_t* dirs[] = {L"corpus-flac", L"corpus-mp3"};
+	vector<wstring>* outs[] = {&flacs, &mp3s};
+	for (int k = 0; k < 2; ++k) {
+		Runner::runnin_options opts = baseOptions(bopts);
+		opts.files = seeds[k];
+		opts.destFolder = Sys::joinPath(bopts.dir, dirs[k]);
+		setTarget(opts, targets[k]);
+		run_result r = runBatch(opts);
+		if (r.numFailed) {
+			throw std::runtime_error("Failed to make the corpus: " + r.firstError);
+		}
+		for (const wstring& src : seeds[k]) {
+			outs[k]->emplace_back(Convert::destPath(src, opts.destFolder, targets[k] == Runner::target::FLAC ? L".flac" : L".mp3"));
+		}
+	}
+	Sys::removeTree(seedDir);
+	return wavs;
+}
+
+int run(const vector<string>& args)
+{
+	bench_options bopts;
+	bool tempDir = true;
+	const char* stubSpeed = nullptr;
+	string stubSpeedText;
+	for (size_t i = 0; i < args.size(); ++i) {
+		const string& arg = args[i];
+		auto value = [&]() -> const string& {
+			if (i + 1 >= args.size()) throw std::invalid_argument("Missing value for " + arg);
+			return args[++i];
+		};
+		if (arg == "-h" || arg == "--help") {
+			printUsage();
+			return 0;
+		} else if (arg == "--files") {
+			bopts.numFiles = static_cast<size_t>(toNumber(arg, value()));
+		} else if (arg == "--secs") {
+			string v = value();
+			size_t dash = v.find('-');
+			bopts.minSecs = toNumber(arg, v.substr(0, dash));
+			bopts.maxSecs = dash == string::npos ? bopts.minSecs : toNumber(arg, v.substr(dash + 1));
+		} else if (arg == "--rates") {
+			bopts.rates.clear();
+			for (const string& r : split(value())) bopts.rates.emplace_back(static_cast<unsigned>(toNumber(arg, r)));
+		} else if (arg == "--threads") {
+			for (const string& t : split(value())) bopts.threads.emplace_back(static_cast<size_t>(toNumber(arg, t)));
+		} else if (arg == "--targets") {
+			bopts.targets.clear();
+			for (const string& t : split(value())) {
+				if (t == "mp3") bopts.targets.emplace_back(Runner::target::MP3);
+				else if (t == "flac") bopts.targets.emplace_back(Runner::target::FLAC);
+				else if (t == "wav") bopts.targets.emplace_back(Runner::target::WAV);
+				else throw std::invalid_argument("Invalid target: " + t);
+			}
+		} else if (arg == "--flac") {
+			bopts.flac = Sys::fromUtf8(value());
+		} else if (arg == "--lame") {
+			bopts.lame = Sys::fromUtf8(value());
+		} else if (arg == "--stub-speed") {
+			stubSpeedText = value();
+			toNumber(arg, stubSpeedText);
+			stubSpeed = stubSpeedText.c_str();
+		} else if (arg == "--seed") {
+			bopts.seed = static_cast<unsigned>(toNumber(arg, value()));
+		} else if (arg == "--dir") {
+			bopts.dir = Sys::absolutePath(Sys::fromUtf8(value()));
+			tempDir = false;
+		} else {
+			throw std::invalid_argument("Unknown option: " + arg);
+		}
+	}
+	if (!bopts.numFiles || bopts.rates.empty() || bopts.minSecs <= 0 || bopts.maxSecs < bopts.minSecs) {
+		throw std::invalid_argument("The corpus needs files, rates and durations above zero.");
+	}
+	if (bopts.threads.empty()) {
+		for (size_t n = 1; n < Sys::numProcessors(); n *= 2) bopts.threads.emplace_back(n);
+		bopts.threads.emplace_back(Sys::numProcessors());
+	}
+	if (std::count(bopts.threads.begin(), bopts.threads.end(), 0)) {
+		throw std::invalid_argument("Worker counts start at 1.");
+	}
+	if (stubSpeed) { // the stubs read it, spawned by the runs
+#ifdef _WIN32
+		_putenv_s("STUB_CODEC_SPEED", stubSpeed);
+#else
+		setenv("STUB_CODEC_SPEED", stubSpeed, 1);
+#endif
+	}
+	if (tempDir) {
+		bopts.dir = Sys::joinPath(Sys::tempFolder(), L"flac-lame-bench");
+		Sys::removeTree(bopts.dir); // left by a run which failed
+	}
+	if (!Sys::isDir(bopts.dir)) Sys::createDir(bopts.dir);
+
+	Runner::runnin_options probe = baseOptions(bopts);
+	Convert::validateTools(probe.convOpts);
+	printf("Tools: %s, %s.\n", Convert::toolVersion(bopts.flac).c_str(), Convert::toolVersion(bopts.lame).c_str());
+
+	vector<wstring> flacs, mp3s;
+	vector<wstring> wavs = makeCorpus(bopts, flacs, mp3s);
+	printf("Corpus: %zu files each of WAV, FLAC and MP3, %g to %g s, in %s.\n\n",
+		bopts.numFiles, bopts.minSecs, bopts.maxSecs, Sys::toUtf8(bopts.dir).c_str());
+
+	bool anyFailed = false;
+	puts("target workers files    secs  files/s     MB/s  speedup   p50 s   p95 s   p99 s");
+	for (Runner::target t : bopts.targets) {
+		Runner::runnin_options opts = baseOptions(bopts);
+		setTarget(opts, t);
+		for (const vector<wstring>* srcs : {&wavs, &flacs, &mp3s}) { // all but its own format
+			if ((t == Runner::target::WAV && srcs == &wavs) || (t == Runner::target::FLAC && srcs == &flacs)
+				|| (t == Runner::target::MP3 && srcs == &mp3s)) continue;
+			opts.files.insert(opts.files.end(), srcs->begin(), srcs->end());
+		}
+
+		double baseRate = 0;
+		for (size_t n : bopts.threads) {
+			opts.numThreads = n;
+			opts.destFolder = Sys::joinPath(bopts.dir, Sys::fromUtf8(string("out-") + targetName(t)));
+			run_result r = runBatch(opts);
+			Sys::removeTree(opts.destFolder); // same disk space for each run
+
+			double rate = r.secs > 0 ? r.numConverted / r.secs : 0;
+			if (!baseRate) baseRate = rate;
+			printf("%-6s %7zu %5zu %7.2f %8.2f %8.2f %7.2fx %7.3f %7.3f %7.3f\n",
+				targetName(t), n, r.numConverted, r.secs, rate, r.bytesIn / r.secs / (1024 * 1024),
+				baseRate ? rate / baseRate : 0, r.p50, r.p95, r.p99);
+			if (r.numFailed) {
+				fprintf(stderr, "%zu files failed, the first one with: %s\n", r.numFailed, r.firstError.c_str());
+				anyFailed = true;
+			}
+		}
+	}
+
+	// The transcodes, FLAC to MP3 and back, through a pipe and through a WAV
+	// on disk, at the most workers.
+	struct transcode final {
+		Runner::target t;
+		const vector<wstring>* srcs;
+		const char* name;
+	};
+	vector<transcode> transcodes;
+	for (Runner::target t : bopts.targets) {
+		if (t == Runner::target::MP3) transcodes.push_back({t, &flacs, "flac>mp3"});
+		if (t == Runner::target::FLAC) transcodes.push_back({t, &mp3s, "mp3>flac"});
+	}
+	if (!transcodes.empty()) {
+		bool ioKnown = diskBytesWritten() > 0;
+		printf("\n%-9s %-6s workers    secs  MB written  outputs MB\n", "transcode", "path");
+		for (const transcode& tc : transcodes) {
+			for (bool streaming : {true, false}) {
+				Runner::runnin_options opts = baseOptions(bopts);
+				setTarget(opts, tc.t);
+				opts.files = *tc.srcs;
+				opts.numThreads = bopts.threads.back();
+				opts.convOpts.streaming = streaming;
+				opts.destFolder = Sys::joinPath(bopts.dir, L"out-transcode");
+				uint64_t written0 = diskBytesWritten();
+				run_result r = runBatch(opts);
+				uint64_t written = diskBytesWritten() - written0;
+				uint64_t outBytes = 0;
+				for (const wstring& src : opts.files) {
+					wstring dest = Convert::destPath(src, opts.destFolder, Runner::targetExt(tc.t));
+					if (Sys::exists(dest)) outBytes += Sys::fileSize(dest);
+				}
+				Sys::removeTree(opts.destFolder);
+
+				char writtenText[32] = "-";
+				if (ioKnown) snprintf(writtenText, sizeof(writtenText), "%.2f", written / (1024.0 * 1024));
+				printf("%-9s %-6s %7zu %7.2f %11s %11.2f\n", tc.name, streaming ? "piped" : "wav",
+					opts.numThreads, r.secs, writtenText, outBytes / (1024.0 * 1024));
+				if (r.numFailed) {
+					fprintf(stderr, "%zu files failed, the first one with: %s\n", r.numFailed, r.firstError.c_str());
+					anyFailed = true;
+				}
+			}
+		}
+	}
+
+	if (tempDir) Sys::removeTree(bopts.dir);
+	return anyFailed ? EXIT_FAILED_FILES : 0;
+}
+
+}//namespace
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	vector<string> args;
+	for (int i = 1; i < argc; ++i) {
+		args.emplace_back(Sys::toUtf8(argv[i]));
+	}
+#else
+int main(int argc, char* argv[])
+{
+	vector<string> args(argv + 1, argv + argc);
+#endif
+
+	try {
+		return run(args);
+	} catch (const std::invalid_argument& e) {
+		fprintf(stderr, "%s\nRun with --help for usage.\n", e.what());
+		return EXIT_USAGE;
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return EXIT_USAGE;
+	}
+}
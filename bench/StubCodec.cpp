@@ -0,0 +1,326 @@
+// Deterministic stand-ins for the flac and lame tools, taking the arguments
+// the engine gives the real ones, so a benchmark measures the scheduling and
+// the I/O apart from the codecs. Built twice: stub-flac, and stub-lame with
+// STUB_LAME defined.
+//
+// A stub FLAC is a STREAMINFO, signed as FLAC does, followed by the raw PCM;
+// a stub MP3 is a run of silent 128 kbps frames, as long as the audio. With
+// STUB_CODEC_SPEED set, each file also keeps a core busy for its duration
+// divided by that, as a codec running that many times faster than real time.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "Md5.h"
+#include "Sys.h"
+using std::string;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+const uint8_t MP3_FRAME_HDR[] = {0xff, 0xfb, 0x90, 0x44}; // MPEG-1 layer III, 128 kbps, 44.1 kHz, joint stereo
+const size_t  MP3_FRAME_SZ = 417, MP3_FRAME_SAMPLES = 1152, MP3_RATE = 44100;
+
+struct pcm_audio final {
+	unsigned sampleRate = 0, channels = 0, bitsPerSample = 0;
+	vector<uint8_t> data; // little-endian, as in WAV
+
+	size_t numFrames() const { return data.size() / (channels * ((bitsPerSample + 7) / 8)); }
+	double secs() const { return sampleRate ? static_cast<double>(numFrames()) / sampleRate : 0; }
+};
+
+uint32_t getLe(const uint8_t* p, unsigned numBytes)
+{
+	uint32_t v = 0;
+	for (unsigned i = numBytes; i-- > 0; ) v = (v << 8) | p[i];
+	return v;
+}
+
+void putLe(vector<uint8_t>& out, uint32_t v, unsigned numBytes)
+{
+	for (unsigned i = 0; i < numBytes; ++i) out.emplace_back(static_cast<uint8_t>(v >> (8 * i)));
+}
+
+vector<uint8_t> readAll(const wstring& path)
+{
+	FILE* fp = path == L"-" ? stdin : Sys::openFile(path, "rb");
+	if (!fp) throw std::runtime_error("Failed to open " + Sys::toUtf8(path));
+	vector<uint8_t> data;
+	uint8_t buf[65536];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0; ) {
+		data.insert(data.end(), buf, buf + n);
+	}
+	if (fp != stdin) fclose(fp);
+	return data;
+}
+
+void writeAll(const wstring& path, const vector<uint8_t>& data)
+{
+	FILE* fp = path == L"-" ? stdout : Sys::openFile(path, "wb");
+	if (!fp) throw std::runtime_error("Failed to create " + Sys::toUtf8(path));
+	bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	ok = (fp == stdout ? fflush(fp) : fclose(fp)) == 0 && ok;
+	if (!ok) throw std::runtime_error("Failed to write " + Sys::toUtf8(path));
+}
+
+pcm_audio parseWav(const vector<uint8_t>& d, bool ignoreSizes = false)
+{
+	// Sizes of 0 or past the end, as streamed WAVs have, run to the end of the data;
+	// with --ignore-chunk-sizes, any size does, chunks after it included, as in flac.
+	if (d.size() < 12 || memcmp(d.data(), "RIFF", 4) || memcmp(d.data() + 8, "WAVE", 4)) {
+		throw std::runtime_error("Not a WAV file.");
+	}
+	pcm_audio a;
+	for (size_t pos = 12; pos + 8 <= d.size(); ) {
+		size_t sz = getLe(&d[pos + 4], 4);
+		if (!memcmp(&d[pos], "fmt ", 4) && pos + 24 <= d.size()) {
+			a.channels = getLe(&d[pos + 10], 2);
+			a.sampleRate = getLe(&d[pos + 12], 4);
+			a.bitsPerSample = getLe(&d[pos + 22], 2);
+		} else if (!memcmp(&d[pos], "data", 4)) {
+			if (!a.channels || !a.bitsPerSample) break;
+			size_t end = (ignoreSizes || sz == 0 || sz > d.size() - pos - 8) ? d.size() : pos + 8 + sz;
+			a.data.assign(d.begin() + pos + 8, d.begin() + end);
+			a.data.resize(a.numFrames() * a.channels * ((a.bitsPerSample + 7) / 8)); // whole frames only
+			return a;
+		}
+		pos += 8 + sz + (sz & 1);
+	}
+	throw std::runtime_error("WAV file has no fmt or data chunk.");
+}
+
+vector<uint8_t> makeWav(const pcm_audio& a)
+{
+	unsigned blockAlign = a.channels * ((a.bitsPerSample + 7) / 8);
+	vector<uint8_t> w = {'R', 'I', 'F', 'F'};
+	putLe(w, static_cast<uint32_t>(36 + a.data.size()), 4);
+	for (char c : string("WAVEfmt ")) w.emplace_back(c);
+	putLe(w, 16, 4);
+	putLe(w, 1, 2); // PCM
+	putLe(w, a.channels, 2);
+	putLe(w, a.sampleRate, 4);
+	putLe(w, a.sampleRate * blockAlign, 4);
+	putLe(w, blockAlign, 2);
+	putLe(w, a.bitsPerSample, 2);
+	for (char c : string("data")) w.emplace_back(c);
+	putLe(w, static_cast<uint32_t>(a.data.size()), 4);
+	w.insert(w.end(), a.data.begin(), a.data.end());
+	return w;
+}
+
+void work(double audioSecs)
+{
+	// Busy, not asleep, so it counts against the cores as a codec would.
+	const char* speed = getenv("STUB_CODEC_SPEED");
+	double factor = speed ? atof(speed) : 0;
+	if (factor <= 0) return;
+	auto until = std::chrono::steady_clock::now() + std::chrono::duration<double>(audioSecs / factor);
+	while (std::chrono::steady_clock::now() < until) { }
+}
+
+wstring withExtension(const wstring& src, const wchar_t* ext)
+{
+	if (src == L"-") throw std::runtime_error("No output given for stdin.");
+	return Sys::changeExtension(src, ext);
+}
+
+#ifndef STUB_LAME
+
+pcm_audio parseFlac(const vector<uint8_t>& d, std::array<uint8_t, 16>* md5 = nullptr)
+{
+	if (d.size() < 42 || memcmp(d.data(), "fLaC", 4) || (d[4] & 0x7f) != 0) {
+		throw std::runtime_error("Not a stub FLAC file.");
+	}
+	const uint8_t* si = &d[8];
+	pcm_audio a;
+	a.sampleRate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+	a.channels = ((si[12] >> 1) & 7) + 1;
+	a.bitsPerSample = (((si[12] & 1) << 4) | (si[13] >> 4)) + 1;
+	if (md5) memcpy(md5->data(), si + 18, 16);
+
+	size_t pos = 4;
+	for (;;) { // metadata blocks, the last one flagged
+		if (pos + 4 > d.size()) throw std::runtime_error("Truncated stub FLAC metadata.");
+		bool isLast = (d[pos] & 0x80) != 0;
+		pos += 4 + ((d[pos + 1] << 16) | (d[pos + 2] << 8) | d[pos + 3]);
+		if (isLast) break;
+	}
+	if (pos > d.size()) throw std::runtime_error("Truncated stub FLAC metadata.");
+	a.data.assign(d.begin() + pos, d.end());
+	return a;
+}
+
+vector<uint8_t> makeFlac(const pcm_audio& a)
+{
+	Md5 md5;
+	md5.update(a.data.data(), a.data.size());
+	std::array<uint8_t, 16> sig = md5.finish();
+
+	vector<uint8_t> f = {'f', 'L', 'a', 'C', 0x80, 0, 0, 34}; // STREAMINFO, the last block
+	uint8_t si[34] = {0x10, 0x00, 0x10, 0x00}; // block sizes of 4096
+	uint64_t packed = (static_cast<uint64_t>(a.sampleRate) << 44)
+		| (static_cast<uint64_t>(a.channels - 1) << 41)
+		| (static_cast<uint64_t>(a.bitsPerSample - 1) << 36)
+		| (a.numFrames() & 0xfffffffffULL);
+	for (int i = 0; i < 8; ++i) si[10 + i] = static_cast<uint8_t>(packed >> (8 * (7 - i)));
+	memcpy(si + 18, sig.data(), 16);
+	f.insert(f.end(), si, si + sizeof(si));
+	f.insert(f.end(), a.data.begin(), a.data.end());
+	return f;
+}
+
+int flac(const vector<wstring>& args)
+{
+	bool decode = false, test = false, toStdout = false, ignoreSizes = false;
+	wstring src, out;
+	for (size_t i = 0; i < args.size(); ++i) {
+		const wstring& a = args[i];
+		if (a == L"--version") {
+			puts("flac stub");
+			return 0;
+		} else if (a == L"-d") {
+			decode = true;
+		} else if (a == L"-t") {
+			test = true;
+		} else if (a == L"-c") {
+			toStdout = true;
+		} else if (a == L"--ignore-chunk-sizes") {
+			ignoreSizes = true;
+		} else if (a == L"-o" && i + 1 < args.size()) {
+			out = args[++i];
+		} else if (a == L"-" || a[0] != L'-') {
+			src = a;
+		} // levels, -V, -s and the rest change nothing here
+	}
+	if (src.empty()) throw std::runtime_error("No input file.");
+
+	vector<uint8_t> in = readAll(src);
+	if (test) {
+		std::array<uint8_t, 16> stored;
+		pcm_audio a = parseFlac(in, &stored);
+		Md5 md5;
+		md5.update(a.data.data(), a.data.size());
+		work(a.secs());
+		if (md5.finish() != stored) throw std::runtime_error("MD5 signature mismatch.");
+		return 0;
+	}
+	if (decode) {
+		pcm_audio a = parseFlac(in);
+		work(a.secs());
+		writeAll(toStdout ? L"-" : !out.empty() ? out : withExtension(src, L".wav"), makeWav(a));
+		return 0;
+	}
+	pcm_audio a = in.size() >= 4 && !memcmp(in.data(), "fLaC", 4) ? parseFlac(in) : parseWav(in, ignoreSizes);
+	work(a.secs());
+	writeAll(!out.empty() ? out : withExtension(src, L".flac"), makeFlac(a));
+	return 0;
+}
+
+#else
+
+size_t mp3Frames(const vector<uint8_t>& d)
+{
+	size_t pos = 0;
+	if (d.size() >= 10 && !memcmp(d.data(), "ID3", 3)) {
+		pos = 10 + ((d[6] << 21) | (d[7] << 14) | (d[8] << 7) | d[9]);
+	}
+	if (pos + 4 > d.size() || memcmp(&d[pos], MP3_FRAME_HDR, 2)) {
+		throw std::runtime_error("Not a stub MP3 file.");
+	}
+	return (d.size() - pos) / MP3_FRAME_SZ;
+}
+
+vector<uint8_t> makeMp3(size_t numFrames)
+{
+	vector<uint8_t> m(numFrames * MP3_FRAME_SZ, 0);
+	for (size_t i = 0; i < numFrames; ++i) memcpy(&m[i * MP3_FRAME_SZ], MP3_FRAME_HDR, sizeof(MP3_FRAME_HDR));
+	return m;
+}
+
+int lame(const vector<wstring>& args)
+{
+	bool decode = false, mp3Input = false;
+	vector<wstring> files;
+	for (size_t i = 0; i < args.size(); ++i) {
+		const wstring& a = args[i];
+		if (a == L"--version") {
+			puts("LAME stub");
+			return 0;
+		} else if (a == L"--decode") {
+			decode = true;
+		} else if (a == L"--mp3input") {
+			mp3Input = true;
+		} else if ((a == L"-V" || a == L"-b") && i + 1 < args.size()) {
+			++i; // quality, changes nothing here
+		} else if (a == L"-" || a[0] != L'-') {
+			files.emplace_back(a);
+		}
+	}
+	if (files.empty()) throw std::runtime_error("No input file.");
+	const wstring& src = files[0];
+
+	vector<uint8_t> in = readAll(src);
+	if (decode) {
+		pcm_audio a;
+		a.sampleRate = MP3_RATE;
+		a.channels = 2;
+		a.bitsPerSample = 16;
+		a.data.assign(mp3Frames(in) * MP3_FRAME_SAMPLES * 4, 0); // silence, as the stub frames hold
+		work(a.secs());
+		writeAll(files.size() > 1 ? files[1] : withExtension(src, L".wav"), makeWav(a));
+		return 0;
+	}
+	size_t numFrames;
+	if (mp3Input) {
+		numFrames = mp3Frames(in);
+		work(static_cast<double>(numFrames * MP3_FRAME_SAMPLES) / MP3_RATE);
+	} else {
+		pcm_audio a = parseWav(in);
+		numFrames = static_cast<size_t>(a.secs() * MP3_RATE + MP3_FRAME_SAMPLES - 1) / MP3_FRAME_SAMPLES + 1; // and the encoder delay
+		work(a.secs());
+	}
+	writeAll(files.size() > 1 ? files[1] : withExtension(src, L".mp3"), makeMp3(numFrames));
+	return 0;
+}
+
+#endif
+
+}//namespace
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	vector<wstring> args(argv + 1, argv + argc);
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#else
+int main(int argc, char* argv[])
+{
+	vector<wstring> args;
+	for (int i = 1; i < argc; ++i) {
+		args.emplace_back(Sys::fromUtf8(argv[i]));
+	}
+#endif
+
+	try {
+#ifdef STUB_LAME
+		return lame(args);
+#else
+		return flac(args);
+#endif
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+}
@@ -30,6 +30,8 @@
 #define MNU_ABOUT                       1021
 #define MNU_OPENFILES                   1022
 #define MNU_REMSELECTED                 1023
+#define LBL_RATE                        1024
+#define LST_WORKERS                     1025
 
 // Next default values for new objects
 // 
@@ -37,7 +39,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        107
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1024
+#define _APS_NEXT_CONTROL_VALUE         1026
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
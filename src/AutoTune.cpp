@@ -0,0 +1,60 @@
+#include "AutoTune.h"
+#include <algorithm>
+
+static const double GAIN_UP = 1.03;   // more workers must pay for themselves
+static const double LOSS_DOWN = 0.98; // fewer workers may cost a little, within noise
+static const double CPU_BUSY = 0.95;
+static const size_t HOLD_SAMPLES = 5;
+
+AutoTune::AutoTune(size_t minLevel, size_t maxLevel, size_t startLevel)
+	: mMin(std::max<size_t>(minLevel, 1)), mMax(std::max(maxLevel, mMin)),
+		mLevel(std::min(std::max(startLevel, mMin), mMax)), mCur(mLevel)
+{
+}
+
+size_t AutoTune::update(const sample& s)
+{
+	if (s.throughput <= 0) return mLevel; // nothing finished, nothing learned
+
+	if (mLevel == mCur) { // measured the accepted level itself
+		mCurThroughput = mCurThroughput > 0 ? (mCurThroughput + s.throughput) / 2 : s.throughput;
+		double prevIo = mCurIo;
+		mCurIo = s.ioBytesPerSec;
+		if (mHoldLeft) {
+			--mHoldLeft;
+			return mLevel;
+		}
+		if (mDir > 0 && s.cpuUtil > CPU_BUSY && s.ioBytesPerSec <= prevIo * GAIN_UP) {
+			mDir = -1; // CPU is the wall and the disk isn't speeding up: no point in adding
+		}
+		return mLevel = _trial();
+	}
+
+	bool better = mLevel > mCur ?
+		s.throughput > mCurThroughput * GAIN_UP : s.throughput >= mCurThroughput * LOSS_DOWN;
+	if (better) {
+		mCur = mLevel;
+		mCurThroughput = s.throughput;
+		mCurIo = s.ioBytesPerSec;
+		mTurns = 0;
+		return mLevel = _trial(); // same direction, one more step
+	}
+
+	mLevel = mCur; // back to where it was good
+	mDir = -mDir;
+	if (++mTurns >= 2) {
+		mTurns = 0;
+		mHoldLeft = HOLD_SAMPLES;
+	}
+	return mLevel;
+}
+
+size_t AutoTune::_trial()
+{
+	size_t step = std::max<size_t>(mCur / 4, 1);
+	size_t next = mDir > 0 ? std::min(mCur + step, mMax) : (mCur > mMin + step ? mCur - step : mMin);
+	if (next == mCur) { // hit a bound, try the other way next time
+		mDir = -mDir;
+	}
+	return next;
+}
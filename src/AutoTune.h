@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+
+// Picks the number of active workers while a batch runs, by hill climbing on
+// throughput: tries one step further, keeps it if the batch got faster (or,
+// going down, no slower), otherwise turns back; after turning twice it holds
+// for a while, then probes again since the mix of jobs changes.
+class AutoTune final {
+public:
+	struct sample final {
+		double throughput = 0;    // audio seconds converted per wall second
+		double cpuUtil = -1;      // whole machine, 0 to 1; negative if unknown
+		double ioBytesPerSec = 0; // read from sources plus written to outputs
+		double latency = 0;       // seconds of work per audio second, averaged over the jobs
+	};
+
+private:
+	size_t mMin, mMax;
+	size_t mLevel;   // being measured now
+	size_t mCur;     // accepted level
+	double mCurThroughput = 0, mCurIo = 0;
+	int    mDir = +1;
+	size_t mTurns = 0, mHoldLeft = 0;
+
+public:
+	AutoTune(size_t minLevel, size_t maxLevel, size_t startLevel);
+
+	size_t update(const sample& s); // returns the level to use until the next sample
+	size_t level() const  { return mLevel; }
+	size_t chosen() const { return mCur; }
+
+private:
+	size_t _trial();
+};
@@ -0,0 +1,56 @@
+#include "Cancel.h"
+#include <algorithm>
+#include "Process.h"
+using std::lock_guard;
+using std::mutex;
+
+static thread_local Cancel* tlCancel = nullptr;
+
+Cancel::bind::bind(Cancel& c)
+	: mPrev(tlCancel)
+{
+	tlCancel = &c;
+}
+
+Cancel::bind::~bind()
+{
+	tlCancel = mPrev;
+}
+
+void Cancel::request()
+{
+	lock_guard<mutex> lk(mMtx);
+	mRequested = true;
+	for (Process* proc : mLive) {
+		proc->kill(); // its owner is blocked waiting for it, and sees it die
+	}
+}
+
+Cancel* Cancel::current()
+{
+	return tlCancel;
+}
+
+bool Cancel::isRequested()
+{
+	return tlCancel && tlCancel->requested();
+}
+
+void Cancel::check()
+{
+	if (isRequested()) throw error();
+}
+
+bool Cancel::enlist(Process* proc)
+{
+	lock_guard<mutex> lk(mMtx);
+	if (mRequested) return false;
+	mLive.emplace_back(proc);
+	return true;
+}
+
+void Cancel::discharge(Process* proc)
+{
+	lock_guard<mutex> lk(mMtx);
+	mLive.erase(std::remove(mLive.begin(), mLive.end(), proc), mLive.end());
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+class Process;
+
+// Stops a batch from any thread. The tools started by the jobs bound to it
+// are killed, any started later dies at once, and in-process conversions give
+// up at their next block; like Telemetry, the binding is per thread, so
+// Convert needs no extra arguments.
+class Cancel final {
+public:
+	class error final : public std::runtime_error {
+	public:
+		error() : std::runtime_error("Cancelled.") { }
+	};
+
+	// Jobs running on the calling thread belong to this Cancel, while in scope.
+	class bind final {
+	private:
+		Cancel* mPrev;
+
+	public:
+		explicit bind(Cancel& c);
+		bind(const bind&) = delete;
+		bind& operator=(const bind&) = delete;
+		~bind();
+	};
+
+private:
+	std::mutex            mMtx;
+	std::vector<Process*> mLive; // children running now
+	std::atomic<bool>     mRequested{false};
+
+public:
+	void request();
+	bool requested() const { return mRequested; }
+
+	static Cancel* current(); // of the calling thread, or null
+	static bool    isRequested(); // for the calling thread
+	static void    check(); // throws error if requested for the calling thread
+
+	// For Process: a child is enlisted once running, and discharged before
+	// it's reaped, so it's never killed after its id is reused.
+	bool enlist(Process* proc); // false if already requested, the child must go
+	void discharge(Process* proc);
+};
@@ -0,0 +1,714 @@
+// Headless batch front end: same engine as the dialog, no window. One JSON
+// line per file goes to stdout, so scripts can follow along; the exit code is
+// nonzero if any file failed.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <csignal>
+#include <pthread.h>
+#endif
+#include "Codec.h"
+#include "DirScanner.h"
+#include "Farm.h"
+#include "Node.h"
+#include "Runner.h"
+#include "Sys.h"
+#include "Watcher.h"
+using std::string;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+const int EXIT_FAILED_FILES = 1, EXIT_USAGE = 2, EXIT_CANCELLED = 130; // as shells report Ctrl+C
+
+using ini_sections = std::map<string, std::map<string, string>>;
+
+void printUsage()
+{
+	fputs(
+		"Usage: flac-lame-cli -t mp3|flac|wav [options] [file|folder...]\n"
+		"\n"
+		"Files are read from the manifest, or one per line from stdin if none are given.\n"
+		"Folders are searched for FLAC, MP3 and WAV files, subfolders included.\n"
+		"\n"
+		"  -t, --target FMT        output format: mp3, flac or wav\n"
+		"  -q, --quality Q         MP3: VBR 0-9 (default 4) or CBR kbps (default 128); FLAC: 1-8 (default 8)\n"
+		"      --cbr               MP3 at constant bitrate, instead of VBR\n"
+		"  -d, --dest DIR          destination folder, created if needed; default is beside each source\n"
+		"      --delete-source     delete each source file after its conversion succeeds\n"
+		"      --no-verify         skip checking each output on a job of its own before its source goes;\n"
+		"                          FLAC encoders still verify as they write\n"
+		"      --dedupe            convert files with the same audio once, FLAC and WAV alike, and link or\n"
+		"                          copy the outputs to the others\n"
+		"      --also FMT[:Q][:cbr][=DIR]\n"
+		"                          another output of each file, decoded once for all; repeatable, and DIR\n"
+		"                          defaults to -d, e.g. -t flac -d lossless --also mp3:0=v0 --also mp3:128:cbr=cbr\n"
+		"  -j, --threads N|auto    files converted in parallel; auto, the default, starts with\n"
+		"                          one per core and tunes itself on the measured throughput\n"
+		"  -m, --manifest FILE     read the files to convert from FILE, one per line\n"
+		"      --ini FILE          read [Tools] and [Options] from an INI file, like the GUI\n"
+		"      --lame PATH         LAME tool (default: lame in PATH)\n"
+		"      --flac PATH         FLAC tool (default: flac in PATH)\n"
+		"      --no-streaming      convert FLAC/MP3 through an intermediary WAV file\n"
+		"      --in-process        use the linked codecs instead of the tools\n"
+		"      --parallel-flac S   encode FLAC on all cores above S seconds; 0 disables (default 900)\n"
+		"      --no-cache          convert every file, even if the destination cache says it's up to date\n"
+		"      --cache-hash        also hash the sources for the cache, not just size and time\n"
+		"      --retries N         try a failed file up to N more times, waiting 1, 2, 4... seconds (default 0)\n"
+		"      --disk-jobs N       files at once on each disk; default is 4 on spinning disks and network\n"
+		"                          shares, no limit on the others\n"
+		"      --disk-mbps N       megabytes per second read plus written on each disk; 0, the default, is no limit\n"
+		"      --priority P        of the tools and workers: normal, the default, low or idle\n"
+		"      --pin-cores         run each worker and its tools on a physical core of its own, wrapping around\n"
+		"      --cpu-limit PCT     percent of the machine all the tools may take together; Windows only\n"
+		"      --replaygain        measure the loudness while converting, and tag FLAC and MP3 outputs with\n"
+		"                          track gain, and album gain for the files of each source folder\n"
+		"      --failed-list FILE  write the files which failed to FILE, to give back with -m for a re-run\n"
+		"      --journal FILE      log the files started and finished to FILE; given again with the same\n"
+		"                          files and settings, a cancelled or crashed batch resumes where it stopped\n"
+		"      --watch DIR         keep converting the files which land in DIR, subfolders included, until\n"
+		"                          Ctrl+C; repeatable, and the files already there are converted first\n"
+		"      --settle MS         with --watch, quiet time before a file is taken, a tenth of it once its\n"
+		"                          writer closed it (default 2000)\n"
+		"      --telemetry-csv FILE\n"
+		"                          write the queue wait, stage times and bytes of each file as CSV\n"
+		"      --telemetry-json FILE\n"
+		"                          the same as JSON, with totals and the busy time of each worker\n"
+		"      --trace FILE        write a timeline of the workers, for chrome://tracing or Perfetto\n"
+		"      --remote HOST:PORT[,...]\n"
+		"                          also convert on the nodes there, a worker for each slot they offer;\n"
+		"                          repeatable, and the port defaults to 7878\n"
+		"      --remote-shared     nodes read the sources by path, from storage shared with them, instead\n"
+		"                          of receiving them; with --serve, accept such jobs\n"
+		"      --serve [HOST:]PORT run as a node, converting for the --remote of other machines until\n"
+		"                          Ctrl+C; -j sets the slots, one per core by default. No target is given,\n"
+		"                          the jobs bring theirs. Use on a trusted network only\n",
+		stderr);
+}
+
+string trimmed(const string& s)
+{
+	size_t beg = s.find_first_not_of(" \t\r\n");
+	if (beg == string::npos) return {};
+	size_t end = s.find_last_not_of(" \t\r\n");
+	return s.substr(beg, end - beg + 1);
+}
+
+void readFileList(std::istream& in, vector<wstring>& files)
+{
+	string line;
+	while (std::getline(in, line)) {
+		line = trimmed(line);
+		if (!line.empty() && line[0] != '#') files.emplace_back(Sys::fromUtf8(line)); // comments, as in M3U playlists
+	}
+}
+
+ini_sections readIni(const wstring& path)
+{
+	FILE* fp = Sys::openFile(path, "rb");
+	if (!fp) {
+		throw std::runtime_error("File not found:\n" + Sys::toUtf8(path));
+	}
+	string text;
+	char buf[4096];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0; ) {
+		text.append(buf, n);
+	}
+	fclose(fp);
+	if (text.compare(0, 3, "\xef\xbb\xbf") == 0) text.erase(0, 3); // UTF-8 BOM
+
+	ini_sections sections;
+	string section;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t eol = text.find('\n', pos);
+		string line = trimmed(text.substr(pos, eol == string::npos ? string::npos : eol - pos));
+		pos = (eol == string::npos) ? text.size() : eol + 1;
+
+		if (line.empty() || line[0] == ';' || line[0] == '#') continue;
+		if (line.front() == '[' && line.back() == ']') {
+			section = trimmed(line.substr(1, line.size() - 2));
+		} else if (line.find('=') != string::npos) {
+			size_t eq = line.find('=');
+			sections[section][trimmed(line.substr(0, eq))] = trimmed(line.substr(eq + 1));
+		}
+	}
+	return sections;
+}
+
+// Ctrl+C, or a kill, cancels the batch: the tools are stopped, their partial
+// outputs removed, and the journal keeps what was finished.
+class stop_on_signal final {
+private:
+	std::function<void()> mOnStop;
+#ifdef _WIN32
+	static std::atomic<stop_on_signal*> sThis;
+
+	static BOOL WINAPI _onCtrl(DWORD)
+	{
+		stop_on_signal* self = sThis;
+		if (!self) return FALSE; // default handling, the process ends
+		self->mOnStop();
+		return TRUE;
+	}
+#else
+	sigset_t          mSigs;
+	std::atomic<bool> mDone{false};
+	std::thread       mThr;
+#endif
+
+public:
+	explicit stop_on_signal(std::function<void()> onStop) : mOnStop(std::move(onStop))
+	{
+#ifdef _WIN32
+		sThis = this;
+		SetConsoleCtrlHandler(_onCtrl, TRUE);
+#else
+		// Blocked before the workers exist, so they inherit it, and only
+		// this thread takes the signals; the children get them unblocked.
+		sigemptyset(&mSigs);
+		sigaddset(&mSigs, SIGINT);
+		sigaddset(&mSigs, SIGTERM);
+		sigaddset(&mSigs, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &mSigs, nullptr);
+		mThr = std::thread([this]() {
+			int sig = 0;
+			sigwait(&mSigs, &sig);
+			if (!mDone) mOnStop();
+		});
+#endif
+	}
+
+	~stop_on_signal()
+	{
+#ifdef _WIN32
+		SetConsoleCtrlHandler(_onCtrl, FALSE);
+		sThis = nullptr;
+#else
+		mDone = true;
+		pthread_kill(mThr.native_handle(), SIGTERM); // wakes it, blocked as it is
+		mThr.join();
+		pthread_sigmask(SIG_UNBLOCK, &mSigs, nullptr);
+#endif
+	}
+};
+
+#ifdef _WIN32
+std::atomic<stop_on_signal*> stop_on_signal::sThis{nullptr};
+#endif
+
+void expandFolders(vector<wstring>& files)
+{
+	// Folders are replaced by their files, sorted, so indexes are the same on each run.
+	vector<wstring> folders;
+	auto isFolder = [](const wstring& f) { return Sys::isDir(f); };
+	std::copy_if(files.begin(), files.end(), std::back_inserter(folders), isFolder);
+	if (folders.empty()) return;
+	files.erase(std::remove_if(files.begin(), files.end(), isFolder), files.end());
+
+	vector<wstring> found;
+	std::mutex foundMtx;
+	DirScanner scanner({L".flac", L".mp3", L".wav"});
+	scanner.start(folders, [&](vector<wstring>&& batch) {
+		std::lock_guard<std::mutex> lk(foundMtx);
+		found.insert(found.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+	});
+	scanner.wait();
+
+	std::sort(found.begin(), found.end());
+	files.insert(files.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+	fprintf(stderr, "Scanned %zu folders in %.2f seconds, %.0f files/s: %zu files found%s.\n",
+		scanner.numDirs(), scanner.elapsedSecs(), scanner.filesPerSec(), scanner.numFiles(),
+		scanner.numUnreadable() ? (", " + std::to_string(scanner.numUnreadable()) + " folders unreadable").c_str() : "");
+}
+
+unsigned toNumber(const string& opt, const string& val)
+{
+	if (val.empty() || val.find_first_not_of("0123456789") != string::npos) {
+		throw std::invalid_argument("Option " + opt + " expects a number, got \"" + val + "\".");
+	}
+	return static_cast<unsigned>(std::stoul(val));
+}
+
+ProcessPolicy::priority toPriority(const string& opt, const string& val)
+{
+	if (val == "normal") return ProcessPolicy::priority::NORMAL;
+	if (val == "low") return ProcessPolicy::priority::LOW;
+	if (val == "idle") return ProcessPolicy::priority::IDLE;
+	unsigned num = toNumber(opt, val); // as the INI file has it
+	if (num > 2) throw std::invalid_argument("Option " + opt + " expects normal, low or idle, got \"" + val + "\".");
+	return static_cast<ProcessPolicy::priority>(num);
+}
+
+Convert::output toOutput(const string& spec, const wstring& defaultDest)
+{
+	// FMT[:QUALITY][:cbr][=DIR], as given to --also.
+	size_t eq = spec.find('=');
+	string head = spec.substr(0, eq);
+	vector<string> parts;
+	for (size_t pos = 0; pos <= head.size(); ) {
+		size_t colon = std::min(head.find(':', pos), head.size());
+		parts.emplace_back(head.substr(pos, colon - pos));
+		pos = colon + 1;
+	}
+
+	Convert::output out;
+	out.dest = eq == string::npos ? defaultDest : Sys::fromUtf8(spec.substr(eq + 1));
+	string quality;
+	for (size_t i = 1; i < parts.size(); ++i) {
+		if (parts[i] == "cbr") out.isVbr = false;
+		else if (parts[i] == "vbr") out.isVbr = true;
+		else quality = std::to_string(toNumber("--also", parts[i]));
+	}
+	if (parts[0] == "mp3") {
+		out.ext = L".mp3";
+		if (quality.empty()) quality = out.isVbr ? "4" : "128";
+	} else if (parts[0] == "flac") {
+		out.ext = L".flac";
+		if (quality.empty()) quality = "8";
+	} else if (parts[0] == "wav") {
+		out.ext = L".wav";
+	} else {
+		throw std::invalid_argument("Unknown output format \"" + parts[0] + "\" in --also " + spec + ".");
+	}
+	out.quality = Sys::fromUtf8(quality);
+	return out;
+}
+
+string resultFields(const Runner::file_result& res)
+{
+	// Of the JSON line each finished file prints, what follows its name.
+	char secs[32];
+	snprintf(secs, sizeof(secs), "%.3f", res.secs);
+	string fields = string(",\"status\":") + (!res.error.empty() ? "\"failed\""
+			: res.cacheState == ConvCache::state::UP_TO_DATE ? "\"skipped\"" : "\"ok\"")
+		+ ",\"secs\":" + secs;
+	if (res.cacheState == ConvCache::state::STALE) fields.append(",\"invalidated\":true");
+	if (res.resumed) fields.append(",\"resumed\":true");
+	if (res.attempts > 1) fields.append(",\"attempts\":" + std::to_string(res.attempts));
+	if (res.bytesSaved) fields.append(",\"bytes_saved\":" + std::to_string(res.bytesSaved));
+	if (!res.duplicateOf.empty()) fields.append(",\"duplicate_of\":" + Sys::jsonString(Sys::toUtf8(res.duplicateOf)));
+	if (!res.node.empty()) fields.append(",\"node\":" + Sys::jsonString(res.node));
+	if (res.hasGain) {
+		char gain[64];
+		snprintf(gain, sizeof(gain), ",\"track_gain\":%.2f,\"true_peak\":%.6f", res.trackGain, res.truePeak);
+		fields.append(gain);
+	}
+	if (!res.error.empty()) fields.append(",\"error\":" + Sys::jsonString(res.error));
+	if (res.exitCode) fields.append(",\"exit_code\":" + std::to_string(res.exitCode));
+	if (!res.errText.empty()) fields.append(",\"stderr\":" + Sys::jsonString(res.errText));
+	return fields;
+}
+
+void createDestFolders(const Runner::runnin_options& opts)
+{
+	for (const Convert::output& o : Runner::outputs(opts)) {
+		if (!o.dest.empty() && !Sys::isDir(o.dest)) Sys::createDir(o.dest);
+	}
+}
+
+int watch(const Runner::runnin_options& opts, const Watcher::options& wopts)
+{
+	// As a daemon: each file is converted as it lands, until a signal stops
+	// it. Its line tells the seconds from landing to output, too.
+	std::mutex outMtx;
+	Watcher watcher(opts, wopts);
+	stop_on_signal stopper([&watcher]() { watcher.stop(); });
+	fprintf(stderr, "Watching %zu folders, until Ctrl+C.\n", wopts.folders.size());
+	watcher.run([&](const wstring& file, const Runner::file_result& res, double latencySecs) {
+		char latency[48];
+		snprintf(latency, sizeof(latency), ",\"latency\":%.3f}\n", latencySecs);
+		string line = "{\"file\":" + Sys::jsonString(Sys::toUtf8(file)) + resultFields(res) + latency;
+
+		std::lock_guard<std::mutex> lk(outMtx);
+		fwrite(line.data(), 1, line.size(), stdout);
+		fflush(stdout);
+	});
+
+	fprintf(stderr, "Stopped: %zu files converted, %zu skipped, %zu failed, in %zu batches.\n",
+		watcher.numConverted(), watcher.numSkipped(), watcher.numFailed(), watcher.numBatches());
+	if (watcher.numConverted()) {
+		fprintf(stderr, "From landing to output, p50 %.3f s, p95 %.3f s, p99 %.3f s.\n",
+			watcher.latencySecs(50), watcher.latencySecs(95), watcher.latencySecs(99));
+	}
+	return 0; // how a watch ends, what was cancelled comes back on the next one
+}
+
+int serve(const Node::options& nopts)
+{
+	// As a node: the farms bring the files, this machine lends its tools.
+	std::mutex outMtx;
+	Node node(nopts);
+	stop_on_signal stopper([&node]() { node.stop(); });
+	fprintf(stderr, "Serving on %s:%s with %zu slots, until Ctrl+C.\n",
+		nopts.host.empty() ? "*" : nopts.host.c_str(), nopts.port.c_str(), node.numSlots());
+	node.run([&](const string& farm, const wstring& file, const string& error, double secs) {
+		char num[32];
+		snprintf(num, sizeof(num), "%.3f", secs);
+		string line = "{\"farm\":" + Sys::jsonString(farm) + ",\"file\":" + Sys::jsonString(Sys::toUtf8(file))
+			+ ",\"status\":" + (error.empty() ? "\"ok\"" : "\"failed\"") + ",\"secs\":" + num
+			+ (error.empty() ? "" : ",\"error\":" + Sys::jsonString(error)) + "}\n";
+
+		std::lock_guard<std::mutex> lk(outMtx);
+		fwrite(line.data(), 1, line.size(), stdout);
+		fflush(stdout);
+	});
+
+	fprintf(stderr, "Stopped: %zu files converted, %zu failed, for %zu connections.\n",
+		node.numDone(), node.numFailed(), node.numConnections());
+	return 0;
+}
+
+int run(const vector<string>& args)
+{
+	Runner::runnin_options opts;
+	opts.isVbr = true;
+
+	vector<wstring> manifests;
+	bool fromStdin = false;
+	string targetName, quality, lame, flac, streaming, inProcess, parallelFlac, cache, cacheHash, retries, diskJobs, diskMBps,
+		priority, pinCores, cpuLimit, replayGain, settle, verify, dedupe, remote, remoteShared, serveSpec;
+	wstring iniPath, failedListPath;
+	vector<string> alsoSpecs;
+	Watcher::options wopts;
+
+	for (size_t i = 0; i < args.size(); ++i) {
+		const string& arg = args[i];
+		auto value = [&]() -> const string& {
+			if (i + 1 >= args.size()) {
+				throw std::invalid_argument("Option " + arg + " expects a value.");
+			}
+			return args[++i];
+		};
+
+		if (arg == "-h" || arg == "--help") {
+			printUsage();
+			return 0;
+		} else if (arg == "-t" || arg == "--target") {
+			targetName = value();
+		} else if (arg == "-q" || arg == "--quality") {
+			quality = value();
+		} else if (arg == "--cbr") {
+			opts.isVbr = false;
+		} else if (arg == "-d" || arg == "--dest") {
+			opts.destFolder = Sys::fromUtf8(value());
+		} else if (arg == "--delete-source") {
+			opts.delSrc = true;
+		} else if (arg == "--no-verify") {
+			verify = "0";
+		} else if (arg == "--dedupe") {
+			dedupe = "1";
+		} else if (arg == "--also") {
+			alsoSpecs.emplace_back(value());
+		} else if (arg == "-j" || arg == "--threads") {
+			const string& num = value();
+			opts.numThreads = (num == "auto") ? 0 : toNumber(arg, num); // 0 is auto too
+		} else if (arg == "-m" || arg == "--manifest") {
+			manifests.emplace_back(Sys::fromUtf8(value()));
+		} else if (arg == "--ini") {
+			iniPath = Sys::fromUtf8(value());
+		} else if (arg == "--lame") {
+			lame = value();
+		} else if (arg == "--flac") {
+			flac = value();
+		} else if (arg == "--no-streaming") {
+			streaming = "0";
+		} else if (arg == "--in-process") {
+			inProcess = "1";
+		} else if (arg == "--parallel-flac") {
+			parallelFlac = value();
+		} else if (arg == "--no-cache") {
+			cache = "0";
+		} else if (arg == "--cache-hash") {
+			cacheHash = "1";
+		} else if (arg == "--retries") {
+			retries = value();
+		} else if (arg == "--disk-jobs") {
+			diskJobs = value();
+		} else if (arg == "--disk-mbps") {
+			diskMBps = value();
+		} else if (arg == "--priority") {
+			priority = value();
+		} else if (arg == "--pin-cores") {
+			pinCores = "1";
+		} else if (arg == "--cpu-limit") {
+			cpuLimit = value();
+		} else if (arg == "--replaygain") {
+			replayGain = "1";
+		} else if (arg == "--failed-list") {
+			failedListPath = Sys::fromUtf8(value());
+		} else if (arg == "--journal") {
+			opts.journalPath = Sys::fromUtf8(value());
+		} else if (arg == "--watch") {
+			wopts.folders.emplace_back(Sys::fromUtf8(value()));
+		} else if (arg == "--settle") {
+			settle = value();
+		} else if (arg == "--telemetry-csv") {
+			opts.telemetryCsv = Sys::fromUtf8(value());
+		} else if (arg == "--telemetry-json") {
+			opts.telemetryJson = Sys::fromUtf8(value());
+		} else if (arg == "--trace") {
+			opts.telemetryTrace = Sys::fromUtf8(value());
+		} else if (arg == "--remote") {
+			remote.append(remote.empty() ? "" : ",").append(value());
+		} else if (arg == "--remote-shared") {
+			remoteShared = "1";
+		} else if (arg == "--serve") {
+			serveSpec = value();
+		} else if (arg == "-") {
+			fromStdin = true;
+		} else if (arg.size() > 1 && arg[0] == '-') {
+			throw std::invalid_argument("Unknown option " + arg + ".");
+		} else {
+			opts.files.emplace_back(Sys::fromUtf8(arg));
+		}
+	}
+
+	if (!iniPath.empty()) { // explicit options take precedence over the INI file
+		ini_sections ini = readIni(iniPath);
+		if (lame.empty()) lame = ini["Tools"]["lame"];
+		if (flac.empty()) flac = ini["Tools"]["flac"];
+		if (streaming.empty()) streaming = ini["Options"]["streaming"];
+		if (inProcess.empty()) inProcess = ini["Options"]["inprocess"];
+		if (parallelFlac.empty()) parallelFlac = ini["Options"]["parallelflac"];
+		if (cache.empty()) cache = ini["Options"]["cache"];
+		if (cacheHash.empty()) cacheHash = ini["Options"]["cachehash"];
+		if (retries.empty()) retries = ini["Options"]["retries"];
+		if (diskJobs.empty()) diskJobs = ini["Options"]["diskjobs"];
+		if (diskMBps.empty()) diskMBps = ini["Options"]["diskmbps"];
+		if (priority.empty()) priority = ini["Options"]["priority"];
+		if (pinCores.empty()) pinCores = ini["Options"]["pincores"];
+		if (cpuLimit.empty()) cpuLimit = ini["Options"]["cpulimit"];
+		if (replayGain.empty()) replayGain = ini["Options"]["replaygain"];
+		if (settle.empty()) settle = ini["Options"]["settle"];
+		if (verify.empty()) verify = ini["Options"]["verify"];
+		if (dedupe.empty()) dedupe = ini["Options"]["dedupe"];
+		if (remote.empty()) remote = ini["Options"]["remote"];
+		if (remoteShared.empty()) remoteShared = ini["Options"]["remoteshared"];
+	}
+	if (!lame.empty()) opts.convOpts.lame = Sys::fromUtf8(lame);
+	if (!flac.empty()) opts.convOpts.flac = Sys::fromUtf8(flac);
+	if (!streaming.empty()) opts.convOpts.streaming = toNumber("streaming", streaming) != 0;
+	if (!inProcess.empty()) opts.convOpts.inProcess = toNumber("inprocess", inProcess) != 0;
+	if (!parallelFlac.empty()) opts.convOpts.parallelFlacSecs = toNumber("parallelflac", parallelFlac);
+	if (!cache.empty()) opts.useCache = toNumber("cache", cache) != 0;
+	if (!cacheHash.empty()) opts.cacheHash = toNumber("cachehash", cacheHash) != 0;
+	if (!retries.empty()) opts.retries = toNumber("retries", retries);
+	if (!diskJobs.empty()) opts.diskJobs = toNumber("diskjobs", diskJobs);
+	if (!diskMBps.empty()) opts.diskMBps = toNumber("diskmbps", diskMBps);
+	if (!priority.empty()) opts.policy.prio = toPriority("priority", priority);
+	if (!pinCores.empty()) opts.policy.pinCores = toNumber("pincores", pinCores) != 0;
+	if (!cpuLimit.empty()) opts.policy.cpuPercent = toNumber("cpulimit", cpuLimit);
+	if (!replayGain.empty()) opts.replayGain = toNumber("replaygain", replayGain) != 0;
+	if (!settle.empty()) wopts.settleMs = toNumber("settle", settle);
+	if (!verify.empty()) opts.verify = toNumber("verify", verify) != 0;
+	if (!dedupe.empty()) opts.dedupe = toNumber("dedupe", dedupe) != 0;
+	if (!remote.empty()) opts.remote.nodes = Farm::parseNodes(remote);
+	if (!remoteShared.empty()) opts.remote.shared = toNumber("remoteshared", remoteShared) != 0;
+
+	if (!serveSpec.empty()) {
+		if (!targetName.empty() || !opts.files.empty() || !manifests.empty() || fromStdin
+			|| !wopts.folders.empty())
+		{
+			throw std::invalid_argument("A node takes no target or files of its own with --serve, the farms bring them.");
+		}
+		Node::options nopts;
+		size_t colon = serveSpec.rfind(':');
+		if (colon != string::npos) nopts.host = serveSpec.substr(0, colon);
+		nopts.port = serveSpec.substr(colon + 1); // all of it, without a host
+		if (nopts.host.size() > 2 && nopts.host.front() == '[' && nopts.host.back() == ']') { // IPv6
+			nopts.host = nopts.host.substr(1, nopts.host.size() - 2);
+		}
+		toNumber("--serve", nopts.port);
+		nopts.numSlots = opts.numThreads;
+		nopts.shared = opts.remote.shared;
+		nopts.convOpts = opts.convOpts;
+		nopts.policy = opts.policy;
+		if (nopts.convOpts.inProcess && !Codec::available()) {
+			throw std::invalid_argument("In-process conversion was asked, but this build has no codec libraries.");
+		}
+		Convert::validateTools(nopts.convOpts);
+		return serve(nopts);
+	}
+
+	if (targetName == "mp3") {
+		opts.targetType = Runner::target::MP3;
+		if (quality.empty()) quality = opts.isVbr ? "4" : "128";
+	} else if (targetName == "flac") {
+		opts.targetType = Runner::target::FLAC;
+		if (quality.empty()) quality = "8";
+	} else if (targetName == "wav") {
+		opts.targetType = Runner::target::WAV;
+	} else {
+		throw std::invalid_argument(targetName.empty() ?
+			"No target format given." : "Unknown target format \"" + targetName + "\".");
+	}
+	if (!quality.empty()) toNumber("--quality", quality);
+	opts.quality = Sys::fromUtf8(quality);
+	for (const string& spec : alsoSpecs) {
+		opts.moreOutputs.emplace_back(toOutput(spec, opts.destFolder));
+	}
+	vector<Convert::output> outs = Runner::outputs(opts);
+	for (size_t i = 0; i < outs.size(); ++i) {
+		for (size_t j = 0; j < i; ++j) {
+			if (Sys::hasExtension(outs[i].ext, outs[j].ext) && Sys::isSamePath(outs[i].dest, outs[j].dest)) {
+				throw std::invalid_argument("Two outputs would write the same " + Sys::toUtf8(outs[i].ext)
+					+ " files; give each one a folder of its own.");
+			}
+		}
+	}
+
+	if (opts.convOpts.inProcess && !Codec::available()) {
+		throw std::invalid_argument("In-process conversion was asked, but this build has no codec libraries.");
+	}
+	Convert::validateTools(opts.convOpts);
+
+	if (!wopts.folders.empty()) {
+		if (!opts.files.empty() || !manifests.empty() || fromStdin) {
+			throw std::invalid_argument("No files are given with --watch, they come as they land.");
+		}
+		if (!opts.remote.nodes.empty()) {
+			throw std::invalid_argument("Nodes convert batches, not --watch.");
+		}
+		if (!opts.journalPath.empty() || !failedListPath.empty()
+			|| !opts.telemetryCsv.empty() || !opts.telemetryJson.empty() || !opts.telemetryTrace.empty())
+		{
+			throw std::invalid_argument("The journal, the failed list and the telemetry files are for batches, not --watch.");
+		}
+		for (const wstring& folder : wopts.folders) {
+			if (!Sys::isDir(folder)) throw std::invalid_argument("Not a folder to watch: " + Sys::toUtf8(folder));
+		}
+		createDestFolders(opts);
+		return watch(opts, wopts);
+	}
+
+	for (const wstring& manifest : manifests) {
+		std::ifstream in(Sys::toUtf8(manifest));
+		if (!in) {
+			throw std::invalid_argument("Manifest not found: " + Sys::toUtf8(manifest));
+		}
+		readFileList(in, opts.files);
+	}
+	if (fromStdin || (opts.files.empty() && manifests.empty())) {
+		readFileList(std::cin, opts.files);
+	}
+
+	expandFolders(opts.files);
+
+	createDestFolders(opts);
+
+	std::mutex outMtx;
+	Runner runner(opts);
+	stop_on_signal stopper([&runner]() { runner.cancel(); });
+	runner.start([&](const Runner::file_result& res) {
+		string line = "{\"index\":" + std::to_string(res.index)
+			+ ",\"file\":" + Sys::jsonString(Sys::toUtf8(opts.files[res.index])) + resultFields(res) + "}\n";
+
+		std::lock_guard<std::mutex> lk(outMtx);
+		fwrite(line.data(), 1, line.size(), stdout);
+		fflush(stdout); // consumers follow the batch as it goes
+	});
+	runner.wait();
+	runner.exportTelemetry();
+	if (!failedListPath.empty()) {
+		string list = "#EXTM3U\n"; // also a playlist, for a look at the files
+		for (const Runner::file_result& f : runner.failures()) {
+			list.append(Sys::toUtf8(opts.files[f.index])).append("\n");
+		}
+		Sys::writeFile(failedListPath, list);
+	}
+	double secs = runner.elapsedSecs();
+
+	fprintf(stderr, "%zu files processed in %.2f seconds, with %zu workers%s: "
+		"%zu converted (%zu invalidated), %zu skipped, %zu failed, %zu retries.\n",
+		runner.numDone(), secs, runner.numWorkersChosen(), opts.numThreads || runner.farm() ? "" : " (auto)",
+		runner.numConverted(), runner.numInvalidated(), runner.numSkipped(), runner.numFailed(), runner.numRetries());
+	if (runner.numConverted()) {
+		fprintf(stderr, "%.2f files/s, %.2f MB/s read; per file p50 %.3f s, p95 %.3f s, p99 %.3f s.\n",
+			runner.numConverted() / secs, runner.bytesConverted() / secs / (1024 * 1024),
+			runner.latencySecs(50), runner.latencySecs(95), runner.latencySecs(99));
+	}
+	if (runner.bytesSaved()) {
+		fprintf(stderr, "%.2f MB not written, read directly by the encoders or moved instead of copied.\n",
+			runner.bytesSaved() / (1024.0 * 1024));
+	}
+	if (runner.numAlbumsTagged()) {
+		fprintf(stderr, "%zu albums tagged with their ReplayGain.\n", runner.numAlbumsTagged());
+	}
+	if (runner.numDuplicates()) {
+		fprintf(stderr, "%zu duplicates given the outputs of the same audio, saving %.2f seconds of converting.\n",
+			runner.numDuplicates(), runner.duplicateSecsSaved());
+	}
+	if (runner.farm()) {
+		for (const Farm::node_stats& n : runner.farm()->stats()) {
+			if (!n.problem.empty()) {
+				fprintf(stderr, "Node %s left out: %s\n", n.name.c_str(), n.problem.c_str());
+			} else {
+				fprintf(stderr, "Node %s: %zu slots, %zu files converted, %.1f s of CPU time, %zu connections lost.\n",
+					n.name.c_str(), n.numSlots, n.numFiles, n.cpuSecs, n.numLost);
+			}
+		}
+		if (runner.numReassigned()) {
+			fprintf(stderr, "%zu files taken back from nodes lost, and converted elsewhere.\n", runner.numReassigned());
+		}
+	}
+	vector<double> cpu = runner.workerCpuSecs(); // workers never started show 0
+	double cpuTotal = std::accumulate(cpu.begin(), cpu.end(), 0.0);
+	if (cpuTotal > 0) {
+		string perWorker;
+		for (double c : cpu) {
+			char num[32];
+			snprintf(num, sizeof(num), "%s%.1f", perWorker.empty() ? "" : " ", c);
+			perWorker.append(num);
+		}
+		fprintf(stderr, "%.1f s of CPU time, %.0f%% of the wall time; per worker, tools included: %s.\n",
+			cpuTotal, 100 * cpuTotal / secs, perWorker.c_str());
+	}
+	if (runner.cancelled()) {
+		fprintf(stderr, "Cancelled, %zu of %zu files finished.%s\n", runner.numDone(), opts.files.size(),
+			opts.journalPath.empty() ? "" : " Run again with the same journal to resume.");
+		return EXIT_CANCELLED;
+	}
+	return runner.numFailed() ? EXIT_FAILED_FILES : 0;
+}
+
+}//namespace
+
+#ifdef _WIN32
+int wmain(int argc, wchar_t* argv[])
+{
+	vector<string> args;
+	for (int i = 1; i < argc; ++i) {
+		args.emplace_back(Sys::toUtf8(argv[i]));
+	}
+#else
+int main(int argc, char* argv[])
+{
+	vector<string> args(argv + 1, argv + argc);
+#endif
+
+	try {
+		return run(args);
+	} catch (const std::invalid_argument& e) {
+		fprintf(stderr, "%s\nRun with --help for usage.\n", e.what());
+		return EXIT_USAGE;
+	} catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		return EXIT_USAGE;
+	}
+}
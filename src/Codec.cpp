@@ -0,0 +1,780 @@
+
+#include "Codec.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include "Cancel.h"
+#include "Loudness.h"
+#include "Sys.h"
+#ifdef FLE_INPROC_CODECS
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
+#include <lame/lame.h>
+#endif
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using std::wstring;
+using stage = Codec::error::stage;
+
+static const size_t BLOCK_FRAMES = 4096; // PCM frames moved from decoder to encoder at a time
+static const size_t FANOUT_BLOCKS = 16; // decoded ahead of the slowest encoder, when there are several
+
+Codec::error::error(stage where, const wstring& file, int code, const string& msg)
+	: std::runtime_error(msg), where(where), file(file), code(code)
+{
+}
+
+namespace {
+
+FILE* openFile(const wstring& path, const char* mode, stage where)
+{
+	FILE* fp = Sys::openFile(path, mode);
+	if (!fp) {
+		throw Codec::error(where, path, errno, "Failed to open file.");
+	}
+	return fp;
+}
+
+uint16_t le16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+uint32_t le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+
+void putLe16(uint8_t* p, uint32_t v) { p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; }
+void putLe32(uint8_t* p, uint32_t v) { putLe16(p, v); putLe16(p + 2, v >> 16); }
+
+class wav_decoder final : public Codec::decoder {
+private:
+	FILE*           mFp;
+	wstring         mPath;
+	Codec::format   mFmt;
+	unsigned        mBytesPerSample = 0;
+	uint64_t        mBytesLeft = 0;
+	vector<uint8_t> mRaw;
+
+public:
+	explicit wav_decoder(const wstring& src) : mPath(src) {
+		mFp = openFile(src, "rb", stage::OPEN);
+		try {
+			_parseHeader();
+		} catch (...) {
+			fclose(mFp);
+			throw;
+		}
+	}
+
+	~wav_decoder() { fclose(mFp); }
+
+	const Codec::format& fmt() const override { return mFmt; }
+
+	size_t read(int32_t* buf, size_t maxFrames) override {
+		size_t frameSz = mBytesPerSample * mFmt.channels;
+		uint64_t want = maxFrames * frameSz;
+		if (want > mBytesLeft) want = mBytesLeft - mBytesLeft % frameSz;
+		mRaw.resize(static_cast<size_t>(want));
+
+		size_t got = fread(&mRaw[0], 1, mRaw.size(), mFp);
+		if (got < mRaw.size() && ferror(mFp)) {
+			throw Codec::error(stage::DECODE, mPath, errno, "Failed to read WAV data.");
+		}
+		got -= got % frameSz; // a truncated last frame is dropped
+		mBytesLeft = (got < mRaw.size()) ? 0 : mBytesLeft - got;
+
+		const uint8_t* p = &mRaw[0];
+		for (size_t i = 0; i < got / mBytesPerSample; ++i, p += mBytesPerSample) {
+			switch (mBytesPerSample) {
+			case 1: buf[i] = static_cast<int32_t>(p[0]) - 128; break; // 8-bit WAV is unsigned
+			case 2: buf[i] = static_cast<int16_t>(le16(p)); break;
+			case 3: buf[i] = static_cast<int32_t>((p[0] << 8) | (p[1] << 16) | (static_cast<uint32_t>(p[2]) << 24)) >> 8; break;
+			case 4: buf[i] = static_cast<int32_t>(le32(p));
+			}
+		}
+		return got / frameSz;
+	}
+
+private:
+	void _parseHeader() {
+		uint8_t hdr[12];
+		if (fread(hdr, 1, 12, mFp) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+			throw Codec::error(stage::OPEN, mPath, 0, "Not a RIFF/WAVE file.");
+		}
+
+		bool gotFmt = false;
+		for (;;) {
+			uint8_t chunk[8];
+			if (fread(chunk, 1, 8, mFp) != 8) {
+				throw Codec::error(stage::OPEN, mPath, 0, "WAV file has no data chunk.");
+			}
+			uint32_t chunkSz = le32(chunk + 4);
+
+			if (!memcmp(chunk, "fmt ", 4) && chunkSz >= 16) {
+				vector<uint8_t> f(chunkSz + (chunkSz & 1)); // chunks are word-aligned
+				if (fread(&f[0], 1, f.size(), mFp) != f.size()) {
+					throw Codec::error(stage::OPEN, mPath, 0, "Truncated WAV fmt chunk.");
+				}
+				uint16_t tag = le16(&f[0]);
+				if (tag == 0xfffe && chunkSz >= 26) tag = le16(&f[24]); // WAVE_FORMAT_EXTENSIBLE subformat
+				if (tag != 1) {
+					throw Codec::error(stage::OPEN, mPath, tag, "WAV file is not integer PCM.");
+				}
+				mFmt.channels = le16(&f[2]);
+				mFmt.sampleRate = le32(&f[4]);
+				mBytesPerSample = (le16(&f[14]) + 7) / 8;
+				mFmt.bitsPerSample = mBytesPerSample * 8; // narrower samples are left-justified in the container
+				gotFmt = true;
+			} else if (!memcmp(chunk, "data", 4)) {
+				if (!gotFmt || !mFmt.channels || !mFmt.sampleRate
+					|| mBytesPerSample < 1 || mBytesPerSample > 4)
+				{
+					throw Codec::error(stage::OPEN, mPath, 0, "Unsupported WAV format.");
+				}
+				bool sizeKnown = chunkSz && chunkSz != 0xffffffff; // streamed WAVs leave it blank
+				mBytesLeft = sizeKnown ? chunkSz : UINT64_MAX;
+				mFmt.totalFrames = sizeKnown ? chunkSz / (mBytesPerSample * mFmt.channels) : 0;
+				return;
+			} else if (fseek(mFp, chunkSz + (chunkSz & 1), SEEK_CUR)) {
+				throw Codec::error(stage::OPEN, mPath, errno, "Truncated WAV file.");
+			}
+		}
+	}
+};
+
+class wav_encoder final : public Codec::encoder {
+private:
+	FILE*           mFp;
+	wstring         mPath;
+	Codec::format   mFmt;
+	unsigned        mBytesPerSample;
+	uint64_t        mDataBytes = 0;
+	vector<uint8_t> mRaw;
+
+public:
+	wav_encoder(const wstring& dest, const Codec::format& fmt)
+		: mPath(dest), mFmt(fmt), mBytesPerSample((fmt.bitsPerSample + 7) / 8)
+	{
+		mFp = openFile(dest, "wb", stage::OPEN);
+		_writeHeader(); // sizes are fixed in finish()
+	}
+
+	~wav_encoder() { if (mFp) fclose(mFp); }
+
+	void write(const int32_t* buf, size_t numFrames) override {
+		size_t numSamples = numFrames * mFmt.channels;
+		mRaw.resize(numSamples * mBytesPerSample);
+		uint8_t* p = &mRaw[0];
+		for (size_t i = 0; i < numSamples; ++i, p += mBytesPerSample) {
+			uint32_t v = static_cast<uint32_t>(buf[i]);
+			if (mBytesPerSample == 1) v += 128; // back to unsigned
+			for (unsigned b = 0; b < mBytesPerSample; ++b) {
+				p[b] = (v >> (8 * b)) & 0xff;
+			}
+		}
+		if (fwrite(&mRaw[0], 1, mRaw.size(), mFp) != mRaw.size()) {
+			throw Codec::error(stage::WRITE, mPath, errno, "Failed to write WAV data.");
+		}
+		mDataBytes += mRaw.size();
+	}
+
+	void finish() override {
+		if (mDataBytes & 1) fputc(0, mFp); // pad byte
+		if (fseek(mFp, 0, SEEK_SET)) {
+			throw Codec::error(stage::WRITE, mPath, errno, "Failed to rewind WAV file.");
+		}
+		_writeHeader();
+		int ret = fclose(mFp);
+		mFp = nullptr;
+		if (ret) {
+			throw Codec::error(stage::WRITE, mPath, errno, "Failed to close WAV file.");
+		}
+	}
+
+private:
+	bool _isExtensible() const { return mFmt.channels > 2 || mFmt.bitsPerSample > 16; }
+
+	void _writeHeader() {
+		static const uint32_t CHANNEL_MASKS[] = {0x4, 0x3, 0x7, 0x33, 0x607, 0x60f, 0x70f, 0x63f};
+		static const uint8_t PCM_GUID_TAIL[] = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+			0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71};
+
+		uint32_t fmtSz = _isExtensible() ? 40 : 16;
+		uint32_t dataSz = mDataBytes > 0xfffffff0 ? 0xfffffff0 : static_cast<uint32_t>(mDataBytes);
+		uint8_t hdr[68] = {0};
+
+		memcpy(hdr, "RIFF", 4);
+		putLe32(hdr + 4, 4 + (8 + fmtSz) + (8 + dataSz + (dataSz & 1)));
+		memcpy(hdr + 8, "WAVEfmt ", 8);
+		putLe32(hdr + 16, fmtSz);
+		putLe16(hdr + 20, _isExtensible() ? 0xfffe : 1);
+		putLe16(hdr + 22, mFmt.channels);
+		putLe32(hdr + 24, mFmt.sampleRate);
+		putLe32(hdr + 28, mFmt.sampleRate * mFmt.channels * mBytesPerSample);
+		putLe16(hdr + 32, mFmt.channels * mBytesPerSample);
+		putLe16(hdr + 34, mBytesPerSample * 8);
+		if (_isExtensible()) {
+			putLe16(hdr + 36, 22);
+			putLe16(hdr + 38, mFmt.bitsPerSample);
+			putLe32(hdr + 40, mFmt.channels <= 8 ? CHANNEL_MASKS[mFmt.channels - 1] : 0);
+			putLe16(hdr + 44, 1); // KSDATAFORMAT_SUBTYPE_PCM
+			memcpy(hdr + 46, PCM_GUID_TAIL, sizeof(PCM_GUID_TAIL));
+		}
+		uint8_t* data = hdr + 20 + fmtSz;
+		memcpy(data, "data", 4);
+		putLe32(data + 4, dataSz);
+
+		size_t hdrSz = 20 + fmtSz + 8;
+		if (fwrite(hdr, 1, hdrSz, mFp) != hdrSz) {
+			throw Codec::error(stage::WRITE, mPath, errno, "Failed to write WAV header.");
+		}
+	}
+};
+
+#ifdef FLE_INPROC_CODECS
+
+class flac_decoder final : public Codec::decoder {
+private:
+	FLAC__StreamDecoder* mDec;
+	wstring         mPath;
+	Codec::format   mFmt;
+	vector<int32_t> mPending; // frames of the last FLAC block not yet read
+	size_t          mPendingPos = 0;
+	string          mStreamError;
+	bool            mFinished = false;
+
+public:
+	explicit flac_decoder(const wstring& src) : mPath(src) {
+		mDec = FLAC__stream_decoder_new();
+		if (!mDec) {
+			throw Codec::error(stage::OPEN, mPath, 0, "Failed to create FLAC decoder.");
+		}
+		FLAC__stream_decoder_set_md5_checking(mDec, true);
+
+		FILE* fp = nullptr;
+		try {
+			fp = openFile(src, "rb", stage::OPEN);
+		} catch (...) {
+			FLAC__stream_decoder_delete(mDec);
+			throw;
+		}
+		FLAC__StreamDecoderInitStatus st = FLAC__stream_decoder_init_FILE(mDec, fp, // file is closed by the decoder
+			_writeCb, _metadataCb, _errorCb, this);
+		if (st != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+			fclose(fp);
+			FLAC__stream_decoder_delete(mDec);
+			throw Codec::error(stage::OPEN, mPath, st, FLAC__StreamDecoderInitStatusString[st]);
+		}
+
+		if (!FLAC__stream_decoder_process_until_end_of_metadata(mDec) || !mFmt.sampleRate) {
+			FLAC__StreamDecoderState state = FLAC__stream_decoder_get_state(mDec);
+			FLAC__stream_decoder_delete(mDec);
+			throw Codec::error(stage::OPEN, mPath, state, "FLAC file has no valid STREAMINFO.");
+		}
+	}
+
+	~flac_decoder() { FLAC__stream_decoder_delete(mDec); }
+
+	const Codec::format& fmt() const override { return mFmt; }
+
+	size_t read(int32_t* buf, size_t maxFrames) override {
+		while (mPendingPos == mPending.size()) {
+			mPending.clear();
+			mPendingPos = 0;
+
+			FLAC__StreamDecoderState state = FLAC__stream_decoder_get_state(mDec);
+			if (state == FLAC__STREAM_DECODER_END_OF_STREAM) {
+				if (!mFinished) {
+					mFinished = true;
+					if (!FLAC__stream_decoder_finish(mDec)) { // false only when MD5 doesn't match
+						throw Codec::error(stage::DECODE, mPath, state, "FLAC MD5 signature mismatch.");
+					}
+				}
+				return 0;
+			}
+			if (!FLAC__stream_decoder_process_single(mDec) || !mStreamError.empty()) {
+				state = FLAC__stream_decoder_get_state(mDec);
+				throw Codec::error(stage::DECODE, mPath, state,
+					mStreamError.empty() ? FLAC__StreamDecoderStateString[state] : mStreamError);
+			}
+		}
+
+		size_t numFrames = (mPending.size() - mPendingPos) / mFmt.channels;
+		if (numFrames > maxFrames) numFrames = maxFrames;
+		memcpy(buf, &mPending[mPendingPos], numFrames * mFmt.channels * sizeof(int32_t));
+		mPendingPos += numFrames * mFmt.channels;
+		return numFrames;
+	}
+
+private:
+	static FLAC__StreamDecoderWriteStatus _writeCb(const FLAC__StreamDecoder*,
+		const FLAC__Frame* frame, const FLAC__int32* const buffer[], void* clientData)
+	{
+		flac_decoder* self = static_cast<flac_decoder*>(clientData);
+		unsigned numFrames = frame->header.blocksize;
+		unsigned numChannels = frame->header.channels;
+		size_t base = self->mPending.size();
+		self->mPending.resize(base + numFrames * numChannels);
+
+		for (unsigned i = 0; i < numFrames; ++i) { // interleave
+			for (unsigned c = 0; c < numChannels; ++c) {
+				self->mPending[base + i * numChannels + c] = buffer[c][i];
+			}
+		}
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	static void _metadataCb(const FLAC__StreamDecoder*,
+		const FLAC__StreamMetadata* meta, void* clientData)
+	{
+		if (meta->type == FLAC__METADATA_TYPE_STREAMINFO) {
+			Codec::format& fmt = static_cast<flac_decoder*>(clientData)->mFmt;
+			fmt.sampleRate = meta->data.stream_info.sample_rate;
+			fmt.channels = meta->data.stream_info.channels;
+			fmt.bitsPerSample = meta->data.stream_info.bits_per_sample;
+			fmt.totalFrames = meta->data.stream_info.total_samples;
+		}
+	}
+
+	static void _errorCb(const FLAC__StreamDecoder*,
+		FLAC__StreamDecoderErrorStatus status, void* clientData)
+	{
+		static_cast<flac_decoder*>(clientData)->mStreamError = // the flac tool also gives up on a corrupted stream
+			FLAC__StreamDecoderErrorStatusString[status];
+	}
+};
+
+class flac_encoder final : public Codec::encoder {
+private:
+	FLAC__StreamEncoder* mEnc;
+	wstring mPath;
+
+public:
+	flac_encoder(const wstring& dest, const Codec::format& fmt, unsigned level, bool verify)
+		: mPath(dest)
+	{
+		if (fmt.bitsPerSample > 24 || fmt.channels > 8) {
+			throw Codec::error(stage::ENCODE, mPath, 0,
+				"FLAC supports up to 8 channels and 24 bits per sample.");
+		}
+		mEnc = FLAC__stream_encoder_new();
+		if (!mEnc) {
+			throw Codec::error(stage::OPEN, mPath, 0, "Failed to create FLAC encoder.");
+		}
+		FLAC__stream_encoder_set_verify(mEnc, verify);
+		FLAC__stream_encoder_set_compression_level(mEnc, level);
+		FLAC__stream_encoder_set_channels(mEnc, fmt.channels);
+		FLAC__stream_encoder_set_bits_per_sample(mEnc, fmt.bitsPerSample);
+		FLAC__stream_encoder_set_sample_rate(mEnc, fmt.sampleRate);
+		FLAC__stream_encoder_set_total_samples_estimate(mEnc, fmt.totalFrames);
+
+		FILE* fp = nullptr;
+		try {
+			fp = openFile(dest, "w+b", stage::OPEN); // must be seekable, STREAMINFO is rewritten at the end
+		} catch (...) {
+			FLAC__stream_encoder_delete(mEnc);
+			throw;
+		}
+		FLAC__StreamEncoderInitStatus st = FLAC__stream_encoder_init_FILE(mEnc, fp, nullptr, nullptr);
+		if (st != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+			fclose(fp);
+			FLAC__stream_encoder_delete(mEnc);
+			throw Codec::error(stage::OPEN, mPath, st, FLAC__StreamEncoderInitStatusString[st]);
+		}
+	}
+
+	~flac_encoder() { FLAC__stream_encoder_delete(mEnc); }
+
+	void write(const int32_t* buf, size_t numFrames) override {
+		if (!FLAC__stream_encoder_process_interleaved(mEnc, buf, static_cast<unsigned>(numFrames))) {
+			_throwState();
+		}
+	}
+
+	void finish() override {
+		if (!FLAC__stream_encoder_finish(mEnc)) {
+			_throwState();
+		}
+	}
+
+private:
+	void _throwState() {
+		FLAC__StreamEncoderState state = FLAC__stream_encoder_get_state(mEnc);
+		throw Codec::error(
+			state == FLAC__STREAM_ENCODER_IO_ERROR ? stage::WRITE : stage::ENCODE,
+			mPath, state, FLAC__StreamEncoderStateString[state]);
+	}
+};
+
+class mp3_decoder final : public Codec::decoder {
+private:
+	FILE*          mFp;
+	hip_t          mHip;
+	wstring        mPath;
+	Codec::format  mFmt;
+	mp3data_struct mMp3Data{};
+	vector<unsigned char> mIn;
+	vector<short>  mPcmL, mPcmR;
+	size_t         mNumDecoded = 0; // frames decoded so far
+	int            mPeeked = 0; // frames of the first MPEG frame, decoded to learn the format
+
+public:
+	explicit mp3_decoder(const wstring& src)
+		: mPath(src), mIn(4096), mPcmL(4608), mPcmR(4608)
+	{
+		mFp = openFile(src, "rb", stage::OPEN);
+		_skipId3v2();
+		mHip = hip_decode_init();
+		if (!mHip) {
+			fclose(mFp);
+			throw Codec::error(stage::OPEN, mPath, 0, "Failed to create MP3 decoder.");
+		}
+
+		try {
+			mPeeked = _decodeFrame(); // format is only known after the first frame header
+		} catch (...) {
+			hip_decode_exit(mHip);
+			fclose(mFp);
+			throw;
+		}
+		if (mPeeked <= 0 || !mFmt.sampleRate) {
+			hip_decode_exit(mHip);
+			fclose(mFp);
+			throw Codec::error(stage::DECODE, mPath, mPeeked, "No MPEG audio frames found.");
+		}
+	}
+
+	~mp3_decoder() {
+		hip_decode_exit(mHip);
+		fclose(mFp);
+	}
+
+	const Codec::format& fmt() const override { return mFmt; }
+
+	size_t read(int32_t* buf, size_t maxFrames) override {
+		size_t numFrames = 0;
+		while (numFrames + 1152 <= maxFrames) { // an MPEG frame has at most 1152 samples
+			int n = mPeeked ? mPeeked : _decodeFrame();
+			mPeeked = 0;
+			if (n <= 0) break;
+
+			for (int i = 0; i < n; ++i, ++numFrames) {
+				buf[numFrames * mFmt.channels] = mPcmL[i];
+				if (mFmt.channels == 2) buf[numFrames * 2 + 1] = mPcmR[i];
+			}
+		}
+		return numFrames;
+	}
+
+private:
+	int _decodeFrame() {
+		int ret = hip_decode1_headers(mHip, &mIn[0], 0, &mPcmL[0], &mPcmR[0], &mMp3Data); // buffered data first
+		while (ret == 0) {
+			size_t len = fread(&mIn[0], 1, mIn.size(), mFp);
+			ret = hip_decode1_headers(mHip, &mIn[0], len, &mPcmL[0], &mPcmR[0], &mMp3Data);
+			if (!len) break; // end of file, nothing else buffered
+		}
+
+		if (ret < 0) {
+			if (mNumDecoded) return 0; // like LAME itself, trailing junk just ends the stream
+			throw Codec::error(stage::DECODE, mPath, ret, "MP3 decoding failed.");
+		}
+		if (ret > 0 && !mFmt.sampleRate && mMp3Data.header_parsed) {
+			mFmt.sampleRate = mMp3Data.samplerate;
+			mFmt.channels = mMp3Data.stereo;
+			mFmt.bitsPerSample = 16;
+			mFmt.totalFrames = mMp3Data.nsamp;
+		}
+		mNumDecoded += ret;
+		return ret;
+	}
+
+	void _skipId3v2() {
+		uint8_t hdr[10];
+		if (fread(hdr, 1, 10, mFp) == 10 && !memcmp(hdr, "ID3", 3)) {
+			long tagSz = (hdr[6] << 21) | (hdr[7] << 14) | (hdr[8] << 7) | hdr[9]; // syncsafe integer
+			if (hdr[5] & 0x10) tagSz += 10; // footer present
+			fseek(mFp, 10 + tagSz, SEEK_SET);
+		} else {
+			fseek(mFp, 0, SEEK_SET);
+		}
+	}
+};
+
+class mp3_encoder final : public Codec::encoder {
+private:
+	lame_global_flags* mGfp;
+	FILE*              mFp = nullptr;
+	wstring            mPath;
+	Codec::format      mFmt;
+	vector<int>        mLeft, mRight;
+	vector<unsigned char> mOut;
+
+public:
+	mp3_encoder(const wstring& dest, const Codec::format& fmt, unsigned quality, bool isVbr)
+		: mPath(dest), mFmt(fmt)
+	{
+		if (fmt.channels > 2) {
+			throw Codec::error(stage::ENCODE, mPath, 0, "MP3 supports only mono or stereo.");
+		}
+		mGfp = lame_init();
+		if (!mGfp) {
+			throw Codec::error(stage::OPEN, mPath, 0, "Failed to create LAME encoder.");
+		}
+		lame_set_in_samplerate(mGfp, fmt.sampleRate);
+		lame_set_num_channels(mGfp, fmt.channels);
+		if (isVbr) {
+			lame_set_VBR(mGfp, vbr_default);
+			lame_set_VBR_q(mGfp, quality);
+		} else {
+			lame_set_VBR(mGfp, vbr_off);
+			lame_set_brate(mGfp, quality);
+		}
+		lame_set_findReplayGain(mGfp, 0); // same as --noreplaygain
+		lame_set_write_id3tag_automatic(mGfp, 0);
+
+		int ret = lame_init_params(mGfp);
+		if (ret < 0) {
+			lame_close(mGfp);
+			throw Codec::error(stage::ENCODE, mPath, ret, "Invalid LAME encoding parameters.");
+		}
+
+		try {
+			mFp = openFile(dest, "w+b", stage::OPEN); // rewound at the end, to write the LAME tag
+		} catch (...) {
+			lame_close(mGfp);
+			throw;
+		}
+	}
+
+	~mp3_encoder() {
+		lame_close(mGfp);
+		if (mFp) fclose(mFp);
+	}
+
+	void write(const int32_t* buf, size_t numFrames) override {
+		unsigned shift = 32 - mFmt.bitsPerSample; // LAME wants full-scale 32-bit samples
+		mLeft.resize(numFrames);
+		mRight.resize(numFrames);
+		for (size_t i = 0; i < numFrames; ++i) {
+			mLeft[i] = static_cast<int>(static_cast<uint32_t>(buf[i * mFmt.channels]) << shift);
+			if (mFmt.channels == 2) {
+				mRight[i] = static_cast<int>(static_cast<uint32_t>(buf[i * 2 + 1]) << shift);
+			}
+		}
+
+		mOut.resize(numFrames * 5 / 4 + 7200); // worst case, as documented in lame.h
+		int sz = lame_encode_buffer_int(mGfp, &mLeft[0], mFmt.channels == 2 ? &mRight[0] : &mLeft[0],
+			static_cast<int>(numFrames), &mOut[0], static_cast<int>(mOut.size()));
+		if (sz < 0) {
+			throw Codec::error(stage::ENCODE, mPath, sz, "LAME encoding failed.");
+		}
+		_put(&mOut[0], sz);
+	}
+
+	void finish() override {
+		mOut.resize(7200);
+		int sz = lame_encode_flush(mGfp, &mOut[0], static_cast<int>(mOut.size()));
+		if (sz < 0) {
+			throw Codec::error(stage::ENCODE, mPath, sz, "LAME flushing failed.");
+		}
+		_put(&mOut[0], sz);
+
+		unsigned char tag[2880]; // largest possible MPEG frame
+		size_t tagSz = lame_get_lametag_frame(mGfp, tag, sizeof(tag));
+		if (tagSz > 0 && tagSz <= sizeof(tag)) { // Xing/LAME tag goes into the frame reserved at the start
+			if (fseek(mFp, 0, SEEK_SET)) {
+				throw Codec::error(stage::WRITE, mPath, errno, "Failed to rewind MP3 file.");
+			}
+			_put(tag, tagSz);
+		}
+
+		int ret = fclose(mFp);
+		mFp = nullptr;
+		if (ret) {
+			throw Codec::error(stage::WRITE, mPath, errno, "Failed to close MP3 file.");
+		}
+	}
+
+private:
+	void _put(const unsigned char* data, size_t sz) {
+		if (sz && fwrite(data, 1, sz, mFp) != sz) {
+			throw Codec::error(stage::WRITE, mPath, errno, "Failed to write MP3 data.");
+		}
+	}
+};
+
+#else
+
+void throwUnavailable(const wstring& file)
+{
+	throw Codec::error(stage::OPEN, file, 0,
+		"This build has no in-process codecs, it was compiled without FLE_INPROC_CODECS.");
+}
+
+#endif // FLE_INPROC_CODECS
+
+}//namespace
+
+bool Codec::available()
+{
+#ifdef FLE_INPROC_CODECS
+	return true;
+#else
+	return false;
+#endif
+}
+
+std::string Codec::version()
+{
+#ifdef FLE_INPROC_CODECS
+	return string("libFLAC ") + FLAC__VERSION_STRING + ", LAME " + get_lame_version();
+#else
+	return {};
+#endif
+}
+
+unique_ptr<Codec::decoder> Codec::openDecoder(const wstring& src)
+{
+	if (Sys::hasExtension(src, L".wav")) {
+		return std::make_unique<wav_decoder>(src);
+	}
+#ifdef FLE_INPROC_CODECS
+	if (Sys::hasExtension(src, L".flac")) {
+		return std::make_unique<flac_decoder>(src);
+	} else if (Sys::hasExtension(src, L".mp3")) {
+		return std::make_unique<mp3_decoder>(src);
+	}
+#else
+	if (Sys::hasExtension(src, {L".flac", L".mp3"})) {
+		throwUnavailable(src);
+	}
+#endif
+	throw error(stage::OPEN, src, 0, "Not a FLAC/MP3/WAV file.");
+}
+
+unique_ptr<Codec::encoder> Codec::openWavEncoder(const wstring& dest, const format& fmt)
+{
+	return std::make_unique<wav_encoder>(dest, fmt);
+}
+
+unique_ptr<Codec::encoder> Codec::openFlacEncoder(const wstring& dest, const format& fmt,
+	unsigned level, bool verify)
+{
+#ifdef FLE_INPROC_CODECS
+	return std::make_unique<flac_encoder>(dest, fmt, level, verify);
+#else
+	(void)fmt; (void)level; (void)verify;
+	throwUnavailable(dest);
+	return nullptr;
+#endif
+}
+
+unique_ptr<Codec::encoder> Codec::openMp3Encoder(const wstring& dest, const format& fmt,
+	unsigned quality, bool isVbr)
+{
+#ifdef FLE_INPROC_CODECS
+	return std::make_unique<mp3_encoder>(dest, fmt, quality, isVbr);
+#else
+	(void)fmt; (void)quality; (void)isVbr;
+	throwUnavailable(dest);
+	return nullptr;
+#endif
+}
+
+void Codec::transcode(decoder& dec, encoder& enc)
+{
+	thread_local vector<int32_t> buf; // reused by all the files this worker converts
+	buf.resize(BLOCK_FRAMES * dec.fmt().channels);
+	Loudness* meter = Loudness::capture::open(dec.fmt().sampleRate, dec.fmt().channels, dec.fmt().bitsPerSample);
+
+	for (;;) {
+		Cancel::check(); // a block is a blink, so cancelling is too
+		size_t numFrames = dec.read(&buf[0], BLOCK_FRAMES);
+		if (!numFrames) break;
+		if (meter) meter->add(&buf[0], numFrames); // still in the cache, cheaper than anywhere else
+		enc.write(&buf[0], numFrames);
+	}
+	enc.finish();
+}
+
+void Codec::transcode(decoder& dec, const vector<encoder*>& encs)
+{
+	if (encs.size() == 1) {
+		transcode(dec, *encs[0]);
+		return;
+	}
+
+	// Each encoder runs on a thread of its own, taking the blocks the decoder
+	// puts in a ring. A slot is refilled only once every encoder is past it,
+	// so the slowest one holds the decoder back, and the ring is all the PCM
+	// held in memory, however far apart the encoders are.
+	size_t blockLen = BLOCK_FRAMES * dec.fmt().channels;
+	vector<vector<int32_t>> slots(FANOUT_BLOCKS, vector<int32_t>(blockLen));
+	vector<size_t> slotFrames(FANOUT_BLOCKS, 0);
+	vector<size_t> taken(encs.size(), 0); // blocks each encoder is done with
+	size_t produced = 0;
+	bool ended = false, failed = false;
+	std::exception_ptr err;
+	std::mutex mtx;
+	std::condition_variable cv;
+
+	vector<std::thread> thrs;
+	for (size_t e = 0; e < encs.size(); ++e) {
+		thrs.emplace_back([&, e]() {
+			try {
+				for (;;) {
+					size_t block;
+					{
+						std::unique_lock<std::mutex> lk(mtx);
+						cv.wait(lk, [&]() { return taken[e] < produced || ended || failed; });
+						if (failed || taken[e] == produced) break; // all consumed, or given up
+						block = taken[e];
+					}
+					size_t slot = block % FANOUT_BLOCKS;
+					encs[e]->write(&slots[slot][0], slotFrames[slot]);
+					std::lock_guard<std::mutex> lk(mtx);
+					++taken[e];
+					cv.notify_all();
+				}
+				if (!failed) encs[e]->finish();
+			} catch (...) {
+				std::lock_guard<std::mutex> lk(mtx);
+				if (!err) err = std::current_exception();
+				failed = true;
+				cv.notify_all();
+			}
+		});
+	}
+
+	Loudness* meter = Loudness::capture::open(dec.fmt().sampleRate, dec.fmt().channels, dec.fmt().bitsPerSample);
+	try {
+		for (;;) {
+			Cancel::check();
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				cv.wait(lk, [&]() { return failed || produced - *std::min_element(taken.begin(), taken.end()) < FANOUT_BLOCKS; });
+				if (failed) break;
+			}
+			size_t slot = produced % FANOUT_BLOCKS; // no encoder is on it anymore
+			size_t numFrames = dec.read(&slots[slot][0], BLOCK_FRAMES);
+			if (!numFrames) break;
+			if (meter) meter->add(&slots[slot][0], numFrames);
+			slotFrames[slot] = numFrames;
+			std::lock_guard<std::mutex> lk(mtx);
+			++produced;
+			cv.notify_all();
+		}
+	} catch (...) {
+		std::lock_guard<std::mutex> lk(mtx);
+		if (!err) err = std::current_exception();
+		failed = true;
+	}
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		ended = true;
+		cv.notify_all();
+	}
+	for (std::thread& t : thrs) t.join();
+	if (err) std::rethrow_exception(err);
+}
\ No newline at end of file
@@ -0,0 +1,58 @@
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// In-process decoding and encoding, linked against libFLAC and libmp3lame when
+// FLE_INPROC_CODECS is defined. PCM travels as interleaved 32-bit integers at
+// the original bit depth, in buffers reused across the files of each worker.
+struct Codec final {
+private:
+	Codec() = delete;
+
+public:
+	struct format final {
+		unsigned sampleRate = 0, channels = 0, bitsPerSample = 0;
+		uint64_t totalFrames = 0; // 0 if unknown
+	};
+
+	// What went wrong, and where, instead of an opaque exit code.
+	class error final : public std::runtime_error {
+	public:
+		enum class stage { OPEN, DECODE, ENCODE, WRITE };
+
+		stage        where;
+		std::wstring file;
+		int          code; // library status, or errno
+
+		error(stage where, const std::wstring& file, int code, const std::string& msg);
+	};
+
+	class decoder {
+	public:
+		virtual ~decoder() { }
+		virtual const format& fmt() const = 0;
+		virtual size_t read(int32_t* buf, size_t maxFrames) = 0; // returns 0 at end of stream
+	};
+
+	class encoder {
+	public:
+		virtual ~encoder() { }
+		virtual void write(const int32_t* buf, size_t numFrames) = 0;
+		virtual void finish() = 0; // output is complete only after this
+	};
+
+	static bool available();
+	static std::string version(); // of the linked libraries, empty if none
+	static std::unique_ptr<decoder> openDecoder(const std::wstring& src);
+	static std::unique_ptr<encoder> openWavEncoder(const std::wstring& dest, const format& fmt);
+	static std::unique_ptr<encoder> openFlacEncoder(const std::wstring& dest, const format& fmt,
+		unsigned level, bool verify);
+	static std::unique_ptr<encoder> openMp3Encoder(const std::wstring& dest, const format& fmt,
+		unsigned quality, bool isVbr);
+	static void transcode(decoder& dec, encoder& enc);
+	static void transcode(decoder& dec, const std::vector<encoder*>& encs); // decoded once, encoded all at once
+};
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include "ConvCache.h"
+#include <cinttypes>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+#include "Sys.h"
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::wstring;
+
+const wchar_t* const ConvCache::FILE_NAME = L"flac-lame-frontend.cache";
+
+static const char HEADER[] = "flac-lame-frontend cache 1\n";
+static const size_t HASH_CHUNK_SZ = 64 * 1024; // hashed at both ends of the file
+
+ConvCache::ConvCache(const wstring& folder)
+	: mPath(Sys::joinPath(folder, FILE_NAME))
+{
+	size_t numLines = _load();
+	if (numLines > 1000 && numLines > 2 * mEntries.size()) {
+		_rewrite(); // mostly superseded lines, squeeze them out
+	}
+
+	bool isNew = !Sys::exists(mPath);
+	mFp = Sys::openFile(mPath, "ab");
+	if (!mFp) {
+		throw std::runtime_error("Failed to open the conversion cache:\n" + Sys::toUtf8(mPath));
+	}
+	if (isNew) {
+		fputs(HEADER, mFp);
+		fflush(mFp);
+	}
+}
+
+ConvCache::~ConvCache()
+{
+	if (mFp) fclose(mFp);
+}
+
+ConvCache::state ConvCache::lookup(const wstring& src, const fingerprint& fp, uint64_t settings,
+	const wstring& destPath)
+{
+	entry e;
+	{
+		lock_guard<mutex> lk(mMtx);
+		auto it = mEntries.find(Sys::absolutePath(src));
+		if (it == mEntries.end()) return state::NEW;
+		e = it->second;
+	}
+
+	if (!(e.src == fp) || e.settings != settings
+		|| !Sys::exists(destPath) || Sys::fileSize(destPath) != e.destSize) { // output deleted or touched
+		return state::STALE;
+	}
+	return state::UP_TO_DATE;
+}
+
+void ConvCache::record(const wstring& src, const fingerprint& fp, uint64_t settings,
+	const wstring& destPath)
+{
+	wstring key = Sys::absolutePath(src);
+	if (key.find(L'\n') != wstring::npos) return; // can't be stored in a line
+
+	entry e;
+	e.src = fp;
+	e.settings = settings;
+	e.destSize = Sys::fileSize(destPath);
+	string line = _formatLine(key, e);
+
+	lock_guard<mutex> lk(mMtx);
+	mEntries[key] = e;
+	fputs(line.c_str(), mFp);
+	fflush(mFp); // an interrupted batch keeps what was done
+}
+
+ConvCache::fingerprint ConvCache::fingerprintOf(const wstring& src, bool withHash)
+{
+	fingerprint fp;
+	fp.size = Sys::fileSize(src);
+	fp.mtime = Sys::lastWriteTime(src);
+	if (!withHash) return fp;
+
+	// Head and tail of the file are enough to catch retagging and re-rips,
+	// without reading whole files on every run.
+	FILE* f = Sys::openFile(src, "rb");
+	if (!f) return fp;
+	std::vector<char> buf(HASH_CHUNK_SZ);
+	size_t n = fread(&buf[0], 1, buf.size(), f);
+	fp.hash = hashOf(&buf[0], n, fp.size);
+	if (fp.size > 2 * HASH_CHUNK_SZ && fseek(f, -static_cast<long>(HASH_CHUNK_SZ), SEEK_END) == 0) {
+		n = fread(&buf[0], 1, buf.size(), f);
+		fp.hash = hashOf(&buf[0], n, fp.hash);
+	}
+	fclose(f);
+	if (!fp.hash) fp.hash = 1; // 0 means not hashed
+	return fp;
+}
+
+uint64_t ConvCache::hashOf(const void* data, size_t len, uint64_t seed)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ seed; // FNV-1a
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+size_t ConvCache::_load()
+{
+	FILE* f = Sys::openFile(mPath, "rb");
+	if (!f) return 0;
+	string text;
+	char buf[64 * 1024];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0; ) {
+		text.append(buf, n);
+	}
+	fclose(f);
+
+	if (text.compare(0, sizeof(HEADER) - 1, HEADER) != 0) {
+		throw std::runtime_error("Not a conversion cache, or from a newer version:\n" + Sys::toUtf8(mPath));
+	}
+
+	size_t numLines = 0;
+	mEntries.reserve(text.size() / 80); // rough line length
+	for (size_t pos = sizeof(HEADER) - 1; pos < text.size(); ) {
+		size_t eol = text.find('\n', pos);
+		if (eol == string::npos) break; // torn last line, from an interrupted run
+		const char* line = text.c_str() + pos;
+		pos = eol + 1;
+
+		entry e;
+		uint64_t mtime = 0;
+		const char* end = text.c_str() + eol;
+		const char* path = line;
+		if (!_parseField(path, end, 16, e.settings) || !_parseField(path, end, 10, e.src.size)
+			|| !_parseField(path, end, 10, mtime)
+			|| !_parseField(path, end, 16, e.src.hash) || !_parseField(path, end, 10, e.destSize)
+			|| path == end)
+		{
+			continue; // damaged line, the file will just be converted again
+		}
+		e.src.mtime = static_cast<int64_t>(mtime);
+		mEntries[Sys::fromUtf8(string(path, end))] = e;
+		++numLines;
+	}
+	return numLines;
+}
+
+void ConvCache::_rewrite()
+{
+	wstring tmpPath = mPath + L".tmp";
+	FILE* f = Sys::openFile(tmpPath, "wb");
+	if (!f) return; // keep the long one, it still works
+
+	fputs(HEADER, f);
+	for (const auto& kv : mEntries) {
+		fputs(_formatLine(kv.first, kv.second).c_str(), f);
+	}
+	bool ok = fflush(f) == 0;
+	fclose(f);
+	if (ok) {
+		Sys::replaceFile(tmpPath, mPath);
+	} else {
+		Sys::removeFile(tmpPath);
+	}
+}
+
+bool ConvCache::_parseField(const char*& p, const char* end, int base, uint64_t& val)
+{
+	// No sscanf(), some C libraries measure the whole remaining buffer on each call.
+	char* fieldEnd = nullptr;
+	val = strtoull(p, &fieldEnd, base);
+	if (fieldEnd == p || fieldEnd >= end || *fieldEnd != '\t') return false;
+	p = fieldEnd + 1;
+	return true;
+}
+
+string ConvCache::_formatLine(const wstring& src, const entry& e)
+{
+	char fields[128];
+	snprintf(fields, sizeof(fields), "%" PRIx64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIx64 "\t%" PRIu64 "\t",
+		e.settings, e.src.size, static_cast<uint64_t>(e.src.mtime), e.src.hash, e.destSize);
+	return fields + Sys::toUtf8(src) + "\n";
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Conversions already done into a destination folder, so a re-run skips the
+// sources which didn't change. Kept in the folder itself as an append-only
+// text file, where the last line of each source wins; the whole thing lives
+// in a hash map while the batch runs.
+class ConvCache final {
+public:
+	static const wchar_t* const FILE_NAME;
+
+	struct fingerprint final {
+		uint64_t size = 0;
+		int64_t  mtime = 0;
+		uint64_t hash = 0; // 0 unless hashing was asked
+
+		bool operator==(const fingerprint& other) const {
+			return size == other.size && mtime == other.mtime && hash == other.hash;
+		}
+	};
+
+	enum class state { NEW, STALE, UP_TO_DATE };
+
+private:
+	struct entry final {
+		fingerprint src;
+		uint64_t    settings = 0;
+		uint64_t    destSize = 0;
+	};
+
+	std::wstring mPath;
+	std::mutex   mMtx;
+	std::unordered_map<std::wstring, entry> mEntries;
+	FILE*        mFp = nullptr;
+
+public:
+	explicit ConvCache(const std::wstring& folder);
+	ConvCache(const ConvCache&) = delete;
+	ConvCache& operator=(const ConvCache&) = delete;
+	~ConvCache();
+
+	state lookup(const std::wstring& src, const fingerprint& fp, uint64_t settings,
+		const std::wstring& destPath);
+	void  record(const std::wstring& src, const fingerprint& fp, uint64_t settings,
+		const std::wstring& destPath);
+
+	static fingerprint fingerprintOf(const std::wstring& src, bool withHash);
+	static uint64_t    hashOf(const void* data, size_t len, uint64_t seed = 0);
+
+private:
+	size_t _load();
+	void   _rewrite();
+	static bool        _parseField(const char*& p, const char* end, int base, uint64_t& val);
+	static std::string _formatLine(const std::wstring& src, const entry& e);
+};
@@ -1,146 +1,322 @@
 
 #include "Convert.h"
-#include <winlamb/executable.h>
-#include <winlamb/file.h>
-#include <winlamb/path.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include "Cancel.h"
+#include "FlacParallel.h"
+#include "Loudness.h"
+#include "MappedFile.h"
+#include "Probe.h"
+#include "Process.h"
+#include "Sys.h"
+#include "Telemetry.h"
+#include "Verify.h"
 using std::runtime_error;
+using std::vector;
 using std::wstring;
-using namespace wl;
 
-void Convert::validatePaths(const file_ini& ini)
+static const size_t PIPE_BUF_SZ = 1024 * 1024; // each OS pipe between the processes
+static const size_t PUMP_BUF_SZ = 256 * 1024; // our own buffer, the only PCM held in memory
+
+Convert::tool_error::tool_error(int exitCode, const std::string& errText, const std::string& msg)
+	: std::runtime_error(msg), exitCode(exitCode), errText(errText)
 {
-	if (!ini.structure_is(L"[Tools]lame,flac")) {
-		throw runtime_error("INI file doesn't have the right entries.");
-	}
+}
 
+static bool _isBareName(const wstring& tool)
+{
+	return Sys::fileFrom(tool) == tool; // no folder, left for the PATH search
+}
+
+void Convert::validateTools(const options& opts)
+{
 	// Search for FLAC and LAME tools.
-	if (!file::util::exists(ini[L"Tools"][L"lame"])) {
-		throw runtime_error(str::to_ascii(
-			str::format(L"Could not find LAME tool at:\n%s",
-				ini[L"Tools"][L"lame"]) ));
+	if (!_isBareName(opts.lame) && !Sys::exists(opts.lame)) {
+		throw runtime_error("Could not find LAME tool at:\n" + Sys::toUtf8(opts.lame));
 	}
-	if (!file::util::exists(ini[L"Tools"][L"flac"])) {
-		throw runtime_error(str::to_ascii(
-			str::format(L"Could not find FLAC tool at:\n%s",
-				ini[L"Tools"][L"lame"]) ));
+	if (!_isBareName(opts.flac) && !Sys::exists(opts.flac)) {
+		throw runtime_error("Could not find FLAC tool at:\n" + Sys::toUtf8(opts.flac));
 	}
 }
 
-void Convert::toWav(const file_ini& ini, wstring src, wstring dest, bool delSrc)
+uint64_t Convert::toWav(const options& opts,
+	wstring src, wstring dest, bool delSrc)
 {
 	_validateDestFolder(dest);
 
-	if (path::is_same(path::folder_from(src), dest)) { // destination folder is same of origin
+	if (Sys::isSamePath(Sys::folderFrom(src), dest)) { // destination folder is same of origin
 		dest.clear();
 	}
 
-	wstring cmdLine;
-	if (path::has_extension(src, L".mp3")) {
-		cmdLine = str::format(L"\"%s\" --decode \"%s\"",
-			ini[L"Tools"][L"lame"], src);
-	} else if (path::has_extension(src, L".flac")) {
-		cmdLine = str::format(L"\"%s\" -d \"%s\"",
-			ini[L"Tools"][L"flac"], src);
+	if (Sys::hasExtension(src, L".wav")) { // nothing to convert, just to put elsewhere
+		return _copyWav(src, destPath(src, dest, L".wav"), delSrc);
+	}
+
+	if (opts.inProcess && Sys::hasExtension(src, {L".mp3", L".flac"})) {
+		_executeInProcess(src, destPath(src, dest, L".wav"), delSrc,
+			[](const wstring& out, const Codec::format& fmt) {
+				return Codec::openWavEncoder(out, fmt);
+			});
+		return 0;
+	}
+
+	vector<wstring> cmd;
+	if (Sys::hasExtension(src, L".mp3")) {
+		cmd = {opts.lame, L"--decode", src};
+	} else if (Sys::hasExtension(src, L".flac")) {
+		cmd = {opts.flac, L"-d", src};
 		if (!dest.empty()) {
-			cmdLine.append(L" -o"); // different destination folder requires flag
+			cmd.emplace_back(L"-o"); // different destination folder requires flag
 		}
 	} else {
-		throw runtime_error(str::to_ascii(
-			str::format(L"Not a FLAC/MP3: %s\n", src) ));
+		throw runtime_error("Not a FLAC/MP3: " + Sys::toUtf8(src) + "\n");
 	}
 
 	if (!dest.empty()) { // different destination folder
-		wstring destWavPath = src;
-		path::change_extension(destWavPath, L".wav");
-		cmdLine.append( str::format(L" \"%s\\%s\"",
-			dest, path::file_from(destWavPath)) );
+		cmd.emplace_back(destPath(src, dest, L".wav"));
 	}
 
-	_execute(cmdLine, src, delSrc);
+	_execute(cmd, src, destPath(src, dest, L".wav"), delSrc, Telemetry::stage::DECODE);
+	return 0;
 }
 
-void Convert::toFlac(const file_ini& ini, wstring src, wstring dest,
-	bool delSrc, const wstring& quality)
+uint64_t Convert::toFlac(const options& opts,
+	wstring src, wstring dest, bool delSrc, const wstring& quality)
 {
 	_validateDestFolder(dest);
 
-	if (path::is_same(path::folder_from(src), dest)) { // destination folder is same of origin
+	if (Sys::isSamePath(Sys::folderFrom(src), dest)) { // destination folder is same of origin
 		dest.clear();
 	}
 
-	if (path::has_extension(src, {L".flac", L".mp3"})) { // needs intermediary WAV conversion
-		if (path::has_extension(src, L".mp3")) {
-			toWav(ini, src, dest, delSrc); // send WAV straight to new folder, if any
-		} else if (path::has_extension(src, L".flac")) {
-			toWav(ini, src, dest, // send WAV straight to new folder, if any
-				dest.empty() ? true : delSrc); // if same destination folder, then delete source (will be replaced)
-		}
+	unsigned numThreads = opts.parallelFlacThreads ? opts.parallelFlacThreads : std::thread::hardware_concurrency();
+	bool isLong = opts.parallelFlacSecs && numThreads > 1 && Codec::available() // one core isn't enough for this one
+		&& Sys::hasExtension(src, {L".flac", L".mp3", L".wav"})
+		&& _durationSecs(src) >= opts.parallelFlacSecs;
+
+	if ((opts.inProcess || isLong) && Sys::hasExtension(src, {L".flac", L".mp3", L".wav"})) {
+		unsigned level = std::stoul(quality);
+		bool verify = !Verify::isDeferred();
+		_executeInProcess(src, destPath(src, dest, L".flac"), delSrc,
+			[level, isLong, verify, numThreads](const wstring& out, const Codec::format& fmt) -> std::unique_ptr<Codec::encoder> {
+				if (isLong) {
+					return std::make_unique<FlacParallel>(out, fmt, level, verify, numThreads);
+				}
+				return Codec::openFlacEncoder(out, fmt, level, verify); // like -V
+			});
+		return 0;
+	}
+
+	if (Sys::hasExtension(src, L".flac")) { // the encoder reads FLAC itself, and keeps the tags
+		wstring destFlacPath = destPath(src, dest, L".flac");
+		vector<wstring> cmd = _flacCmd(opts, quality);
+		cmd.insert(cmd.end(), {src, L"-o", destFlacPath});
+		return _executeDirect(cmd, src, destFlacPath, delSrc);
+	}
+
+	if (opts.streaming && Sys::hasExtension(src, L".mp3")) { // decoder writes straight into the encoder
+		wstring destFlacPath = destPath(src, dest, L".flac");
+		vector<wstring> cmd = _flacCmd(opts, quality);
+		cmd.insert(cmd.end(), {L"--ignore-chunk-sizes", // LAME can't rewind stdout to fix the WAV header
+			L"-", L"-o", destFlacPath});
+		_executePiped(_decoderCmd(opts, src), cmd, src, destFlacPath, delSrc);
+		return 0;
+	}
+
+	bool isScratch = false;
+	if (Sys::hasExtension(src, L".mp3")) { // needs intermediary WAV conversion
+		toWav(opts, src, dest, delSrc); // send WAV straight to new folder, if any
 
 		if (!dest.empty()) { // different destination folder
-			src = str::format(L"%s\\%s", dest, path::file_from(src));
+			src = Sys::joinPath(dest, Sys::fileFrom(src));
 			dest.clear();
 		}
 
-		path::change_extension(src, L".wav"); // our source is now a WAV
+		src = Sys::changeExtension(src, L".wav"); // our source is now a WAV
+		isScratch = !delSrc; // with the source deleted, the WAV is all that's left of it
 		delSrc = true; // delete the WAV at end
-	} else if (!path::has_extension(src, L".wav")) {
-		throw runtime_error(str::to_ascii(
-			str::format(L"Not a FLAC/WAV: %s\n", src) ));
+	} else if (!Sys::hasExtension(src, L".wav")) {
+		throw runtime_error("Not a FLAC/WAV: " + Sys::toUtf8(src) + "\n");
 	}
 
-	wstring cmdLine = str::format(L"\"%s\" -%s -V --no-seektable \"%s\"",
-		ini[L"Tools"][L"flac"], quality, src);
+	vector<wstring> cmd = _flacCmd(opts, quality);
+	cmd.emplace_back(src);
 
 	if (!dest.empty()) { // different destination folder
-		wstring destFlacPath(src);
-		path::change_extension(src, L".flac");
-		cmdLine.append( str::format(L" -o \"%s\\%s\"",
-			dest, path::file_from(destFlacPath)) );
+		cmd.insert(cmd.end(), {L"-o", destPath(src, dest, L".flac")});
 	}
 
-	_execute(cmdLine, src, delSrc);
+	try {
+		_execute(cmd, src, destPath(src, dest, L".flac"), delSrc, Telemetry::stage::ENCODE);
+	} catch (const Cancel::error&) {
+		if (isScratch) Sys::removeFile(src); // the intermediary WAV
+		throw;
+	}
+	return 0;
 }
 
-void Convert::toMp3(const file_ini& ini, wstring src, wstring dest, bool delSrc,
-	const wstring& quality, bool isVbr)
+uint64_t Convert::toMp3(const options& opts,
+	wstring src, wstring dest, bool delSrc, const wstring& quality, bool isVbr)
 {
 	_validateDestFolder(dest);
 
-	if (path::is_same(path::folder_from(src), dest)) { // destination folder is same of origin
+	if (Sys::isSamePath(Sys::folderFrom(src), dest)) { // destination folder is same of origin
 		dest.clear();
 	}
 
-	if (path::has_extension(src, {L".flac", L".mp3"})) { // needs intermediary WAV conversion
-		if (path::has_extension(src, L".flac")) {
-			toWav(ini, src, dest, delSrc); // send WAV straight to new folder, if any
-		} else if (path::has_extension(src, L".mp3")) {
-			toWav(ini, src, dest, // send WAV straight to new folder, if any
-				dest.empty() ? true : delSrc); // if same destination folder, then delete source (will be replaced)
-		}
+	if (opts.inProcess && Sys::hasExtension(src, {L".flac", L".mp3", L".wav"})) {
+		unsigned numQuality = std::stoul(quality);
+		_executeInProcess(src, destPath(src, dest, L".mp3"), delSrc,
+			[numQuality, isVbr](const wstring& out, const Codec::format& fmt) {
+				return Codec::openMp3Encoder(out, fmt, numQuality, isVbr);
+			});
+		return 0;
+	}
+
+	if (Sys::hasExtension(src, L".mp3")) { // the encoder decodes MP3 itself
+		wstring destMp3Path = destPath(src, dest, L".mp3");
+		return _executeDirect({opts.lame, (isVbr ? L"-V" : L"-b") + quality, L"--noreplaygain",
+			L"--mp3input", src, destMp3Path}, src, destMp3Path, delSrc);
+	}
+
+	if (opts.streaming && Sys::hasExtension(src, L".flac")) { // decoder writes straight into the encoder
+		wstring destMp3Path = destPath(src, dest, L".mp3");
+		_executePiped(_decoderCmd(opts, src),
+			{opts.lame, (isVbr ? L"-V" : L"-b") + quality, L"--noreplaygain", L"-", destMp3Path},
+			src, destMp3Path, delSrc);
+		return 0;
+	}
+
+	bool isScratch = false;
+	if (Sys::hasExtension(src, L".flac")) { // needs intermediary WAV conversion
+		toWav(opts, src, dest, delSrc); // send WAV straight to new folder, if any
 
 		if (!dest.empty()) { // different destination folder
-			src = str::format(L"%s\\%s", dest, path::file_from(src));
+			src = Sys::joinPath(dest, Sys::fileFrom(src));
 			dest.clear();
 		}
 
-		path::change_extension(src, L".wav"); // our source is now a WAV
+		src = Sys::changeExtension(src, L".wav"); // our source is now a WAV
+		isScratch = !delSrc; // with the source deleted, the WAV is all that's left of it
 		delSrc = true; // delete the WAV at end
-	} else if (!path::has_extension(src, L".wav")) {
-		throw runtime_error(str::to_ascii(
-			str::format(L"Not a FLAC/MP3/WAV: %s\n", src) ));
+	} else if (!Sys::hasExtension(src, L".wav")) {
+		throw runtime_error("Not a FLAC/MP3/WAV: " + Sys::toUtf8(src) + "\n");
 	}
 
-	wstring cmdLine = str::format(L"\"%s\" -%s%s --noreplaygain \"%s\"",
-		ini[L"Tools"][L"lame"], (isVbr ? L"V" : L"b"), quality, src);
+	vector<wstring> cmd = {opts.lame, (isVbr ? L"-V" : L"-b") + quality, L"--noreplaygain", src};
 
 	if (!dest.empty()) { // different destination folder
-		wstring destMp3Path(src);
-		path::change_extension(src, L".mp3");
-		cmdLine.append( str::format(L" \"%s\\%s\"",
-			dest, path::file_from(destMp3Path)) );
+		cmd.emplace_back(destPath(src, dest, L".mp3"));
+	}
+
+	try {
+		_execute(cmd, src, destPath(src, dest, L".mp3"), delSrc, Telemetry::stage::ENCODE);
+	} catch (const Cancel::error&) {
+		if (isScratch) Sys::removeFile(src); // the intermediary WAV
+		throw;
+	}
+	return 0;
+}
+
+uint64_t Convert::toMany(const options& opts,
+	const wstring& src, const vector<output>& outs, bool delSrc)
+{
+	if (outs.size() == 1) { // with all the shortcuts of a single output
+		const output& o = outs[0];
+		if (Sys::hasExtension(o.ext, L".mp3")) return toMp3(opts, src, o.dest, delSrc, o.quality, o.isVbr);
+		if (Sys::hasExtension(o.ext, L".flac")) return toFlac(opts, src, o.dest, delSrc, o.quality);
+		return toWav(opts, src, o.dest, delSrc);
+	}
+	if (!Sys::hasExtension(src, {L".flac", L".mp3", L".wav"})) {
+		throw runtime_error("Not a FLAC/MP3/WAV: " + Sys::toUtf8(src) + "\n");
+	}
+
+	vector<output> targets = outs;
+	vector<wstring> destPaths, outPaths;
+	bool replacesSrc = false;
+	for (output& o : targets) {
+		_validateDestFolder(o.dest);
+		destPaths.emplace_back(destPath(src, o.dest, o.ext));
+		bool isSrc = Sys::isSamePath(src, destPaths.back());
+		replacesSrc = replacesSrc || isSrc;
+		bool isDone = isSrc && Sys::hasExtension(o.ext, L".wav"); // a WAV of itself, left where it is
+		outPaths.emplace_back(isSrc && !isDone ? destPaths.back() + L".tmp" : destPaths.back());
+	}
+	auto removeOutputs = [&]() {
+		for (const wstring& out : outPaths) {
+			if (!Sys::isSamePath(out, src) && Sys::exists(out)) Sys::removeFile(out);
+		}
+	};
+
+	if (opts.inProcess) {
+		try {
+			Telemetry::scope transcoding(Telemetry::stage::TRANSCODE);
+			std::unique_ptr<Codec::decoder> dec = Codec::openDecoder(src);
+			vector<std::unique_ptr<Codec::encoder>> encs;
+			vector<Codec::encoder*> encPtrs;
+			for (size_t i = 0; i < targets.size(); ++i) {
+				const output& o = targets[i];
+				if (Sys::isSamePath(outPaths[i], src)) continue; // the WAV source is that output already
+				if (Sys::hasExtension(o.ext, L".mp3")) {
+					encs.emplace_back(Codec::openMp3Encoder(outPaths[i], dec->fmt(), std::stoul(o.quality), o.isVbr));
+				} else if (Sys::hasExtension(o.ext, L".flac")) {
+					encs.emplace_back(Codec::openFlacEncoder(outPaths[i], dec->fmt(), std::stoul(o.quality),
+						!Verify::isDeferred()));
+				} else {
+					encs.emplace_back(Codec::openWavEncoder(outPaths[i], dec->fmt()));
+				}
+				encPtrs.emplace_back(encs.back().get());
+			}
+			Codec::transcode(*dec, encPtrs);
+		} catch (...) { // decoder and encoders are gone, so the output files are already closed
+			removeOutputs();
+			throw;
+		}
+	} else {
+		// The encoders read the same PCM, each through a pipe of its own. A WAV
+		// among the outputs is decoded first, by the decoder itself, which
+		// writes a proper header; the encoders then read it, not a decoder.
+		// Without streaming, a WAV made aside does the same.
+		wstring pcmSrc = src;
+		bool isScratch = false;
+		auto wavOut = std::find_if(targets.begin(), targets.end(),
+			[](const output& o) { return Sys::hasExtension(o.ext, L".wav"); });
+		if (wavOut != targets.end() || (!opts.streaming && !Sys::hasExtension(src, L".wav"))) {
+			wstring wavDest = wavOut != targets.end() ? wavOut->dest : targets[0].dest;
+			pcmSrc = destPath(src, wavDest, L".wav");
+			isScratch = wavOut == targets.end();
+			if (!Sys::hasExtension(src, L".wav")) toWav(opts, src, wavDest, false);
+			else _copyWav(src, pcmSrc, false);
+		}
+
+		vector<vector<wstring>> encCmds;
+		vector<wstring> encOutPaths;
+		for (size_t i = 0; i < targets.size(); ++i) {
+			if (Sys::hasExtension(targets[i].ext, L".wav")) continue; // done above
+			encCmds.emplace_back(_encoderCmd(opts, targets[i], outPaths[i]));
+			encOutPaths.emplace_back(outPaths[i]);
+		}
+		try {
+			_executeFanOut(Sys::hasExtension(pcmSrc, L".wav") ? vector<wstring>() : _decoderCmd(opts, pcmSrc),
+				pcmSrc, encCmds, encOutPaths);
+		} catch (...) {
+			removeOutputs(); // the WAV too, the source isn't done until all are
+			if (isScratch && Sys::exists(pcmSrc)) Sys::removeFile(pcmSrc);
+			throw;
+		}
+		if (isScratch) Sys::removeFile(pcmSrc);
 	}
 
-	_execute(cmdLine, src, delSrc);
+	for (size_t i = 0; i < targets.size(); ++i) {
+		_commitOutput(src, destPaths[i], outPaths[i], false);
+	}
+	if (delSrc && !replacesSrc) { // else it's already gone, replaced by an output
+		Telemetry::scope deleting(Telemetry::stage::DELETE);
+		Sys::removeFile(src);
+	}
+	return 0;
 }
 
 void Convert::_validateDestFolder(wstring& dest)
@@ -149,24 +325,363 @@ void Convert::_validateDestFolder(wstring& dest)
 		return; // same destination of source file, it's OK
 	}
 
-	path::trim_backslash(dest);
+	dest = Sys::trimSeparator(dest);
+
+	if (!Sys::isDir(dest)) {
+		throw runtime_error("Destination is not a folder:\n" + Sys::toUtf8(dest));
+	}
+}
+
+wstring Convert::destPath(const wstring& src, const wstring& dest, const wchar_t* ext)
+{
+	return Sys::changeExtension(
+		Sys::joinPath(dest.empty() ? Sys::folderFrom(src) : dest, Sys::fileFrom(src)), ext);
+}
+
+std::string Convert::toolVersion(const wstring& tool)
+{
+	// First line of "--version", which both tools print to stdout.
+	try {
+		Process::pipe out(4096);
+		Process proc;
+		proc.start({tool, L"--version"}, Process::NO_HANDLE, out.hWrite);
+		out.closeWrite();
+
+		std::string text;
+		char buf[1024];
+		for (size_t n; (n = out.read(buf, sizeof(buf))) > 0; ) {
+			text.append(buf, n);
+		}
+		proc.wait();
+		return text.substr(0, text.find_first_of("\r\n"));
+	} catch (const std::exception&) {
+		return {}; // missing tool, the conversions will tell
+	}
+}
+
+uint64_t Convert::_durationSecs(const wstring& src)
+{
+	return static_cast<uint64_t>(Probe::read(src).durationSecs); // 0 if unknown, let the conversion tell
+}
+
+uint64_t Convert::_pcmBytes(const wstring& src)
+{
+	// What a decoder would have written, had there been one.
+	Probe::info i = Probe::read(src);
+	return static_cast<uint64_t>(i.durationSecs * i.sampleRate)
+		* i.channels * ((i.bitsPerSample + 7) / 8);
+}
+
+uint64_t Convert::_wavDataEnd(const wstring& src)
+{
+	// Where the audio stops: chunks after it, LIST or id3, aren't PCM to an
+	// encoder which reads up to EOF. Placeholder sizes run to the end.
+	MappedFile file;
+	if (!file.open(src)) return UINT64_MAX; // reading it fails next, and tells
+	for (uint64_t off = 12; off + 8 <= file.size(); ) {
+		size_t len = 8;
+		const uint8_t* buf = file.view(off, len);
+		if (len < 8) break;
+		uint32_t chunkSz = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (static_cast<uint32_t>(buf[7]) << 24);
+		if (!memcmp(buf, "data", 4)) {
+			uint64_t end = off + 8 + chunkSz;
+			return chunkSz && end <= file.size() ? end : file.size(); // streamed, or RF64
+		}
+		off += 8 + static_cast<uint64_t>(chunkSz) + (chunkSz & 1); // chunks are word-aligned
+	}
+	return file.size();
+}
+
+vector<wstring> Convert::_decoderCmd(const options& opts, const wstring& src)
+{
+	if (Sys::hasExtension(src, L".mp3")) {
+		return {opts.lame, L"--decode", src, L"-"};
+	}
+	return {opts.flac, L"-d", L"-c", src}; // decoded WAV goes to stdout
+}
 
-	if (!file::util::is_dir(dest)) {
-		throw runtime_error(str::to_ascii(
-			str::format(L"Destination is not a folder:\n%s", dest) ));
+vector<wstring> Convert::_encoderCmd(const options& opts, const output& out, const wstring& outPath)
+{
+	// Reading WAV from stdin, as in the piped conversions.
+	if (Sys::hasExtension(out.ext, L".mp3")) {
+		return {opts.lame, (out.isVbr ? L"-V" : L"-b") + out.quality, L"--noreplaygain", L"-", outPath};
 	}
+	vector<wstring> cmd = _flacCmd(opts, out.quality);
+	cmd.insert(cmd.end(), {L"--ignore-chunk-sizes", // LAME can't rewind stdout to fix the WAV header
+		L"-", L"-o", outPath});
+	return cmd;
 }
 
-void Convert::_execute(const wstring& cmdLine, const wstring& src, bool delSrc)
+vector<wstring> Convert::_flacCmd(const options& opts, const wstring& quality)
 {
-#ifdef _DEBUG
+	// The encoder decodes what it wrote as it goes, unless that's checked later.
+	vector<wstring> cmd = {opts.flac, L"-" + quality};
+	if (!Verify::isDeferred()) cmd.emplace_back(L"-V");
+	cmd.emplace_back(L"--no-seektable");
+	return cmd;
+}
+
+void Convert::_execute(const vector<wstring>& cmd, const wstring& src, const wstring& outPath,
+	bool delSrc, Telemetry::stage what)
+{
+#if defined(_DEBUG) && defined(_WIN32)
 	// Debug summary of operations about to be performed.
-	OutputDebugString( str::format(L"Run %s\n", cmdLine).c_str() );
+	OutputDebugStringW( (L"Run " + Process::formatCmdLine(cmd) + L"\n").c_str() );
+	if (delSrc) {
+		OutputDebugStringW( (L"Del " + src + L"\n").c_str() );
+	}
+#endif
+
+	Cancel::check(); // nothing written yet
+	Telemetry::scope running(what);
+	Process tool;
+	{
+		Telemetry::scope spawning(Telemetry::stage::SPAWN);
+		tool.start(cmd, Process::NO_HANDLE, Process::NO_HANDLE, true); // run tool
+	}
+	if (what == Telemetry::stage::ENCODE && Sys::hasExtension(src, L".wav")) {
+		Loudness::measureWavFile(src); // while the encoder reads it too, so it's read from the cache
+	}
+	int exitCode = tool.wait();
+	running.end();
+	if (exitCode && Cancel::isRequested()) { // killed halfway through
+		if (Sys::exists(outPath)) Sys::removeFile(outPath);
+		throw Cancel::error();
+	}
+	if (exitCode) {
+		throw tool_error(exitCode, tool.errText(), "Tool failed with exit code " + std::to_string(exitCode) + ":\n"
+			+ Sys::toUtf8(Process::formatCmdLine(cmd)));
+	}
+
+	if (delSrc) {
+		Telemetry::scope deleting(Telemetry::stage::DELETE);
+		Sys::removeFile(src); // delete source file
+	}
+}
+
+uint64_t Convert::_executeDirect(const vector<wstring>& cmd,
+	const wstring& src, const wstring& destPath, bool delSrc)
+{
+	// One tool reading the source and writing the destination, nothing in
+	// between; like the piped conversions, the destination is the last
+	// argument, and written aside when it's the source itself.
+	uint64_t saved = _pcmBytes(src); // source may be replaced
+	bool replacesSrc = Sys::isSamePath(src, destPath);
+	wstring outPath = replacesSrc ? destPath + L".tmp" : destPath;
+	vector<wstring> toolCmd = cmd;
+	if (replacesSrc) toolCmd.back() = outPath;
+
+	try {
+		_execute(toolCmd, src, outPath, false, Telemetry::stage::ENCODE);
+	} catch (...) {
+		if (Sys::exists(outPath)) Sys::removeFile(outPath); // don't leave a truncated output
+		throw;
+	}
+	_commitOutput(src, destPath, outPath, delSrc);
+	return saved;
+}
+
+uint64_t Convert::_copyWav(const wstring& src, const wstring& destPath, bool delSrc)
+{
+#if defined(_DEBUG) && defined(_WIN32)
+	OutputDebugStringW( ((delSrc ? L"Move " : L"Copy ") + src + L" -> " + destPath + L"\n").c_str() );
+#endif
+
+	if (Sys::isSamePath(src, destPath)) return 0; // already where it should be
+
+	Telemetry::scope copying(Telemetry::stage::COPY);
+	if (delSrc) {
+		uint64_t size = Sys::fileSize(src);
+		return Sys::moveFile(src, destPath) ? size : 0; // renamed, nothing written at all
+	}
+	Sys::copyFile(src, destPath);
+	return 0;
+}
+
+void Convert::_executePiped(const vector<wstring>& decoderCmd, const vector<wstring>& encoderCmd,
+	const wstring& src, const wstring& destPath, bool delSrc)
+{
+#if defined(_DEBUG) && defined(_WIN32)
+	OutputDebugStringW( (L"Run " + Process::formatCmdLine(decoderCmd)
+		+ L" | " + Process::formatCmdLine(encoderCmd) + L"\n").c_str() );
 	if (delSrc) {
-		OutputDebugString( str::format(L"Del %s\n", src).c_str() );
+		OutputDebugStringW( (L"Del " + src + L"\n").c_str() );
 	}
 #endif
 
-	executable::exec(cmdLine); // run tool
-	if (delSrc) file::util::del(src); // delete source file
+	// Re-encoding onto the very same path: write aside, then replace the source.
+	bool replacesSrc = Sys::isSamePath(src, destPath);
+	wstring outPath = replacesSrc ? destPath + L".tmp" : destPath;
+	vector<wstring> encCmd = encoderCmd;
+	if (replacesSrc) encCmd.back() = outPath; // output file is always the last argument
+
+	Cancel::check();
+	Process::pipe decPipe(PIPE_BUF_SZ), encPipe(PIPE_BUF_SZ);
+	Process decoder, encoder;
+	Telemetry::scope decoding(Telemetry::stage::DECODE);
+	Telemetry::scope encoding(Telemetry::stage::ENCODE, 1); // runs alongside the decoder
+	{
+		Telemetry::scope spawning(Telemetry::stage::SPAWN);
+		decoder.start(decoderCmd, Process::NO_HANDLE, decPipe.hWrite, true);
+		decPipe.closeWrite(); // only the decoder writes, so we get EOF when it finishes
+		encoder.start(encCmd, encPipe.hRead, Process::NO_HANDLE, true);
+		encPipe.closeRead();
+	}
+
+	vector<char> buf(PUMP_BUF_SZ);
+	Loudness::wav_feed loudness; // the PCM passes through here anyway
+	for (;;) {
+		size_t numRead = decPipe.read(&buf[0], buf.size());
+		if (!numRead) break; // decoder is done, or died
+		if (!encPipe.write(&buf[0], numRead)) break; // encoder is gone, its exit code will tell why
+		loudness.feed(&buf[0], numRead);
+	}
+	encPipe.closeWrite(); // EOF for the encoder
+	decPipe.closeRead(); // if we stopped early, decoder fails writing and quits
+
+	int decExit = decoder.wait();
+	decoding.end();
+	int encExit = encoder.wait();
+	encoding.end();
+	if (decExit || encExit) {
+		if (Sys::exists(outPath)) Sys::removeFile(outPath); // don't leave a truncated output
+		Cancel::check(); // killed, not failed
+		std::string errText;
+		if (!decoder.errText().empty()) errText.append("decoder: ").append(decoder.errText());
+		if (!encoder.errText().empty()) {
+			if (!errText.empty()) errText.append("\n");
+			errText.append("encoder: ").append(encoder.errText());
+		}
+		throw tool_error(decExit ? decExit : encExit, errText, // a failing decoder usually breaks the encoder too
+			"Decoder exited with code " + std::to_string(decExit)
+			+ ", encoder with code " + std::to_string(encExit) + ":\n"
+			+ Sys::toUtf8(Process::formatCmdLine(decoderCmd) + L" | " + Process::formatCmdLine(encCmd)));
+	}
+
+	_commitOutput(src, destPath, outPath, delSrc);
+}
+
+void Convert::_executeFanOut(const vector<wstring>& decoderCmd, const wstring& src,
+	const vector<vector<wstring>>& encoderCmds, const vector<wstring>& outPaths)
+{
+	// One decoder, or the WAV read right here, pumped into all the encoders.
+	// Writes block while an encoder's pipe is full, so the slowest one sets
+	// the pace, and the pipes are all the PCM held in memory.
+	Cancel::check();
+	FILE* fin = nullptr;
+	uint64_t numLeft = 0; // of the WAV, up to the end of its data chunk
+	if (decoderCmd.empty()) {
+		numLeft = _wavDataEnd(src);
+		fin = Sys::openFile(src, "rb");
+		if (!fin) throw runtime_error("Failed to read:\n" + Sys::toUtf8(src));
+	}
+	std::unique_ptr<Process::pipe> decPipe;
+	Process decoder;
+	vector<std::unique_ptr<Process::pipe>> encPipes;
+	vector<std::unique_ptr<Process>> encoders;
+	Telemetry::scope decoding(Telemetry::stage::DECODE);
+	Telemetry::scope encoding(Telemetry::stage::ENCODE, 1); // all of them, alongside the decoder
+	try {
+		Telemetry::scope spawning(Telemetry::stage::SPAWN);
+		if (!fin) {
+			decPipe = std::make_unique<Process::pipe>(PIPE_BUF_SZ);
+			decoder.start(decoderCmd, Process::NO_HANDLE, decPipe->hWrite, true);
+			decPipe->closeWrite();
+		}
+		for (const vector<wstring>& cmd : encoderCmds) {
+			encPipes.emplace_back(std::make_unique<Process::pipe>(PIPE_BUF_SZ));
+			encoders.emplace_back(std::make_unique<Process>());
+			encoders.back()->start(cmd, encPipes.back()->hRead, Process::NO_HANDLE, true);
+			encPipes.back()->closeRead();
+		}
+	} catch (...) {
+		if (fin) fclose(fin);
+		throw;
+	}
+
+	vector<char> buf(PUMP_BUF_SZ);
+	Loudness::wav_feed loudness;
+	vector<bool> alive(encPipes.size(), true);
+	size_t numAlive = encPipes.size();
+	while (numAlive) {
+		size_t numRead = fin ? fread(&buf[0], 1, static_cast<size_t>(std::min<uint64_t>(buf.size(), numLeft)), fin)
+			: decPipe->read(&buf[0], buf.size());
+		if (!numRead) break; // decoder is done, or died
+		numLeft -= fin ? numRead : 0;
+		for (size_t e = 0; e < encPipes.size(); ++e) {
+			if (alive[e] && !encPipes[e]->write(&buf[0], numRead)) { // gone, its exit code will tell why
+				alive[e] = false;
+				--numAlive;
+			}
+		}
+		loudness.feed(&buf[0], numRead);
+	}
+	for (std::unique_ptr<Process::pipe>& p : encPipes) p->closeWrite(); // EOF for the encoders
+	if (decPipe) decPipe->closeRead(); // if we stopped early, decoder fails writing and quits
+	bool readFailed = fin && ferror(fin);
+	if (fin) fclose(fin);
+
+	int decExit = fin ? 0 : decoder.wait();
+	decoding.end();
+	vector<int> encExits;
+	for (std::unique_ptr<Process>& enc : encoders) encExits.emplace_back(enc->wait());
+	encoding.end();
+
+	auto failed = std::find_if(encExits.begin(), encExits.end(), [](int code) { return code != 0; });
+	if (decExit || failed != encExits.end() || readFailed) {
+		for (const wstring& out : outPaths) {
+			if (Sys::exists(out)) Sys::removeFile(out); // don't leave truncated outputs
+		}
+		Cancel::check(); // killed, not failed
+		if (readFailed) throw runtime_error("Failed to read:\n" + Sys::toUtf8(src));
+		size_t e = failed - encExits.begin();
+		std::string errText;
+		if (!fin && !decoder.errText().empty()) errText.append("decoder: ").append(decoder.errText());
+		if (failed != encExits.end() && !encoders[e]->errText().empty()) {
+			if (!errText.empty()) errText.append("\n");
+			errText.append("encoder: ").append(encoders[e]->errText());
+		}
+		wstring cmdLine = decoderCmd.empty() ? src : Process::formatCmdLine(decoderCmd);
+		std::string codes = fin ? "Encoder exited with code " + std::to_string(*failed)
+			: "Decoder exited with code " + std::to_string(decExit)
+				+ (failed != encExits.end() ? ", encoder with code " + std::to_string(*failed) : std::string());
+		throw tool_error(decExit ? decExit : *failed, errText, codes + ":\n"
+			+ Sys::toUtf8(cmdLine + L" | " + Process::formatCmdLine(encoderCmds[failed != encExits.end() ? e : 0])));
+	}
+}
+
+void Convert::_executeInProcess(const wstring& src, const wstring& destPath, bool delSrc,
+	std::function<std::unique_ptr<Codec::encoder>(const wstring&, const Codec::format&)> openEncoder)
+{
+#if defined(_DEBUG) && defined(_WIN32)
+	OutputDebugStringW( (L"Transcode " + src + L" -> " + destPath + L"\n").c_str() );
+#endif
+
+	bool replacesSrc = Sys::isSamePath(src, destPath);
+	wstring outPath = replacesSrc ? destPath + L".tmp" : destPath;
+
+	try {
+		Telemetry::scope transcoding(Telemetry::stage::TRANSCODE);
+		std::unique_ptr<Codec::decoder> dec = Codec::openDecoder(src);
+		std::unique_ptr<Codec::encoder> enc = openEncoder(outPath, dec->fmt());
+		Codec::transcode(*dec, *enc);
+	} catch (...) { // decoder and encoder are gone, so the output file is already closed
+		if (Sys::exists(outPath)) Sys::removeFile(outPath);
+		throw;
+	}
+
+	_commitOutput(src, destPath, outPath, delSrc);
+}
+
+void Convert::_commitOutput(const wstring& src, const wstring& destPath,
+	const wstring& outPath, bool delSrc)
+{
+	if (outPath != destPath) { // output was written aside, because it replaces the source
+		if (Verify::isDeferred()) return; // left there until it's verified
+		Telemetry::scope replacing(Telemetry::stage::DELETE);
+		Sys::replaceFile(outPath, destPath);
+	} else if (delSrc) {
+		Telemetry::scope deleting(Telemetry::stage::DELETE);
+		Sys::removeFile(src); // delete source file
+	}
 }
\ No newline at end of file
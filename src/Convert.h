@@ -1,20 +1,77 @@
-
 #pragma once
-#include <winlamb/file_ini.h>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Codec.h"
+#include "Telemetry.h"
 
 struct Convert final {
 private:
 	Convert() = delete;
 
 public:
-	static void validatePaths(const wl::file_ini& ini);
-	static void toWav(const wl::file_ini& ini, std::wstring src, std::wstring dest, bool delSrc);
-	static void toFlac(const wl::file_ini& ini, std::wstring src, std::wstring dest,
-		bool delSrc, const std::wstring& quality);
-	static void toMp3(const wl::file_ini& ini, std::wstring src, std::wstring dest,
-		bool delSrc, const std::wstring& quality, bool isVbr);
+	struct options final {
+		std::wstring lame = L"lame", flac = L"flac"; // tools; bare names are searched in PATH
+		bool streaming = true;  // pipe decoder into encoder instead of an intermediary WAV on disk
+		bool inProcess = false; // use the linked codecs instead of spawning the tools
+		unsigned parallelFlacSecs = 900; // longer FLAC encodes are split across all cores; 0 disables
+		unsigned parallelFlacThreads = 0; // of each such encode; 0 is one per core, 1 disables too
+	};
+
+	// One of several outputs made from a single decoding of the source.
+	struct output final {
+		const wchar_t* ext = L".flac"; // L".flac", L".mp3" or L".wav"
+		std::wstring   quality;
+		bool           isVbr = true; // MP3 only
+		std::wstring   dest; // folder; empty is beside the source
+	};
+
+	// A tool which failed, with what it said about it.
+	class tool_error final : public std::runtime_error {
+	public:
+		int         exitCode;
+		std::string errText; // tail of its stderr
+
+		tool_error(int exitCode, const std::string& errText, const std::string& msg);
+	};
+
+	// Each conversion returns the bytes it didn't have to write thanks to a
+	// shortcut: the decoded audio, when the encoder reads the source format
+	// itself, or the whole file, when it's moved instead of copied.
+	static void     validateTools(const options& opts);
+	static uint64_t toWav(const options& opts,
+		std::wstring src, std::wstring dest, bool delSrc);
+	static uint64_t toFlac(const options& opts,
+		std::wstring src, std::wstring dest, bool delSrc, const std::wstring& quality);
+	static uint64_t toMp3(const options& opts,
+		std::wstring src, std::wstring dest, bool delSrc, const std::wstring& quality, bool isVbr);
+	static uint64_t toMany(const options& opts,
+		const std::wstring& src, const std::vector<output>& outs, bool delSrc);
+	static std::wstring destPath(const std::wstring& src, const std::wstring& dest, const wchar_t* ext);
+	static std::string  toolVersion(const std::wstring& tool);
 
 private:
-	static void _validateDestFolder(std::wstring& dest);
-	static void _execute(const std::wstring& cmdLine, const std::wstring& src, bool delSrc);
-};
\ No newline at end of file
+	static void         _validateDestFolder(std::wstring& dest);
+	static uint64_t     _durationSecs(const std::wstring& src);
+	static uint64_t     _pcmBytes(const std::wstring& src);
+	static uint64_t     _wavDataEnd(const std::wstring& src);
+	static std::vector<std::wstring> _decoderCmd(const options& opts, const std::wstring& src);
+	static std::vector<std::wstring> _encoderCmd(const options& opts, const output& out, const std::wstring& outPath);
+	static std::vector<std::wstring> _flacCmd(const options& opts, const std::wstring& quality);
+	static void _execute(const std::vector<std::wstring>& cmd, const std::wstring& src,
+		const std::wstring& outPath, bool delSrc, Telemetry::stage what);
+	static void _executeInProcess(const std::wstring& src, const std::wstring& destPath, bool delSrc,
+		std::function<std::unique_ptr<Codec::encoder>(const std::wstring&, const Codec::format&)> openEncoder);
+	static uint64_t _executeDirect(const std::vector<std::wstring>& cmd,
+		const std::wstring& src, const std::wstring& destPath, bool delSrc);
+	static uint64_t _copyWav(const std::wstring& src, const std::wstring& destPath, bool delSrc);
+	static void _executePiped(const std::vector<std::wstring>& decoderCmd,
+		const std::vector<std::wstring>& encoderCmd,
+		const std::wstring& src, const std::wstring& destPath, bool delSrc);
+	static void _executeFanOut(const std::vector<std::wstring>& decoderCmd, const std::wstring& src,
+		const std::vector<std::vector<std::wstring>>& encoderCmds, const std::vector<std::wstring>& outPaths);
+	static void _commitOutput(const std::wstring& src, const std::wstring& destPath,
+		const std::wstring& outPath, bool delSrc);
+};
@@ -0,0 +1,70 @@
+#include "Dedupe.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include "Cancel.h"
+#include "MappedFile.h"
+#include "Md5.h"
+#include "Verify.h"
+using std::array;
+using std::string;
+using std::wstring;
+
+static const size_t WINDOW_SZ = 4 * 1024 * 1024; // mapped at once, while hashing
+static const size_t APE_FOOTER_SZ = 32, ID3V1_SZ = 128;
+
+static uint32_t le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+
+string Dedupe::headerKey(const Probe::info& i)
+{
+	if (!i.problem.empty() || !i.sampleRate || i.durationSecs <= 0) return {};
+	string fmt = std::to_string(i.sampleRate) + " " + std::to_string(i.channels);
+	if (i.fmt == Probe::format::FLAC || i.fmt == Probe::format::WAV) { // exact, counted in samples
+		return "pcm " + fmt + " " + std::to_string(i.bitsPerSample)
+			+ " " + std::to_string(std::llround(i.durationSecs * i.sampleRate));
+	}
+	if (i.fmt == Probe::format::MP3) { // estimated, so coarse; a match may be missed, never made
+		return "mp3 " + fmt + " " + std::to_string(std::llround(i.durationSecs * 10));
+	}
+	return {};
+}
+
+string Dedupe::contentKey(const wstring& path)
+{
+	array<uint8_t, 16> md5{};
+	unsigned bitsPerSample = 0;
+	if (Verify::pcmMd5(path, md5, bitsPerSample)) return Md5::hex(md5);
+	if (Probe::read(path).fmt != Probe::format::MP3) return {};
+
+	// The frames alone, without the tags around them.
+	MappedFile file;
+	if (!file.open(path)) return {};
+	size_t len = 10;
+	const uint8_t* buf = file.view(0, len);
+	uint64_t beg = Probe::id3v2Size(buf, len), end = file.size();
+	if (end >= beg + ID3V1_SZ) {
+		len = 3;
+		buf = file.view(end - ID3V1_SZ, len);
+		if (len == 3 && !memcmp(buf, "TAG", 3)) end -= ID3V1_SZ;
+	}
+	if (end >= beg + APE_FOOTER_SZ) {
+		len = APE_FOOTER_SZ;
+		buf = file.view(end - APE_FOOTER_SZ, len);
+		if (len == APE_FOOTER_SZ && !memcmp(buf, "APETAGEX", 8)) {
+			uint64_t tagSz = le32(buf + 12) + ((le32(buf + 20) & 0x80000000) ? APE_FOOTER_SZ : 0); // footer, and header if any
+			end -= std::min(tagSz, end - beg);
+		}
+	}
+
+	Md5 hash;
+	for (uint64_t pos = beg; pos < end; ) {
+		Cancel::check();
+		len = static_cast<size_t>(std::min<uint64_t>(WINDOW_SZ, end - pos));
+		buf = file.view(pos, len);
+		if (!len) return {};
+		hash.update(buf, len);
+		pos += len;
+	}
+	return "mp3 " + Md5::hex(hash.finish());
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include "Probe.h"
+
+// Finds the files of a batch with the same audio: under other names, from
+// other archives, or both as FLAC and as WAV. What the headers tell narrows
+// the batch to the files which may be alike, and only those are hashed, over
+// their samples, so FLAC and WAV match each other, and FLAC costs nothing,
+// its signature being that hash already. MP3 files only match MP3 files, by
+// their frames, whatever their tags.
+struct Dedupe final {
+private:
+	Dedupe() = delete;
+
+public:
+	static std::string headerKey(const Probe::info& i); // equal for files which may be alike; empty if it can't match
+	static std::string contentKey(const std::wstring& path); // equal for the same audio; empty if it can't be hashed
+};
@@ -0,0 +1,98 @@
+#include "DeviceGate.h"
+#include <algorithm>
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+using std::wstring;
+
+uint64_t DeviceGate::deviceOf(const wstring& folder)
+{
+	{
+		lock_guard<mutex> lk(mMtx);
+		auto found = mFolders.find(folder);
+		if (found != mFolders.end()) return found->second;
+	}
+	Sys::device dev = Sys::deviceOf(folder); // outside the lock, it may touch the disk
+
+	lock_guard<mutex> lk(mMtx);
+	mFolders.emplace(folder, dev.id);
+	if (dev.id) {
+		auto ins = mDevices.emplace(dev.id, device_state());
+		if (ins.second) {
+			ins.first->second.seeks = dev.seeks;
+			ins.first->second.budget = mLimits.maxBytesPerSec; // one second of burst
+			ins.first->second.refilled = clock_type::now();
+		}
+	}
+	return dev.id;
+}
+
+DeviceGate::verdict DeviceGate::enter(size_t job, const vector<use>& uses,
+	clock_type::time_point& resumeAt)
+{
+	// All or nothing: a slot taken on one device while waiting for another
+	// would just sit there.
+	clock_type::time_point now = clock_type::now();
+	lock_guard<mutex> lk(mMtx);
+	for (const use& u : uses) {
+		auto found = mDevices.find(u.device);
+		if (found == mDevices.end()) continue;
+		device_state& dev = found->second;
+		unsigned maxJobs = _maxJobs(dev);
+		if (maxJobs && dev.running >= maxJobs) {
+			dev.parked.emplace_back(job); // a running job will leave, and bring it back
+			return verdict::PARKED;
+		}
+		if (mLimits.maxBytesPerSec > 0) {
+			_refill(dev, now);
+			if (dev.budget < 0) {
+				resumeAt = now + std::chrono::duration_cast<clock_type::duration>(
+					std::chrono::duration<double>(-dev.budget / mLimits.maxBytesPerSec));
+				return verdict::THROTTLED;
+			}
+		}
+	}
+	for (const use& u : uses) {
+		auto found = mDevices.find(u.device);
+		if (found == mDevices.end()) continue;
+		++found->second.running;
+		found->second.budget -= static_cast<double>(u.bytes); // may go into debt, the next ones pay for it
+	}
+	return verdict::ENTERED;
+}
+
+vector<size_t> DeviceGate::leave(const vector<use>& uses)
+{
+	vector<size_t> resumed;
+	lock_guard<mutex> lk(mMtx);
+	for (const use& u : uses) {
+		auto found = mDevices.find(u.device);
+		if (found == mDevices.end()) continue;
+		device_state& dev = found->second;
+		--dev.running;
+		if (!dev.parked.empty()) { // one slot freed, one job back
+			resumed.emplace_back(dev.parked.front());
+			dev.parked.pop_front();
+		}
+	}
+	return resumed;
+}
+
+size_t DeviceGate::numDevices()
+{
+	lock_guard<mutex> lk(mMtx);
+	return mDevices.size();
+}
+
+unsigned DeviceGate::_maxJobs(const device_state& dev) const
+{
+	if (mLimits.maxJobs) return mLimits.maxJobs;
+	return dev.seeks ? SEEK_DEVICE_JOBS : 0;
+}
+
+void DeviceGate::_refill(device_state& dev, clock_type::time_point now) const
+{
+	double secs = std::chrono::duration<double>(now - dev.refilled).count();
+	dev.budget = std::min(dev.budget + secs * mLimits.maxBytesPerSec, mLimits.maxBytesPerSec);
+	dev.refilled = now;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Sys.h"
+
+// Admission of jobs per disk. While it runs, a job holds a slot on each
+// device it reads or writes, and charges its bytes to them; a job which finds
+// a device full is parked there, and given back when a slot frees up, so the
+// worker moves on to a job on another disk instead of waiting.
+class DeviceGate final {
+public:
+	using clock_type = std::chrono::steady_clock;
+
+	static const unsigned SEEK_DEVICE_JOBS = 4; // spinning disks and network shares, when not told otherwise
+
+	struct limits final {
+		unsigned maxJobs = 0;        // per device; 0 is SEEK_DEVICE_JOBS on seeking ones, no limit on the others
+		double   maxBytesPerSec = 0; // per device, read plus written; 0 is no limit
+	};
+
+	struct use final {
+		uint64_t device = 0; // 0 is unknown, never held back
+		uint64_t bytes = 0;
+	};
+
+	enum class verdict { ENTERED, PARKED, THROTTLED };
+
+private:
+	struct device_state final {
+		bool     seeks = false;
+		unsigned running = 0;
+		double   budget = 0; // bytes which may still go this second; negative is debt
+		clock_type::time_point refilled;
+		std::deque<size_t> parked; // jobs, oldest first
+	};
+
+	limits     mLimits;
+	std::mutex mMtx;
+	std::unordered_map<uint64_t, device_state> mDevices;
+	std::unordered_map<std::wstring, uint64_t> mFolders; // a lookup each, not each file
+
+public:
+	explicit DeviceGate(const limits& lim) : mLimits(lim) { }
+
+	uint64_t deviceOf(const std::wstring& folder);
+	verdict  enter(size_t job, const std::vector<use>& uses, clock_type::time_point& resumeAt);
+	std::vector<size_t> leave(const std::vector<use>& uses); // parked jobs to try again
+	size_t   numDevices();
+
+private:
+	unsigned _maxJobs(const device_state& dev) const;
+	void     _refill(device_state& dev, clock_type::time_point now) const;
+};
@@ -0,0 +1,115 @@
+#include "DirScanner.h"
+#include <algorithm>
+#include "Sys.h"
+using std::vector;
+using std::wstring;
+using clock_type = std::chrono::steady_clock;
+
+static const size_t BATCH_SZ = 2048; // files handed over at once
+static const std::chrono::milliseconds BATCH_MAX_WAIT(200); // or sooner, so a slow share still shows progress
+static const size_t MIN_THREADS = 4, MAX_THREADS = 16; // listing waits on the disk, or on the network
+
+DirScanner::~DirScanner()
+{
+	cancel();
+	mScheduler.reset(); // join the workers before the callbacks go away
+}
+
+void DirScanner::start(const vector<wstring>& folders, batch_func onBatch, done_func onDone)
+{
+	mOnBatch = std::move(onBatch);
+	mOnDone = std::move(onDone);
+	mTime0 = mLastFlush = clock_type::now();
+	if (folders.empty()) {
+		mTime1 = mTime0;
+		mDone = true;
+		if (mOnDone) mOnDone();
+		return;
+	}
+
+	mScheduler = std::make_unique<Scheduler>(
+		std::min(std::max(Sys::numProcessors(), MIN_THREADS), MAX_THREADS));
+	mDirsLeft = folders.size();
+	for (const wstring& folder : folders) {
+		mScheduler->submit([this, folder](size_t) {
+			_scanDir(folder);
+		});
+	}
+	mScheduler->close(); // subfolders are submitted by the jobs themselves
+}
+
+void DirScanner::cancel()
+{
+	mCancelled = true;
+	if (mScheduler) mScheduler->cancel(); // folders being listed stop at the next entry
+}
+
+void DirScanner::wait()
+{
+	if (mScheduler) mScheduler->join();
+}
+
+double DirScanner::elapsedSecs() const
+{
+	return std::chrono::duration<double>((mDone ? mTime1 : clock_type::now()) - mTime0).count();
+}
+
+double DirScanner::filesPerSec() const
+{
+	double secs = elapsedSecs();
+	return secs > 0 ? mNumFiles / secs : 0;
+}
+
+void DirScanner::_scanDir(const wstring& dir)
+{
+	vector<wstring> found;
+	bool readable = Sys::listDir(dir, [&](const wstring& path, bool isDir) {
+		if (mCancelled) return false;
+		if (isDir) {
+			++mDirsLeft; // before this one is counted out, so the total never touches zero early
+			mScheduler->submit([this, path](size_t) {
+				_scanDir(path);
+			});
+		} else {
+			for (const wstring& ext : mExts) {
+				if (Sys::hasExtension(path, ext.c_str())) {
+					found.emplace_back(path);
+					break;
+				}
+			}
+		}
+		return true;
+	});
+
+	++mNumDirs;
+	if (!readable) ++mNumUnreadable;
+	mNumFiles += found.size();
+	_add(found, false);
+	if (--mDirsLeft == 0 && !mCancelled) { // all other folders already handed their files over
+		vector<wstring> none;
+		_add(none, true);
+		mTime1 = clock_type::now();
+		mDone = true;
+		if (mOnDone) mOnDone();
+	}
+}
+
+void DirScanner::_add(vector<wstring>& found, bool isLast)
+{
+	vector<wstring> batch;
+	{
+		std::lock_guard<std::mutex> lk(mBatchMtx);
+		if (mBatch.empty()) {
+			mBatch.swap(found);
+		} else {
+			mBatch.insert(mBatch.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+		}
+		clock_type::time_point now = clock_type::now();
+		if (mBatch.empty() || (mBatch.size() < BATCH_SZ && now - mLastFlush < BATCH_MAX_WAIT && !isLast)) {
+			return;
+		}
+		batch.swap(mBatch);
+		mLastFlush = now;
+	}
+	if (!mCancelled) mOnBatch(std::move(batch)); // outside the lock, the caller may be slow
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Scheduler.h"
+
+// Walks folder trees on several threads, each folder listed once and its
+// files filtered by extension on the way. Found files are handed over in
+// batches, so the caller can show them while big trees are still scanned.
+class DirScanner final {
+public:
+	using batch_func = std::function<void(std::vector<std::wstring>&& files)>; // called from the workers
+	using done_func = std::function<void()>; // from the last worker, not called if cancelled
+
+private:
+	std::vector<std::wstring>  mExts;
+	batch_func                 mOnBatch;
+	done_func                  mOnDone;
+	std::unique_ptr<Scheduler> mScheduler;
+	std::mutex                 mBatchMtx;
+	std::vector<std::wstring>  mBatch;
+	std::chrono::steady_clock::time_point mTime0, mLastFlush, mTime1;
+	std::atomic<size_t>        mDirsLeft{0}, mNumDirs{0}, mNumFiles{0}, mNumUnreadable{0};
+	std::atomic<bool>          mDone{false}, mCancelled{false};
+
+public:
+	explicit DirScanner(std::vector<std::wstring> exts) : mExts(std::move(exts)) { }
+	~DirScanner();
+
+	void   start(const std::vector<std::wstring>& folders, batch_func onBatch, done_func onDone = nullptr);
+	void   cancel();
+	void   wait();
+	bool   isDone() const        { return mDone; }
+	size_t numDirs() const       { return mNumDirs; }
+	size_t numFiles() const      { return mNumFiles; }
+	size_t numUnreadable() const { return mNumUnreadable; }
+	double elapsedSecs() const; // until done
+	double filesPerSec() const;
+
+private:
+	void _scanDir(const std::wstring& dir);
+	void _add(std::vector<std::wstring>& found, bool isLast);
+};
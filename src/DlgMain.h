@@ -1,5 +1,8 @@
 
 #pragma once
+#include <memory>
+#include <unordered_set>
+#include <vector>
 #include <winlamb/dialog_main.h>
 #include <winlamb/button.h>
 #include <winlamb/checkbox.h>
@@ -10,18 +13,31 @@
 #include <winlamb/resizer.h>
 #include <winlamb/progress_taskbar.h>
 #include <winlamb/textbox.h>
+#include "DirScanner.h"
+#include "FileCatalog.h"
+#include "Scheduler.h"
 
 class DlgMain final : public wl::dialog_main {
 private:
+	static const UINT WM_SCAN_BATCH = WM_APP + 1; // lParam is a heap vector of the files found
+	static const UINT WM_SCAN_DONE = WM_APP + 2;
+	static const UINT WM_PROBE_BATCH = WM_APP + 3; // lParam is a heap vector of files and their headers
+
 	wl::file_ini         mIniFile;
+	std::wstring         mIniPath;
 	wl::progress_taskbar mTaskbarProg;
 	wl::resizer          mLayoutResizer;
-	wl::listview         mLstFiles;
+	wl::listview         mLstFiles; // owner data, rows come from mFiles
+	FileCatalog          mFiles;
 	wl::textbox          mTxtDest;
 	wl::combobox         mCmbCbr, mCmbVbr, mCmbFlac, mCmbNumThreads;
 	wl::radio_group      mRadMp3FlacWav, mRadMp3Type;
 	wl::checkbox         mChkDelSrc;
 	wl::button           mBtnRun;
+	std::wstring         mTitle;
+	std::vector<std::unique_ptr<DirScanner>> mScanners; // one per dropped set of folders, until done
+	std::unique_ptr<Scheduler> mProber; // reads the headers of the files as they're added
+	bool                 mRunWhenProbed = false; // Run was pressed before all headers were read
 
 public:
 	DlgMain();
@@ -30,9 +46,15 @@ private:
 	void    messages();
 	void    validateIni();
 	void    validateDestFolder();
-	void    validateFilesExist(const std::vector<std::wstring>& files);
+	void    validateFilesExist(const std::vector<std::wstring>& files,
+		const std::unordered_set<std::wstring>& skipped);
+	bool    validateFilesProbed(const std::unordered_set<std::wstring>& skipped);
 	INT_PTR updateRunBtnCounter(size_t newCount);
-	void    putFileIntoList(const std::wstring& file);
-
-	static DWORD numProcessors();
+	void    putFilesIntoList(const std::vector<std::wstring>& files);
+	void    probeFiles(const std::vector<std::wstring>& files);
+	void    removeSelectedFiles();
+	void    readFileList(const std::wstring& listPath, std::vector<std::wstring>& files);
+	void    scanFolders(const std::vector<std::wstring>& folders);
+	void    updateScanStatus();
+	int     iniOption(const wchar_t* key, int defVal) const;
 };
\ No newline at end of file
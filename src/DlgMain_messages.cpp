@@ -1,8 +1,14 @@
 
 #include "DlgMain.h"
+#include <algorithm>
+#include <winlamb/path.h>
 #include <winlamb/sysdlg.h>
 #include <winlamb/version.h>
+#include "Codec.h"
 #include "DlgRunnin.h"
+#include "Farm.h"
+#include "Journal.h"
+#include "Sys.h"
 #include "../res/resource.h"
 using std::vector;
 using std::wstring;
@@ -15,18 +21,23 @@ void DlgMain::messages()
 		try {
 			validateIni();
 		} catch (const std::exception& e) {
-			sysdlg::msgbox(this, L"Fail", str::to_wstring(e.what()), MB_ICONERROR);
+			sysdlg::msgbox(this, L"Fail", Sys::fromUtf8(e.what()), MB_ICONERROR);
 			SendMessage(hwnd(), WM_CLOSE, 0, 0); // halt program
 			return TRUE;
 		}
 
 		mTaskbarProg.init(this);
+		wchar_t title[256]{};
+		GetWindowTextW(hwnd(), title, ARRAYSIZE(title));
+		mTitle = title; // shown back when no folders are being scanned
 		mTxtDest.assign(this, TXT_DEST);
 
 		// Main listview initialization.
 		mLstFiles.assign(this, LST_FILES)
 			.set_context_menu(MEN_MAIN)
 			.columns.add(L"File", 300)
+				.add(L"Format", 130)
+				.add(L"Length", 60)
 				.set_width_to_fill(0);
 		mLstFiles.imageList16.load_from_shell({L"mp3", L"flac", L"wav"}); // icons of the 3 filetypes we use
 
@@ -47,17 +58,8 @@ void DlgMain::messages()
 			.select(7);
 
 		mCmbNumThreads.assign(this, CMB_NUMTHREADS)
-			.add(L"1|2|4|6|8|12");
-
-		switch (numProcessors()) {
-			case 1:  mCmbNumThreads.select(0); break;
-			case 2:  mCmbNumThreads.select(1); break;
-			case 4:  mCmbNumThreads.select(2); break;
-			case 6:  mCmbNumThreads.select(3); break;
-			case 8:  mCmbNumThreads.select(4); break;
-			case 12: mCmbNumThreads.select(5); break;
-			default: mCmbNumThreads.select(0);
-		}
+			.add(L"Auto|1|2|4|6|8|12|16|24|32|48|64")
+			.select(0); // starts with one per core, then tunes itself while running
 
 		// Initializing radio buttons.
 		mRadMp3FlacWav.assign(this, {RAD_MP3, RAD_FLAC, RAD_WAV});
@@ -68,6 +70,7 @@ void DlgMain::messages()
 
 		mChkDelSrc.assign(this, CHK_DELSRC);
 		mBtnRun.assign(this, BTN_RUN);
+		mProber = std::make_unique<Scheduler>(std::min<size_t>(Sys::numProcessors(), 8)); // disk bound beyond that
 
 		// Layout control when resizing.
 		mLayoutResizer
@@ -90,25 +93,58 @@ void DlgMain::messages()
 
 	on_message(WM_DROPFILES, [&](wm::dropfiles p)
 	{
-		vector<wstring> files = p.files();
-
-		for (const wstring& drop : files) {
-			if (file::util::is_dir(drop)) { // if a directory, add all files inside of it
-				for (const wstring& f : file::util::list_dir(drop, L"*.mp3")) {
-					putFileIntoList(f);
-				}
-				for (const wstring& f : file::util::list_dir(drop, L"*.flac")) {
-					putFileIntoList(f);
-				}
-				for (const wstring& f : file::util::list_dir(drop, L"*.wav")) {
-					putFileIntoList(f);
-				}
+		vector<wstring> drops = p.files();
+		vector<wstring> files, folders;
+
+		for (const wstring& drop : drops) {
+			if (file::util::is_dir(drop)) { // if a directory, add all files inside of it, subfolders too
+				folders.emplace_back(drop);
+			} else if (path::has_extension(drop, L".m3u8") || path::has_extension(drop, L".m3u")) {
+				readFileList(drop, files); // like the list of failed files
 			} else {
-				putFileIntoList(drop); // add single file
+				files.emplace_back(drop); // add single file
 			}
 		}
+		putFilesIntoList(files);
+		if (!folders.empty()) {
+			scanFolders(folders); // in the background, the files come in batches
+		}
+		return TRUE;
+	});
+
+	on_message(WM_SCAN_BATCH, [&](params p)
+	{
+		std::unique_ptr<vector<wstring>> batch(reinterpret_cast<vector<wstring>*>(p.lParam));
+		putFilesIntoList(*batch);
+		updateScanStatus();
+		return TRUE;
+	});
+
+	on_message(WM_SCAN_DONE, [&](params)
+	{
+		mScanners.erase(std::remove_if(mScanners.begin(), mScanners.end(),
+			[](const std::unique_ptr<DirScanner>& s) { return s->isDone(); }), mScanners.end());
+		updateScanStatus();
+		return TRUE;
+	});
 
-		updateRunBtnCounter(mLstFiles.items.count());
+	on_message(WM_PROBE_BATCH, [&](params p)
+	{
+		using probed = vector<std::pair<wstring, Probe::info>>;
+		std::unique_ptr<probed> batch(reinterpret_cast<probed*>(p.lParam));
+		for (std::pair<wstring, Probe::info>& f : *batch) {
+			mFiles.setInfo(f.first, std::move(f.second));
+		}
+		InvalidateRect(mLstFiles.hwnd(), nullptr, FALSE); // visible rows are asked again
+
+		if (mRunWhenProbed && !mFiles.numUnprobed()) { // the last ones Run was waiting for
+			mRunWhenProbed = false;
+			mTaskbarProg.clear();
+			updateScanStatus();
+			PostMessageW(hwnd(), WM_COMMAND, MAKEWPARAM(BTN_RUN, BN_CLICKED), 0);
+		} else if (mRunWhenProbed) {
+			updateScanStatus();
+		}
 		return TRUE;
 	});
 
@@ -145,24 +181,27 @@ void DlgMain::messages()
 			L"WAV audio files (*.wav)|*.wav",
 			files))
 		{
-			for (const wstring& file : files) {
-				putFileIntoList(file);
-			}
-			updateRunBtnCounter(mLstFiles.items.count());
+			putFilesIntoList(files);
 		}
 		return TRUE;
 	});
 
 	on_command(MNU_REMSELECTED, [&](params)
 	{
-		mLstFiles.items.remove_selected();
-		updateRunBtnCounter(mLstFiles.items.count());
+		removeSelectedFiles();
 		return TRUE;
 	});
 
 	on_command(IDCANCEL, [&](params)
 	{
-		if (!mLstFiles.items.count() || mBtnRun.is_enabled()) {
+		if (!mScanners.empty()) { // ESC stops the folder scans first
+			mScanners.clear(); // files already found stay in the list
+			updateScanStatus();
+		} else if (mRunWhenProbed) { // then a Run waiting for the headers
+			mRunWhenProbed = false;
+			mTaskbarProg.clear();
+			updateScanStatus();
+		} else if (mFiles.empty() || mBtnRun.is_enabled()) {
 			SendMessage(hwnd(), WM_CLOSE, 0, 0); // close on ESC only if not processing
 		}
 		return TRUE;
@@ -203,24 +242,73 @@ void DlgMain::messages()
 
 	on_command(BTN_RUN, [&](params)
 	{
-		DlgRunnin dlgRun(mTaskbarProg, mIniFile);
+		if (!mScanners.empty()) {
+			sysdlg::msgbox(this, L"Scanning",
+				L"Folders are still being scanned. Wait for them, or press ESC to stop the scan.",
+				MB_ICONINFORMATION);
+			return TRUE;
+		}
+		if (mFiles.numUnprobed()) { // not on the UI thread: Run comes back once the prober is done
+			mRunWhenProbed = true;
+			updateScanStatus();
+			return TRUE;
+		}
+
+		DlgRunnin dlgRun(mTaskbarProg);
 		dlgRun.opts.destFolder = mTxtDest.get_text();
 
-		vector<wstring> files;
 		try {
 			validateDestFolder();
-			files = mLstFiles.items.get_texts(mLstFiles.items.get_all(), 0);
-			validateFilesExist(files);
 		} catch (const std::exception& e) {
-			sysdlg::msgbox(this, L"Fail", str::to_wstring(e.what()), MB_ICONERROR);
+			sysdlg::msgbox(this, L"Fail", Sys::fromUtf8(e.what()), MB_ICONERROR);
 			return TRUE;
 		}
-		dlgRun.opts.files = std::move(files);
+		dlgRun.opts.files = mFiles.files();
 
 		// Retrieve settings.
 		dlgRun.opts.delSrc = mChkDelSrc.is_checked();
 		dlgRun.opts.isVbr = mRadMp3Type.get_checked_id() == RAD_VBR;
-		dlgRun.opts.numThreads = std::stoul(mCmbNumThreads.get_selected_text());
+		wstring numThreads = mCmbNumThreads.get_selected_text();
+		dlgRun.opts.numThreads = (numThreads == L"Auto") ? 0 : std::stoul(numThreads);
+		dlgRun.opts.convOpts.lame = mIniFile[L"Tools"][L"lame"];
+		dlgRun.opts.convOpts.flac = mIniFile[L"Tools"][L"flac"];
+		dlgRun.opts.convOpts.streaming = iniOption(L"streaming", 1) != 0;
+		dlgRun.opts.convOpts.inProcess = iniOption(L"inprocess", 0) != 0;
+		dlgRun.opts.convOpts.parallelFlacSecs = iniOption(L"parallelflac", 900);
+		dlgRun.opts.useCache = iniOption(L"cache", 1) != 0;
+		dlgRun.opts.cacheHash = iniOption(L"cachehash", 0) != 0;
+		dlgRun.opts.retries = iniOption(L"retries", 0);
+		dlgRun.opts.diskJobs = iniOption(L"diskjobs", 0);
+		dlgRun.opts.diskMBps = iniOption(L"diskmbps", 0);
+		dlgRun.opts.policy.prio = static_cast<ProcessPolicy::priority>(
+			std::min(iniOption(L"priority", 0), static_cast<int>(ProcessPolicy::priority::IDLE)));
+		dlgRun.opts.policy.pinCores = iniOption(L"pincores", 0) != 0;
+		dlgRun.opts.policy.cpuPercent = iniOption(L"cpulimit", 0);
+		dlgRun.opts.replayGain = iniOption(L"replaygain", 0) != 0;
+		dlgRun.opts.verify = iniOption(L"verify", 1) != 0;
+		dlgRun.opts.dedupe = iniOption(L"dedupe", 0) != 0;
+		dlgRun.opts.remote.shared = iniOption(L"remoteshared", 0) != 0;
+		try {
+			dlgRun.opts.remote.nodes = Farm::parseNodes(Sys::toUtf8(mIniFile[L"Options"][L"remote"]));
+		} catch (const std::exception& e) {
+			sysdlg::msgbox(this, L"Fail", Sys::fromUtf8(e.what()), MB_ICONERROR);
+			return TRUE;
+		}
+		dlgRun.continueOnError = iniOption(L"continueonerror", 0) != 0;
+		dlgRun.reportPath = Sys::joinPath(Sys::folderFrom(mIniPath), L"flac-lame-failures.txt");
+		dlgRun.failedListPath = Sys::joinPath(Sys::folderFrom(mIniPath), L"flac-lame-failed.m3u8");
+		if (iniOption(L"telemetry", 0)) { // written next to the INI file
+			wstring folder = Sys::folderFrom(mIniPath);
+			dlgRun.opts.telemetryCsv = Sys::joinPath(folder, L"flac-lame-telemetry.csv");
+			dlgRun.opts.telemetryJson = Sys::joinPath(folder, L"flac-lame-telemetry.json");
+			dlgRun.opts.telemetryTrace = Sys::joinPath(folder, L"flac-lame-trace.json");
+		}
+		if (dlgRun.opts.convOpts.inProcess && !Codec::available()) {
+			sysdlg::msgbox(this, L"Fail",
+				L"In-process conversion was asked in the INI file, but this build has no codec libraries.",
+				MB_ICONERROR);
+			return TRUE;
+		}
 
 		int mfw = mRadMp3FlacWav.get_checked_id();
 		wstring quality;
@@ -235,29 +323,79 @@ void DlgMain::messages()
 
 		// Which format are we converting to?
 		switch (mfw) {
-		case RAD_MP3:  dlgRun.opts.targetType = DlgRunnin::target::MP3; break;
-		case RAD_FLAC: dlgRun.opts.targetType = DlgRunnin::target::FLAC; break;
-		case RAD_WAV:  dlgRun.opts.targetType = DlgRunnin::target::WAV;
+		case RAD_MP3:  dlgRun.opts.targetType = Runner::target::MP3; break;
+		case RAD_FLAC: dlgRun.opts.targetType = Runner::target::FLAC; break;
+		case RAD_WAV:  dlgRun.opts.targetType = Runner::target::WAV;
 		}
 
+		// A batch cancelled or crashed halfway left its journal; the same
+		// files with the same settings may resume it.
+		Journal::contents resumed;
+		if (iniOption(L"journal", 1)) {
+			dlgRun.opts.journalPath = Sys::joinPath(Sys::folderFrom(mIniPath), L"flac-lame-journal.txt");
+			resumed = Journal::read(dlgRun.opts.journalPath, Runner::batchKey(dlgRun.opts));
+			size_t numFinished = std::count_if(dlgRun.opts.files.begin(), dlgRun.opts.files.end(),
+				[&](const wstring& f) { return resumed.finished.count(f) != 0; });
+			if (numFinished) {
+				int answer = sysdlg::msgbox(this, L"Resume",
+					str::format(L"%u of these %u files were already converted by a batch which didn't finish.\n\n"
+						L"Resume it, skipping them? Choose No to convert them all again.",
+						numFinished, dlgRun.opts.files.size()),
+					MB_ICONQUESTION | MB_YESNOCANCEL);
+				if (answer == IDCANCEL) return TRUE;
+				if (answer == IDNO) {
+					Sys::removeFile(dlgRun.opts.journalPath);
+					resumed = Journal::contents{};
+				}
+			}
+		}
+
+		try { // sources of finished files may be deleted by now
+			validateFilesExist(dlgRun.opts.files, resumed.finished);
+		} catch (const std::exception& e) {
+			sysdlg::msgbox(this, L"Fail", Sys::fromUtf8(e.what()), MB_ICONERROR);
+			return TRUE;
+		}
+		if (!validateFilesProbed(resumed.finished)) return TRUE;
+
 		// Finally invoke dialog.
 		dlgRun.show(this);
 		return TRUE;
 	});
 
-	on_notify(LST_FILES, LVN_INSERTITEM, [&](params)
-	{
-		return updateRunBtnCounter(mLstFiles.items.count()); // new item inserted
-	});
-
-	on_notify(LST_FILES, LVN_DELETEITEM, [&](params)
-	{
-		return updateRunBtnCounter(mLstFiles.items.count() - 1); // item about to be deleted
-	});
-
-	on_notify(LST_FILES, LVN_DELETEALLITEMS, [&](params)
+	on_notify(LST_FILES, LVN_GETDISPINFO, [&](params p)
 	{
-		return updateRunBtnCounter(0); // all items about to be deleted
+		// Owner data: the list view asks only for the rows it's painting.
+		LVITEMW& item = reinterpret_cast<NMLVDISPINFOW*>(p.lParam)->item;
+		if (item.iItem < 0 || static_cast<size_t>(item.iItem) >= mFiles.size()) return 0;
+		const wstring& file = mFiles[item.iItem];
+
+		if ((item.mask & LVIF_TEXT) && item.iSubItem == 0) {
+			lstrcpynW(item.pszText, file.c_str(), item.cchTextMax);
+		} else if (item.mask & LVIF_TEXT) {
+			const Probe::info* info = mFiles.info(item.iItem); // blank until probed
+			wstring text;
+			if (info && item.iSubItem == 1) {
+				if (!info->problem.empty()) {
+					text = Sys::fromUtf8(info->problem);
+				} else if (info->fmt == Probe::format::UNKNOWN) {
+					text = L"Unknown";
+				} else {
+					text = str::format(L"%s, %.1f kHz", Probe::formatName(info->fmt), info->sampleRate / 1000.0);
+					if (info->bitsPerSample) text.append(str::format(L", %u bit", info->bitsPerSample));
+				}
+			} else if (info && item.iSubItem == 2 && info->durationSecs > 0) {
+				unsigned secs = static_cast<unsigned>(info->durationSecs + 0.5);
+				text = secs >= 3600 ? str::format(L"%u:%02u:%02u", secs / 3600, secs / 60 % 60, secs % 60)
+					: str::format(L"%u:%02u", secs / 60, secs % 60);
+			}
+			lstrcpynW(item.pszText, text.c_str(), item.cchTextMax);
+		}
+		if ((item.mask & LVIF_IMAGE) && item.iSubItem == 0) {
+			item.iImage = path::has_extension(file, L".mp3") ? 0
+				: path::has_extension(file, L".flac") ? 1 : 2; // icons loaded in this order
+		}
+		return 0;
 	});
 
 	on_notify(LST_FILES, LVN_KEYDOWN, [&](wmn::lvn::keydown p)
@@ -1,9 +1,11 @@
 
 #include "DlgMain.h"
+#include <algorithm>
 #include <winlamb/executable.h>
 #include <winlamb/path.h>
 #include <winlamb/sysdlg.h>
 #include "Convert.h"
+#include "Sys.h"
 #include "../res/resource.h"
 using std::vector;
 using std::wstring;
@@ -23,14 +25,21 @@ DlgMain::DlgMain()
 void DlgMain::validateIni()
 {
 	// Validate and load INI file.
-	wstring iniPath = executable::get_own_path().append(L"\\flac-lame-frontend.ini");
-	if (!file::util::exists(iniPath)) {
+	mIniPath = executable::get_own_path().append(L"\\flac-lame-frontend.ini");
+	if (!file::util::exists(mIniPath)) {
 		throw std::runtime_error(str::to_ascii(
-			str::format(L"File not found:\n%s", iniPath) ));
+			str::format(L"File not found:\n%s", mIniPath) ));
 	}
 
-	mIniFile.load_from_file(iniPath);
-	Convert::validatePaths(mIniFile); // validate tools
+	mIniFile.load_from_file(mIniPath);
+	if (!mIniFile.structure_is(L"[Tools]lame,flac")) {
+		throw std::runtime_error("INI file doesn't have the right entries.");
+	}
+
+	Convert::options tools; // validate tools
+	tools.lame = mIniFile[L"Tools"][L"lame"];
+	tools.flac = mIniFile[L"Tools"][L"flac"];
+	Convert::validateTools(tools);
 }
 
 void DlgMain::validateDestFolder()
@@ -61,16 +70,41 @@ void DlgMain::validateDestFolder()
 	}
 }
 
-void DlgMain::validateFilesExist(const vector<wstring>& files)
+void DlgMain::validateFilesExist(const vector<wstring>& files, const std::unordered_set<wstring>& skipped)
 {
 	for (const wstring& f : files) { // each filepath
-		if (!file::util::exists(f)) {
+		if (!skipped.count(f) && !file::util::exists(f)) {
 			throw std::runtime_error(str::to_ascii(
 				str::format(L"Process aborted, file does not exist:\n%s", f) ));
 		}
 	}
 }
 
+bool DlgMain::validateFilesProbed(const std::unordered_set<wstring>& skipped)
+{
+	// Run waits for the prober, so all headers are read by now; the runner
+	// probes again anyway, and fails what it finds broken.
+	vector<wstring> broken;
+	for (size_t i = 0; i < mFiles.size(); ++i) {
+		if (skipped.count(mFiles[i])) continue;
+		const Probe::info* info = mFiles.info(i);
+		if (info && !info->problem.empty()) {
+			broken.emplace_back(str::format(L"%s\n%s", mFiles[i], Sys::fromUtf8(info->problem)));
+		}
+	}
+	if (broken.empty()) return true;
+
+	const size_t MAX_SHOWN = 8;
+	wstring msg = str::format(L"%u file(s) can't be converted, and will be reported as failed:\n\n",
+		broken.size());
+	for (size_t i = 0; i < broken.size() && i < MAX_SHOWN; ++i) {
+		msg.append(broken[i]).append(L"\n\n");
+	}
+	if (broken.size() > MAX_SHOWN) msg.append(str::format(L"...and %u more.\n\n", broken.size() - MAX_SHOWN));
+	msg.append(L"Run anyway?");
+	return sysdlg::msgbox(this, L"Broken files", msg, MB_ICONWARNING | MB_YESNO) == IDYES;
+}
+
 INT_PTR DlgMain::updateRunBtnCounter(size_t newCount)
 {
 	wstring caption = newCount ?
@@ -80,24 +114,127 @@ INT_PTR DlgMain::updateRunBtnCounter(size_t newCount)
 	return 0;
 };
 
-void DlgMain::putFileIntoList(const wstring& file)
+void DlgMain::putFilesIntoList(const vector<wstring>& files)
+{
+	vector<wstring> accepted;
+	accepted.reserve(files.size());
+	for (const wstring& f : files) {
+		if (path::has_extension(f, L".mp3") || path::has_extension(f, L".flac")
+			|| path::has_extension(f, L".wav")) // bypass file if unaccepted format
+		{
+			accepted.emplace_back(f);
+		}
+	}
+
+	vector<wstring> added;
+	if (mFiles.add(accepted, &added)) { // add only if not present yet
+		ListView_SetItemCountEx(mLstFiles.hwnd(), mFiles.size(), LVSICF_NOSCROLL); // rows are asked back on painting
+		updateRunBtnCounter(mFiles.size());
+		probeFiles(added);
+	}
+}
+
+void DlgMain::probeFiles(const vector<wstring>& files)
+{
+	// Headers are mapped, not read, so a chunk takes a few milliseconds; the
+	// results are posted back like the scan batches.
+	const size_t PROBE_CHUNK = 256;
+	HWND hDlg = hwnd();
+	for (size_t c = 0; c < files.size(); c += PROBE_CHUNK) {
+		vector<wstring> chunk(files.begin() + c, files.begin() + std::min(c + PROBE_CHUNK, files.size()));
+		mProber->submit([hDlg, chunk = std::move(chunk)](size_t) {
+			auto* probed = new vector<std::pair<wstring, Probe::info>>();
+			probed->reserve(chunk.size());
+			for (const wstring& f : chunk) {
+				probed->emplace_back(f, Probe::read(f));
+			}
+			if (!PostMessageW(hDlg, WM_PROBE_BATCH, 0, reinterpret_cast<LPARAM>(probed))) {
+				delete probed; // window is gone
+			}
+		});
+	}
+}
+
+void DlgMain::removeSelectedFiles()
 {
-	int iType = -1;
-	if (path::has_extension(file, L".mp3"))       iType = 0;
-	else if (path::has_extension(file, L".flac")) iType = 1;
-	else if (path::has_extension(file, L".wav"))  iType = 2; // what type of audio file is this?
+	vector<size_t> selected;
+	for (int i = -1; (i = ListView_GetNextItem(mLstFiles.hwnd(), i, LVNI_SELECTED)) != -1; ) {
+		selected.emplace_back(i);
+	}
+	if (selected.empty()) return;
+
+	mFiles.remove(selected);
+	ListView_SetItemState(mLstFiles.hwnd(), -1, 0, LVIS_SELECTED | LVIS_FOCUSED); // indexes moved
+	ListView_SetItemCountEx(mLstFiles.hwnd(), mFiles.size(), LVSICF_NOSCROLL);
+	updateRunBtnCounter(mFiles.size());
+}
 
-	if (iType == -1) {
-		return; // bypass file if unaccepted format
+void DlgMain::readFileList(const wstring& listPath, vector<wstring>& files)
+{
+	// One path per line, UTF-8, comments start with '#'.
+	FILE* fp = Sys::openFile(listPath, "rb");
+	if (!fp) return;
+	std::string text;
+	char buf[4096];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0; ) {
+		text.append(buf, n);
 	}
-	if (!mLstFiles.items.exists(file)) {
-		mLstFiles.items.add_with_icon(file, iType); // add only if not present yet
+	fclose(fp);
+
+	size_t pos = (text.compare(0, 3, "\xef\xbb\xbf") == 0) ? 3 : 0; // UTF-8 BOM
+	while (pos < text.size()) {
+		size_t eol = text.find_first_of("\r\n", pos);
+		if (eol == std::string::npos) eol = text.size();
+		std::string line = text.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (!line.empty() && line[0] != '#') files.emplace_back(Sys::fromUtf8(line));
 	}
 }
 
-DWORD DlgMain::numProcessors()
+void DlgMain::scanFolders(const vector<wstring>& folders)
 {
-	SYSTEM_INFO si{};
-	GetSystemInfo(&si);
-	return si.dwNumberOfProcessors;
-}
\ No newline at end of file
+	// Results are posted, never sent: the workers must not wait on the UI
+	// thread, which may be destroying their scanner at that very moment.
+	HWND hDlg = hwnd();
+	mScanners.emplace_back(std::make_unique<DirScanner>(vector<wstring>{L".mp3", L".flac", L".wav"}));
+	mScanners.back()->start(folders,
+		[hDlg](vector<wstring>&& batch) {
+			vector<wstring>* files = new vector<wstring>(std::move(batch));
+			if (!PostMessageW(hDlg, WM_SCAN_BATCH, 0, reinterpret_cast<LPARAM>(files))) {
+				delete files; // window is gone
+			}
+		},
+		[hDlg]() {
+			PostMessageW(hDlg, WM_SCAN_DONE, 0, 0);
+		});
+	updateScanStatus();
+}
+
+void DlgMain::updateScanStatus()
+{
+	if (mScanners.empty() && mRunWhenProbed) {
+		size_t numLeft = mFiles.numUnprobed();
+		SetWindowTextW(hwnd(), str::format(L"%s - reading headers, %u of %u files left (ESC to stop)",
+			mTitle, numLeft, mFiles.size()).c_str());
+		mTaskbarProg.set_pos(mFiles.size() - numLeft, mFiles.size());
+		return;
+	}
+	if (mScanners.empty()) {
+		SetWindowTextW(hwnd(), mTitle.c_str());
+		return;
+	}
+	size_t numFiles = 0;
+	double filesPerSec = 0;
+	for (const std::unique_ptr<DirScanner>& s : mScanners) {
+		numFiles += s->numFiles();
+		filesPerSec += s->filesPerSec();
+	}
+	SetWindowTextW(hwnd(), str::format(L"%s - scanning, %u files found, %.0f files/s (ESC to stop)",
+		mTitle, numFiles, filesPerSec).c_str());
+}
+
+int DlgMain::iniOption(const wchar_t* key, int defVal) const
+{
+	// Optional tweaks under [Options], absent from the INI file unless the user wants them.
+	return static_cast<int>(GetPrivateProfileIntW(L"Options", key, defVal, mIniPath.c_str()));
+}
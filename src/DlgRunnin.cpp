@@ -1,71 +1,96 @@
-
 #include "DlgRunnin.h"
+#include <algorithm>
+#include <numeric>
 #include <winlamb/str.h>
 #include <winlamb/sysdlg.h>
-#include "Convert.h"
+#include "Sys.h"
 #include "../res/resource.h"
+using std::vector;
 using std::wstring;
 using namespace wl;
 
-DlgRunnin::DlgRunnin(progress_taskbar& taskbarProgr, const file_ini& iniFile)
-	: mTaskbarProgr(taskbarProgr), mIniFile(iniFile)
+static const UINT_PTR TIMER_PROGRESS = 1;
+static const UINT PROGRESS_MS = 250; // the UI costs the same, whatever the files per second
+
+DlgRunnin::DlgRunnin(progress_taskbar& taskbarProgr)
+	: mTaskbarProgr(taskbarProgr)
 {
 	setup.dialogId = DLG_RUNNIN;
 
 	on_message(WM_INITDIALOG, [&](params)
 	{
 		mLbl.assign(this, LBL_STATUS);
+		mLblRate.assign(this, LBL_RATE);
 		mProg.assign(this, PRO_STATUS);
+		mLstWorkers = GetDlgItem(hwnd(), LST_WORKERS);
 
 		mProg.set_range(0, opts.files.size());
 		mTaskbarProgr.set_pos(0);
 		mLbl.set_text( str::format(L"0 of %u files finished...", opts.files.size()) ); // initial text
-		mTime0.set_now(); // start timer
 
 		// Proceed to the file conversion straight away.
-		size_t batchSz = (opts.numThreads < opts.files.size()) ?
-			opts.numThreads : opts.files.size(); // limit parallel processing
-
-		for (size_t i = 0; i < batchSz; ++i) {
-			run_thread_detached([&]() {
-				processNextFile();
+		mRunner = std::make_unique<Runner>(opts);
+		try {
+			mRunner->start([this](const Runner::file_result& res) {
+				fileDone(res);
 			});
+		} catch (const std::exception& e) { // the journal couldn't be opened, or no node answered
+			mRunner.reset();
+			sysdlg::msgbox(this, L"Conversion failed", Sys::fromUtf8(e.what()), MB_ICONERROR);
+			EndDialog(hwnd(), IDCANCEL);
+			return TRUE;
 		}
+		SetTimer(hwnd(), TIMER_PROGRESS, PROGRESS_MS, nullptr);
 
 		center_on_parent();
 		return TRUE;
 	});
 
-	on_message(WM_CLOSE, [](params)
+	on_message(WM_TIMER, [&](params p)
 	{
-		return TRUE; // don't close the dialog, EndDialog() not called
+		if (p.wParam != TIMER_PROGRESS) return TRUE;
+		if (mCancelling) {
+			if (mRunner->finished()) cancelled();
+		} else if (!mStopped) {
+			updateProgress();
+		}
+		return TRUE;
+	});
+
+	on_command(IDCANCEL, [&](params)
+	{
+		cancelBatch();
+		return TRUE;
+	});
+
+	on_message(WM_CLOSE, [&](params)
+	{
+		cancelBatch(); // closing is cancelling, the tools aren't left running
+		return TRUE;
 	});
 }
 
-void DlgRunnin::processNextFile()
+DlgRunnin::~DlgRunnin()
 {
-	size_t curIndex = mCurFile++;
-	if (curIndex >= opts.files.size()) return;
-
-	const wstring& file = opts.files[curIndex];
+	if (mRunner) {
+		mRunner->wait();
+		try {
+			mRunner->exportTelemetry(); // of failed batches too, they're the interesting ones
+		} catch (const std::exception&) { } // only a diagnostic, the batch itself is done
+	}
+	mRunner.reset(); // join the workers before opts goes away
+}
 
-	try {
-		switch (opts.targetType) {
-		case target::MP3:
-			Convert::toMp3(mIniFile, file, opts.destFolder, opts.delSrc, opts.quality, opts.isVbr);
-			break;
-		case target::FLAC:
-			Convert::toFlac(mIniFile, file, opts.destFolder, opts.delSrc, opts.quality);
-			break;
-		case target::WAV:
-			Convert::toWav(mIniFile, file, opts.destFolder, opts.delSrc);
-		}
-	} catch (const std::exception& e) {
-		mCurFile = opts.files.size(); // error, so avoid further processing
+void DlgRunnin::fileDone(const Runner::file_result& res)
+{
+	if (!res.error.empty() && !continueOnError) {
+		if (mStopped.exchange(true)) return; // another file already failed and reported, or cancelled
+		mRunner->cancel(); // error, so avoid further processing
 		run_thread_ui([&]() {
+			KillTimer(hwnd(), TIMER_PROGRESS);
 			sysdlg::msgbox(this, L"Conversion failed",
 				str::format(L"File #%u:\n%s\n%s",
-					curIndex, file, str::to_wstring(e.what())),
+					res.index, opts.files[res.index], Sys::fromUtf8(res.error)),
 				MB_ICONERROR);
 			mTaskbarProgr.clear();
 			EndDialog(hwnd(), IDCANCEL);
@@ -73,26 +98,165 @@ void DlgRunnin::processNextFile()
 		return;
 	}
 
-	++mFilesDone;
-	run_thread_ui([&]() {
-		mProg.set_pos(mFilesDone);
-		mTaskbarProgr.set_pos(mFilesDone, opts.files.size());
-		mLbl.set_text( str::format(L"%u of %u files finished...",
-			mFilesDone, opts.files.size()) );
-	});
+	if (res.numFinished != opts.files.size()) return; // progress is shown by the timer, only the end is handled here
+	if (mStopped.exchange(true)) return; // cancelled just as the last file finished
 
-	if (mFilesDone < opts.files.size()) { // more files to come
-		processNextFile();
+	if (mRunner->numFailed()) { // finished, failures kept for the end
+		run_thread_ui([&]() {
+			KillTimer(hwnd(), TIMER_PROGRESS);
+			updateProgress();
+			sysdlg::msgbox(this, L"Conversion finished with failures", writeFailureReport(), MB_ICONWARNING);
+			mTaskbarProgr.clear();
+			EndDialog(hwnd(), IDOK);
+		});
 	} else { // finished all processing
 		run_thread_ui([&]() {
-			datetime fin;
-			sysdlg::msgbox(this, L"Conversion finished",
-				str::format(L"%u files processed in %.2f seconds.",
-					opts.files.size(),
-					static_cast<double>(fin.ms_diff_from(mTime0)) / 1000),
-				MB_ICONINFORMATION);
+			KillTimer(hwnd(), TIMER_PROGRESS);
+			updateProgress();
+			wstring msg = str::format(L"%u files processed in %.2f seconds, with %u workers%s.\n"
+				L"%u converted (%u changed since last time), %u skipped as up to date.",
+				opts.files.size(), mRunner->elapsedSecs(),
+				mRunner->numWorkersChosen(), opts.numThreads || mRunner->farm() ? L"" : L" (auto)",
+				mRunner->numConverted(), mRunner->numInvalidated(), mRunner->numSkipped());
+			if (mRunner->bytesSaved()) {
+				msg.append(str::format(L"\n%.1f MB not written, thanks to direct conversions.",
+					mRunner->bytesSaved() / (1024.0 * 1024)));
+			}
+			if (mRunner->numAlbumsTagged()) {
+				msg.append(str::format(L"\n%u albums tagged with their ReplayGain.", mRunner->numAlbumsTagged()));
+			}
+			if (mRunner->numDuplicates()) {
+				msg.append(str::format(L"\n%u duplicates given the outputs of the same audio, saving %.1f seconds of converting.",
+					mRunner->numDuplicates(), mRunner->duplicateSecsSaved()));
+			}
+			if (mRunner->farm()) {
+				for (const Farm::node_stats& n : mRunner->farm()->stats()) {
+					msg.append(n.problem.empty()
+						? str::format(L"\nNode %s: %u files converted on %u slots.",
+							Sys::fromUtf8(n.name), n.numFiles, n.numSlots)
+						: str::format(L"\nNode %s left out: %s", Sys::fromUtf8(n.name), Sys::fromUtf8(n.problem)));
+				}
+				if (mRunner->numReassigned()) {
+					msg.append(str::format(L"\n%u files taken back from nodes lost, and converted elsewhere.",
+						mRunner->numReassigned()));
+				}
+			}
+			vector<double> cpu = mRunner->workerCpuSecs();
+			double cpuTotal = std::accumulate(cpu.begin(), cpu.end(), 0.0);
+			if (cpuTotal > 0) {
+				msg.append(str::format(L"\n%.1f seconds of CPU time, %.1f per worker on average.",
+					cpuTotal, cpuTotal / mRunner->numWorkersChosen()));
+			}
+			sysdlg::msgbox(this, L"Conversion finished", msg, MB_ICONINFORMATION);
 			mTaskbarProgr.clear();
 			EndDialog(hwnd(), IDOK); // finally close dialog
 		});
 	}
-}
\ No newline at end of file
+}
+
+void DlgRunnin::cancelBatch()
+{
+	if (!mRunner || mStopped.exchange(true)) return; // already ending
+	mRunner->cancel(); // kills the running tools, which remove what they were writing
+
+	// Workers may take a moment to come back from a tool, or from a node far
+	// away; the window keeps responding meanwhile, and the timer ends it.
+	mCancelling = true;
+	EnableWindow(GetDlgItem(hwnd(), IDCANCEL), FALSE);
+	mLbl.set_text(L"Cancelling...");
+}
+
+void DlgRunnin::cancelled()
+{
+	KillTimer(hwnd(), TIMER_PROGRESS);
+	mCancelling = false;
+	mRunner->wait(); // the workers are out already
+	updateProgress();
+
+	wstring msg = str::format(L"%u of %u files finished before cancelling.",
+		mRunner->numDone(), opts.files.size());
+	if (!opts.journalPath.empty()) {
+		msg.append(L"\nRun the same files again, with the same settings, to resume where it stopped.");
+	}
+	sysdlg::msgbox(this, L"Conversion cancelled", msg, MB_ICONINFORMATION);
+	mTaskbarProgr.clear();
+	EndDialog(hwnd(), IDCANCEL);
+}
+
+void DlgRunnin::updateProgress()
+{
+	Runner::progress p = mRunner->snapshot();
+
+	mProg.set_pos(p.numDone);
+	mTaskbarProgr.set_pos(p.numDone, opts.files.size());
+	mLbl.set_text( str::format(L"%u of %u files finished%s...", p.numDone, opts.files.size(),
+		p.numFailed ? str::format(L", %u failed", p.numFailed) : L"") );
+
+	// Time left goes by the audio still to convert, at the pace so far.
+	double secs = std::max(p.elapsedSecs, 0.001);
+	wstring rate = str::format(L"%.1f files/s, %.1f MB/s", p.numDone / secs, p.bytesIn / secs / (1024 * 1024));
+	if (p.audioTotal > 0 && p.audioDone > 0) {
+		unsigned left = static_cast<unsigned>((p.audioTotal - p.audioDone) / (p.audioDone / secs));
+		rate.append(str::format(L", %u:%02u:%02u left", left / 3600, left / 60 % 60, left % 60));
+	}
+	mLblRate.set_text(rate);
+
+	if (mWorkerLines.size() != p.current.size()) {
+		SendMessageW(mLstWorkers, LB_RESETCONTENT, 0, 0);
+		mWorkerLines.assign(p.current.size(), L"");
+		for (size_t w = 0; w < p.current.size(); ++w) {
+			SendMessageW(mLstWorkers, LB_ADDSTRING, 0, reinterpret_cast<LPARAM>(L""));
+		}
+	}
+	for (size_t w = 0; w < p.current.size(); ++w) {
+		wstring line = str::format(L"Worker %u: %s", w + 1,
+			p.current[w] == Runner::NO_FILE ? L"idle" : Sys::fileFrom(opts.files[p.current[w]]));
+		if (line != mWorkerLines[w]) {
+			SendMessageW(mLstWorkers, LB_DELETESTRING, w, 0);
+			SendMessageW(mLstWorkers, LB_INSERTSTRING, w, reinterpret_cast<LPARAM>(line.c_str()));
+			mWorkerLines[w] = std::move(line);
+		}
+	}
+}
+
+wstring DlgRunnin::writeFailureReport()
+{
+	// Every failure goes to the report file, the first ones to the message
+	// too; the list holds just the paths, to be dropped back for a re-run.
+	const size_t NUM_SHOWN = 5;
+	vector<Runner::file_result> failures = mRunner->failures();
+
+	std::string report, list = "#EXTM3U\n";
+	for (const Runner::file_result& f : failures) {
+		std::string file = Sys::toUtf8(opts.files[f.index]);
+		list.append(file).append("\n");
+		report.append(file).append("\r\n  ").append(f.error);
+		if (f.exitCode) report.append("\r\n  exit code ").append(std::to_string(f.exitCode));
+		if (f.attempts > 1) report.append(", after ").append(std::to_string(f.attempts)).append(" attempts");
+		if (!f.errText.empty()) report.append("\r\n  ").append(f.errText);
+		report.append("\r\n\r\n");
+	}
+
+	wstring msg = str::format(L"%u of %u files failed, in %.2f seconds; %u converted, %u skipped as up to date.\n",
+		failures.size(), opts.files.size(), mRunner->elapsedSecs(),
+		mRunner->numConverted(), mRunner->numSkipped());
+	for (size_t i = 0; i < failures.size() && i < NUM_SHOWN; ++i) {
+		const Runner::file_result& f = failures[i];
+		msg.append(str::format(L"\n%s\n%s\n", opts.files[f.index],
+			Sys::fromUtf8(f.errText.empty() ? f.error : f.errText.substr(0, 300))));
+	}
+	if (failures.size() > NUM_SHOWN) {
+		msg.append(str::format(L"\n...and %u more.\n", failures.size() - NUM_SHOWN));
+	}
+
+	try {
+		if (!reportPath.empty()) Sys::writeFile(reportPath, report);
+		if (!failedListPath.empty()) Sys::writeFile(failedListPath, list);
+		msg.append(str::format(L"\nAll the failures are described in:\n%s\n"
+			L"Drop this list onto the window to try them again:\n%s",
+			reportPath, failedListPath));
+	} catch (const std::exception& e) {
+		msg.append(L"\n").append(Sys::fromUtf8(e.what()));
+	}
+	return msg;
+}
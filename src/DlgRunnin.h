@@ -1,37 +1,36 @@
-
 #pragma once
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 #include <winlamb/dialog_modal.h>
-#include <winlamb/file_ini.h>
 #include <winlamb/label.h>
 #include <winlamb/progressbar.h>
 #include <winlamb/progress_taskbar.h>
+#include "Runner.h"
 
 class DlgRunnin final : public wl::dialog_modal {
-public:
-	enum class target { NONE = 0, MP3, FLAC, WAV };
-
-	struct runnin_options final {
-		std::vector<std::wstring> files;
-		size_t                    numThreads = 2;
-		target                    targetType = target::NONE;
-		bool                      delSrc = false;
-		bool                      isVbr = false;
-		std::wstring              quality;
-		std::wstring              destFolder;
-	};
-
 private:
-	wl::progress_taskbar& mTaskbarProgr;
-	const wl::file_ini&   mIniFile;
-	wl::label             mLbl;
-	wl::progressbar       mProg;
-	size_t                mCurFile = 0, mFilesDone = 0;
-	wl::datetime          mTime0;
+	wl::progress_taskbar&   mTaskbarProgr;
+	wl::label               mLbl, mLblRate;
+	HWND                    mLstWorkers = nullptr;
+	std::vector<std::wstring> mWorkerLines; // as shown, only changed ones are replaced
+	wl::progressbar         mProg;
+	std::atomic<bool>       mStopped{false}; // failed, cancelled or finished, whichever came first
+	bool                    mCancelling = false; // asked, the timer ends the dialog once the workers are out
+	std::unique_ptr<Runner> mRunner;
 
 public:
-	runnin_options opts;
-	DlgRunnin(wl::progress_taskbar& taskbarProgr, const wl::file_ini& iniFile);
+	Runner::runnin_options opts;
+	bool         continueOnError = false; // else the first failure stops the batch
+	std::wstring reportPath, failedListPath; // written at the end, if any file failed
+	explicit DlgRunnin(wl::progress_taskbar& taskbarProgr);
+	~DlgRunnin();
 
 private:
-	void processNextFile();
-};
\ No newline at end of file
+	void fileDone(const Runner::file_result& res);
+	void cancelBatch();
+	void cancelled();
+	void updateProgress();
+	std::wstring writeFailureReport();
+};
@@ -0,0 +1,300 @@
+#include "Farm.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "Cancel.h"
+#include "Md5.h"
+#include "Node.h"
+#include "Sys.h"
+#include "Telemetry.h"
+#include "Verify.h"
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using std::wstring;
+using clock_type = std::chrono::steady_clock;
+using file_ptr = unique_ptr<FILE, int(*)(FILE*)>;
+
+static const unsigned CONNECT_MS = 3000; // and as long for the node to answer
+static const unsigned POLL_MS = 250; // between looks at the clock and the cancel, while a node converts
+static const unsigned LOST_MS = 10 * Node::BEAT_MS; // silence for that long, and the node is lost
+static const unsigned MAX_LOSSES = 3; // of each slot; after that many, its node has proved unreliable
+
+static uint8_t _code(Node::msg m) { return static_cast<uint8_t>(m); }
+
+Farm::Farm(const options& opts)
+	: mOpts(opts)
+{
+	for (const string& name : mOpts.nodes) { // as parseNodes() has them
+		auto n = std::make_unique<node>();
+		size_t colon = name.rfind(':');
+		n->name = name;
+		n->host = name.substr(0, colon);
+		n->port = name.substr(colon + 1);
+		if (n->host.size() > 2 && n->host.front() == '[' && n->host.back() == ']') { // IPv6
+			n->host = n->host.substr(1, n->host.size() - 2);
+		}
+		mNodes.emplace_back(std::move(n));
+	}
+
+	// All at once, so the nodes which don't answer cost their timeout once;
+	// a node offers its slots on the first connection, the others follow.
+	vector<vector<unique_ptr<Socket>>> socks(mNodes.size());
+	vector<std::thread> thrs;
+	for (size_t i = 0; i < mNodes.size(); ++i) {
+		thrs.emplace_back([this, i, &socks]() {
+			node& n = *mNodes[i];
+			try {
+				size_t numOffered = 0;
+				socks[i].emplace_back(_connect(n, &numOffered));
+				while (socks[i].size() < numOffered) socks[i].emplace_back(_connect(n, nullptr));
+			} catch (const std::exception& e) {
+				if (socks[i].empty()) n.problem = e.what(); // else just fewer slots
+			}
+			n.numSlots = socks[i].size();
+		});
+	}
+	for (std::thread& thr : thrs) thr.join();
+
+	for (size_t i = 0; i < mNodes.size(); ++i) {
+		for (unique_ptr<Socket>& sock : socks[i]) {
+			slot s;
+			s.owner = mNodes[i].get();
+			s.sock = std::move(sock);
+			mSlots.emplace_back(std::move(s));
+		}
+	}
+}
+
+vector<Farm::node_stats> Farm::stats() const
+{
+	vector<node_stats> all;
+	for (const unique_ptr<node>& n : mNodes) {
+		node_stats st;
+		st.name = n->name;
+		st.numSlots = n->numSlots;
+		st.numFiles = n->numFiles;
+		st.numLost = n->numLost;
+		st.cpuSecs = n->cpuMs / 1000.0;
+		st.problem = n->problem;
+		all.emplace_back(std::move(st));
+	}
+	return all;
+}
+
+Farm::result Farm::convert(size_t slotIdx, const wstring& src, const vector<Convert::output>& outs, bool delSrc)
+{
+	slot& s = mSlots[slotIdx];
+	node& n = *s.owner;
+	if (!s.sock && !reconnect(slotIdx)) throw lost_error("Node " + n.name + " is gone.");
+
+	// Our paths go along only for the messages, the node has its own.
+	bool deferred = Verify::isDeferred();
+	Node::fields job = {{"name", Sys::toUtf8(Sys::fileFrom(src))}, {"origin", Sys::toUtf8(src)},
+		{"outputs", std::to_string(outs.size())}, {"verify", deferred ? "1" : "0"},
+		{"gain", Loudness::capture::isActive() ? "1" : "0"}};
+	if (mOpts.shared) job["path"] = Sys::toUtf8(Sys::absolutePath(src));
+	vector<wstring> destPaths, partPaths;
+	for (size_t o = 0; o < outs.size(); ++o) {
+		string k = std::to_string(o);
+		destPaths.emplace_back(Convert::destPath(src, outs[o].dest, outs[o].ext));
+		partPaths.emplace_back(destPaths.back() + L".tmp"); // where Convert writes aside too
+		job["ext" + k] = Sys::toUtf8(outs[o].ext);
+		job["quality" + k] = Sys::toUtf8(outs[o].quality);
+		job["vbr" + k] = outs[o].isVbr ? "1" : "0";
+		job["dest" + k] = Sys::toUtf8(destPaths.back());
+	}
+
+	result r;
+	vector<bool> received(outs.size(), false);
+	bool inSync = false; // the node told the file failed, and waits for the next job
+	auto removeParts = [&partPaths, &received]() {
+		for (size_t o = 0; o < partPaths.size(); ++o) {
+			try {
+				if (received[o] || Sys::exists(partPaths[o])) Sys::removeFile(partPaths[o]);
+			} catch (const std::exception&) { } // best effort, a rerun writes over it anyway
+		}
+	};
+	try {
+		Telemetry::scope sending(Telemetry::stage::TRANSFER);
+		s.sock->send(_code(Node::msg::JOB), Node::encode(job));
+		if (!mOpts.shared) _sendSource(*s.sock, src);
+		sending.end();
+
+		std::optional<Telemetry::scope> converting;
+		converting.emplace(Telemetry::stage::REMOTE);
+		clock_type::time_point heard = clock_type::now();
+		for (;;) {
+			uint8_t type = 0;
+			string payload;
+			if (!s.sock->receive(type, payload, POLL_MS)) {
+				if (Cancel::isRequested()) {
+					s.sock.reset(); // the node sees it gone, and kills its tools
+					Cancel::check();
+				}
+				if (clock_type::now() - heard > std::chrono::milliseconds(LOST_MS)) {
+					throw Socket::error("Node " + n.name + " silent for " + std::to_string(LOST_MS / 1000) + " seconds.");
+				}
+				continue;
+			}
+			heard = clock_type::now();
+			if (type == _code(Node::msg::BEAT)) continue;
+
+			Node::fields f = Node::decode(payload);
+			if (type == _code(Node::msg::OUTPUT)) {
+				converting.reset();
+				size_t o = static_cast<size_t>(std::strtoull(f["index"].c_str(), nullptr, 10));
+				if (o >= outs.size() || received[o]) throw Socket::error("Node " + n.name + " sent a wrong output.");
+				received[o] = true; // removed on failure from now on
+				Telemetry::scope receiving(Telemetry::stage::TRANSFER);
+				_receiveOutput(*s.sock, partPaths[o], std::strtoull(f["size"].c_str(), nullptr, 10));
+			} else if (type == _code(Node::msg::DONE)) {
+				r.bytesSaved = std::strtoull(f["bytes_saved"].c_str(), nullptr, 10);
+				r.secs = std::atof(f["secs"].c_str());
+				r.cpuSecs = std::atof(f["cpu"].c_str());
+				r.verified = f["verified"] == "1";
+				if (!f["track_gain"].empty()) {
+					r.gain.emplace();
+					r.gain->trackGain = std::atof(f["track_gain"].c_str());
+					r.gain->trackPeak = std::atof(f["true_peak"].c_str());
+					r.blocks.emplace();
+					if (!r.blocks->fromText(f["blocks"])) throw Socket::error("Node " + n.name + " sent a wrong loudness.");
+				}
+				break;
+			} else if (type == _code(Node::msg::FAIL)) { // the file failed, the connection goes on
+				inSync = true;
+				int exitCode = std::atoi(f["exit_code"].c_str());
+				if (exitCode) throw Convert::tool_error(exitCode, f["stderr"], f["error"]);
+				throw std::runtime_error(f["error"]);
+			} else {
+				throw Socket::error("Node " + n.name + " sent an unexpected message.");
+			}
+		}
+		for (size_t o = 0; o < outs.size(); ++o) {
+			if (!received[o]) throw Socket::error("Node " + n.name + " left out an output.");
+		}
+	} catch (const Socket::error& e) {
+		removeParts();
+		s.sock.reset();
+		++s.numLost;
+		++n.numLost;
+		throw lost_error(e.what());
+	} catch (...) {
+		// Failed here halfway, writing an output, reading the source or on
+		// cancel: the node may still be sending, or waiting for the rest.
+		removeParts();
+		if (!inSync) s.sock.reset(); // the next job connects anew
+		throw;
+	}
+
+	// Final as Convert leaves them: an output replacing its source stays
+	// aside if it's to be verified, and the source goes last.
+	bool replacesSrc = false;
+	for (size_t o = 0; o < outs.size(); ++o) {
+		wstring finalPath = deferred ? Verify::pendingPath(src, destPaths[o]) : destPaths[o];
+		if (finalPath != partPaths[o]) Sys::replaceFile(partPaths[o], finalPath);
+		replacesSrc = replacesSrc || Sys::isSamePath(destPaths[o], src);
+	}
+	if (delSrc && !replacesSrc) {
+		Telemetry::scope deleting(Telemetry::stage::DELETE);
+		Sys::removeFile(src);
+	}
+	++n.numFiles;
+	n.cpuMs += static_cast<uint64_t>(r.cpuSecs * 1000);
+	return r;
+}
+
+bool Farm::reconnect(size_t slotIdx)
+{
+	slot& s = mSlots[slotIdx];
+	if (s.owner->down || s.numLost >= MAX_LOSSES) return false;
+	try {
+		s.sock = _connect(*s.owner, nullptr);
+		return true;
+	} catch (const std::exception&) {
+		s.owner->down = true; // its other slots don't try either
+		return false;
+	}
+}
+
+vector<string> Farm::parseNodes(const string& list)
+{
+	vector<string> nodes;
+	for (size_t pos = 0; pos < list.size(); ) {
+		size_t comma = std::min(list.find(',', pos), list.size());
+		size_t beg = list.find_first_not_of(" \t", pos), end = list.find_last_not_of(" \t", comma - 1);
+		pos = comma + 1;
+		if (beg >= comma || end == string::npos || end < beg) continue;
+		string spec = list.substr(beg, end - beg + 1);
+
+		size_t colon = spec.rfind(':');
+		bool hasPort = colon != string::npos && spec.find(']', colon) == string::npos
+			&& (spec.front() == '[' || spec.find(':') == colon); // a bare IPv6 address has colons too
+		string host = hasPort ? spec.substr(0, colon) : spec;
+		string port = hasPort ? spec.substr(colon + 1) : string(Node::DEFAULT_PORT);
+		if (host.empty() || port.empty() || port.find_first_not_of("0123456789") != string::npos) {
+			throw std::invalid_argument("Not a node: \"" + spec + "\", expected HOST:PORT.");
+		}
+		if (host.find(':') != string::npos && host.front() != '[') host = "[" + host + "]";
+		nodes.emplace_back(host + ":" + port);
+	}
+	return nodes;
+}
+
+unique_ptr<Socket> Farm::_connect(node& n, size_t* numOffered) const
+{
+	unique_ptr<Socket> sock = Socket::connect(n.host, n.port, CONNECT_MS);
+	sock->send(_code(Node::msg::HELLO), Node::encode({{"protocol", Node::PROTOCOL},
+		{"shared", mOpts.shared ? "1" : "0"}}));
+	uint8_t type = 0;
+	string payload;
+	if (!sock->receive(type, payload, CONNECT_MS)) throw Socket::error("Node " + n.name + " did not answer.");
+	Node::fields f = Node::decode(payload);
+	if (type == _code(Node::msg::FAIL)) throw Socket::error("Node " + n.name + " refused: " + f["error"]);
+	if (type != _code(Node::msg::HELLO) || f["protocol"] != Node::PROTOCOL) {
+		throw Socket::error("No node of ours at " + n.name + ".");
+	}
+	if (numOffered) *numOffered = static_cast<size_t>(std::strtoull(f["slots"].c_str(), nullptr, 10));
+	return sock;
+}
+
+void Farm::_sendSource(Socket& sock, const wstring& src) const
+{
+	file_ptr fp(Sys::openFile(src, "rb"), fclose);
+	if (!fp) throw std::runtime_error("Failed to read:\n" + Sys::toUtf8(src));
+	string buf(Node::DATA_SZ, '\0');
+	for (size_t n; (n = fread(&buf[0], 1, buf.size(), fp.get())) > 0; ) {
+		Cancel::check();
+		sock.send(_code(Node::msg::DATA), buf.data(), n);
+	}
+	if (ferror(fp.get())) throw std::runtime_error("Failed to read:\n" + Sys::toUtf8(src));
+	sock.send(_code(Node::msg::END), string());
+}
+
+void Farm::_receiveOutput(Socket& sock, const wstring& path, uint64_t size) const
+{
+	file_ptr fp(Sys::openFile(path, "wb"), fclose);
+	if (!fp) throw std::runtime_error("Failed to write:\n" + Sys::toUtf8(path));
+	Md5 md5;
+	uint64_t got = 0;
+	for (;;) {
+		uint8_t type = 0;
+		string data;
+		if (!sock.receive(type, data, LOST_MS)) throw Socket::error("Connection to " + sock.peer() + " stalled.");
+		if (type == _code(Node::msg::END)) {
+			if (fclose(fp.release()) != 0) throw std::runtime_error("Failed to write:\n" + Sys::toUtf8(path));
+			if (got != size || Md5::hex(md5.finish()) != Node::decode(data)["md5"]) {
+				throw Socket::error("Output damaged on its way from " + sock.peer() + ":\n" + Sys::toUtf8(path));
+			}
+			return;
+		}
+		if (type != _code(Node::msg::DATA)) throw Socket::error("Unexpected message from " + sock.peer() + ".");
+		md5.update(data.data(), data.size());
+		got += data.size();
+		if (fwrite(data.data(), 1, data.size(), fp.get()) != data.size()) {
+			throw std::runtime_error("Failed to write:\n" + Sys::toUtf8(path));
+		}
+	}
+}
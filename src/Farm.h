@@ -0,0 +1,89 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Convert.h"
+#include "Loudness.h"
+#include "Socket.h"
+#include "Tags.h"
+
+// Other machines a batch converts on, each one running a Node. Every slot a
+// node offers is a connection, and the Runner gives it a worker of its own,
+// which sends a file there and waits for the outputs while the other workers
+// go on; so a batch runs on as many cores as all the machines have. A node
+// silent for a few beats is taken as lost, and its file goes to another.
+class Farm final {
+public:
+	struct options final {
+		std::vector<std::string> nodes; // host:port
+		bool shared = false; // nodes read the sources by path, from storage they share with this machine
+	};
+
+	// The node went away, before the job or during it; the file isn't to blame.
+	class lost_error final : public std::runtime_error {
+	public:
+		explicit lost_error(const std::string& msg) : std::runtime_error(msg) { }
+	};
+
+	// What a node did with a file, besides its outputs.
+	struct result final {
+		uint64_t bytesSaved = 0; // as Convert counts them
+		double   secs = 0, cpuSecs = 0; // there, its tools included
+		bool     verified = false; // the outputs were checked there, as Verify would here
+		std::optional<Tags::replay_gain> gain; // track only, if measured
+		std::optional<Loudness::histogram> blocks;
+	};
+
+	struct node_stats final {
+		std::string name; // host:port
+		size_t      numSlots = 0, numFiles = 0, numLost = 0;
+		double      cpuSecs = 0;
+		std::string problem; // why it was left out, if it was
+	};
+
+private:
+	struct node final {
+		std::string name, host, port;
+		size_t      numSlots = 0;
+		std::string problem;
+		std::atomic<bool>     down{false}; // refused to come back after a loss
+		std::atomic<size_t>   numFiles{0}, numLost{0};
+		std::atomic<uint64_t> cpuMs{0};
+	};
+
+	struct slot final {
+		node*    owner = nullptr;
+		std::unique_ptr<Socket> sock; // null once lost, until reconnected
+		unsigned numLost = 0;
+	};
+
+	options mOpts;
+	std::vector<std::unique_ptr<node>> mNodes;
+	std::vector<slot> mSlots; // each one used by a single worker
+
+public:
+	explicit Farm(const options& opts); // connects to all the nodes at once; those not reached are left out
+	Farm(const Farm&) = delete;
+	Farm& operator=(const Farm&) = delete;
+
+	size_t numSlots() const { return mSlots.size(); }
+	const std::string& nodeName(size_t slotIdx) const { return mSlots[slotIdx].owner->name; }
+	std::vector<node_stats> stats() const;
+
+	// As Convert::toMany, on the node of the slot; verified there if the
+	// calling thread defers, and measured if it captures loudness. Throws
+	// lost_error, and the outputs are gone.
+	result convert(size_t slotIdx, const std::wstring& src, const std::vector<Convert::output>& outs, bool delSrc);
+	bool   reconnect(size_t slotIdx); // after a loss; false if its node won't come back
+
+	static std::vector<std::string> parseNodes(const std::string& list); // comma-separated; throws invalid_argument
+
+private:
+	std::unique_ptr<Socket> _connect(node& n, size_t* numSlots) const; // throws Socket::error
+	void _sendSource(Socket& sock, const std::wstring& src) const;
+	void _receiveOutput(Socket& sock, const std::wstring& path, uint64_t size) const; // checked against its hash
+};
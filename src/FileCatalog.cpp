@@ -0,0 +1,93 @@
+#include "FileCatalog.h"
+#include <algorithm>
+#include <cwctype>
+using std::vector;
+using std::wstring;
+
+static wint_t _lower(wchar_t ch)
+{
+	if (ch < 0x80) return (ch >= L'A' && ch <= L'Z') ? ch + (L'a' - L'A') : ch; // most paths, without the locale
+	return towlower(ch);
+}
+
+size_t FileCatalog::add(const vector<wstring>& files, vector<wstring>* added)
+{
+	// New ones are sorted among themselves, then merged, so a big batch
+	// costs a sort and a single pass instead of one shift per file.
+	size_t numOld = mFiles.size();
+	for (const wstring& f : files) {
+		if (mKeys.emplace(_key(f), std::nullopt).second) mFiles.emplace_back(f);
+	}
+	if (mFiles.size() == numOld) return 0;
+	if (added) added->assign(mFiles.begin() + numOld, mFiles.end());
+
+	std::sort(mFiles.begin() + numOld, mFiles.end(), _isBefore);
+	std::inplace_merge(mFiles.begin(), mFiles.begin() + numOld, mFiles.end(), _isBefore);
+	return mFiles.size() - numOld;
+}
+
+void FileCatalog::remove(vector<size_t> indexes)
+{
+	std::sort(indexes.begin(), indexes.end());
+	indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+
+	size_t out = 0, next = 0;
+	for (size_t i = 0; i < mFiles.size(); ++i) {
+		if (next < indexes.size() && indexes[next] == i) { // compacted in one pass
+			mKeys.erase(_key(mFiles[i]));
+			++next;
+		} else {
+			if (out != i) mFiles[out] = std::move(mFiles[i]);
+			++out;
+		}
+	}
+	mFiles.resize(out);
+}
+
+void FileCatalog::setInfo(const wstring& file, Probe::info info)
+{
+	auto it = mKeys.find(_key(file));
+	if (it != mKeys.end()) it->second = std::move(info);
+}
+
+const Probe::info* FileCatalog::info(size_t index) const
+{
+	auto it = mKeys.find(_key(mFiles[index]));
+	return (it != mKeys.end() && it->second) ? &*it->second : nullptr;
+}
+
+size_t FileCatalog::numUnprobed() const
+{
+	return std::count_if(mKeys.begin(), mKeys.end(),
+		[](const auto& k) { return !k.second; });
+}
+
+void FileCatalog::clear()
+{
+	mFiles.clear();
+	mKeys.clear();
+}
+
+wstring FileCatalog::_key(const wstring& file)
+{
+#ifdef _WIN32
+	wstring key = file; // case-insensitive file system
+	std::transform(key.begin(), key.end(), key.begin(), [](wchar_t ch) { return static_cast<wchar_t>(_lower(ch)); });
+	return key;
+#else
+	return file;
+#endif
+}
+
+bool FileCatalog::_isBefore(const wstring& a, const wstring& b)
+{
+	// Same order the sorted list view had: case-insensitive.
+	size_t len = std::min(a.size(), b.size());
+	for (size_t i = 0; i < len; ++i) {
+		if (a[i] == b[i]) continue;
+		wint_t ca = _lower(a[i]), cb = _lower(b[i]);
+		if (ca != cb) return ca < cb;
+	}
+	if (a.size() != b.size()) return a.size() < b.size();
+	return a < b;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Probe.h"
+
+// The files to convert, sorted as shown, with a hash set of their paths so
+// each new file is checked for a duplicate in constant time. The list view
+// only displays the rows it asks for, straight from here, along with what
+// the probe found in each file's headers.
+class FileCatalog final {
+private:
+	std::vector<std::wstring> mFiles;
+	std::unordered_map<std::wstring, std::optional<Probe::info>> mKeys; // paths compared like the file system does
+
+public:
+	size_t add(const std::vector<std::wstring>& files, std::vector<std::wstring>* added = nullptr); // returns how many were new
+	void   remove(std::vector<size_t> indexes);
+	void   setInfo(const std::wstring& file, Probe::info info); // ignored if the file was removed meanwhile
+	const Probe::info* info(size_t index) const; // null until probed
+	size_t numUnprobed() const;
+	void   clear();
+	size_t size() const { return mFiles.size(); }
+	bool   empty() const { return mFiles.empty(); }
+	const std::wstring& operator[](size_t index) const { return mFiles[index]; }
+	const std::vector<std::wstring>& files() const { return mFiles; }
+
+private:
+	static std::wstring _key(const std::wstring& file);
+	static bool _isBefore(const std::wstring& a, const std::wstring& b);
+};
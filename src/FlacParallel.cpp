@@ -0,0 +1,308 @@
+
+#include "FlacParallel.h"
+#include <cerrno>
+#include <cstring>
+#include "Sys.h"
+#ifdef FLE_INPROC_CODECS
+#include <FLAC/stream_encoder.h>
+#endif
+using std::array;
+using std::vector;
+using std::wstring;
+using stage = Codec::error::stage;
+
+static const size_t SEGMENT_BLOCKS = 64; // about 6 seconds of 44.1 kHz audio per segment
+static const uint32_t PADDING_SZ = 8192; // same room for tags the flac tool leaves
+
+namespace {
+
+#ifdef FLE_INPROC_CODECS // used only by the segment encoders
+
+uint8_t crc8(const uint8_t* data, size_t len)
+{
+	uint8_t crc = 0;
+	for (size_t i = 0; i < len; ++i) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; ++b) {
+			crc = (crc & 0x80) ? static_cast<uint8_t>((crc << 1) ^ 0x07) : static_cast<uint8_t>(crc << 1);
+		}
+	}
+	return crc;
+}
+
+uint16_t crc16(const uint8_t* data, size_t len)
+{
+	static uint16_t table[256];
+	static bool tableReady = [] {
+		for (unsigned i = 0; i < 256; ++i) {
+			uint16_t crc = static_cast<uint16_t>(i << 8);
+			for (int b = 0; b < 8; ++b) {
+				crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x8005) : static_cast<uint16_t>(crc << 1);
+			}
+			table[i] = crc;
+		}
+		return true;
+	}();
+	(void)tableReady;
+
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; ++i) {
+		crc = static_cast<uint16_t>((crc << 8) ^ table[(crc >> 8) ^ data[i]]);
+	}
+	return crc;
+}
+
+void putUtf8Number(vector<uint8_t>& out, uint64_t v)
+{
+	// FLAC's extended UTF-8 coding of frame numbers, up to 36 bits.
+	if (v < 0x80) {
+		out.emplace_back(static_cast<uint8_t>(v));
+		return;
+	}
+	static const uint8_t PREFIX[] = {0, 0, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe};
+	unsigned numBytes = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4
+		: v < 0x4000000 ? 5 : v < 0x80000000 ? 6 : 7;
+
+	out.emplace_back(static_cast<uint8_t>(PREFIX[numBytes] | (v >> (6 * (numBytes - 1)))));
+	for (unsigned i = numBytes - 1; i-- > 0; ) {
+		out.emplace_back(static_cast<uint8_t>(0x80 | ((v >> (6 * i)) & 0x3f)));
+	}
+}
+
+// Copies a frame of a segment, replacing its number (which restarts at zero
+// on every segment encoder) with its number in the whole stream.
+void appendRenumbered(vector<uint8_t>& out, const uint8_t* frame, size_t len, uint64_t frameNum)
+{
+	if (len < 8 || frame[0] != 0xff || frame[1] != 0xf8) {
+		throw std::runtime_error("Unexpected FLAC frame from segment encoder.");
+	}
+
+	uint8_t first = frame[4];
+	size_t numLen = first < 0x80 ? 1 : first < 0xe0 ? 2 : first < 0xf0 ? 3
+		: first < 0xf8 ? 4 : first < 0xfc ? 5 : first < 0xfe ? 6 : 7;
+	size_t extrasBeg = 4 + numLen, extrasEnd = extrasBeg; // explicit block size and sample rate
+	unsigned bsCode = frame[2] >> 4, srCode = frame[2] & 0x0f;
+	if (bsCode == 6) extrasEnd += 1; else if (bsCode == 7) extrasEnd += 2;
+	if (srCode == 12) extrasEnd += 1; else if (srCode == 13 || srCode == 14) extrasEnd += 2;
+
+	size_t hdrBeg = out.size();
+	out.insert(out.end(), frame, frame + 4);
+	putUtf8Number(out, frameNum);
+	out.insert(out.end(), frame + extrasBeg, frame + extrasEnd);
+	out.emplace_back(crc8(&out[hdrBeg], out.size() - hdrBeg));
+
+	out.insert(out.end(), frame + extrasEnd + 1, frame + len - 2); // subframes, old CRC-16 left out
+	uint16_t crc = crc16(&out[hdrBeg], out.size() - hdrBeg);
+	out.emplace_back(static_cast<uint8_t>(crc >> 8));
+	out.emplace_back(static_cast<uint8_t>(crc & 0xff));
+}
+#endif
+
+void putBe(uint8_t* p, uint64_t v, unsigned numBytes)
+{
+	for (unsigned i = 0; i < numBytes; ++i) {
+		p[i] = static_cast<uint8_t>(v >> (8 * (numBytes - 1 - i)));
+	}
+}
+
+}//namespace
+
+FlacParallel::FlacParallel(const wstring& dest, const Codec::format& fmt,
+	unsigned level, bool verify, size_t numThreads)
+	: mPath(dest), mFmt(fmt), mLevel(level), mBlockSize(level <= 2 ? 1152 : 4096), // libFLAC's own choice per level
+		mVerify(verify), mSegFrames(mBlockSize * SEGMENT_BLOCKS), mMaxInFlight(numThreads * 2),
+		mPolicy(ProcessPolicy::current(mWorker)), mPool(numThreads)
+{
+#ifndef FLE_INPROC_CODECS
+	throw Codec::error(stage::OPEN, dest, 0,
+		"This build has no in-process codecs, it was compiled without FLE_INPROC_CODECS.");
+#endif
+	if (fmt.bitsPerSample > 24 || fmt.channels > 8) {
+		throw Codec::error(stage::ENCODE, dest, 0,
+			"FLAC supports up to 8 channels and 24 bits per sample.");
+	}
+
+	mFp = Sys::openFile(dest, "wb");
+	if (!mFp) {
+		throw Codec::error(stage::OPEN, dest, errno, "Failed to open file.");
+	}
+	_writeHeader({}); // final STREAMINFO is only known at the end
+}
+
+FlacParallel::~FlacParallel()
+{
+	mPool.cancel(); // unfinished encode, segments still queued are pointless
+	mPool.join();
+	if (mFp) fclose(mFp);
+}
+
+void FlacParallel::write(const int32_t* buf, size_t numFrames)
+{
+	unsigned bytesPerSample = (mFmt.bitsPerSample + 7) / 8;
+	size_t numSamples = numFrames * mFmt.channels;
+	mMd5Buf.resize(numSamples * bytesPerSample);
+	uint8_t* p = mMd5Buf.empty() ? nullptr : &mMd5Buf[0];
+	for (size_t i = 0; i < numSamples; ++i) { // signature is over little-endian signed samples
+		for (unsigned b = 0; b < bytesPerSample; ++b) {
+			*p++ = static_cast<uint8_t>(static_cast<uint32_t>(buf[i]) >> (8 * b));
+		}
+	}
+	mMd5.update(mMd5Buf.data(), mMd5Buf.size());
+	mTotalFrames += numFrames;
+
+	while (numFrames) {
+		if (!mCur) {
+			mCur = std::make_shared<segment>();
+			mCur->pcm.reserve(mSegFrames * mFmt.channels);
+		}
+		size_t room = mSegFrames - mCur->pcm.size() / mFmt.channels;
+		size_t take = (numFrames < room) ? numFrames : room;
+		mCur->pcm.insert(mCur->pcm.end(), buf, buf + take * mFmt.channels);
+		buf += take * mFmt.channels;
+		numFrames -= take;
+
+		if (take == room) _dispatch();
+	}
+}
+
+void FlacParallel::finish()
+{
+	if (mCur && !mCur->pcm.empty()) _dispatch(); // last segment, possibly short
+	while (!mInFlight.empty()) _writeOldest();
+	mPool.close();
+
+	if (fseek(mFp, 0, SEEK_SET)) {
+		throw Codec::error(stage::WRITE, mPath, errno, "Failed to rewind FLAC file.");
+	}
+	_writeHeader(mMd5.finish());
+	int ret = fclose(mFp);
+	mFp = nullptr;
+	if (ret) {
+		throw Codec::error(stage::WRITE, mPath, errno, "Failed to close FLAC file.");
+	}
+}
+
+void FlacParallel::_dispatch()
+{
+	if (mInFlight.size() >= mMaxInFlight) {
+		_writeOldest(); // bounded memory: wait for the oldest segment before reading any further
+	}
+
+	std::shared_ptr<segment> seg = std::move(mCur);
+	uint64_t firstFrameNum = mNumSegs++ * SEGMENT_BLOCKS;
+	mInFlight.emplace_back(seg, seg->done.get_future());
+
+	Codec::format fmt = mFmt;
+	unsigned level = mLevel, blockSize = mBlockSize;
+	bool verify = mVerify;
+	ProcessPolicy* policy = mPolicy;
+	size_t worker = mWorker;
+	mPool.submit([seg, fmt, level, blockSize, verify, firstFrameNum, policy, worker](size_t) {
+		if (policy) policy->placeHelper(worker); // else pinned where the worker is, as threads inherit it
+		try {
+			_encodeSegment(*seg, fmt, level, blockSize, verify, firstFrameNum);
+			seg->done.set_value();
+		} catch (...) {
+			seg->done.set_exception(std::current_exception());
+		}
+	});
+}
+
+void FlacParallel::_writeOldest()
+{
+	in_flight oldest = std::move(mInFlight.front());
+	mInFlight.pop_front();
+	oldest.second.get(); // rethrows the error of the segment, if any
+
+	segment& seg = *oldest.first;
+	for (unsigned sz : seg.frameSizes) {
+		if (!mMinFrameSz || sz < mMinFrameSz) mMinFrameSz = sz;
+		if (sz > mMaxFrameSz) mMaxFrameSz = sz;
+	}
+	if (fwrite(seg.frames.data(), 1, seg.frames.size(), mFp) != seg.frames.size()) {
+		throw Codec::error(stage::WRITE, mPath, errno, "Failed to write FLAC frames.");
+	}
+}
+
+void FlacParallel::_writeHeader(const array<uint8_t, 16>& md5)
+{
+	uint8_t hdr[4 + 4 + 34 + 4] = {'f', 'L', 'a', 'C'};
+	uint8_t* si = hdr + 8;
+
+	hdr[4] = 0; // STREAMINFO, not the last block
+	putBe(hdr + 5, 34, 3);
+	putBe(si, mBlockSize, 2); // min and max block size, only the very last frame may be shorter
+	putBe(si + 2, mBlockSize, 2);
+	putBe(si + 4, mMinFrameSz, 3);
+	putBe(si + 7, mMaxFrameSz, 3);
+	putBe(si + 10, (static_cast<uint64_t>(mFmt.sampleRate) << 44)
+		| (static_cast<uint64_t>(mFmt.channels - 1) << 41)
+		| (static_cast<uint64_t>(mFmt.bitsPerSample - 1) << 36)
+		| (mTotalFrames & 0xfffffffffULL), 8);
+	memcpy(si + 18, md5.data(), 16);
+
+	uint8_t* pad = si + 34;
+	pad[0] = 0x80 | 1; // PADDING, last block
+	putBe(pad + 1, PADDING_SZ, 3);
+
+	static const uint8_t zeros[PADDING_SZ] = {0};
+	if (fwrite(hdr, 1, sizeof(hdr), mFp) != sizeof(hdr)
+		|| fwrite(zeros, 1, PADDING_SZ, mFp) != PADDING_SZ)
+	{
+		throw Codec::error(stage::WRITE, mPath, errno, "Failed to write FLAC header.");
+	}
+}
+
+void FlacParallel::_encodeSegment(segment& seg, const Codec::format& fmt,
+	unsigned level, unsigned blockSize, bool verify, uint64_t firstFrameNum)
+{
+#ifdef FLE_INPROC_CODECS
+	struct context final {
+		segment& seg;
+		uint64_t nextFrameNum;
+	} ctx = {seg, firstFrameNum};
+
+	FLAC__StreamEncoder* enc = FLAC__stream_encoder_new();
+	if (!enc) throw std::runtime_error("Failed to create FLAC encoder.");
+	FLAC__stream_encoder_set_verify(enc, verify);
+	FLAC__stream_encoder_set_compression_level(enc, level);
+	FLAC__stream_encoder_set_blocksize(enc, blockSize);
+	FLAC__stream_encoder_set_channels(enc, fmt.channels);
+	FLAC__stream_encoder_set_bits_per_sample(enc, fmt.bitsPerSample);
+	FLAC__stream_encoder_set_sample_rate(enc, fmt.sampleRate);
+	FLAC__stream_encoder_set_do_md5(enc, false); // the signature is computed over the whole stream
+
+	auto writeCb = [](const FLAC__StreamEncoder*, const FLAC__byte buffer[], size_t bytes,
+		uint32_t samples, uint32_t, void* clientData) -> FLAC__StreamEncoderWriteStatus
+	{
+		if (!samples) return FLAC__STREAM_ENCODER_WRITE_STATUS_OK; // metadata of the segment stream, discarded
+		context& ctx = *static_cast<context*>(clientData);
+		size_t before = ctx.seg.frames.size();
+		try {
+			appendRenumbered(ctx.seg.frames, buffer, bytes, ctx.nextFrameNum++);
+		} catch (...) {
+			return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+		}
+		ctx.seg.frameSizes.emplace_back(static_cast<unsigned>(ctx.seg.frames.size() - before));
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+	};
+
+	FLAC__StreamEncoderInitStatus st = FLAC__stream_encoder_init_stream(enc,
+		writeCb, nullptr, nullptr, nullptr, &ctx);
+	bool ok = st == FLAC__STREAM_ENCODER_INIT_STATUS_OK
+		&& FLAC__stream_encoder_process_interleaved(enc, seg.pcm.data(),
+			static_cast<unsigned>(seg.pcm.size() / fmt.channels))
+		&& FLAC__stream_encoder_finish(enc);
+	FLAC__StreamEncoderState state = FLAC__stream_encoder_get_state(enc);
+	FLAC__stream_encoder_delete(enc);
+	if (!ok) {
+		throw std::runtime_error(st != FLAC__STREAM_ENCODER_INIT_STATUS_OK ?
+			FLAC__StreamEncoderInitStatusString[st] : FLAC__StreamEncoderStateString[state]);
+	}
+
+	seg.pcm.clear();
+	seg.pcm.shrink_to_fit(); // PCM no longer needed while the segment waits its turn
+#else
+	(void)seg; (void)fmt; (void)level; (void)blockSize; (void)verify; (void)firstFrameNum;
+#endif
+}
\ No newline at end of file
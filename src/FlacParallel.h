@@ -0,0 +1,56 @@
+
+#pragma once
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <memory>
+#include <utility>
+#include "Codec.h"
+#include "Md5.h"
+#include "ProcessPolicy.h"
+#include "Scheduler.h"
+
+// FLAC encoder for very long recordings: PCM is cut into segments of whole
+// blocks, which are encoded on all cores and stitched back into one stream,
+// with frame numbers, STREAMINFO and MD5 as a serial encode would produce.
+class FlacParallel final : public Codec::encoder {
+private:
+	struct segment final {
+		std::vector<int32_t>  pcm;
+		std::vector<uint8_t>  frames; // encoded and renumbered, ready to be written
+		std::vector<unsigned> frameSizes;
+		std::promise<void>    done;
+	};
+	using in_flight = std::pair<std::shared_ptr<segment>, std::future<void>>;
+
+	std::wstring  mPath;
+	Codec::format mFmt;
+	unsigned      mLevel, mBlockSize;
+	bool          mVerify;
+	size_t        mSegFrames, mMaxInFlight, mNumSegs = 0;
+	FILE*         mFp;
+	Md5           mMd5;
+	std::vector<uint8_t>     mMd5Buf;
+	std::shared_ptr<segment> mCur;
+	std::deque<in_flight>    mInFlight;
+	uint64_t      mTotalFrames = 0;
+	unsigned      mMinFrameSz = 0, mMaxFrameSz = 0;
+	size_t        mWorker = 0; // before mPolicy, which sets it
+	ProcessPolicy* mPolicy; // of the worker encoding the file, placing the pool on its share of the cores
+	Scheduler     mPool;
+
+public:
+	FlacParallel(const std::wstring& dest, const Codec::format& fmt,
+		unsigned level, bool verify, size_t numThreads);
+	~FlacParallel();
+
+	void write(const int32_t* buf, size_t numFrames) override;
+	void finish() override;
+
+private:
+	void _dispatch();
+	void _writeOldest();
+	void _writeHeader(const std::array<uint8_t, 16>& md5);
+	static void _encodeSegment(segment& seg, const Codec::format& fmt,
+		unsigned level, unsigned blockSize, bool verify, uint64_t firstFrameNum);
+};
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "Journal.h"
+#include <cinttypes>
+#include <cstring>
+#include <stdexcept>
+#include "Sys.h"
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::wstring;
+
+static const char HEADER[] = "flac-lame-frontend journal 1 ";
+
+Journal::Journal(const wstring& path, uint64_t batchKey)
+	: mPath(path), mPrev(read(path, batchKey))
+{
+	// Another batch, or none: start a new journal. Same batch: keep appending,
+	// the earlier events still count if this run is interrupted too.
+	bool isNew = mPrev.finished.empty() && mPrev.interrupted.empty();
+	mFp = Sys::openFile(mPath, isNew ? "wb" : "ab");
+	if (!mFp) {
+		throw std::runtime_error("Failed to open the batch journal:\n" + Sys::toUtf8(mPath));
+	}
+	if (isNew) {
+		fprintf(mFp, "%s%016" PRIx64 "\n", HEADER, batchKey);
+		fflush(mFp);
+	}
+}
+
+Journal::~Journal()
+{
+	if (mFp) fclose(mFp);
+}
+
+void Journal::started(const wstring& file)
+{
+	_append('>', file);
+}
+
+void Journal::finished(const wstring& file)
+{
+	_append('=', file);
+}
+
+void Journal::complete()
+{
+	lock_guard<mutex> lk(mMtx);
+	if (mFp) {
+		fclose(mFp);
+		mFp = nullptr;
+	}
+	Sys::removeFile(mPath);
+}
+
+Journal::contents Journal::read(const wstring& path, uint64_t batchKey)
+{
+	contents c;
+	FILE* f = Sys::openFile(path, "rb");
+	if (!f) return c;
+	string text;
+	char buf[64 * 1024];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0; ) {
+		text.append(buf, n);
+	}
+	fclose(f);
+
+	char header[64];
+	snprintf(header, sizeof(header), "%s%016" PRIx64 "\n", HEADER, batchKey);
+	if (text.compare(0, strlen(header), header) != 0) return c; // another batch, or not a journal
+
+	for (size_t pos = strlen(header); pos < text.size(); ) {
+		size_t eol = text.find('\n', pos);
+		if (eol == string::npos) break; // torn last line
+		if (eol - pos > 2 && text[pos + 1] == ' ') {
+			wstring file = Sys::fromUtf8(text.substr(pos + 2, eol - pos - 2));
+			if (text[pos] == '>') {
+				c.interrupted.emplace(std::move(file));
+			} else if (text[pos] == '=') {
+				c.interrupted.erase(file);
+				c.finished.emplace(std::move(file));
+			}
+		}
+		pos = eol + 1;
+	}
+	return c;
+}
+
+void Journal::_append(char event, const wstring& file)
+{
+	if (file.find(L'\n') != wstring::npos) return; // can't be stored in a line, it'll just run again
+	string line = string(1, event) + ' ' + Sys::toUtf8(file) + '\n';
+
+	lock_guard<mutex> lk(mMtx);
+	if (!mFp) return;
+	fputs(line.c_str(), mFp);
+	fflush(mFp); // a crash keeps what was done
+}
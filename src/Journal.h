@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+// Files of a batch started and finished so far, so a batch cancelled or
+// crashed halfway resumes where it stopped. Append-only like ConvCache, one
+// flushed line per event; a torn last line, from a crash, is ignored. Unlike
+// the cache it also covers deleted and replaced sources, which can't be
+// fingerprinted afterwards.
+class Journal final {
+public:
+	struct contents final {
+		std::unordered_set<std::wstring> finished;
+		std::unordered_set<std::wstring> interrupted; // started, never finished: their outputs are partial
+	};
+
+private:
+	std::wstring mPath;
+	std::mutex   mMtx;
+	FILE*        mFp = nullptr;
+	contents     mPrev; // of the earlier run of the same batch, read only
+
+public:
+	Journal(const std::wstring& path, uint64_t batchKey); // resumes the same batch, else starts over
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+	~Journal();
+
+	bool isFinished(const std::wstring& file) const { return mPrev.finished.count(file) != 0; }
+	const std::unordered_set<std::wstring>& interrupted() const { return mPrev.interrupted; }
+	void started(const std::wstring& file);
+	void finished(const std::wstring& file);
+	void complete(); // whole batch done, nothing to resume: the journal goes
+
+	static contents read(const std::wstring& path, uint64_t batchKey); // empty if another batch
+
+private:
+	void _append(char event, const std::wstring& file);
+};
@@ -0,0 +1,457 @@
+#include "Loudness.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "Cancel.h"
+#include "Sys.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOUDNESS_SSE2
+#include <emmintrin.h>
+#endif
+using std::vector;
+using std::wstring;
+
+static const double GATE_ABS = -70, TOP_LUFS = 5; // range of the histogram; louder blocks go to the top bin
+static const size_t NUM_BINS = 1000;
+static const size_t HIST = 11; // input samples the interpolator looks back
+static const size_t CONV_FRAMES = 4096; // WAV bytes are converted this many frames at a time
+static const size_t MAX_HEAD = 1024 * 1024; // of a WAV, before the data; anything bigger isn't one
+static const size_t FEED_BUF_SZ = 256 * 1024;
+
+// ITU-R BS.1770-4 interpolator, 4 phases of 12 taps: the true peak is
+// looked for between the samples, where a DAC would put it.
+static const float PHASES[4][HIST + 1] = {
+	{ 0.0017089843750f,  0.0109863281250f, -0.0196533203125f,  0.0332031250000f, -0.0594482421875f,  0.1373291015625f,
+	  0.9721679687500f, -0.1022949218750f,  0.0476074218750f, -0.0266113281250f,  0.0148925781250f, -0.0083007812500f},
+	{-0.0291748046875f,  0.0292968750000f, -0.0517578125000f,  0.0891113281250f, -0.1665039062500f,  0.4650878906250f,
+	  0.7797851562500f, -0.2003173828125f,  0.1015625000000f, -0.0582275390625f,  0.0330810546875f, -0.0189208984375f},
+	{-0.0189208984375f,  0.0330810546875f, -0.0582275390625f,  0.1015625000000f, -0.2003173828125f,  0.7797851562500f,
+	  0.4650878906250f, -0.1665039062500f,  0.0891113281250f, -0.0517578125000f,  0.0292968750000f, -0.0291748046875f},
+	{-0.0083007812500f,  0.0148925781250f, -0.0266113281250f,  0.0476074218750f, -0.1022949218750f,  0.9721679687500f,
+	  0.1373291015625f, -0.0594482421875f,  0.0332031250000f, -0.0196533203125f,  0.0109863281250f,  0.0017089843750f},
+};
+
+static double _lufs(double energy)
+{
+	return -0.691 + 10 * std::log10(energy);
+}
+
+static thread_local Loudness::capture* tlCapture = nullptr;
+
+Loudness::histogram::histogram()
+	: mCounts(NUM_BINS, 0), mEnergy(NUM_BINS, 0)
+{
+}
+
+void Loudness::histogram::add(double energy)
+{
+	if (energy <= 0) return;
+	double lufs = _lufs(energy);
+	if (lufs < GATE_ABS) return; // absolute gate
+	size_t bin = std::min(static_cast<size_t>((lufs - GATE_ABS) * NUM_BINS / (TOP_LUFS - GATE_ABS)), NUM_BINS - 1);
+	++mCounts[bin];
+	mEnergy[bin] += energy;
+}
+
+void Loudness::histogram::merge(const histogram& other)
+{
+	for (size_t b = 0; b < NUM_BINS; ++b) {
+		mCounts[b] += other.mCounts[b];
+		mEnergy[b] += other.mEnergy[b];
+	}
+}
+
+double Loudness::histogram::integrated() const
+{
+	// Relative gate 10 LU below the blocks above the absolute one; the bin
+	// it falls in goes by its center.
+	uint64_t count = 0;
+	double energy = 0;
+	for (size_t b = 0; b < NUM_BINS; ++b) {
+		count += mCounts[b];
+		energy += mEnergy[b];
+	}
+	if (!count) return -std::numeric_limits<double>::infinity();
+	double gate = _lufs(energy / count) - 10;
+
+	count = 0;
+	energy = 0;
+	for (size_t b = 0; b < NUM_BINS; ++b) {
+		double center = GATE_ABS + (b + 0.5) * (TOP_LUFS - GATE_ABS) / NUM_BINS;
+		if (center <= gate) continue;
+		count += mCounts[b];
+		energy += mEnergy[b];
+	}
+	return count ? _lufs(energy / count) : -std::numeric_limits<double>::infinity();
+}
+
+std::string Loudness::histogram::toText() const
+{
+	// Only the bins with blocks, each as "bin count energy", exact to the bit.
+	std::string text;
+	char num[64];
+	for (size_t b = 0; b < NUM_BINS; ++b) {
+		if (!mCounts[b]) continue;
+		snprintf(num, sizeof(num), "%zu %u %.17g;", b, mCounts[b], mEnergy[b]);
+		text.append(num);
+	}
+	return text;
+}
+
+bool Loudness::histogram::fromText(const std::string& text)
+{
+	histogram h;
+	for (size_t pos = 0; pos < text.size(); ) {
+		size_t end = text.find(';', pos);
+		if (end == std::string::npos) return false;
+		size_t bin = 0;
+		unsigned count = 0;
+		double energy = 0;
+		if (sscanf(text.substr(pos, end - pos).c_str(), "%zu %u %lg", &bin, &count, &energy) != 3
+			|| bin >= NUM_BINS) return false;
+		h.mCounts[bin] = count;
+		h.mEnergy[bin] = energy;
+		pos = end + 1;
+	}
+	*this = std::move(h);
+	return true;
+}
+
+Loudness::capture::capture()
+	: mPrev(tlCapture)
+{
+	tlCapture = this;
+}
+
+Loudness::capture::~capture()
+{
+	tlCapture = mPrev;
+}
+
+bool Loudness::capture::isActive()
+{
+	return tlCapture != nullptr;
+}
+
+Loudness* Loudness::capture::open(unsigned sampleRate, unsigned channels, unsigned bitsPerSample)
+{
+	if (!tlCapture || sampleRate < 8000 || !channels || channels > 8 || !bitsPerSample || bitsPerSample > 32) {
+		return nullptr;
+	}
+	tlCapture->mMeter = std::make_unique<Loudness>(sampleRate, channels, bitsPerSample);
+	return tlCapture->mMeter.get();
+}
+
+Loudness::wav_feed::wav_feed()
+	: mActive(capture::isActive())
+{
+}
+
+void Loudness::wav_feed::feed(const void* data, size_t len)
+{
+	if (!mActive) return;
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+
+	if (!mMeter) { // still in the header
+		mHead.append(reinterpret_cast<const char*>(p), len);
+		if (!_parseHead()) {
+			if (mHead.size() > MAX_HEAD) mActive = false;
+			return;
+		}
+		len = 0; // what came after the header is in mCarry now
+	}
+
+	size_t frameBytes = mBytesPerSample * mChannels;
+	if (!mCarry.empty()) {
+		size_t fill = std::min(len, (frameBytes - mCarry.size() % frameBytes) % frameBytes);
+		mCarry.append(reinterpret_cast<const char*>(p), fill);
+		p += fill;
+		len -= fill;
+		size_t numFrames = mCarry.size() / frameBytes;
+		_convert(reinterpret_cast<const uint8_t*>(mCarry.data()), numFrames);
+		mCarry.erase(0, numFrames * frameBytes);
+		if (!mCarry.empty()) return; // still short of a frame, nothing else came
+	}
+	size_t numFrames = len / frameBytes;
+	_convert(p, numFrames);
+	mCarry.assign(reinterpret_cast<const char*>(p) + numFrames * frameBytes, len - numFrames * frameBytes);
+}
+
+bool Loudness::wav_feed::_parseHead()
+{
+	// Just enough of RIFF for what the decoders write: PCM, plain or
+	// extensible, and chunks skipped until the data.
+	auto le16 = [this](size_t at) { return static_cast<unsigned>(static_cast<uint8_t>(mHead[at]) | static_cast<uint8_t>(mHead[at + 1]) << 8); };
+	auto le32 = [&](size_t at) { return le16(at) | le16(at + 2) << 16; };
+
+	if (mHead.size() < 12) return false;
+	if ((mHead.compare(0, 4, "RIFF") && mHead.compare(0, 4, "RF64")) || mHead.compare(8, 4, "WAVE")) {
+		mActive = false;
+		return false;
+	}
+	unsigned sampleRate = 0;
+	for (size_t pos = 12; pos + 8 <= mHead.size(); ) {
+		size_t chunkSize = le32(pos + 4);
+		if (!mHead.compare(pos, 4, "data")) {
+			if (!sampleRate || !mChannels || !mBytesPerSample || mBytesPerSample > 4) break;
+			mMeter = capture::open(sampleRate, mChannels, mBytesPerSample * 8);
+			if (!mMeter) break;
+			mCarry = mHead.substr(pos + 8);
+			mHead.clear();
+			mHead.shrink_to_fit();
+			return true;
+		}
+		if (pos + 8 + chunkSize > mHead.size()) return false; // not all here yet
+		if (!mHead.compare(pos, 4, "fmt ") && chunkSize >= 16) {
+			unsigned tag = le16(pos + 8);
+			if (tag == 0xFFFE && chunkSize >= 26) tag = le16(pos + 32); // extensible, the subformat tells
+			if (tag != 1) break; // float or compressed
+			mChannels = le16(pos + 10);
+			sampleRate = le32(pos + 12);
+			mBytesPerSample = mChannels ? le16(pos + 20) / mChannels : 0; // container, from the block align
+		}
+		pos += 8 + chunkSize + (chunkSize & 1);
+	}
+	if (mMeter) return true;
+	if (mHead.size() >= 12 && (mHead.find("data") != std::string::npos || mHead.size() > MAX_HEAD)) {
+		mActive = false; // a data chunk came, but nothing to measure in it
+	}
+	return false;
+}
+
+void Loudness::wav_feed::_convert(const uint8_t* p, size_t numFrames)
+{
+	mFrames.resize(CONV_FRAMES * mChannels);
+	while (numFrames) {
+		size_t n = std::min(numFrames, CONV_FRAMES);
+		int32_t* out = &mFrames[0];
+		for (size_t s = 0; s < n * mChannels; ++s, p += mBytesPerSample) {
+			switch (mBytesPerSample) {
+			case 1: out[s] = static_cast<int32_t>(p[0]) - 128; break; // 8-bit WAV is unsigned
+			case 2: out[s] = static_cast<int16_t>(p[0] | p[1] << 8); break;
+			case 3: out[s] = static_cast<int32_t>(static_cast<uint32_t>(p[0] << 8 | p[1] << 16 | p[2] << 24)) >> 8; break;
+			default: out[s] = static_cast<int32_t>(static_cast<uint32_t>(p[0] | p[1] << 8 | p[2] << 16)
+				| static_cast<uint32_t>(p[3]) << 24);
+			}
+		}
+		mMeter->add(&mFrames[0], n);
+		numFrames -= n;
+	}
+}
+
+void Loudness::measureWavFile(const wstring& path)
+{
+	if (!capture::isActive()) return;
+	FILE* fp = nullptr;
+	try {
+		fp = Sys::openFile(path, "rb");
+	} catch (const std::exception&) {
+		return; // the conversion will tell
+	}
+	if (!fp) return;
+
+	wav_feed feed;
+	vector<char> buf(FEED_BUF_SZ);
+	for (size_t n; (n = fread(&buf[0], 1, buf.size(), fp)) > 0; ) {
+		if (Cancel::isRequested()) break;
+		feed.feed(&buf[0], n);
+	}
+	fclose(fp);
+}
+
+Loudness::Loudness(unsigned sampleRate, unsigned channels, unsigned bitsPerSample)
+	: mRate(sampleRate), mChannels(channels),
+		mScale(1.0 / static_cast<double>(1ull << (bitsPerSample - 1))),
+		mZ(4 * (channels + 1), 0), mSum(channels, 0), mWeights(channels, 1),
+		mSubLen((sampleRate + 5) / 10), mOversample(sampleRate < 96000),
+		mHistory(HIST * channels, 0)
+{
+	// K-weighting: a high shelf for the head, then a high-pass, as biquads
+	// designed for this rate from their analog prototypes.
+	const double PI = 3.14159265358979323846;
+	double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+	double k = std::tan(PI * f0 / sampleRate);
+	double vh = std::pow(10.0, gain / 20), vb = std::pow(vh, 0.4996667741545416);
+	double a0 = 1 + k / q + k * k;
+	double pre[5] = {(vh + vb * k / q + k * k) / a0, 2 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0,
+		2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0};
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = std::tan(PI * f0 / sampleRate);
+	a0 = 1 + k / q + k * k;
+	double hp[5] = {1, -2, 1, 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0};
+
+	std::copy(pre, pre + 5, mCoef[0]);
+	std::copy(hp, hp + 5, mCoef[1]);
+
+	if (channels == 6) { // 5.1 as WAV orders it: the LFE doesn't count, the surrounds count more
+		mWeights = {1, 1, 1, 0, 1.41, 1.41};
+	}
+}
+
+void Loudness::add(const int32_t* frames, size_t numFrames)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	_peaks(frames, numFrames);
+	while (numFrames) {
+		size_t n = std::min(numFrames, mSubLen - mSubFill);
+		_filter(frames, n);
+		frames += n * mChannels;
+		numFrames -= n;
+		mSubFill += n;
+		if (mSubFill == mSubLen) _endSubBlock();
+	}
+	mSecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+Loudness::result Loudness::finish() const
+{
+	result r;
+	r.lufs = mBlocks.integrated();
+	r.truePeak = mPeak;
+	return r;
+}
+
+void Loudness::_filter(const int32_t* frames, size_t numFrames)
+{
+	// Direct form II transposed; states are laid out by state, then
+	// channel, so two neighbouring channels load as one vector.
+	size_t stride = mChannels + 1;
+	double* z1 = &mZ[0];
+	double* z2 = &mZ[stride];
+	double* u1 = &mZ[2 * stride];
+	double* u2 = &mZ[3 * stride];
+	const double* pre = mCoef[0];
+	const double* hp = mCoef[1];
+	size_t c = 0;
+
+#ifdef LOUDNESS_SSE2
+	const __m128d scale = _mm_set1_pd(mScale);
+	const __m128d b0 = _mm_set1_pd(pre[0]), b1 = _mm_set1_pd(pre[1]), b2 = _mm_set1_pd(pre[2]);
+	const __m128d a1 = _mm_set1_pd(pre[3]), a2 = _mm_set1_pd(pre[4]);
+	const __m128d hb1 = _mm_set1_pd(hp[1]), ha1 = _mm_set1_pd(hp[3]), ha2 = _mm_set1_pd(hp[4]);
+	for (; c + 1 < mChannels; c += 2) {
+		__m128d s1 = _mm_loadu_pd(z1 + c), s2 = _mm_loadu_pd(z2 + c);
+		__m128d t1 = _mm_loadu_pd(u1 + c), t2 = _mm_loadu_pd(u2 + c);
+		__m128d acc = _mm_setzero_pd();
+		const int32_t* f = frames + c;
+		for (size_t i = 0; i < numFrames; ++i, f += mChannels) {
+			__m128d x = _mm_mul_pd(_mm_cvtepi32_pd(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(f))), scale);
+			__m128d y = _mm_add_pd(_mm_mul_pd(b0, x), s1);
+			s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x), _mm_mul_pd(a1, y)), s2);
+			s2 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+			__m128d w = _mm_add_pd(y, t1); // high-pass: b0 and b2 are 1
+			t1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(hb1, y), _mm_mul_pd(ha1, w)), t2);
+			t2 = _mm_sub_pd(y, _mm_mul_pd(ha2, w));
+			acc = _mm_add_pd(acc, _mm_mul_pd(w, w));
+		}
+		_mm_storeu_pd(z1 + c, s1);
+		_mm_storeu_pd(z2 + c, s2);
+		_mm_storeu_pd(u1 + c, t1);
+		_mm_storeu_pd(u2 + c, t2);
+		double sums[2];
+		_mm_storeu_pd(sums, acc);
+		mSum[c] += sums[0];
+		mSum[c + 1] += sums[1];
+	}
+#endif
+
+	for (; c < mChannels; ++c) { // odd one out, or all without SSE2
+		double s1 = z1[c], s2 = z2[c], t1 = u1[c], t2 = u2[c], acc = 0;
+		const int32_t* f = frames + c;
+		for (size_t i = 0; i < numFrames; ++i, f += mChannels) {
+			double x = *f * mScale;
+			double y = pre[0] * x + s1;
+			s1 = pre[1] * x - pre[3] * y + s2;
+			s2 = pre[2] * x - pre[4] * y;
+			double w = y + t1;
+			t1 = hp[1] * y - hp[3] * w + t2;
+			t2 = y - hp[4] * w;
+			acc += w * w;
+		}
+		z1[c] = s1;
+		z2[c] = s2;
+		u1[c] = t1;
+		u2[c] = t2;
+		mSum[c] += acc;
+	}
+
+	for (double& z : mZ) { // silence decays into denormals, which are slow
+		if (std::fabs(z) < 1e-30) z = 0;
+	}
+}
+
+void Loudness::_endSubBlock()
+{
+	double energy = 0;
+	for (size_t c = 0; c < mChannels; ++c) {
+		energy += mWeights[c] * mSum[c];
+		mSum[c] = 0;
+	}
+	mRing[mNumSubs++ % 4] = energy / mSubLen;
+	mSubFill = 0;
+	if (mNumSubs >= 4) { // 400 ms blocks, overlapping by 75%
+		mBlocks.add((mRing[0] + mRing[1] + mRing[2] + mRing[3]) / 4);
+	}
+}
+
+void Loudness::_peaks(const int32_t* frames, size_t numFrames)
+{
+	float peak = mPeak;
+	if (!mOversample) { // above 96 kHz, the samples are close enough
+		for (size_t s = 0; s < numFrames * mChannels; ++s) {
+			peak = std::max(peak, static_cast<float>(std::fabs(frames[s] * mScale)));
+		}
+		mPeak = peak;
+		return;
+	}
+
+	mChan.resize(HIST + numFrames);
+	float scale = static_cast<float>(mScale);
+	for (size_t c = 0; c < mChannels; ++c) {
+		float* x = &mChan[0];
+		std::copy(&mHistory[c * HIST], &mHistory[c * HIST] + HIST, x);
+		for (size_t i = 0; i < numFrames; ++i) {
+			x[HIST + i] = frames[i * mChannels + c] * scale;
+		}
+		size_t i = 0;
+
+#ifdef LOUDNESS_SSE2
+		// The four phases of an output sample are one vector, so each input
+		// sample is multiplied once by its four taps.
+		__m128 taps[HIST + 1];
+		for (size_t k = 0; k <= HIST; ++k) {
+			taps[k] = _mm_setr_ps(PHASES[0][k], PHASES[1][k], PHASES[2][k], PHASES[3][k]);
+		}
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		__m128 vpeak = _mm_set1_ps(peak);
+		for (; i < numFrames; ++i) {
+			const float* p = x + HIST + i;
+			__m128 acc = _mm_mul_ps(taps[0], _mm_set1_ps(p[0]));
+			for (size_t k = 1; k <= HIST; ++k) {
+				acc = _mm_add_ps(acc, _mm_mul_ps(taps[k], _mm_set1_ps(p[-static_cast<ptrdiff_t>(k)])));
+			}
+			vpeak = _mm_max_ps(vpeak, _mm_and_ps(acc, absMask));
+			vpeak = _mm_max_ps(vpeak, _mm_and_ps(_mm_set1_ps(p[0]), absMask));
+		}
+		float lanes[4];
+		_mm_storeu_ps(lanes, vpeak);
+		peak = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#endif
+
+		for (; i < numFrames; ++i) {
+			const float* p = x + HIST + i;
+			peak = std::max(peak, std::fabs(p[0])); // never below the sample peak
+			for (size_t ph = 0; ph < 4; ++ph) {
+				float acc = 0;
+				for (size_t k = 0; k <= HIST; ++k) acc += PHASES[ph][k] * p[-static_cast<ptrdiff_t>(k)];
+				peak = std::max(peak, std::fabs(acc));
+			}
+		}
+		std::copy(x + numFrames, x + numFrames + HIST, &mHistory[c * HIST]);
+	}
+	mPeak = peak;
+}
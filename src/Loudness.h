@@ -0,0 +1,110 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// EBU R128 loudness and true peak of the PCM a conversion passes through
+// anyway, for ReplayGain 2.0 tags, so no separate scan of the library is
+// needed. The K-weighting filters run two channels at once and the 4x
+// oversampling four phases at once, with SSE2 where there is, always on x64.
+class Loudness final {
+public:
+	static constexpr double REFERENCE_LUFS = -18; // ReplayGain 2.0
+
+	// Loudness of the 400 ms gating blocks, binned; the blocks of the tracks
+	// of an album add up to the album's, which is not the average of theirs.
+	class histogram final {
+	private:
+		std::vector<uint32_t> mCounts;
+		std::vector<double>   mEnergy; // sum of the energies binned there, so the means are exact
+
+	public:
+		histogram();
+		void   add(double energy);
+		void   merge(const histogram& other);
+		double integrated() const; // LUFS, gated; -infinity if it's all silence
+		std::string toText() const; // to be sent to another machine
+		bool   fromText(const std::string& text); // false if it isn't one
+	};
+
+	struct result final {
+		double lufs = -std::numeric_limits<double>::infinity();
+		double truePeak = 0; // linear, 1 is full scale
+
+		bool   isValid() const { return lufs > -std::numeric_limits<double>::infinity(); }
+		double gainDb() const { return REFERENCE_LUFS - lufs; }
+	};
+
+	// Measures what the conversions of the calling thread pass through,
+	// while in scope; like Cancel, Convert needs no extra arguments.
+	class capture final {
+	private:
+		capture*                  mPrev;
+		std::unique_ptr<Loudness> mMeter;
+
+	public:
+		capture();
+		capture(const capture&) = delete;
+		capture& operator=(const capture&) = delete;
+		~capture();
+		Loudness* meter() const { return mMeter.get(); } // of the last stream opened, if any
+
+		static bool      isActive();
+		static Loudness* open(unsigned sampleRate, unsigned channels, unsigned bitsPerSample); // null if not capturing
+	};
+
+	// A WAV stream, from a pipe or a file, measured as it comes; the meter
+	// opens once the header is through.
+	class wav_feed final {
+	private:
+		bool        mActive;
+		std::string mHead; // until the data chunk starts
+		std::string mCarry; // partial frame between feeds
+		Loudness*   mMeter = nullptr;
+		unsigned    mBytesPerSample = 0, mChannels = 0;
+		std::vector<int32_t> mFrames;
+
+	public:
+		wav_feed(); // does nothing unless capturing
+		void feed(const void* data, size_t len);
+
+	private:
+		bool _parseHead();
+		void _convert(const uint8_t* p, size_t numFrames);
+	};
+
+	static void measureWavFile(const std::wstring& path); // into the capture of the calling thread
+
+private:
+	unsigned mRate, mChannels;
+	double   mScale; // to full scale
+	double   mCoef[2][5]; // pre-filter and high-pass: b0, b1, b2, a1, a2
+	std::vector<double> mZ; // filter states, 4 per channel in runs of channels
+	std::vector<double> mSum; // squares of this 100 ms sub-block, per channel
+	std::vector<double> mWeights;
+	size_t   mSubLen, mSubFill = 0, mNumSubs = 0;
+	double   mRing[4] = {}; // energies of the last sub-blocks, a block is 4 of them
+	histogram mBlocks;
+	bool     mOversample; // true peak by 4x oversampling, below 96 kHz; sample peak above
+	std::vector<float> mHistory; // last input samples of each channel, for the interpolator
+	std::vector<float> mChan; // one channel, with its history in front
+	float    mPeak = 0;
+	double   mSecs = 0;
+
+public:
+	Loudness(unsigned sampleRate, unsigned channels, unsigned bitsPerSample);
+	Loudness(const Loudness&) = delete;
+	Loudness& operator=(const Loudness&) = delete;
+
+	void   add(const int32_t* frames, size_t numFrames); // interleaved, at the original bit depth
+	result finish() const; // of what was added; a trailing partial block doesn't count
+	const histogram& blocks() const { return mBlocks; }
+	double secs() const { return mSecs; } // spent measuring
+
+private:
+	void _filter(const int32_t* frames, size_t numFrames);
+	void _endSubBlock();
+	void _peaks(const int32_t* frames, size_t numFrames);
+};
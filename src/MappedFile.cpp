@@ -0,0 +1,129 @@
+#include "MappedFile.h"
+#include "Sys.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using std::wstring;
+
+#ifdef _WIN32
+
+bool MappedFile::open(const wstring& path)
+{
+	close();
+	mFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER sz{};
+	if (!GetFileSizeEx(mFile, &sz)) {
+		close();
+		return false;
+	}
+	mSize = static_cast<uint64_t>(sz.QuadPart);
+	if (mSize) { // an empty file can't be mapped, but it's still a valid one
+		mMap = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mMap) {
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	_unmapView();
+	if (mMap) CloseHandle(mMap);
+	if (mFile != INVALID_HANDLE_VALUE) CloseHandle(mFile);
+	mMap = nullptr;
+	mFile = INVALID_HANDLE_VALUE;
+	mSize = 0;
+}
+
+const uint8_t* MappedFile::view(uint64_t offset, size_t& len)
+{
+	_unmapView();
+	if (!mMap || offset >= mSize) {
+		len = 0;
+		return nullptr;
+	}
+	if (len > mSize - offset) len = static_cast<size_t>(mSize - offset);
+
+	static DWORD gran = []() { SYSTEM_INFO si{}; GetSystemInfo(&si); return si.dwAllocationGranularity; }();
+	uint64_t start = offset - offset % gran; // views begin on the allocation granularity
+	size_t delta = static_cast<size_t>(offset - start);
+	mView = MapViewOfFile(mMap, FILE_MAP_READ,
+		static_cast<DWORD>(start >> 32), static_cast<DWORD>(start), delta + len);
+	if (!mView) {
+		len = 0;
+		return nullptr;
+	}
+	mViewLen = delta + len;
+	return static_cast<const uint8_t*>(mView) + delta;
+}
+
+void MappedFile::_unmapView()
+{
+	if (mView) UnmapViewOfFile(mView);
+	mView = nullptr;
+	mViewLen = 0;
+}
+
+#else
+
+bool MappedFile::open(const wstring& path)
+{
+	close();
+	mFd = ::open(Sys::toUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+	if (mFd == -1) return false;
+
+	struct stat st{};
+	if (fstat(mFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close();
+		return false;
+	}
+	mSize = static_cast<uint64_t>(st.st_size);
+	return true;
+}
+
+void MappedFile::close()
+{
+	_unmapView();
+	if (mFd != -1) ::close(mFd);
+	mFd = -1;
+	mSize = 0;
+}
+
+const uint8_t* MappedFile::view(uint64_t offset, size_t& len)
+{
+	_unmapView();
+	if (mFd == -1 || offset >= mSize) {
+		len = 0;
+		return nullptr;
+	}
+	if (len > mSize - offset) len = static_cast<size_t>(mSize - offset);
+
+	static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	uint64_t start = offset - offset % page; // views begin on a page
+	size_t delta = static_cast<size_t>(offset - start);
+	void* p = mmap(nullptr, delta + len, PROT_READ, MAP_PRIVATE, mFd, static_cast<off_t>(start));
+	if (p == MAP_FAILED) {
+		len = 0;
+		return nullptr;
+	}
+	mView = p;
+	mViewLen = delta + len;
+	return static_cast<const uint8_t*>(mView) + delta;
+}
+
+void MappedFile::_unmapView()
+{
+	if (mView) munmap(mView, mViewLen);
+	mView = nullptr;
+	mViewLen = 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+// Read-only memory mapping of a file, one view at a time. Only the pages a
+// view covers are read from the disk, and only when touched, so probing a
+// header costs a page fault instead of a buffer fill.
+class MappedFile final {
+private:
+#ifdef _WIN32
+	HANDLE mFile = INVALID_HANDLE_VALUE, mMap = nullptr;
+#else
+	int    mFd = -1;
+#endif
+	uint64_t mSize = 0;
+	void*    mView = nullptr;
+	size_t   mViewLen = 0;
+
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	bool     open(const std::wstring& path); // false if it can't be read; never throws
+	void     close();
+	uint64_t size() const { return mSize; }
+	const uint8_t* view(uint64_t offset, size_t& len); // len is clamped to the file; replaces the last view
+
+private:
+	void _unmapView();
+};
@@ -0,0 +1,99 @@
+
+#include "Md5.h"
+#include <cstring>
+
+Md5::Md5()
+	: mState{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476}
+{
+}
+
+void Md5::update(const void* data, size_t numBytes)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	size_t used = mNumBytes % 64;
+	mNumBytes += numBytes;
+
+	if (used) { // complete the pending block first
+		size_t fill = (numBytes < 64 - used) ? numBytes : 64 - used;
+		memcpy(mBlock + used, p, fill);
+		p += fill;
+		numBytes -= fill;
+		if (used + fill < 64) return;
+		_transform(mBlock);
+	}
+	for (; numBytes >= 64; p += 64, numBytes -= 64) {
+		_transform(p);
+	}
+	memcpy(mBlock, p, numBytes);
+}
+
+std::array<uint8_t, 16> Md5::finish()
+{
+	uint64_t numBits = mNumBytes * 8;
+	uint8_t pad[72] = {0x80};
+	size_t used = mNumBytes % 64;
+	size_t padLen = (used < 56) ? 56 - used : 120 - used;
+	for (int i = 0; i < 8; ++i) {
+		pad[padLen + i] = static_cast<uint8_t>(numBits >> (8 * i));
+	}
+	update(pad, padLen + 8);
+
+	std::array<uint8_t, 16> digest;
+	for (int i = 0; i < 16; ++i) {
+		digest[i] = static_cast<uint8_t>(mState[i / 4] >> (8 * (i % 4)));
+	}
+	return digest;
+}
+
+std::string Md5::hex(const std::array<uint8_t, 16>& digest)
+{
+	static const char DIGITS[] = "0123456789abcdef";
+	std::string text;
+	for (uint8_t b : digest) {
+		text.push_back(DIGITS[b >> 4]);
+		text.push_back(DIGITS[b & 0x0f]);
+	}
+	return text;
+}
+
+void Md5::_transform(const uint8_t* block)
+{
+	static const uint32_t K[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+	static const unsigned S[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+	uint32_t m[16];
+	for (int i = 0; i < 16; ++i) {
+		m[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16)
+			| (static_cast<uint32_t>(block[i * 4 + 3]) << 24);
+	}
+
+	uint32_t a = mState[0], b = mState[1], c = mState[2], d = mState[3];
+	for (unsigned i = 0; i < 64; ++i) {
+		uint32_t f;
+		unsigned g;
+		switch (i / 16) {
+		case 0:  f = (b & c) | (~b & d); g = i; break;
+		case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+		case 2:  f = b ^ c ^ d;          g = (3 * i + 5) % 16; break;
+		default: f = c ^ (b | ~d);       g = (7 * i) % 16;
+		}
+		uint32_t rot = a + f + K[i] + m[g];
+		unsigned s = S[(i / 16) * 4 + i % 4];
+		a = d;
+		d = c;
+		c = b;
+		b += (rot << s) | (rot >> (32 - s));
+	}
+	mState[0] += a;
+	mState[1] += b;
+	mState[2] += c;
+	mState[3] += d;
+}
\ No newline at end of file
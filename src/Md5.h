@@ -0,0 +1,23 @@
+
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental MD5 (RFC 1321), as used by FLAC to sign the decoded PCM.
+class Md5 final {
+private:
+	uint32_t mState[4];
+	uint64_t mNumBytes = 0;
+	uint8_t  mBlock[64];
+
+public:
+	Md5();
+	void update(const void* data, size_t numBytes);
+	std::array<uint8_t, 16> finish();
+	static std::string hex(const std::array<uint8_t, 16>& digest); // lowercase, as md5sum prints it
+
+private:
+	void _transform(const uint8_t* block);
+};
\ No newline at end of file
@@ -0,0 +1,371 @@
+#include "Node.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include "Loudness.h"
+#include "Md5.h"
+#include "Probe.h"
+#include "Sys.h"
+#include "Verify.h"
+using std::string;
+using std::vector;
+using std::wstring;
+using clock_type = std::chrono::steady_clock;
+using file_ptr = std::unique_ptr<FILE, int(*)(FILE*)>;
+
+const char* const Node::PROTOCOL = "flac-lame-node 1";
+const char* const Node::DEFAULT_PORT = "7878";
+
+static const unsigned HELLO_MS = 10000; // for a farm to say what it is, once connected
+static const unsigned STALL_MS = 30000; // between the messages of a source
+static const size_t MAX_OUTPUTS = 16;
+
+static uint8_t _code(Node::msg m) { return static_cast<uint8_t>(m); }
+
+static string _num(double val)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.17g", val); // back to the same double
+	return buf;
+}
+
+string Node::encode(const fields& f)
+{
+	string text;
+	for (const auto& kv : f) {
+		text.append(kv.first).push_back('=');
+		for (char ch : kv.second) { // a line each, errors and stderr included
+			if (ch == '\\') text.append("\\\\");
+			else if (ch == '\n') text.append("\\n");
+			else if (ch == '\r') text.append("\\r");
+			else text.push_back(ch);
+		}
+		text.push_back('\n');
+	}
+	return text;
+}
+
+Node::fields Node::decode(const string& payload)
+{
+	fields f;
+	for (size_t pos = 0; pos < payload.size(); ) {
+		size_t eol = payload.find('\n', pos), eq = payload.find('=', pos);
+		if (eol == string::npos || eq > eol) throw std::runtime_error("Malformed message.");
+		string& val = f[payload.substr(pos, eq - pos)];
+		for (size_t i = eq + 1; i < eol; ++i) {
+			char ch = payload[i];
+			if (ch == '\\' && i + 1 < eol) {
+				ch = payload[++i];
+				ch = ch == 'n' ? '\n' : ch == 'r' ? '\r' : ch;
+			}
+			val.push_back(ch);
+		}
+		pos = eol + 1;
+	}
+	return f;
+}
+
+Node::Node(const options& opts)
+	: mOpts(opts)
+{
+	if (!mOpts.numSlots) mOpts.numSlots = Sys::numProcessors();
+	if (!mOpts.convOpts.parallelFlacThreads) { // as the Runner shares the cores among its workers
+		mOpts.convOpts.parallelFlacThreads = static_cast<unsigned>(std::max<size_t>(Sys::numProcessors() / mOpts.numSlots, 1));
+	}
+	if (mOpts.port.empty()) mOpts.port = DEFAULT_PORT;
+	mListener = Socket::listen(mOpts.host, mOpts.port);
+
+	// Twice the slots offered: a farm which lost a connection may come back
+	// before the old one has wound down here.
+	mSlotTaken.assign(2 * mOpts.numSlots, false);
+	mPolicy = std::make_unique<ProcessPolicy>(mOpts.policy, mSlotTaken.size());
+	mScratch = Sys::joinPath(Sys::tempFolder(), L"flac-lame-node-" + Sys::fromUtf8(mOpts.port)); // one node per port
+	Sys::removeTree(mScratch); // left by one killed
+}
+
+Node::~Node()
+{
+	stop();
+	_reap(true);
+	try {
+		Sys::removeTree(mScratch);
+	} catch (const std::exception&) { } // best effort, the next node on this port does it anyway
+}
+
+void Node::run(job_done_func onJobDone)
+{
+	mOnJobDone = std::move(onJobDone);
+	while (!mStop) {
+		std::unique_ptr<Socket> sock = mListener->accept(BEAT_MS); // wakes to see a stop
+		_reap(false);
+		if (!sock || mStop) continue;
+
+		auto c = std::make_unique<conn>();
+		c->sock = std::move(sock);
+		conn& added = *c;
+		{
+			std::lock_guard<std::mutex> lk(mMtx);
+			mConns.emplace_back(std::move(c));
+		}
+		++mNumFarms;
+		added.thr = std::thread([this, &added]() { _serve(added); });
+	}
+	_reap(true);
+}
+
+void Node::stop()
+{
+	mStop = true;
+	std::lock_guard<std::mutex> lk(mMtx);
+	for (std::unique_ptr<conn>& c : mConns) {
+		c->cancel.request(); // its tools are killed
+		c->sock->shutdown();
+	}
+}
+
+void Node::_reap(bool all)
+{
+	std::list<std::unique_ptr<conn>> over;
+	{
+		std::lock_guard<std::mutex> lk(mMtx);
+		for (auto it = mConns.begin(); it != mConns.end(); ) {
+			if (all || (*it)->done) {
+				over.splice(over.end(), mConns, it++);
+			} else {
+				++it;
+			}
+		}
+	}
+	for (std::unique_ptr<conn>& c : over) { // joined unlocked, the last thing they do is lock
+		if (c->thr.joinable()) c->thr.join();
+	}
+}
+
+void Node::_serve(conn& c)
+{
+	try {
+		if (_hello(c)) {
+			while (!mStop) {
+				uint8_t type = 0;
+				string payload;
+				if (!c.sock->receive(type, payload, BEAT_MS)) continue; // between jobs, for as long as the farm likes
+				if (type != _code(msg::JOB)) throw std::runtime_error("Expected a job.");
+				_runJob(c, decode(payload));
+			}
+		}
+	} catch (const Socket::error&) {
+		// The farm went away, or this node is stopping.
+	} catch (const std::exception& e) {
+		try {
+			c.sock->send(_code(msg::FAIL), encode({{"error", e.what()}})); // a confused farm is told, then dropped
+		} catch (const std::exception&) { }
+	}
+	if (c.hasSlot) {
+		try {
+			Sys::removeTree(Sys::joinPath(mScratch, std::to_wstring(c.slot))); // of a job cut short
+		} catch (const std::exception&) { } // the next job of the slot tries again
+	}
+
+	std::lock_guard<std::mutex> lk(mMtx);
+	if (c.hasSlot) mSlotTaken[c.slot] = false;
+	c.done = true;
+}
+
+bool Node::_hello(conn& c)
+{
+	uint8_t type = 0;
+	string payload;
+	if (!c.sock->receive(type, payload, HELLO_MS) || type != _code(msg::HELLO)) return false; // not a farm
+	fields f = decode(payload);
+
+	string refusal;
+	if (f["protocol"] != PROTOCOL) {
+		refusal = "This node speaks " + string(PROTOCOL) + ", not " + f["protocol"] + ".";
+	} else if (f["shared"] == "1" && !mOpts.shared) {
+		refusal = "This node takes no shared paths.";
+	} else {
+		std::lock_guard<std::mutex> lk(mMtx);
+		auto free = std::find(mSlotTaken.begin(), mSlotTaken.end(), false);
+		if (free == mSlotTaken.end()) {
+			refusal = "All the slots of this node are taken.";
+		} else {
+			*free = true;
+			c.slot = static_cast<size_t>(free - mSlotTaken.begin());
+			c.hasSlot = true;
+		}
+	}
+	if (!refusal.empty()) {
+		c.sock->send(_code(msg::FAIL), encode({{"error", refusal}}));
+		return false;
+	}
+	c.sock->send(_code(msg::HELLO), encode({{"protocol", PROTOCOL}, {"slots", std::to_string(mOpts.numSlots)}}));
+	return true;
+}
+
+void Node::_runJob(conn& c, const fields& job)
+{
+	// A job the farm got wrong is an error of the connection, which is dropped;
+	// one failing to convert is the farm's to report, and the next one follows.
+	clock_type::time_point t0 = clock_type::now();
+	auto field = [&job](const string& key) {
+		auto it = job.find(key);
+		return it == job.end() ? string() : it->second;
+	};
+	wstring name = Sys::fromUtf8(field("name"));
+	if (name.empty() || name == L"." || name == L".." || Sys::fileFrom(name) != name) {
+		throw std::runtime_error("Bad file name in job.");
+	}
+	string count = field("outputs");
+	size_t numOuts = count.size() <= 2 && count.find_first_not_of("0123456789") == string::npos
+		? static_cast<size_t>(std::atoi(count.c_str())) : 0;
+	if (!numOuts || numOuts > MAX_OUTPUTS) throw std::runtime_error("Bad outputs in job.");
+
+	wstring folder = Sys::joinPath(mScratch, std::to_wstring(c.slot));
+	Sys::removeTree(folder);
+	vector<Convert::output> outs;
+	for (size_t o = 0; o < numOuts; ++o) {
+		string k = std::to_string(o), ext = field("ext" + k), quality = field("quality" + k);
+		Convert::output out;
+		out.ext = ext == ".flac" ? L".flac" : ext == ".mp3" ? L".mp3" : ext == ".wav" ? L".wav" : nullptr;
+		if (!out.ext || quality.size() > 3 || quality.find_first_not_of("0123456789") != string::npos) {
+			throw std::runtime_error("Bad outputs in job."); // they go to the tools
+		}
+		out.quality = Sys::fromUtf8(quality);
+		out.isVbr = field("vbr" + k) != "0";
+		out.dest = Sys::joinPath(folder, L"o" + Sys::fromUtf8(k)); // one each, they may share an extension
+		Sys::createDir(out.dest);
+		outs.emplace_back(out);
+	}
+
+	wstring src = Sys::fromUtf8(field("path"));
+	if (!src.empty() && !mOpts.shared) throw std::runtime_error("This node takes no shared paths.");
+	if (src.empty()) { // it comes over the wire
+		src = Sys::joinPath(Sys::joinPath(folder, L"src"), name);
+		Sys::createDir(Sys::folderFrom(src));
+		file_ptr fp(Sys::openFile(src, "wb"), fclose);
+		if (!fp) throw std::runtime_error("Failed to write:\n" + Sys::toUtf8(src));
+		for (;;) {
+			uint8_t type = 0;
+			string data;
+			if (!c.sock->receive(type, data, STALL_MS)) throw Socket::error("Farm stalled sending " + Sys::toUtf8(name) + ".");
+			if (type == _code(msg::END)) break;
+			if (type != _code(msg::DATA)) throw std::runtime_error("Expected the source.");
+			if (fwrite(data.data(), 1, data.size(), fp.get()) != data.size()) {
+				throw std::runtime_error("Failed to write:\n" + Sys::toUtf8(src));
+			}
+		}
+		if (fclose(fp.release()) != 0) throw std::runtime_error("Failed to write:\n" + Sys::toUtf8(src));
+	}
+
+	// Converted on this thread, with the tools of this slot, while another
+	// one beats; if the farm is gone, the tools are killed.
+	fields done;
+	string error, errText;
+	int exitCode = 0;
+	double cpu0 = mPolicy->cpuSecs(c.slot), threadCpu0 = Sys::threadCpuSecs();
+	std::mutex beatMtx;
+	std::condition_variable beatCv;
+	bool converting = true;
+	std::thread beater([&]() {
+		std::unique_lock<std::mutex> lk(beatMtx);
+		while (!beatCv.wait_for(lk, std::chrono::milliseconds(BEAT_MS), [&converting]() { return !converting; })) {
+			try {
+				c.sock->send(_code(msg::BEAT), string());
+			} catch (const Socket::error&) {
+				c.cancel.request();
+				return;
+			}
+		}
+	});
+	try {
+		Cancel::bind bound(c.cancel);
+		ProcessPolicy::bind placed(*mPolicy, c.slot);
+		std::optional<Verify::deferred> deferred; // checked here, as the farm would
+		if (field("verify") == "1") deferred.emplace();
+		std::optional<Loudness::capture> loudness;
+		if (field("gain") == "1") loudness.emplace();
+
+		done["bytes_saved"] = std::to_string(Convert::toMany(mOpts.convOpts, src, outs, false));
+		Verify::reference ref;
+		if (deferred) ref = Verify::referenceOf(src);
+		for (const Convert::output& o : outs) {
+			wstring out = Convert::destPath(src, o.dest, o.ext);
+			if (!Sys::exists(out)) throw std::runtime_error("No output was written:\n" + Sys::toUtf8(out));
+			if (deferred) Verify::output(mOpts.convOpts, out, Probe::formatOfExtension(out), ref);
+		}
+		if (deferred) done["verified"] = "1";
+		Loudness* meter = loudness ? loudness->meter() : nullptr;
+		if (meter) {
+			Loudness::result r = meter->finish();
+			if (r.isValid()) {
+				done["track_gain"] = _num(r.gainDb());
+				done["true_peak"] = _num(r.truePeak);
+				done["blocks"] = meter->blocks().toText();
+			}
+		}
+	} catch (const Convert::tool_error& e) {
+		error = e.what();
+		exitCode = e.exitCode;
+		errText = e.errText;
+	} catch (const std::exception& e) {
+		error = e.what();
+	}
+	{
+		std::lock_guard<std::mutex> lk(beatMtx);
+		converting = false;
+	}
+	beatCv.notify_all();
+	beater.join();
+	mPolicy->charge(c.slot, Sys::threadCpuSecs() - threadCpu0);
+	double cpuSecs = mPolicy->cpuSecs(c.slot) - cpu0;
+
+	if (!error.empty()) {
+		// The paths of the farm mean something there, not these.
+		auto swap = [&error](const wstring& path, const string& theirs) {
+			string ours = Sys::toUtf8(path);
+			if (theirs.empty()) return;
+			for (size_t pos = 0; (pos = error.find(ours, pos)) != string::npos; pos += theirs.size()) {
+				error.replace(pos, ours.size(), theirs);
+			}
+		};
+		swap(src, field("origin"));
+		for (size_t o = 0; o < outs.size(); ++o) {
+			swap(Convert::destPath(src, outs[o].dest, outs[o].ext), field("dest" + std::to_string(o)));
+		}
+		fields fail = {{"error", error}, {"stderr", errText}};
+		if (exitCode) fail["exit_code"] = std::to_string(exitCode);
+		c.sock->send(_code(msg::FAIL), encode(fail));
+	} else {
+		string buf(DATA_SZ, '\0');
+		for (size_t o = 0; o < outs.size(); ++o) {
+			wstring out = Convert::destPath(src, outs[o].dest, outs[o].ext);
+			file_ptr fp(Sys::openFile(out, "rb"), fclose);
+			if (!fp) throw std::runtime_error("Failed to read:\n" + Sys::toUtf8(out));
+			c.sock->send(_code(msg::OUTPUT), encode({{"index", std::to_string(o)},
+				{"size", std::to_string(Sys::fileSize(out))}}));
+			Md5 md5;
+			for (size_t n; (n = fread(&buf[0], 1, buf.size(), fp.get())) > 0; ) {
+				md5.update(buf.data(), n);
+				c.sock->send(_code(msg::DATA), buf.data(), n);
+			}
+			c.sock->send(_code(msg::END), encode({{"md5", Md5::hex(md5.finish())}})); // the farm hashes what it got
+		}
+		done["secs"] = _num(std::chrono::duration<double>(clock_type::now() - t0).count());
+		done["cpu"] = _num(cpuSecs);
+		c.sock->send(_code(msg::DONE), encode(done));
+	}
+	Sys::removeTree(folder);
+
+	if (error.empty()) {
+		++mNumDone;
+	} else {
+		++mNumFailed;
+	}
+	if (mOnJobDone) {
+		mOnJobDone(c.sock->peer(), name, error, std::chrono::duration<double>(clock_type::now() - t0).count());
+	}
+}
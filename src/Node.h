@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Cancel.h"
+#include "Convert.h"
+#include "ProcessPolicy.h"
+#include "Socket.h"
+
+// Converts files for the farms of other machines, until stopped. Each
+// connection is a slot, running one job at a time with the tools of this
+// machine: the source comes over the wire, or by a path on storage both
+// share, and the outputs go back the same way, checked here if the farm
+// checks its own. While a job runs a beat goes out each second, so the farm
+// tells a long file from a node gone.
+class Node final {
+public:
+	struct options final {
+		std::string host, port; // host empty is all interfaces
+		size_t      numSlots = 0; // jobs at once, 0 is one per core
+		bool        shared = false; // also takes sources by path, from storage it shares with the farms
+		Convert::options       convOpts;
+		ProcessPolicy::options policy;
+	};
+
+	// On each connection, the farm sends HELLO, then for each job JOB, and
+	// its source as DATA up to END, unless shared. The node answers HELLO,
+	// or FAIL; for each job BEAT while converting, then each output as
+	// OUTPUT, DATA up to END, and DONE, or FAIL instead.
+	enum class msg : uint8_t { HELLO = 1, JOB, DATA, END, BEAT, OUTPUT, DONE, FAIL };
+	static const char* const PROTOCOL;
+	static const char* const DEFAULT_PORT;
+	static const unsigned    BEAT_MS = 1000;
+	static const size_t      DATA_SZ = 256 * 1024; // of each DATA message
+
+	// All payloads but DATA are key=value lines.
+	using fields = std::map<std::string, std::string>;
+	static std::string encode(const fields& f);
+	static fields      decode(const std::string& payload); // throws runtime_error
+
+	using job_done_func = std::function<void(const std::string& farm, const std::wstring& file,
+		const std::string& error, double secs)>; // called from the connections
+
+private:
+	struct conn final {
+		std::unique_ptr<Socket> sock;
+		std::thread       thr;
+		Cancel            cancel; // of its job, when the farm goes or the node stops
+		size_t            slot = 0;
+		bool              hasSlot = false;
+		std::atomic<bool> done{false};
+	};
+
+	options        mOpts;
+	std::wstring   mScratch; // sources and outputs while converting, a folder per slot
+	std::unique_ptr<Socket> mListener;
+	std::unique_ptr<ProcessPolicy> mPolicy; // slots as its workers
+	job_done_func  mOnJobDone;
+	std::atomic<bool> mStop{false};
+	std::mutex     mMtx;
+	std::vector<bool> mSlotTaken;
+	std::list<std::unique_ptr<conn>> mConns;
+	std::atomic<size_t> mNumDone{0}, mNumFailed{0}, mNumFarms{0};
+
+public:
+	explicit Node(const options& opts); // listens at once; throws if it can't
+	Node(const Node&) = delete;
+	Node& operator=(const Node&) = delete;
+	~Node();
+
+	void   run(job_done_func onJobDone); // until stop(), on the calling thread
+	void   stop(); // from any thread; the running jobs are cancelled
+	size_t numSlots() const { return mOpts.numSlots; }
+	size_t numDone() const { return mNumDone; } // converted and sent back
+	size_t numFailed() const { return mNumFailed; }
+	size_t numConnections() const { return mNumFarms; } // so far
+
+private:
+	void _serve(conn& c);
+	bool _hello(conn& c);
+	void _runJob(conn& c, const fields& job);
+	void _reap(bool all);
+};
@@ -0,0 +1,193 @@
+#include "Probe.h"
+#include <cstring>
+#include "MappedFile.h"
+#include "Sys.h"
+using std::wstring;
+
+static const size_t HEAD_SZ = 16 * 1024; // headers, once past an ID3v2 tag
+static const uint32_t STREAMED_WAV_SZ = 0x7ffff000; // data sizes from here up are placeholders
+
+static uint32_t be32(const uint8_t* p) { return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint32_t le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+static uint16_t le16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+
+Probe::info Probe::read(const wstring& path)
+{
+	// Only the head is mapped, so a big file costs the same as a small one.
+	info i;
+	MappedFile file;
+	if (!file.open(path)) return i;
+	i.fileSize = file.size();
+	if (!i.fileSize) {
+		i.problem = "File is empty.";
+		return i;
+	}
+
+	size_t len = HEAD_SZ;
+	const uint8_t* buf = file.view(0, len);
+	uint64_t base = id3v2Size(buf, len); // tagged MP3 and FLAC files, often with cover art
+	if (base) {
+		len = HEAD_SZ;
+		buf = file.view(base, len); // past the tag, nothing if the tag is cut short
+		if (!buf) {
+			i.problem = "File is truncated.";
+			return i;
+		}
+	}
+
+	if (_readFlac(buf, len, i)) {
+		i.fmt = format::FLAC;
+	} else if (_readWav(buf, len, i)) {
+		i.fmt = format::WAV;
+	} else if (_readMp3(buf, len, base, i)) {
+		i.fmt = format::MP3;
+	}
+
+	format named = formatOfExtension(path);
+	if (i.fmt != format::UNKNOWN && named != format::UNKNOWN && i.fmt != named) {
+		i.problem = Sys::toUtf8(std::wstring(L"File holds ") + formatName(i.fmt)
+			+ L" audio, not " + formatName(named) + L".");
+	}
+	return i;
+}
+
+const wchar_t* Probe::formatName(format fmt)
+{
+	switch (fmt) {
+	case format::WAV:  return L"WAV";
+	case format::FLAC: return L"FLAC";
+	case format::MP3:  return L"MP3";
+	default:           return L"";
+	}
+}
+
+Probe::format Probe::formatOfExtension(const wstring& path)
+{
+	return Sys::hasExtension(path, L".flac") ? format::FLAC
+		: Sys::hasExtension(path, L".wav") ? format::WAV
+		: Sys::hasExtension(path, L".mp3") ? format::MP3 : format::UNKNOWN;
+}
+
+bool Probe::readMp3Frame(const uint8_t* h, mp3_frame& f)
+{
+	static const unsigned BITRATES[2][16] = { // kbps, layer III
+		{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}, // MPEG-1
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}, // MPEG-2 and 2.5
+	};
+	static const unsigned RATES[3] = {44100, 48000, 32000};
+
+	if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0) return false;
+	unsigned version = (h[1] >> 3) & 0x03; // 3 = MPEG-1, 2 = MPEG-2, 0 = MPEG-2.5
+	unsigned layer = (h[1] >> 1) & 0x03;
+	unsigned bitrateIdx = h[2] >> 4, rateIdx = (h[2] >> 2) & 0x03;
+	if (version == 1 || layer != 1 || bitrateIdx == 0 || bitrateIdx == 15 || rateIdx == 3) return false;
+
+	bool isMpeg1 = version == 3;
+	f.sampleRate = RATES[rateIdx] >> (isMpeg1 ? 0 : version == 2 ? 1 : 2);
+	f.channels = (h[3] >> 6) == 3 ? 1 : 2;
+	f.samplesPerFrame = isMpeg1 ? 1152 : 576;
+	f.sideInfoLen = isMpeg1 ? (f.channels == 1 ? 17 : 32) : (f.channels == 1 ? 9 : 17);
+	f.kbps = BITRATES[isMpeg1 ? 0 : 1][bitrateIdx];
+	f.len = (isMpeg1 ? 144000 : 72000) * f.kbps / f.sampleRate
+		+ ((h[2] >> 1) & 0x01); // padding byte
+	return true;
+}
+
+size_t Probe::id3v2Size(const uint8_t* buf, size_t len)
+{
+	if (len < 10 || memcmp(buf, "ID3", 3) != 0) return 0;
+	size_t sz = ((buf[6] & 0x7f) << 21) | ((buf[7] & 0x7f) << 14) | ((buf[8] & 0x7f) << 7) | (buf[9] & 0x7f);
+	return 10 + sz + ((buf[5] & 0x10) ? 10 : 0); // syncsafe size, plus footer
+}
+
+bool Probe::_readFlac(const uint8_t* buf, size_t len, info& i)
+{
+	if (4 + 4 + 34 > len || memcmp(buf, "fLaC", 4) != 0) return false;
+	const uint8_t* si = buf + 8; // STREAMINFO is always the first block
+
+	i.sampleRate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+	i.channels = ((si[12] >> 1) & 0x07) + 1;
+	i.bitsPerSample = (((si[12] & 0x01) << 4) | (si[13] >> 4)) + 1;
+	uint64_t totalSamples = (static_cast<uint64_t>(si[13] & 0x0f) << 32) | be32(si + 14);
+	if (i.sampleRate) i.durationSecs = static_cast<double>(totalSamples) / i.sampleRate;
+	return true;
+}
+
+bool Probe::_readWav(const uint8_t* buf, size_t len, info& i)
+{
+	if (len < 12 || (memcmp(buf, "RIFF", 4) != 0 && memcmp(buf, "RF64", 4) != 0)
+		|| memcmp(buf + 8, "WAVE", 4) != 0) return false;
+
+	uint32_t byteRate = 0;
+	for (size_t off = 12; off + 8 <= len; ) {
+		uint32_t chunkSz = le32(buf + off + 4);
+		if (!memcmp(buf + off, "fmt ", 4) && off + 8 + 16 <= len) {
+			i.channels = le16(buf + off + 10);
+			i.sampleRate = le32(buf + off + 12);
+			byteRate = le32(buf + off + 16);
+			i.bitsPerSample = le16(buf + off + 22);
+		} else if (!memcmp(buf + off, "data", 4)) {
+			uint64_t dataSz = chunkSz;
+			if (off + 8 + dataSz > i.fileSize) {
+				// Streamed files leave a placeholder there, never fixed; a real
+				// size past the end means the file was cut short.
+				if (chunkSz != 0 && chunkSz < STREAMED_WAV_SZ) i.problem = "File is truncated.";
+				dataSz = i.fileSize > off + 8 ? i.fileSize - off - 8 : 0;
+			}
+			if (byteRate) i.durationSecs = static_cast<double>(dataSz) / byteRate;
+			return true;
+		}
+		off += 8 + chunkSz + (chunkSz & 1); // chunks are word-aligned
+	}
+	return true; // a WAV, though its data chunk is beyond the head
+}
+
+bool Probe::_readMp3(const uint8_t* buf, size_t len, uint64_t base, info& i)
+{
+	for (size_t off = 0; off + 4 <= len; ++off) { // first valid layer III frame header
+		const uint8_t* h = buf + off;
+		mp3_frame f, next;
+		if (!readMp3Frame(h, f)) continue;
+		// A sync word alone turns up in any binary file; the next frame must follow
+		// where this one says it ends, with the same version, layer and rate.
+		const uint8_t* n = h + f.len;
+		if (off + f.len + 4 <= len && (!readMp3Frame(n, next) || ((n[1] ^ h[1]) & 0xfe) || ((n[2] ^ h[2]) & 0x0c))) continue;
+
+		i.sampleRate = f.sampleRate;
+		i.channels = f.channels;
+		unsigned samplesPerFrame = f.samplesPerFrame;
+		uint64_t audioOff = base + off;
+		uint64_t audioSz = i.fileSize > audioOff ? i.fileSize - audioOff : 0;
+
+		// VBR files carry the frame count in a Xing/Info or VBRI header, in the first
+		// frame; Xing may also carry the byte count, which a cut file falls short of.
+		size_t xingOff = off + 4 + f.sideInfoLen;
+		if (xingOff + 8 <= len
+			&& (!memcmp(buf + xingOff, "Xing", 4) || !memcmp(buf + xingOff, "Info", 4)))
+		{
+			uint32_t flags = be32(buf + xingOff + 4);
+			size_t fieldOff = xingOff + 8;
+			uint32_t numFrames = 0;
+			if ((flags & 0x01) && fieldOff + 4 <= len) {
+				numFrames = be32(buf + fieldOff);
+				fieldOff += 4;
+			}
+			if ((flags & 0x02) && fieldOff + 4 <= len && be32(buf + fieldOff) > audioSz) {
+				i.problem = "File is truncated.";
+			}
+			if (numFrames) {
+				i.durationSecs = static_cast<double>(numFrames) * samplesPerFrame / i.sampleRate;
+				return true;
+			}
+		}
+		size_t vbriOff = off + 4 + 32;
+		if (vbriOff + 18 <= len && !memcmp(buf + vbriOff, "VBRI", 4)) {
+			i.durationSecs = static_cast<double>(be32(buf + vbriOff + 14)) * samplesPerFrame / i.sampleRate;
+			return true;
+		}
+
+		i.durationSecs = static_cast<double>(audioSz) * 8 / (f.kbps * 1000.0); // CBR: audio bytes over the bitrate
+		return true;
+	}
+	return false;
+}
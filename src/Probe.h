@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Format and length of an audio file, read from its headers alone: cheap
+// enough to run over a whole batch before dispatching it, and independent
+// of the codec libraries. The format comes from the content, so a file
+// named after the wrong one is caught before a tool chokes on it.
+struct Probe final {
+private:
+	Probe() = delete;
+
+public:
+	enum class format { UNKNOWN = 0, WAV, FLAC, MP3 };
+
+	struct info final {
+		format   fmt = format::UNKNOWN; // not one of ours, or unreadable
+		unsigned sampleRate = 0, channels = 0, bitsPerSample = 0; // 0 if unknown
+		double   durationSecs = 0; // 0 if unknown
+		uint64_t fileSize = 0;
+		std::string problem; // why it can't be converted as named: empty, truncated or mislabeled
+	};
+
+	// Of an MPEG audio layer III frame, from its 4-byte header.
+	struct mp3_frame final {
+		size_t   len = 0; // bytes, header included
+		unsigned sampleRate = 0, channels = 0, samplesPerFrame = 0, kbps = 0;
+		size_t   sideInfoLen = 0; // between the header and the main data, where a Xing header goes
+	};
+
+	static info read(const std::wstring& path); // never throws, unknown fields are left zeroed
+	static const wchar_t* formatName(format fmt);
+	static format formatOfExtension(const std::wstring& path);
+	static bool   readMp3Frame(const uint8_t* h, mp3_frame& f); // false if not a layer III frame header
+	static size_t id3v2Size(const uint8_t* buf, size_t len); // 0 if there's no tag
+
+private:
+	static bool   _readFlac(const uint8_t* buf, size_t len, info& i);
+	static bool   _readWav(const uint8_t* buf, size_t len, info& i);
+	static bool   _readMp3(const uint8_t* buf, size_t len, uint64_t base, info& i);
+};
@@ -0,0 +1,406 @@
+
+#include "Process.h"
+#include "Cancel.h"
+#include "ProcessPolicy.h"
+#include "Sys.h"
+#include <stdexcept>
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+using std::runtime_error;
+using std::string;
+using std::vector;
+using std::wstring;
+
+static const size_t ERR_PIPE_SZ = 64 * 1024;
+static const size_t ERR_TAIL_SZ = 4096; // of each tool's stderr, for the error report
+
+#ifdef _WIN32
+
+const Process::handle Process::NO_HANDLE = nullptr;
+
+Process::pipe::pipe(size_t bufSize)
+{
+	SECURITY_ATTRIBUTES sa{};
+	sa.nLength = sizeof(sa);
+	sa.bInheritHandle = FALSE; // the child end is made inheritable only while spawning
+
+	if (!CreatePipe(&hRead, &hWrite, &sa, static_cast<DWORD>(bufSize))) {
+		throw runtime_error("CreatePipe failed, error " + std::to_string(GetLastError()) + ".");
+	}
+}
+
+size_t Process::pipe::read(void* buf, size_t len)
+{
+	DWORD numRead = 0;
+	if (!ReadFile(hRead, buf, static_cast<DWORD>(len), &numRead, nullptr)) {
+		return 0; // ERROR_BROKEN_PIPE: writer is gone
+	}
+	return numRead;
+}
+
+bool Process::pipe::write(const void* buf, size_t len)
+{
+	const char* p = static_cast<const char*>(buf);
+	while (len) {
+		DWORD numWritten = 0;
+		if (!WriteFile(hWrite, p, static_cast<DWORD>(len), &numWritten, nullptr)) {
+			return false;
+		}
+		p += numWritten;
+		len -= numWritten;
+	}
+	return true;
+}
+
+void Process::pipe::closeRead()
+{
+	if (hRead) {
+		CloseHandle(hRead);
+		hRead = nullptr;
+	}
+}
+
+void Process::pipe::closeWrite()
+{
+	if (hWrite) {
+		CloseHandle(hWrite);
+		hWrite = nullptr;
+	}
+}
+
+void Process::start(const vector<wstring>& argv, handle hStdIn, handle hStdOut, bool captureErr)
+{
+	if (isRunning()) {
+		throw std::logic_error("Process already started.");
+	}
+	handle hStdErr = _beginCapture(captureErr);
+
+	SECURITY_ATTRIBUTES sa{};
+	sa.nLength = sizeof(sa);
+	sa.bInheritHandle = TRUE;
+	HANDLE hNul = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr); // for streams not redirected
+
+	STARTUPINFOEXW si{};
+	si.StartupInfo.cb = sizeof(si);
+	si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+	si.StartupInfo.hStdInput = hStdIn ? hStdIn : hNul;
+	si.StartupInfo.hStdOutput = hStdOut ? hStdOut : hNul;
+	si.StartupInfo.hStdError = hStdErr ? hStdErr : hNul;
+
+	// Other workers are spawning at the same time, so the child must inherit
+	// exactly its own handles; a stray pipe end would prevent EOF elsewhere.
+	vector<HANDLE> inherited = {hNul};
+	if (hStdIn) inherited.emplace_back(hStdIn);
+	if (hStdOut) inherited.emplace_back(hStdOut);
+	if (hStdErr) inherited.emplace_back(hStdErr);
+	for (HANDLE h : inherited) {
+		SetHandleInformation(h, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+	}
+
+	SIZE_T attrSz = 0;
+	InitializeProcThreadAttributeList(nullptr, 1, 0, &attrSz);
+	vector<BYTE> attrBuf(attrSz);
+	si.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(&attrBuf[0]);
+	InitializeProcThreadAttributeList(si.lpAttributeList, 1, 0, &attrSz);
+	UpdateProcThreadAttribute(si.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+		&inherited[0], inherited.size() * sizeof(HANDLE), nullptr, nullptr);
+
+	mPolicy = ProcessPolicy::current(mWorker);
+	DWORD policyFlags = mPolicy ? mPolicy->creationFlags() : 0;
+
+	wstring cmdLine = formatCmdLine(argv); // CreateProcess may write into this buffer
+	BOOL ok = CreateProcessW(nullptr, &cmdLine[0], nullptr, nullptr, TRUE,
+		CREATE_NO_WINDOW | EXTENDED_STARTUPINFO_PRESENT | policyFlags, nullptr, nullptr,
+		&si.StartupInfo, &mPi);
+	DWORD err = GetLastError();
+
+	DeleteProcThreadAttributeList(si.lpAttributeList);
+	for (HANDLE h : inherited) {
+		SetHandleInformation(h, HANDLE_FLAG_INHERIT, 0);
+	}
+	CloseHandle(hNul);
+
+	if (!ok) {
+		mPi = {};
+		mErrPipe.reset();
+		throw runtime_error("Failed to run, error " + std::to_string(err) + ":\n"
+			+ Sys::toUtf8(formatCmdLine(argv)));
+	}
+	if (mPolicy) mPolicy->adopt(mPi.hProcess, mWorker);
+	if (policyFlags & CREATE_SUSPENDED) ResumeThread(mPi.hThread); // grouped before it can spawn anything
+	CloseHandle(mPi.hThread);
+	mPi.hThread = nullptr;
+	_endCapture();
+	_enlist();
+}
+
+int Process::wait()
+{
+	if (!isRunning()) return 0;
+
+	WaitForSingleObject(mPi.hProcess, INFINITE);
+	_discharge(); // our handle keeps the id, but nobody needs to kill it anymore
+	DWORD exitCode = 0;
+	GetExitCodeProcess(mPi.hProcess, &exitCode);
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (GetProcessTimes(mPi.hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser)) {
+		auto ticks = [](const FILETIME& ft) { return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime; };
+		mCpuSecs = (ticks(ftKernel) + ticks(ftUser)) / 1e7; // 100 ns units
+	}
+	if (mPolicy) mPolicy->charge(mWorker, mCpuSecs);
+	CloseHandle(mPi.hProcess);
+	mPi = {};
+	if (mErrThr.joinable()) mErrThr.join(); // the pipe ends when the tool does
+	mErrPipe.reset();
+	return static_cast<int>(exitCode);
+}
+
+void Process::kill()
+{
+	if (isRunning()) {
+		TerminateProcess(mPi.hProcess, 1);
+	}
+}
+
+#else
+
+const Process::handle Process::NO_HANDLE = -1;
+
+Process::pipe::pipe(size_t bufSize)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0) { // children get only the end dup'ed onto their stdin/stdout
+		throw runtime_error(string("pipe failed, ") + strerror(errno) + ".");
+	}
+	hRead = fds[0];
+	hWrite = fds[1];
+#ifdef F_SETPIPE_SZ
+	fcntl(hWrite, F_SETPIPE_SZ, static_cast<int>(bufSize)); // best effort, capped by the system
+#else
+	(void)bufSize;
+#endif
+
+	// A reader that dies must surface as a failed write, not kill the whole program.
+	static bool sigPipeIgnored = (signal(SIGPIPE, SIG_IGN), true);
+	(void)sigPipeIgnored;
+}
+
+size_t Process::pipe::read(void* buf, size_t len)
+{
+	for (;;) {
+		ssize_t n = ::read(hRead, buf, len);
+		if (n >= 0) return static_cast<size_t>(n);
+		if (errno != EINTR) return 0;
+	}
+}
+
+bool Process::pipe::write(const void* buf, size_t len)
+{
+	const char* p = static_cast<const char*>(buf);
+	while (len) {
+		ssize_t n = ::write(hWrite, p, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false; // EPIPE: reader is gone
+		}
+		p += n;
+		len -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+void Process::pipe::closeRead()
+{
+	if (hRead != NO_HANDLE) {
+		close(hRead);
+		hRead = NO_HANDLE;
+	}
+}
+
+void Process::pipe::closeWrite()
+{
+	if (hWrite != NO_HANDLE) {
+		close(hWrite);
+		hWrite = NO_HANDLE;
+	}
+}
+
+void Process::start(const vector<wstring>& argv, handle hStdIn, handle hStdOut, bool captureErr)
+{
+	if (isRunning()) {
+		throw std::logic_error("Process already started.");
+	}
+	handle hStdErr = _beginCapture(captureErr);
+
+	vector<string> args;
+	vector<char*> cargs;
+	for (const wstring& arg : argv) {
+		args.emplace_back(Sys::toUtf8(arg));
+	}
+	for (string& arg : args) {
+		cargs.emplace_back(&arg[0]);
+	}
+	cargs.emplace_back(nullptr);
+
+	int nul = open("/dev/null", O_RDWR | O_CLOEXEC); // for streams not redirected
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, hStdIn != NO_HANDLE ? hStdIn : nul, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, hStdOut != NO_HANDLE ? hStdOut : nul, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, hStdErr != NO_HANDLE ? hStdErr : nul, STDERR_FILENO);
+
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t defSigs;
+	sigemptyset(&defSigs);
+	sigaddset(&defSigs, SIGPIPE); // we ignore it, the tools expect the default
+	posix_spawnattr_setsigdefault(&attr, &defSigs);
+	sigset_t noSigs;
+	sigemptyset(&noSigs);
+	posix_spawnattr_setsigmask(&attr, &noSigs); // the command line blocks some, to wait for them on a thread
+	posix_spawnattr_setpgroup(&attr, 0); // its own, so whatever it spawns is killed with it
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+	pid_t pid = 0;
+	int err = posix_spawnp(&pid, cargs[0], &fa, &attr, &cargs[0], environ); // bare names are searched in PATH
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (nul >= 0) close(nul);
+
+	if (err) {
+		mErrPipe.reset();
+		throw runtime_error(string("Failed to run, ") + strerror(err) + ":\n"
+			+ Sys::toUtf8(formatCmdLine(argv)));
+	}
+	mPid = pid;
+	mPolicy = ProcessPolicy::current(mWorker);
+	if (mPolicy) mPolicy->adopt(pid, mWorker);
+	_endCapture();
+	_enlist();
+}
+
+int Process::wait()
+{
+	if (!isRunning()) return 0;
+
+	siginfo_t info;
+	while (waitid(P_PID, mPid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) { } // exited, not reaped yet
+	_discharge(); // before the id can be reused
+
+	int status = 0;
+	rusage usage{};
+	while (wait4(mPid, &status, 0, &usage) < 0 && errno == EINTR) { }
+	mPid = 0;
+	mCpuSecs = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	if (mPolicy) mPolicy->charge(mWorker, mCpuSecs);
+	if (mErrThr.joinable()) mErrThr.join(); // the pipe ends when the tool does
+	mErrPipe.reset();
+	if (WIFSIGNALED(status)) return 128 + WTERMSIG(status); // same convention as the shells
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+void Process::kill()
+{
+	if (isRunning()) {
+		::kill(-mPid, SIGKILL); // the group it leads
+	}
+}
+
+#endif
+
+Process::~Process()
+{
+	if (isRunning()) { // never leave an orphan behind
+		kill();
+		wait();
+	}
+}
+
+Process::handle Process::_beginCapture(bool captureErr)
+{
+	mErrText.clear();
+	if (!captureErr) return NO_HANDLE;
+	mErrPipe = std::make_unique<pipe>(ERR_PIPE_SZ);
+	return mErrPipe->hWrite;
+}
+
+void Process::_endCapture()
+{
+	// Child is running: our copy of its stderr goes, so EOF comes when it
+	// exits; the tools write little there, only the tail is kept.
+	if (!mErrPipe) return;
+	mErrPipe->closeWrite();
+	mErrThr = std::thread([this]() {
+		char buf[4096];
+		for (size_t n; (n = mErrPipe->read(buf, sizeof(buf))) > 0; ) {
+			mErrText.append(buf, n);
+			if (mErrText.size() > 2 * ERR_TAIL_SZ) mErrText.erase(0, mErrText.size() - ERR_TAIL_SZ);
+		}
+		if (mErrText.size() > ERR_TAIL_SZ) mErrText.erase(0, mErrText.size() - ERR_TAIL_SZ);
+	});
+}
+
+void Process::_enlist()
+{
+	Cancel* cancel = Cancel::current();
+	if (!cancel) return;
+	if (cancel->enlist(this)) {
+		mCancel = cancel;
+	} else {
+		kill(); // cancelled while spawning, wait() reaps it
+	}
+}
+
+void Process::_discharge()
+{
+	if (mCancel) {
+		mCancel->discharge(this);
+		mCancel = nullptr;
+	}
+}
+
+wstring Process::formatCmdLine(const vector<wstring>& argv)
+{
+	// Quoting follows the rules of CommandLineToArgvW(), which the C runtime
+	// of the tools uses to split the arguments back; on POSIX the result is
+	// only used in messages.
+	wstring cmdLine;
+	for (const wstring& arg : argv) {
+		if (!cmdLine.empty()) cmdLine.append(L" ");
+
+		if (!arg.empty() && arg.find_first_of(L" \t\"") == wstring::npos) {
+			cmdLine.append(arg);
+			continue;
+		}
+
+		cmdLine.append(L"\"");
+		size_t numBackslashes = 0;
+		for (wchar_t ch : arg) {
+			if (ch == L'\\') {
+				++numBackslashes;
+			} else if (ch == L'"') {
+				cmdLine.append(numBackslashes + 1, L'\\'); // escape the preceding backslashes and the quote
+				numBackslashes = 0;
+			} else {
+				numBackslashes = 0;
+			}
+			cmdLine.push_back(ch);
+		}
+		cmdLine.append(numBackslashes, L'\\'); // backslashes before the closing quote are doubled
+		cmdLine.append(L"\"");
+	}
+	return cmdLine;
+}
@@ -0,0 +1,83 @@
+
+#pragma once
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#endif
+
+class Cancel;
+class ProcessPolicy;
+
+// Child process whose standard streams can be redirected to pipes. Started
+// on a thread bound to a Cancel, it's killed when that Cancel is requested;
+// bound to a ProcessPolicy, it runs and is accounted as that says. On POSIX
+// it leads its own process group, killed whole.
+class Process final {
+public:
+#ifdef _WIN32
+	using handle = HANDLE;
+#else
+	using handle = int;
+#endif
+	static const handle NO_HANDLE;
+
+	// Anonymous pipe; each end is closed when no longer needed, or at destruction.
+	struct pipe final {
+		handle hRead = NO_HANDLE, hWrite = NO_HANDLE;
+
+		explicit pipe(size_t bufSize);
+		pipe(const pipe&) = delete;
+		pipe& operator=(const pipe&) = delete;
+		~pipe() { closeRead(); closeWrite(); }
+
+		size_t read(void* buf, size_t len); // returns 0 at end of stream
+		bool   write(const void* buf, size_t len); // false if the reader is gone
+		void   closeRead();
+		void   closeWrite();
+	};
+
+private:
+#ifdef _WIN32
+	PROCESS_INFORMATION mPi{};
+#else
+	pid_t mPid = 0;
+#endif
+	std::unique_ptr<pipe> mErrPipe; // when stderr is captured, drained by its own thread
+	std::thread           mErrThr;
+	std::string           mErrText;
+	Cancel*               mCancel = nullptr; // enlisted there while running
+	ProcessPolicy*        mPolicy = nullptr; // charged with its CPU time
+	size_t                mWorker = 0;
+	double                mCpuSecs = 0;
+
+public:
+	Process() = default;
+	Process(const Process&) = delete;
+	Process& operator=(const Process&) = delete;
+	~Process();
+
+	void start(const std::vector<std::wstring>& argv,
+		handle hStdIn = NO_HANDLE, handle hStdOut = NO_HANDLE, bool captureErr = false);
+	int  wait();
+	void kill();
+	const std::string& errText() const { return mErrText; } // tail of the captured stderr, after wait()
+	double cpuSecs() const { return mCpuSecs; } // user plus kernel, after wait()
+#ifdef _WIN32
+	bool isRunning() const { return mPi.hProcess != nullptr; }
+#else
+	bool isRunning() const { return mPid != 0; }
+#endif
+
+	static std::wstring formatCmdLine(const std::vector<std::wstring>& argv);
+
+private:
+	handle _beginCapture(bool captureErr);
+	void   _endCapture();
+	void   _enlist();
+	void   _discharge();
+};
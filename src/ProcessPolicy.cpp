@@ -0,0 +1,186 @@
+#include "ProcessPolicy.h"
+#include "Sys.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+static thread_local ProcessPolicy* tlPolicy = nullptr;
+static thread_local size_t tlWorker = 0;
+
+ProcessPolicy::bind::bind(ProcessPolicy& p, size_t worker)
+	: mPrev(tlPolicy), mPrevWorker(tlWorker)
+{
+	tlPolicy = &p;
+	tlWorker = worker;
+	p._placeThread(p._cpusOf(worker, false));
+}
+
+ProcessPolicy::bind::~bind()
+{
+	tlPolicy = mPrev;
+	tlWorker = mPrevWorker;
+}
+
+ProcessPolicy::ProcessPolicy(const options& opts, size_t numWorkers, size_t numLocal)
+	: mOpts(opts), mNumWorkers(numWorkers), mNumLocal(numLocal ? numLocal : numWorkers), mCpuUs(std::make_unique<std::atomic<uint64_t>[]>(numWorkers))
+{
+	for (size_t w = 0; w < mNumWorkers; ++w) mCpuUs[w] = 0;
+	if (mOpts.pinCores) {
+		mCores = Sys::physicalCores();
+		if (mCores.size() < 2) mCores.clear(); // nowhere else to go
+	}
+
+#ifdef _WIN32
+	// Each tool is assigned as it starts, suspended, so whatever it spawns
+	// is in the job too. Failing that, the tools just run ungrouped.
+	mJob = CreateJobObjectW(nullptr, nullptr);
+	if (mJob) {
+		JOBOBJECT_EXTENDED_LIMIT_INFORMATION li{};
+		li.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+		SetInformationJobObject(mJob, JobObjectExtendedLimitInformation, &li, sizeof(li));
+		if (mOpts.cpuPercent && mOpts.cpuPercent < 100) {
+			JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cr{};
+			cr.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+			cr.CpuRate = mOpts.cpuPercent * 100; // in hundredths of a percent
+			SetInformationJobObject(mJob, JobObjectCpuRateControlInformation, &cr, sizeof(cr));
+		}
+	}
+#endif
+}
+
+ProcessPolicy::~ProcessPolicy()
+{
+#ifdef _WIN32
+	if (mJob) CloseHandle(mJob); // kills what's left, nothing after the batch was waited for
+#endif
+}
+
+ProcessPolicy* ProcessPolicy::current(size_t& worker)
+{
+	worker = tlWorker;
+	return tlPolicy;
+}
+
+void ProcessPolicy::placeHelper(size_t worker) const
+{
+	_placeThread(_cpusOf(worker, true));
+}
+
+std::vector<unsigned> ProcessPolicy::_cpusOf(size_t worker, bool wholeShare) const
+{
+	if (mCores.empty()) return {};
+	std::vector<unsigned> cpus;
+	for (size_t c = worker % mCores.size(); c < mCores.size(); c += mNumLocal) { // wrapped around, a worker keeps its own only
+		cpus.insert(cpus.end(), mCores[c].begin(), mCores[c].end());
+		if (!wholeShare || !mNumLocal) break;
+	}
+	return cpus;
+}
+
+#ifdef _WIN32
+
+static DWORD_PTR _maskOf(const std::vector<unsigned>& cpus)
+{
+	DWORD_PTR mask = 0;
+	for (unsigned cpu : cpus) mask |= static_cast<DWORD_PTR>(1) << cpu;
+	return mask;
+}
+
+DWORD ProcessPolicy::creationFlags() const
+{
+	DWORD flags = mJob ? CREATE_SUSPENDED : 0;
+	if (mOpts.prio == priority::LOW) flags |= BELOW_NORMAL_PRIORITY_CLASS;
+	if (mOpts.prio == priority::IDLE) flags |= IDLE_PRIORITY_CLASS;
+	return flags;
+}
+
+void ProcessPolicy::adopt(HANDLE hProcess, size_t worker)
+{
+	if (mJob) AssignProcessToJobObject(mJob, hProcess);
+	if (!mCores.empty()) SetProcessAffinityMask(hProcess, _maskOf(_cpusOf(worker, false)));
+}
+
+void ProcessPolicy::_placeThread(const std::vector<unsigned>& cpus) const
+{
+	if (!cpus.empty()) SetThreadAffinityMask(GetCurrentThread(), _maskOf(cpus));
+	if (mOpts.prio == priority::LOW) SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+	if (mOpts.prio == priority::IDLE) SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+}
+
+#else
+
+static int _niceOf(ProcessPolicy::priority prio)
+{
+	switch (prio) {
+	case ProcessPolicy::priority::LOW:  return 10;
+	case ProcessPolicy::priority::IDLE: return 19;
+	default:                            return 0;
+	}
+}
+
+static void _renice(id_t id, int nice)
+{
+	// Only ever lowered: raising it back needs privileges we don't have.
+	errno = 0;
+	int cur = getpriority(PRIO_PROCESS, id);
+	if (errno == 0 && cur < nice) setpriority(PRIO_PROCESS, id, nice);
+}
+
+void ProcessPolicy::adopt(pid_t pid, size_t worker)
+{
+	// The child runs already, placed a moment late; both survive its exec.
+	if (mOpts.prio != priority::NORMAL) _renice(static_cast<id_t>(pid), _niceOf(mOpts.prio));
+#ifdef __linux__
+	if (!mCores.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned cpu : _cpusOf(worker, false)) CPU_SET(cpu, &set);
+		sched_setaffinity(pid, sizeof(set), &set);
+	}
+#else
+	(void)worker;
+#endif
+}
+
+void ProcessPolicy::_placeThread(const std::vector<unsigned>& cpus) const
+{
+#ifdef __linux__
+	// Linux schedules threads apart, so only the calling one moves; the
+	// threads it starts later inherit it, hence placeHelper.
+	pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+	if (mOpts.prio != priority::NORMAL) _renice(static_cast<id_t>(tid), _niceOf(mOpts.prio));
+	if (!cpus.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned cpu : cpus) CPU_SET(cpu, &set);
+		sched_setaffinity(tid, sizeof(set), &set);
+	}
+#else
+	(void)cpus; // elsewhere these would move the whole process
+#endif
+}
+
+#endif
+
+void ProcessPolicy::charge(size_t worker, double cpuSecs)
+{
+	if (worker < mNumWorkers) mCpuUs[worker] += static_cast<uint64_t>(cpuSecs * 1e6);
+}
+
+double ProcessPolicy::cpuSecs(size_t worker) const
+{
+	return worker < mNumWorkers ? mCpuUs[worker] / 1e6 : 0;
+}
+
+std::vector<double> ProcessPolicy::cpuSecs() const
+{
+	std::vector<double> secs(mNumWorkers);
+	for (size_t w = 0; w < mNumWorkers; ++w) secs[w] = mCpuUs[w] / 1e6;
+	return secs;
+}
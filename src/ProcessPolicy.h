@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#endif
+
+// How the tools of a batch share the machine: their priority, the physical
+// core each worker's tools are pinned to, so no two encoders fight on sibling
+// hyperthreads, and one group holding them all. Bound per thread like Cancel,
+// with the worker running there; it also totals the CPU time of each worker,
+// its tools included.
+class ProcessPolicy final {
+public:
+	enum class priority { NORMAL = 0, LOW, IDLE }; // below normal and idle classes; nice 10 and 19 on POSIX
+
+	struct options final {
+		priority prio = priority::NORMAL;
+		bool     pinCores = false; // worker N on physical core N, wrapping around
+		unsigned cpuPercent = 0;   // of the machine, all tools together; 0 is no limit, Windows only
+	};
+
+	// Jobs running on the calling thread run their tools under this policy,
+	// as the given worker, while in scope. The thread itself is placed too,
+	// for the in-process codecs; workers are never given back a higher priority.
+	class bind final {
+	private:
+		ProcessPolicy* mPrev;
+		size_t         mPrevWorker;
+
+	public:
+		bind(ProcessPolicy& p, size_t worker);
+		bind(const bind&) = delete;
+		bind& operator=(const bind&) = delete;
+		~bind();
+	};
+
+private:
+	options mOpts;
+	std::vector<std::vector<unsigned>> mCores; // logical CPUs of each physical one, when pinning
+	size_t  mNumWorkers;
+	size_t  mNumLocal; // the first workers, whose jobs run on this machine
+	std::unique_ptr<std::atomic<uint64_t>[]> mCpuUs; // per worker
+#ifdef _WIN32
+	HANDLE  mJob = nullptr; // its tools die with it, even if we crash
+#endif
+
+public:
+	ProcessPolicy(const options& opts, size_t numWorkers, size_t numLocal = 0); // 0 is all of them
+	ProcessPolicy(const ProcessPolicy&) = delete;
+	ProcessPolicy& operator=(const ProcessPolicy&) = delete;
+	~ProcessPolicy();
+
+	static ProcessPolicy* current(size_t& worker); // of the calling thread, or null
+
+	// For Process: the creation flags, and the placement of a child just
+	// started; on Windows it's still suspended, and resumed after.
+#ifdef _WIN32
+	DWORD creationFlags() const;
+	void  adopt(HANDLE hProcess, size_t worker);
+#else
+	void  adopt(pid_t pid, size_t worker);
+#endif
+	void  charge(size_t worker, double cpuSecs);
+
+	// For the threads a job starts itself, the pool of a long FLAC encode:
+	// placed as their worker, but over its whole share of the cores, every
+	// numLocal-th physical one from its own; they'd all crowd on that one else.
+	void  placeHelper(size_t worker) const;
+
+	double              cpuSecs(size_t worker) const; // so far
+	std::vector<double> cpuSecs() const; // of each worker
+
+private:
+	std::vector<unsigned> _cpusOf(size_t worker, bool wholeShare) const; // empty if not pinning
+	void _placeThread(const std::vector<unsigned>& cpus) const;
+};
@@ -0,0 +1,935 @@
+#include "Runner.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include "Dedupe.h"
+#include "Probe.h"
+#include "Sys.h"
+#include "Verify.h"
+using std::vector;
+using std::wstring;
+using clock_type = std::chrono::steady_clock;
+
+static const size_t PROBE_CHUNK = 64; // files probed by each job, before dispatching
+static const std::chrono::seconds TUNE_PERIOD(2), TUNE_MAX_WINDOW(60); // for the auto worker count
+static const std::chrono::seconds RETRY_FIRST_DELAY(1), RETRY_MAX_DELAY(30); // doubled on each attempt
+static const size_t RETRY_QUEUE_MAX = 1024; // beyond that, something is broken for good
+
+Runner::~Runner()
+{
+	_stopTune();
+	_stopRetry();
+	mScheduler.reset(); // join the workers before the options go away
+}
+
+void Runner::start(file_done_func onFileDone)
+{
+	mOnFileDone = std::move(onFileDone);
+	mTime0 = clock_type::now();
+	mFileSecs.assign(mOpts.files.size(), -1); // negative for the ones not converted
+	mAttempts.assign(mOpts.files.size(), 0);
+	mOutputs = outputs(mOpts);
+	if (mOpts.useCache && !mOpts.delSrc) { // deleted sources can't come back unchanged
+		mSettingsKeys = _settingsKeys();
+	}
+	if (!mOpts.journalPath.empty()) {
+		mJournal = std::make_unique<Journal>(mOpts.journalPath, batchKey(mOpts));
+		for (const wstring& src : mJournal->interrupted()) {
+			_removeLeftovers(src); // the run was killed along with its tools
+		}
+	}
+	if (_tagsGain()) {
+		mAlbumOf.assign(mOpts.files.size(), nullptr);
+		for (size_t i = 0; i < mOpts.files.size(); ++i) {
+			std::unique_ptr<album>& a = mAlbums[Sys::folderFrom(Sys::absolutePath(mOpts.files[i]))];
+			if (!a) a = std::make_unique<album>();
+			++a->filesLeft;
+			mAlbumOf[i] = a.get();
+		}
+	}
+
+	size_t numFiles = mOpts.files.size();
+	if (!mOpts.telemetryCsv.empty() || !mOpts.telemetryJson.empty() || !mOpts.telemetryTrace.empty()) {
+		mTelemetry = std::make_unique<Telemetry>(numFiles);
+	}
+	if (!mOpts.remote.nodes.empty()) {
+		// Local workers as many as asked, or one per core, never tuned: a
+		// tuned count would park the slots of the nodes, which come after.
+		mFarm = std::make_unique<Farm>(mOpts.remote);
+		if (!mFarm->numSlots()) {
+			std::string why;
+			for (const Farm::node_stats& n : mFarm->stats()) why += "\n" + n.problem;
+			throw std::runtime_error("No node could be reached:" + why);
+		}
+		mLocalWorkers = mOpts.numThreads ? mOpts.numThreads : Sys::numProcessors();
+		mScheduler = std::make_unique<Scheduler>(mLocalWorkers + mFarm->numSlots());
+	} else if (mOpts.numThreads) {
+		mScheduler = std::make_unique<Scheduler>(std::min(mOpts.numThreads, numFiles)); // limit parallel processing
+	} else {
+		// Auto: start with one per core. Tools waiting on the disk leave room
+		// for more, so up to twice that many threads are kept, parked.
+		size_t numCores = Sys::numProcessors();
+		size_t maxWorkers = std::max<size_t>(std::min(2 * numCores, numFiles), 1);
+		mScheduler = std::make_unique<Scheduler>(maxWorkers);
+		mTune = std::make_unique<AutoTune>(1, maxWorkers, std::min(numCores, maxWorkers));
+		mScheduler->setActiveLimit(mTune->level());
+		mTuneThr = std::thread([this]() { _tuneLoop(); });
+	}
+	// A long FLAC encode splits over the cores the other workers leave, not
+	// all of them: with every worker on one, that's still a thread per core.
+	size_t numLocal = mFarm ? mLocalWorkers : mScheduler->activeLimit();
+	mConvOpts = mOpts.convOpts;
+	if (!mConvOpts.parallelFlacThreads) {
+		mConvOpts.parallelFlacThreads = static_cast<unsigned>(std::max<size_t>(Sys::numProcessors() / numLocal, 1));
+	}
+	DeviceGate::limits lim;
+	lim.maxJobs = mOpts.diskJobs;
+	lim.maxBytesPerSec = mOpts.diskMBps * 1024.0 * 1024;
+	mGate = std::make_unique<DeviceGate>(lim);
+	if (mOpts.retries || mOpts.diskMBps) { // throttled files wait there too
+		mRetryThr = std::thread([this]() { _retryLoop(); });
+	}
+
+	mNumWorkers = mScheduler->numWorkers();
+	mCurrent = std::make_unique<std::atomic<size_t>[]>(mNumWorkers);
+	for (size_t w = 0; w < mNumWorkers; ++w) mCurrent[w] = NO_FILE;
+	mPolicy = std::make_unique<ProcessPolicy>(mOpts.policy, mNumWorkers, numLocal); // the nodes' slots come after
+
+	size_t numChunks = (numFiles + PROBE_CHUNK - 1) / PROBE_CHUNK;
+	if (!numChunks) {
+		mScheduler->close();
+		return;
+	}
+
+	// Headers are read on the workers too, so a big batch doesn't hold the
+	// caller; the last probe to finish dispatches the actual conversions.
+	mCosts.assign(numFiles, 0);
+	mProblems.assign(numFiles, std::string());
+	mUses.assign(numFiles, {});
+	if (mOpts.dedupe) mDupKeys.assign(numFiles, std::string());
+	mProbesLeft = numChunks;
+	for (size_t c = 0; c < numChunks; ++c) {
+		mScheduler->submit([this, c, numFiles](size_t) {
+			for (size_t i = c * PROBE_CHUNK; i < numFiles && i < (c + 1) * PROBE_CHUNK; ++i) {
+				Probe::info info = Probe::read(mOpts.files[i]);
+				mCosts[i] = estimateCost(mOpts.files[i], info);
+				if (mOpts.dedupe) mDupKeys[i] = Dedupe::headerKey(info);
+				mProblems[i] = std::move(info.problem);
+				_findDevices(i, info);
+			}
+			if (--mProbesLeft == 0) _probed();
+		});
+	}
+}
+
+void Runner::cancel()
+{
+	mCancel.request(); // files already running are stopped, not failed
+	_stopRetry(); // the ones waiting are dropped
+	if (mScheduler) mScheduler->cancel();
+}
+
+void Runner::wait()
+{
+	if (mScheduler) mScheduler->join();
+	_stopTune();
+	_stopRetry();
+}
+
+size_t Runner::numWorkersChosen()
+{
+	std::lock_guard<std::mutex> lk(mTuneMtx);
+	if (mTune) return mTune->chosen();
+	return mScheduler ? mScheduler->numWorkers() : 0;
+}
+
+void Runner::exportTelemetry() const
+{
+	if (!mTelemetry) return;
+	if (!mOpts.telemetryCsv.empty()) mTelemetry->writeCsv(mOpts.telemetryCsv);
+	if (!mOpts.telemetryJson.empty()) mTelemetry->writeJson(mOpts.telemetryJson);
+	if (!mOpts.telemetryTrace.empty()) mTelemetry->writeTrace(mOpts.telemetryTrace);
+}
+
+vector<double> Runner::workerCpuSecs() const
+{
+	return mPolicy ? mPolicy->cpuSecs() : vector<double>();
+}
+
+double Runner::elapsedSecs() const
+{
+	return std::chrono::duration<double>(clock_type::now() - mTime0).count();
+}
+
+Runner::progress Runner::snapshot() const
+{
+	progress p;
+	p.numDone = mFilesDone;
+	p.numFailed = mFilesFailed;
+	p.bytesIn = mBytesIn;
+	p.audioDone = mAudioDoneMs / 1000.0;
+	p.audioTotal = mAudioTotalMs / 1000.0;
+	p.elapsedSecs = elapsedSecs();
+	p.current.reserve(mNumWorkers);
+	for (size_t w = 0; w < mNumWorkers; ++w) {
+		p.current.emplace_back(mCurrent[w].load());
+	}
+	return p;
+}
+
+vector<Runner::file_result> Runner::failures() const
+{
+	std::lock_guard<std::mutex> lk(mFailuresMtx);
+	vector<file_result> sorted = mFailures;
+	std::sort(sorted.begin(), sorted.end(),
+		[](const file_result& a, const file_result& b) { return a.index < b.index; });
+	return sorted;
+}
+
+double Runner::latencySecs(double percentile) const
+{
+	// Nearest rank, so p99 of a small batch is its slowest file.
+	vector<double> secs;
+	std::copy_if(mFileSecs.begin(), mFileSecs.end(), std::back_inserter(secs),
+		[](double s) { return s >= 0; });
+	if (secs.empty()) return 0;
+	size_t rank = static_cast<size_t>(std::ceil(percentile / 100 * secs.size()));
+	rank = std::min(std::max<size_t>(rank, 1), secs.size()) - 1;
+	std::nth_element(secs.begin(), secs.begin() + rank, secs.end());
+	return secs[rank];
+}
+
+uint64_t Runner::convert(const runnin_options& opts, const wstring& file)
+{
+	if (opts.targetType == target::NONE) return 0;
+	return Convert::toMany(opts.convOpts, file, outputs(opts), opts.delSrc);
+}
+
+vector<Convert::output> Runner::outputs(const runnin_options& opts)
+{
+	Convert::output main;
+	main.ext = targetExt(opts.targetType);
+	main.quality = opts.quality;
+	main.isVbr = opts.isVbr;
+	main.dest = opts.destFolder;
+	vector<Convert::output> outs = {main};
+	outs.insert(outs.end(), opts.moreOutputs.begin(), opts.moreOutputs.end());
+	return outs;
+}
+
+const wchar_t* Runner::targetExt(target targetType)
+{
+	switch (targetType) {
+	case target::MP3:  return L".mp3";
+	case target::FLAC: return L".flac";
+	case target::WAV:  return L".wav";
+	default:           return L"";
+	}
+}
+
+double Runner::estimateCost(const wstring& file, const Probe::info& i)
+{
+	// Encoding time follows the audio length; when the headers don't tell
+	// it, guess from the size at a typical rate of each format.
+	if (i.durationSecs > 0) return i.durationSecs;
+
+	return static_cast<double>(i.fileSize) / bytesPerSec(Sys::hasExtension(file, L".mp3") ? L".mp3"
+		: Sys::hasExtension(file, L".flac") ? L".flac" : L".wav");
+}
+
+double Runner::bytesPerSec(const wchar_t* ext)
+{
+	if (Sys::hasExtension(ext, L".mp3")) return 24000;
+	if (Sys::hasExtension(ext, L".flac")) return 100000;
+	return 176400; // CD audio
+}
+
+void Runner::_probed()
+{
+	if (!mOpts.dedupe) {
+		_dispatch();
+		return;
+	}
+	// Only the files whose headers match another's are hashed, each on a job
+	// of its own; the last one groups them, and dispatches. Files replaced in
+	// place by their outputs are left out, they have nothing to share.
+	std::map<std::string, vector<size_t>> byHeader;
+	for (size_t i = 0; i < mOpts.files.size(); ++i) {
+		const wstring& src = mOpts.files[i];
+		bool inPlace = std::any_of(mOutputs.begin(), mOutputs.end(), [&src](const Convert::output& o) {
+			return Sys::isSamePath(src, Convert::destPath(src, o.dest, o.ext));
+		});
+		if (!mDupKeys[i].empty() && !inPlace) byHeader[mDupKeys[i]].emplace_back(i);
+	}
+	vector<size_t> toHash;
+	for (const auto& same : byHeader) {
+		if (same.second.size() > 1) toHash.insert(toHash.end(), same.second.begin(), same.second.end());
+	}
+	vector<std::string> headerKeys;
+	headerKeys.swap(mDupKeys);
+	mDupKeys.assign(mOpts.files.size(), std::string()); // unique unless hashed alike
+	if (toHash.empty()) {
+		_dispatch();
+		return;
+	}
+
+	mHashesLeft = toHash.size();
+	for (size_t i : toHash) {
+		mScheduler->submit([this, i, key = headerKeys[i]](size_t) {
+			std::string content = Dedupe::contentKey(mOpts.files[i]);
+			if (!content.empty()) mDupKeys[i] = key + " " + content;
+			if (--mHashesLeft == 0) {
+				_groupDuplicates();
+				_dispatch();
+			}
+		});
+	}
+}
+
+void Runner::_groupDuplicates()
+{
+	std::map<std::string, vector<size_t>> groups;
+	for (size_t i = 0; i < mDupKeys.size(); ++i) {
+		if (!mDupKeys[i].empty()) groups[mDupKeys[i]].emplace_back(i);
+	}
+	mLeaderOf.assign(mOpts.files.size(), NO_FILE);
+	auto decodeRank = [this](size_t i) { // a WAV needs no decoding at all, FLAC decodes faster than MP3
+		const wstring& f = mOpts.files[i];
+		return Sys::hasExtension(f, L".wav") ? 0 : Sys::hasExtension(f, L".flac") ? 1 : 2;
+	};
+	for (const auto& g : groups) {
+		if (g.second.size() < 2) continue;
+		// Same audio, so the same length: the cheapest to decode leads.
+		size_t leader = *std::min_element(g.second.begin(), g.second.end(), [&](size_t a, size_t b) {
+			int ra = decodeRank(a), rb = decodeRank(b);
+			return ra != rb ? ra < rb : mCosts[a] < mCosts[b];
+		});
+		for (size_t i : g.second) {
+			if (i == leader) continue;
+			mLeaderOf[i] = leader;
+			mFollowers[leader].emplace_back(i);
+			mCosts[i] = 0; // no work of its own, not in the estimate
+		}
+	}
+}
+
+vector<size_t> Runner::dispatchOrder(const vector<double>& costs, const vector<uint64_t>& devices)
+{
+	// Longest first, so no long file is left alone at the end while the other
+	// workers idle. Submitted round-robin, each worker's deque stays sorted:
+	// owners pop their longest, thieves take the shortest from the back.
+	vector<size_t> order(costs.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&costs](size_t a, size_t b) {
+		return costs[a] > costs[b];
+	});
+
+	// Taken in turns from each source disk, so all of them start at once,
+	// instead of one being drained while the others idle. Each disk still
+	// goes longest first.
+	std::map<uint64_t, std::deque<size_t>> byDevice;
+	for (size_t i : order) {
+		byDevice[devices[i]].emplace_back(i);
+	}
+	if (byDevice.size() < 2) return order;
+	order.clear();
+	while (!byDevice.empty()) {
+		for (auto it = byDevice.begin(); it != byDevice.end(); ) {
+			order.emplace_back(it->second.front());
+			it->second.pop_front();
+			it = it->second.empty() ? byDevice.erase(it) : std::next(it);
+		}
+	}
+	return order;
+}
+
+void Runner::_dispatch()
+{
+	uint64_t totalMs = 0;
+	for (double cost : mCosts) {
+		totalMs += static_cast<uint64_t>(cost * 1000); // rounded as each file takes it out
+	}
+	mAudioTotalMs = totalMs;
+
+	vector<uint64_t> devices(mOpts.files.size(), 0);
+	if (mGate->numDevices() > 1) {
+		for (size_t i = 0; i < devices.size(); ++i) {
+			if (!mUses[i].empty()) devices[i] = mUses[i].front().device;
+		}
+	}
+	vector<size_t> order = dispatchOrder(mCosts, devices);
+	if (!mFollowers.empty()) { // submitted when their leader is done
+		order.erase(std::remove_if(order.begin(), order.end(),
+			[this](size_t i) { return mLeaderOf[i] != NO_FILE; }), order.end());
+	}
+
+	for (size_t i : order) {
+		if (mTelemetry) mTelemetry->queued(i);
+		_submit(i);
+	}
+	// Not closed yet: files may come back for another attempt. The last
+	// file to finish closes the scheduler.
+}
+
+void Runner::_submit(size_t index)
+{
+	mScheduler->submit([this, index](size_t worker) {
+		_processFile(index, worker);
+	});
+}
+
+void Runner::_processFile(size_t index, size_t worker)
+{
+	if (mCancel.requested()) return; // taken by the worker just before the cancel
+	if (!_admit(index)) return; // back when its disks have room
+	Cancel::bind bound(mCancel); // the tools of this file are killed on cancel
+	ProcessPolicy::bind placed(*mPolicy, worker);
+	double cpu0 = mPolicy->cpuSecs(worker), threadCpu0 = Sys::threadCpuSecs();
+
+	auto f = std::make_shared<converted>(); // shared with its verifying job, if any
+	f->index = index;
+	f->src = mOpts.files[index];
+	f->t0 = clock_type::now();
+	file_result& res = f->res;
+	res.index = index;
+	res.attempts = ++mAttempts[index]; // only one worker has this file at a time
+	const wstring& src = f->src;
+	if (mTelemetry) mTelemetry->begin(index, src, worker);
+	mCurrent[worker] = index;
+	std::optional<Loudness::capture> loudness; // the PCM is measured where the conversion has it anyway
+	if (!mAlbumOf.empty()) loudness.emplace();
+	std::optional<Verify::deferred> deferred; // checked on a job of its own, while the next file converts
+	if (mOpts.verify) deferred.emplace();
+	bool lost = false; // with the node converting it
+
+	try {
+		res.resumed = mJournal && mJournal->isFinished(src); // its source may be gone since
+		if (res.resumed) {
+			res.cacheState = ConvCache::state::UP_TO_DATE;
+		} else if (!mProblems[index].empty()) { // a tool would fail on it, or worse, convert half of it
+			throw std::runtime_error(mProblems[index] + "\n" + Sys::toUtf8(src));
+		}
+		// Each output is looked up on its own; only the ones not up to date
+		// are converted, still from a single decoding.
+		f->caches.assign(mOutputs.size(), nullptr);
+		bool hasFp = false;
+		for (size_t o = 0; o < mOutputs.size(); ++o) {
+			f->destPaths.emplace_back(Convert::destPath(src, mOutputs[o].dest, mOutputs[o].ext));
+			f->cacheKeys.emplace_back(o ? src + L"|" + mOutputs[o].ext : src); // outputs may share a folder, and its cache
+			ConvCache::state state = res.resumed ? ConvCache::state::UP_TO_DATE : ConvCache::state::NEW;
+			if (!res.resumed && !mSettingsKeys.empty() && !Sys::isSamePath(src, f->destPaths[o])) { // sources replaced in place change each run
+				f->caches[o] = _cacheFor(Sys::folderFrom(f->destPaths[o]));
+				if (!hasFp) f->fp = ConvCache::fingerprintOf(src, mOpts.cacheHash);
+				hasFp = true;
+				state = f->caches[o]->lookup(f->cacheKeys[o], f->fp, mSettingsKeys[o], f->destPaths[o]);
+			}
+			if (state != ConvCache::state::UP_TO_DATE) f->pending.emplace_back(o);
+			if (state == ConvCache::state::STALE) res.cacheState = state;
+		}
+		if (f->pending.empty()) res.cacheState = ConvCache::state::UP_TO_DATE;
+
+		if (res.cacheState != ConvCache::state::UP_TO_DATE) {
+			f->srcSize = Sys::fileSize(src); // source may be deleted
+			if (mJournal) mJournal->started(src);
+			bool linked = !mLeaderOf.empty() && mLeaderOf[index] != NO_FILE && _linkOutputs(*f, mLeaderOf[index]);
+			if (!linked) {
+				vector<Convert::output> outs;
+				for (size_t o : f->pending) outs.emplace_back(mOutputs[o]);
+				if (mFarm && worker >= mLocalWorkers) { // a slot of a node
+					size_t slot = worker - mLocalWorkers;
+					res.node = mFarm->nodeName(slot);
+					Farm::result r = mFarm->convert(slot, src, outs, mOpts.delSrc && !mOpts.verify);
+					res.bytesSaved = r.bytesSaved;
+					mPolicy->charge(worker, r.cpuSecs); // its tools ran there
+					f->checked = r.verified;
+					f->gain = r.gain;
+					f->blocks = r.blocks;
+				} else {
+					res.bytesSaved = Convert::toMany(mConvOpts, src, outs, mOpts.delSrc && !mOpts.verify);
+				}
+			}
+			f->outPaths = f->destPaths;
+			if (mOpts.verify && !linked) {
+				f->unverified = true;
+				for (size_t o : f->pending) {
+					wstring out = Verify::pendingPath(src, f->destPaths[o]);
+					if (Sys::exists(out)) f->outPaths[o] = out; // else a WAV left where it was
+				}
+			}
+			for (size_t o : f->pending) {
+				if (mTune || mTelemetry) f->destSize += Sys::fileSize(f->outPaths[o]);
+			}
+			Loudness* meter = loudness ? loudness->meter() : nullptr;
+			if (meter) {
+				Telemetry::add(Telemetry::stage::ANALYZE, meter->secs());
+				Loudness::result r = meter->finish();
+				if (r.isValid()) {
+					f->gain.emplace();
+					f->gain->trackGain = r.gainDb();
+					f->gain->trackPeak = r.truePeak;
+					f->blocks = meter->blocks();
+				}
+			}
+			if (!mOpts.verify || linked) _finishOutputs(*f);
+
+			if (mTune && !linked) {
+				double ioBytes = static_cast<double>(f->srcSize + f->destSize);
+				double secs = std::chrono::duration<double>(clock_type::now() - f->t0).count();
+				std::lock_guard<std::mutex> lk(mTuneMtx);
+				mWinCost += mCosts[index];
+				mWinBytes += ioBytes;
+				mWinWork += secs;
+				++mWinJobs;
+			}
+		}
+	} catch (const Farm::lost_error& e) {
+		res.error = e.what();
+		lost = true;
+	} catch (const Convert::tool_error& e) {
+		res.error = e.what();
+		res.exitCode = e.exitCode;
+		res.errText = e.errText;
+	} catch (const std::exception& e) {
+		res.error = e.what();
+	}
+
+	mCurrent[worker] = NO_FILE;
+	mPolicy->charge(worker, Sys::threadCpuSecs() - threadCpu0); // in-process codecs, and the waiting
+	if (mTelemetry) mTelemetry->addCpu(index, mPolicy->cpuSecs(worker) - cpu0);
+	for (size_t parked : mGate->leave(mUses[index])) {
+		_submit(parked); // parked behind this one
+	}
+	if (lost && !mCancel.requested()) {
+		// Not the file's fault: it goes to the next worker free, as if it
+		// never started, and the slot goes on only if its node comes back.
+		if (mTelemetry) mTelemetry->end(index, f->srcSize, 0, "reassigned");
+		--mAttempts[index];
+		++mReassigned;
+		if (!mFarm->reconnect(worker - mLocalWorkers)) mScheduler->retire(worker);
+		if (mTelemetry) mTelemetry->queued(index);
+		mScheduler->submit([this, index](size_t w) { _processFile(index, w); }, true);
+		return;
+	}
+	if (f->unverified && res.error.empty()) {
+		// Checked by the next worker free, ahead of the files not started,
+		// while the others go on converting.
+		if (mTelemetry) Telemetry::detach();
+		mScheduler->submit([this, f](size_t w) { _verifyFile(*f, w); }, true);
+		return;
+	}
+	f->removeUnverified();
+	_finishFile(*f);
+}
+
+void Runner::_verifyFile(converted& f, size_t worker)
+{
+	if (mCancel.requested()) return; // its outputs go with it
+	Cancel::bind bound(mCancel);
+	ProcessPolicy::bind placed(*mPolicy, worker);
+	double cpu0 = mPolicy->cpuSecs(worker), threadCpu0 = Sys::threadCpuSecs();
+	if (mTelemetry) mTelemetry->resume(f.index);
+	mCurrent[worker] = f.index;
+
+	try {
+		Telemetry::scope verifying(Telemetry::stage::VERIFY);
+		if (!f.checked) { // else by the node which converted it, before sending it here
+			Verify::reference ref = Verify::referenceOf(f.src);
+			for (size_t o : f.pending) {
+				if (Sys::isSamePath(f.outPaths[o], f.src)) continue; // nothing was written
+				Verify::output(mConvOpts, f.outPaths[o], Probe::formatOfExtension(f.destPaths[o]), ref);
+			}
+		}
+		verifying.end();
+
+		// Only now final: outputs in place of their source, then tags and the
+		// cache, and the source last.
+		bool replacesSrc = false;
+		for (size_t o : f.pending) {
+			replacesSrc = replacesSrc || Sys::isSamePath(f.destPaths[o], f.src);
+			if (f.outPaths[o] == f.destPaths[o]) continue;
+			Telemetry::scope replacing(Telemetry::stage::DELETE);
+			Sys::replaceFile(f.outPaths[o], f.destPaths[o]);
+			f.outPaths[o] = f.destPaths[o];
+		}
+		f.unverified = false;
+		_finishOutputs(f);
+		if (mOpts.delSrc && !replacesSrc) {
+			Telemetry::scope deleting(Telemetry::stage::DELETE);
+			Sys::removeFile(f.src);
+		}
+	} catch (const Convert::tool_error& e) {
+		f.res.error = e.what();
+		f.res.exitCode = e.exitCode;
+		f.res.errText = e.errText;
+	} catch (const std::exception& e) {
+		f.res.error = e.what();
+	}
+	f.removeUnverified();
+
+	mCurrent[worker] = NO_FILE;
+	mPolicy->charge(worker, Sys::threadCpuSecs() - threadCpu0);
+	if (mTelemetry) mTelemetry->addCpu(f.index, mPolicy->cpuSecs(worker) - cpu0);
+	_finishFile(f);
+}
+
+void Runner::_finishOutputs(converted& f)
+{
+	// Tags first, since the cache records the size with them.
+	if (f.gain) {
+		Telemetry::scope tagging(Telemetry::stage::TAG);
+		album::member m;
+		m.rg = *f.gain;
+		m.fp = f.fp;
+		for (size_t o : f.pending) {
+			m.src = f.cacheKeys[o];
+			m.dest = f.destPaths[o];
+			m.cache = f.caches[o];
+			m.settings = mSettingsKeys.empty() ? 0 : mSettingsKeys[o];
+			if (Tags::writeReplayGain(m.dest, m.rg)) f.tagged.emplace_back(m); // WAV has no tags
+		}
+		f.res.hasGain = !f.tagged.empty();
+		if (f.res.hasGain) {
+			f.res.trackGain = f.gain->trackGain;
+			f.res.truePeak = f.gain->trackPeak;
+		}
+	}
+	for (size_t o : f.pending) {
+		if (f.caches[o]) f.caches[o]->record(f.cacheKeys[o], f.fp, mSettingsKeys[o], f.destPaths[o]);
+	}
+}
+
+void Runner::_finishFile(converted& f)
+{
+	size_t index = f.index;
+	file_result& res = f.res;
+	const wstring& src = f.src;
+	if (!res.error.empty() && mCancel.requested()) { // killed, and cleaned up; a resumed batch does it again
+		if (mTelemetry) mTelemetry->end(index, f.srcSize, 0, "cancelled");
+		return;
+	}
+	if (mJournal && res.error.empty() && !res.resumed) mJournal->finished(src);
+	bool retrying = !res.error.empty() && mProblems[index].empty() // same file, same problem
+		&& res.attempts <= mOpts.retries && _scheduleRetry(index);
+	if (mTelemetry) {
+		mTelemetry->end(index, f.srcSize, f.destSize, retrying ? "retried" : !res.error.empty() ? "failed"
+			: res.cacheState == ConvCache::state::UP_TO_DATE ? "skipped" : "ok");
+	}
+	if (retrying) return; // not finished yet
+	if (!mAlbumOf.empty()) {
+		try {
+			_albumFileDone(index, f.tagged, f.blocks ? &*f.blocks : nullptr);
+		} catch (const std::exception& e) { // the last file of the album takes the blame
+			if (res.error.empty()) res.error = e.what();
+		}
+	}
+
+	uint64_t costMs = static_cast<uint64_t>(mCosts[index] * 1000);
+	if (res.error.empty() && res.cacheState != ConvCache::state::UP_TO_DATE) {
+		mAudioDoneMs += costMs;
+	} else {
+		mAudioTotalMs -= costMs; // no work left there, and none done to count in the rate
+	}
+	res.secs = std::chrono::duration<double>(clock_type::now() - f.t0).count();
+	if (!res.error.empty()) {
+		std::lock_guard<std::mutex> lk(mFailuresMtx);
+		mFailures.emplace_back(res);
+		++mFilesFailed;
+	} else if (res.cacheState == ConvCache::state::UP_TO_DATE) {
+		++mFilesSkipped;
+	} else if (res.cacheState == ConvCache::state::STALE) {
+		++mFilesInvalidated;
+	}
+	if (res.error.empty() && res.cacheState != ConvCache::state::UP_TO_DATE) {
+		mFileSecs[index] = res.secs;
+		mBytesIn += f.srcSize;
+		mBytesSaved += res.bytesSaved;
+	}
+	auto followers = mFollowers.find(index);
+	if (followers != mFollowers.end()) { // same audio, waiting for this one
+		for (size_t i : followers->second) {
+			if (!res.error.empty()) mLeaderOf[i] = NO_FILE; // converted on its own, then
+			if (mTelemetry) mTelemetry->queued(i);
+			_submit(i);
+		}
+	}
+	res.numFinished = ++mFilesDone;
+	if (mOnFileDone) mOnFileDone(res);
+	if (res.numFinished == mOpts.files.size()) {
+		if (mJournal && !mFilesFailed) mJournal->complete(); // nothing left to resume
+		mScheduler->close(); // workers leave as soon as this job returns
+		if (mTune) {
+			std::lock_guard<std::mutex> lk(mTuneMtx);
+			mTuneStop = true; // nothing left to tune
+			mTuneCv.notify_all();
+		}
+	}
+}
+
+bool Runner::_linkOutputs(converted& f, size_t leader)
+{
+	// The outputs of the leader are final by now, verified if asked; if one
+	// is gone since, this file is converted after all.
+	const wstring& leaderSrc = mOpts.files[leader];
+	vector<wstring> from;
+	for (size_t o : f.pending) {
+		from.emplace_back(Convert::destPath(leaderSrc, mOutputs[o].dest, mOutputs[o].ext));
+		if (!Sys::exists(from.back())) return false;
+	}
+	Telemetry::scope copying(Telemetry::stage::COPY);
+	for (size_t k = 0; k < f.pending.size(); ++k) {
+		const wstring& dest = f.destPaths[f.pending[k]];
+		if (Sys::isSamePath(from[k], dest)) continue; // a FLAC and a WAV side by side make the same output
+		uint64_t size = Sys::fileSize(from[k]);
+		if (Sys::linkFile(from[k], dest)) f.res.bytesSaved += size;
+	}
+	copying.end();
+	if (mOpts.delSrc) { // never replaced in place, such files aren't grouped
+		Telemetry::scope deleting(Telemetry::stage::DELETE);
+		Sys::removeFile(f.src);
+	}
+
+	f.res.duplicateOf = leaderSrc;
+	++mDuplicates;
+	if (mFileSecs[leader] > 0) mDupSavedMs += static_cast<uint64_t>(mFileSecs[leader] * 1000); // skipped ones took nothing
+	return true;
+}
+
+void Runner::converted::removeUnverified()
+{
+	if (!unverified) return;
+	unverified = false;
+	for (size_t o : pending) {
+		try {
+			if (!Sys::isSamePath(outPaths[o], src) && Sys::exists(outPaths[o])) Sys::removeFile(outPaths[o]);
+		} catch (const std::exception&) { } // best effort, a rerun writes over it anyway
+	}
+}
+
+void Runner::_findDevices(size_t index, const Probe::info& info)
+{
+	// The intermediary WAV, when there's one, goes to the destination folder,
+	// so the source and destination disks are all a file touches.
+	wstring srcFolder = Sys::folderFrom(Sys::absolutePath(mOpts.files[index])); // a bare name has none
+	vector<DeviceGate::use>& uses = mUses[index];
+	uses.push_back({mGate->deviceOf(srcFolder), info.fileSize});
+
+	for (const Convert::output& o : mOutputs) {
+		uint64_t destBytes = static_cast<uint64_t>(mCosts[index] * bytesPerSec(o.ext));
+		uint64_t destDev = mGate->deviceOf(o.dest.empty() ? srcFolder : o.dest);
+		auto use = std::find_if(uses.begin(), uses.end(),
+			[destDev](const DeviceGate::use& u) { return u.device == destDev; });
+		if (use != uses.end()) {
+			use->bytes += destBytes;
+		} else {
+			uses.push_back({destDev, destBytes});
+		}
+	}
+}
+
+bool Runner::_admit(size_t index)
+{
+	clock_type::time_point resumeAt;
+	switch (mGate->enter(index, mUses[index], resumeAt)) {
+	case DeviceGate::verdict::ENTERED:
+		return true;
+	case DeviceGate::verdict::THROTTLED:
+		_submitAt(resumeAt, index, false); // dropped only if the batch was cancelled
+		return false;
+	default:
+		return false; // parked, a file leaving the disk brings it back
+	}
+}
+
+bool Runner::_scheduleRetry(size_t index)
+{
+	// Locked files and the like go away after a while, so the attempts are
+	// spaced out, without holding a worker meanwhile.
+	std::chrono::seconds delay = RETRY_FIRST_DELAY * (1 << std::min(mAttempts[index] - 1, 5u));
+	if (!_submitAt(clock_type::now() + std::min(delay, RETRY_MAX_DELAY), index, true)) return false;
+	++mRetries;
+	return true;
+}
+
+bool Runner::_submitAt(clock_type::time_point when, size_t index, bool capped)
+{
+	std::lock_guard<std::mutex> lk(mRetryMtx);
+	if (mRetryStop || (capped && mRetryQueue.size() >= RETRY_QUEUE_MAX)) return false;
+	mRetryQueue.emplace(when, index);
+	mRetryCv.notify_all();
+	return true;
+}
+
+void Runner::_retryLoop()
+{
+	std::unique_lock<std::mutex> lk(mRetryMtx);
+	while (!mRetryStop) {
+		if (mRetryQueue.empty()) {
+			mRetryCv.wait(lk);
+		} else if (mRetryQueue.begin()->first > clock_type::now()) {
+			mRetryCv.wait_until(lk, mRetryQueue.begin()->first);
+		} else {
+			size_t index = mRetryQueue.begin()->second;
+			mRetryQueue.erase(mRetryQueue.begin());
+			_submit(index); // batch isn't over, so the scheduler is still open
+		}
+	}
+}
+
+void Runner::_stopRetry()
+{
+	{
+		std::lock_guard<std::mutex> lk(mRetryMtx);
+		mRetryStop = true;
+	}
+	mRetryCv.notify_all();
+	if (mRetryThr.joinable()) mRetryThr.join();
+}
+
+void Runner::_tuneLoop()
+{
+	uint64_t idle0 = 0, total0 = 0;
+	bool hasCpu = Sys::cpuTimes(idle0, total0);
+	clock_type::time_point t0 = clock_type::now();
+
+	std::unique_lock<std::mutex> lk(mTuneMtx);
+	while (!mTuneStop) {
+		mTuneCv.wait_for(lk, TUNE_PERIOD);
+		if (mTuneStop) break;
+
+		// Judge only on enough finished files, or throughput is just noise.
+		clock_type::duration elapsed = clock_type::now() - t0;
+		if (mWinJobs < std::max<size_t>(mTune->level() / 2, 2) && elapsed < TUNE_MAX_WINDOW) continue;
+
+		double secs = std::chrono::duration<double>(elapsed).count();
+		AutoTune::sample s;
+		s.throughput = mWinCost / secs;
+		s.ioBytesPerSec = mWinBytes / secs;
+		s.latency = mWinCost > 0 ? mWinWork / mWinCost : 0;
+		uint64_t idle1 = 0, total1 = 0;
+		if (hasCpu && Sys::cpuTimes(idle1, total1) && total1 > total0) {
+			s.cpuUtil = 1 - static_cast<double>(idle1 - idle0) / static_cast<double>(total1 - total0);
+			idle0 = idle1;
+			total0 = total1;
+		}
+		mWinCost = mWinBytes = mWinWork = 0;
+		mWinJobs = 0;
+		t0 = clock_type::now();
+
+		mScheduler->setActiveLimit(mTune->update(s));
+	}
+}
+
+void Runner::_stopTune()
+{
+	{
+		std::lock_guard<std::mutex> lk(mTuneMtx);
+		mTuneStop = true;
+	}
+	mTuneCv.notify_all();
+	if (mTuneThr.joinable()) mTuneThr.join();
+}
+
+ConvCache* Runner::_cacheFor(const wstring& destFolder)
+{
+	std::lock_guard<std::mutex> lk(mCachesMtx); // loading a big one blocks the other workers just once
+	std::unique_ptr<ConvCache>& cache = mCaches[destFolder];
+	if (!cache) cache = std::make_unique<ConvCache>(destFolder);
+	return cache.get();
+}
+
+vector<wstring> Runner::writtenPaths(const runnin_options& opts, const wstring& src)
+{
+	// Its outputs, written in place or aside, and the intermediary WAV.
+	vector<wstring> paths;
+	for (const Convert::output& o : outputs(opts)) {
+		wstring destPath = Convert::destPath(src, o.dest, o.ext);
+		paths.insert(paths.end(), {destPath, destPath + L".tmp", destPath + L".tags"});
+		if (!Sys::hasExtension(o.ext, L".wav") && !Sys::hasExtension(src, L".wav")) {
+			paths.emplace_back(Convert::destPath(src, o.dest, L".wav"));
+		}
+	}
+	return paths;
+}
+
+void Runner::_removeLeftovers(const wstring& src) const
+{
+	// Whatever a conversion killed halfway may have left. A source already
+	// deleted means the conversion did finish, and those are all that's left of it.
+	if (!Sys::exists(src)) return;
+	for (const wstring& f : writtenPaths(mOpts, src)) {
+		try {
+			if (!Sys::isSamePath(f, src) && Sys::exists(f)) Sys::removeFile(f);
+		} catch (const std::exception&) { } // best effort, the conversion writes over it anyway
+	}
+}
+
+uint64_t Runner::batchKey(const runnin_options& opts)
+{
+	// What decides the outputs and where they go. Not the tool versions, as
+	// the cache does: a resumed batch keeps what the old ones did.
+	std::string settings = Sys::toUtf8(targetExt(opts.targetType)) + "|" + Sys::toUtf8(opts.quality)
+		+ (opts.isVbr ? "|vbr|" : "|cbr|") + Sys::toUtf8(opts.destFolder) + (opts.delSrc ? "|del" : "|keep")
+		+ (opts.replayGain ? "|rg" : "");
+	for (const Convert::output& o : opts.moreOutputs) {
+		settings += "|" + Sys::toUtf8(o.ext) + "|" + Sys::toUtf8(o.quality) + (o.isVbr ? "|vbr|" : "|cbr|")
+			+ Sys::toUtf8(o.dest);
+	}
+	return ConvCache::hashOf(settings.data(), settings.size());
+}
+
+bool Runner::_tagsGain() const
+{
+	return mOpts.replayGain && std::any_of(mOutputs.begin(), mOutputs.end(), // WAV has no tags players read
+		[](const Convert::output& o) { return !Sys::hasExtension(o.ext, L".wav"); });
+}
+
+void Runner::_albumFileDone(size_t index, const vector<album::member>& tagged, const Loudness::histogram* blocks)
+{
+	// Album gain is the loudness of all the blocks of all the tracks, so it
+	// waits for the last one; any track not measured, failed or skipped as
+	// up to date, leaves the whole album untagged.
+	album& a = *mAlbumOf[index];
+	{
+		std::lock_guard<std::mutex> lk(a.mtx);
+		if (!tagged.empty()) {
+			a.blocks.merge(*blocks);
+			a.peak = std::max(a.peak, tagged[0].rg.trackPeak);
+			a.members.insert(a.members.end(), tagged.begin(), tagged.end());
+		} else {
+			a.complete = false;
+		}
+		if (--a.filesLeft || !a.complete) return;
+	}
+
+	Loudness::result r;
+	r.lufs = a.blocks.integrated();
+	if (!r.isValid()) return;
+	for (album::member& m : a.members) {
+		m.rg.hasAlbum = true;
+		m.rg.albumGain = r.gainDb();
+		m.rg.albumPeak = a.peak;
+		Tags::writeReplayGain(m.dest, m.rg);
+		if (m.cache) m.cache->record(m.src, m.fp, m.settings, m.dest); // else it would look stale next time
+	}
+	++mAlbumsTagged;
+}
+
+vector<uint64_t> Runner::_settingsKeys() const
+{
+	// Whatever changes the output bytes: format, quality and the encoder itself.
+	const Convert::options& co = mOpts.convOpts;
+	std::string encoders = co.inProcess ? "|" + Codec::version()
+		: "|" + Convert::toolVersion(co.lame) + "|" + Convert::toolVersion(co.flac);
+	vector<uint64_t> keys;
+	for (const Convert::output& o : mOutputs) {
+		bool tagged = _tagsGain() && !Sys::hasExtension(o.ext, L".wav");
+		std::string settings = Sys::toUtf8(o.ext) + "|" + Sys::toUtf8(o.quality)
+			+ (o.isVbr ? "|vbr" : "|cbr") + (tagged ? "|rg" : "") + encoders;
+		uint64_t key = ConvCache::hashOf(settings.data(), settings.size());
+		keys.emplace_back(key ? key : 1); // 0 means no cache
+	}
+	return keys;
+}
@@ -0,0 +1,253 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "AutoTune.h"
+#include "Cancel.h"
+#include "ConvCache.h"
+#include "Convert.h"
+#include "DeviceGate.h"
+#include "Farm.h"
+#include "Journal.h"
+#include "Loudness.h"
+#include "Probe.h"
+#include "ProcessPolicy.h"
+#include "Scheduler.h"
+#include "Tags.h"
+#include "Telemetry.h"
+
+// A batch of conversions spread over the workers, shared by the dialog and
+// the command line; each one decides what to show as the files finish.
+class Runner final {
+public:
+	enum class target { NONE = 0, MP3, FLAC, WAV };
+
+	struct runnin_options final {
+		std::vector<std::wstring> files;
+		size_t                    numThreads = 0; // 0 is auto, tuned while running
+		target                    targetType = target::NONE;
+		bool                      delSrc = false;
+		bool                      isVbr = false;
+		std::wstring              quality;
+		std::wstring              destFolder;
+		Convert::options          convOpts;
+		bool                      useCache = true;   // skip files converted before, unchanged since
+		bool                      cacheHash = false; // also hash the sources, not just size and time
+		std::wstring              telemetryCsv, telemetryJson, telemetryTrace; // written by exportTelemetry(), if set
+		unsigned                  retries = 0; // more attempts for a failed file, each one later than the last
+		unsigned                  diskJobs = 0; // files at once on each disk; 0 is a few on spinning ones and shares, no limit on others
+		unsigned                  diskMBps = 0; // per disk, read plus written; 0 is no limit
+		std::wstring              journalPath; // files started and finished go there; the same batch given it again resumes
+		ProcessPolicy::options    policy; // priority, cores and limits of the tools
+		bool                      replayGain = false; // tag FLAC and MP3 outputs with the loudness measured while converting
+		std::vector<Convert::output> moreOutputs; // besides the target above, from the same decoding of each file
+		bool                      verify = true; // each output checked on a job of its own, before the source goes
+		bool                      dedupe = false; // files with the same audio are converted once, the others link the outputs
+		Farm::options             remote; // other machines converting too, a worker for each slot they offer
+	};
+
+	struct file_result final {
+		size_t      index = 0;
+		std::string error; // empty on success
+		int         exitCode = 0; // of the tool which failed, if any
+		std::string errText; // and the tail of its stderr
+		unsigned    attempts = 1;
+		double      secs = 0; // of the last attempt
+		uint64_t    bytesSaved = 0; // not written thanks to a direct path, see Convert
+		bool        resumed = false; // finished by an earlier run of the batch, so skipped
+		bool        hasGain = false; // measured and tagged
+		double      trackGain = 0, truePeak = 0; // dB, linear
+		size_t      numFinished = 0; // files finished so far, this one included
+		std::wstring duplicateOf; // converted as this other file, its outputs linked or copied; empty if not
+		std::string node; // converted there, empty if here
+		ConvCache::state cacheState = ConvCache::state::NEW; // UP_TO_DATE means it was skipped
+	};
+
+	using file_done_func = std::function<void(const file_result&)>; // called from the workers
+
+	static constexpr size_t NO_FILE = static_cast<size_t>(-1);
+
+	// What a front end samples on its own clock, instead of updating itself on each file.
+	struct progress final {
+		size_t   numDone = 0, numFailed = 0;
+		uint64_t bytesIn = 0;
+		double   audioDone = 0, audioTotal = 0; // seconds of audio, estimated; total is 0 until known
+		double   elapsedSecs = 0;
+		std::vector<size_t> current; // file index each worker is on, or NO_FILE
+	};
+
+private:
+	const runnin_options& mOpts;
+	file_done_func        mOnFileDone;
+	std::atomic<size_t>   mFilesDone{0}, mFilesFailed{0}, mFilesSkipped{0}, mFilesInvalidated{0}, mRetries{0};
+	std::atomic<uint64_t> mBytesIn{0}, mBytesSaved{0};
+	std::atomic<uint64_t> mAudioDoneMs{0}, mAudioTotalMs{0}; // of the files left to convert, failed and skipped ones out
+	std::unique_ptr<std::atomic<size_t>[]> mCurrent; // per worker
+	size_t                mNumWorkers = 0;
+	std::vector<double>   mFileSecs; // of the converted files, each written by its worker
+	mutable std::mutex    mFailuresMtx;
+	std::vector<file_result> mFailures;
+	std::chrono::steady_clock::time_point mTime0;
+	std::vector<Convert::output> mOutputs; // the target, then the others
+	std::vector<uint64_t> mSettingsKeys; // of each output, empty if there's no cache
+	std::vector<double>   mCosts; // estimated, to dispatch the longest files first
+	std::vector<std::string> mProblems; // found by the probe, such files fail without running a tool
+	std::atomic<size_t>   mProbesLeft{0};
+	std::mutex            mCachesMtx;
+	std::map<std::wstring, std::unique_ptr<ConvCache>> mCaches; // one per destination folder
+	std::unique_ptr<Scheduler> mScheduler;
+	std::unique_ptr<DeviceGate> mGate;
+	std::vector<std::vector<DeviceGate::use>> mUses; // disks each file reads and writes, found by the probe
+	std::unique_ptr<Telemetry> mTelemetry; // only if asked for
+	std::unique_ptr<Journal> mJournal;     // only if asked for
+	Cancel                mCancel; // bound to each job while it runs
+	std::unique_ptr<ProcessPolicy> mPolicy; // same, placing its tools and totalling their CPU time
+	Convert::options      mConvOpts; // as given, each long FLAC encode held to its share of the cores
+	std::unique_ptr<Farm> mFarm;   // only if asked for; its slots are the workers past the local ones
+	size_t                mLocalWorkers = 0;
+	std::atomic<size_t>   mReassigned{0};
+
+	// The files of a source folder make an album; when the last one is done,
+	// and all of them were measured, they all get its gain.
+	struct album final {
+		struct member final {
+			std::wstring src, dest; // the source as the cache knows it
+			Tags::replay_gain rg;
+			ConvCache*   cache = nullptr; // its size changes with the tags, so it's recorded again
+			ConvCache::fingerprint fp;
+			uint64_t     settings = 0;
+		};
+		std::mutex          mtx;
+		size_t              filesLeft = 0;
+		bool                complete = true;
+		Loudness::histogram blocks;
+		double              peak = 0;
+		std::vector<member> members;
+	};
+	std::map<std::wstring, std::unique_ptr<album>> mAlbums; // only if tagging
+	std::vector<album*>   mAlbumOf; // per file
+	std::atomic<size_t>   mAlbumsTagged{0};
+
+	// Files with the same audio as others, found before dispatching, if
+	// asked for: each group is converted once, by its cheapest file, and the
+	// others wait for it, then link its outputs.
+	std::vector<std::string> mDupKeys; // per file, of its headers, then of its content; empty if unique
+	std::atomic<size_t>   mHashesLeft{0};
+	std::vector<size_t>   mLeaderOf; // per file, NO_FILE if it's converted itself
+	std::map<size_t, std::vector<size_t>> mFollowers; // by leader
+	std::atomic<size_t>   mDuplicates{0};
+	std::atomic<uint64_t> mDupSavedMs{0};
+
+	// A file past its conversion, carrying what's left once its outputs are
+	// verified: tags, the cache, the source deleted. It goes from the job
+	// which converted it to the one verifying it; dropped with the queue on
+	// cancel, it takes the outputs not verified with it.
+	struct converted final {
+		size_t       index = 0;
+		std::wstring src;
+		file_result  res;
+		std::chrono::steady_clock::time_point t0;
+		uint64_t     srcSize = 0, destSize = 0;
+		std::vector<size_t> pending; // outputs converted, the others were up to date
+		std::vector<std::wstring> destPaths, outPaths, cacheKeys; // per output; one replacing the source stays aside until verified
+		std::vector<ConvCache*> caches;
+		ConvCache::fingerprint fp;
+		std::optional<Tags::replay_gain> gain; // measured, not tagged yet
+		std::optional<Loudness::histogram> blocks;
+		std::vector<album::member> tagged; // outputs with track gain, waiting for the album one
+		bool         unverified = false;
+		bool         checked = false; // verified already, by the node which converted it
+
+		~converted() { removeUnverified(); }
+		void removeUnverified(); // never throws
+	};
+
+	// Auto worker count: what finished since the last sample.
+	std::unique_ptr<AutoTune> mTune;
+	std::thread             mTuneThr;
+	std::mutex              mTuneMtx;
+	std::condition_variable mTuneCv;
+	bool                    mTuneStop = false;
+	double                  mWinCost = 0, mWinBytes = 0, mWinWork = 0;
+	size_t                  mWinJobs = 0;
+
+	// Failed files waiting for another attempt, and throttled ones, by due time.
+	std::vector<unsigned>   mAttempts;
+	std::multimap<std::chrono::steady_clock::time_point, size_t> mRetryQueue;
+	std::thread             mRetryThr;
+	std::mutex              mRetryMtx;
+	std::condition_variable mRetryCv;
+	bool                    mRetryStop = false;
+
+public:
+	explicit Runner(const runnin_options& opts) : mOpts(opts) { }
+	~Runner();
+
+	void   start(file_done_func onFileDone);
+	void   cancel(); // running tools are killed, and what they wrote removed
+	void   wait();
+	bool   cancelled() const { return mCancel.requested(); }
+	bool   finished() const { return !mScheduler || mScheduler->finished(); } // wait() returns at once; for a UI polling after cancel()
+	size_t numDone() const   { return mFilesDone; }
+	size_t numFailed() const { return mFilesFailed; }
+	size_t numSkipped() const { return mFilesSkipped; }
+	size_t numInvalidated() const { return mFilesInvalidated; }
+	size_t numConverted() const { return mFilesDone - mFilesFailed - mFilesSkipped; }
+	size_t numRetries() const { return mRetries; } // attempts beyond the first, all files together
+	size_t numAlbumsTagged() const { return mAlbumsTagged; }
+	size_t numDuplicates() const { return mDuplicates; } // files which linked the outputs of another
+	double duplicateSecsSaved() const { return mDupSavedMs / 1000.0; } // converting them, as long as their leaders took
+	size_t numReassigned() const { return mReassigned; } // files taken back from nodes lost, and sent elsewhere
+	const Farm* farm() const { return mFarm.get(); } // null if converting here only
+	std::vector<file_result> failures() const; // by index, each one complete before it's counted as done
+	progress snapshot() const; // lock-free, cheap enough for a UI timer
+	double elapsedSecs() const;
+	uint64_t bytesConverted() const { return mBytesIn; } // sources read, skipped ones not counted
+	uint64_t bytesSaved() const { return mBytesSaved; } // not written thanks to direct paths
+	double latencySecs(double percentile) const; // of the files converted, after wait()
+	std::vector<double> workerCpuSecs() const; // of each worker and its tools, so far
+	size_t numWorkersChosen(); // the fixed count, or where auto settled
+	void   exportTelemetry() const; // after wait()
+
+	static uint64_t       convert(const runnin_options& opts, const std::wstring& file); // bytes saved
+	static std::vector<Convert::output> outputs(const runnin_options& opts); // the target first
+	static std::vector<std::wstring> writtenPaths(const runnin_options& opts, const std::wstring& src); // all a conversion of it may write
+	static const wchar_t* targetExt(target targetType);
+	static double         estimateCost(const std::wstring& file, const Probe::info& i);
+	static double         bytesPerSec(const wchar_t* ext); // typical, of each format
+	static std::vector<size_t> dispatchOrder(const std::vector<double>& costs,
+		const std::vector<uint64_t>& devices); // of the files, longest first, source disks in turns
+	static uint64_t       batchKey(const runnin_options& opts); // for the journal
+
+private:
+	void       _probed();
+	void       _groupDuplicates();
+	void       _dispatch();
+	void       _tuneLoop();
+	void       _stopTune();
+	bool       _admit(size_t index);
+	bool       _scheduleRetry(size_t index);
+	bool       _submitAt(std::chrono::steady_clock::time_point when, size_t index, bool capped);
+	void       _retryLoop();
+	void       _stopRetry();
+	void       _submit(size_t index);
+	void       _processFile(size_t index, size_t worker);
+	void       _verifyFile(converted& f, size_t worker);
+	void       _finishOutputs(converted& f);
+	void       _finishFile(converted& f);
+	bool       _linkOutputs(converted& f, size_t leader);
+	void       _findDevices(size_t index, const Probe::info& info);
+	ConvCache* _cacheFor(const std::wstring& destFolder);
+	void       _removeLeftovers(const std::wstring& src) const;
+	bool       _tagsGain() const;
+	void       _albumFileDone(size_t index, const std::vector<album::member>& tagged, const Loudness::histogram* blocks);
+	std::vector<uint64_t> _settingsKeys() const;
+};
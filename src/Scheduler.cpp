@@ -0,0 +1,192 @@
+
+#include "Scheduler.h"
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+
+static thread_local const Scheduler* tlScheduler = nullptr; // whose worker runs on this thread
+static thread_local size_t tlWorkerIdx = 0;
+
+Scheduler::Scheduler(size_t numWorkers)
+{
+	if (!numWorkers) numWorkers = 1;
+	mActiveLimit = numWorkers;
+
+	mWorkers.reserve(numWorkers);
+	for (size_t i = 0; i < numWorkers; ++i) {
+		mWorkers.emplace_back(std::make_unique<worker>());
+	}
+	for (size_t i = 0; i < numWorkers; ++i) { // start only after all deques exist, since workers steal
+		mWorkers[i]->thr = std::thread([this, i]() {
+			_workerLoop(i);
+			++mNumExited;
+		});
+	}
+}
+
+Scheduler::~Scheduler()
+{
+	cancel();
+	try {
+		join();
+	} catch (...) { } // destructor must not throw
+}
+
+void Scheduler::submit(job j, bool first)
+{
+	if (mCancelled) return;
+
+	// Ahead from a job: at the front of its own worker's deque, which takes
+	// it next, being about to be free; a busy worker's front would wait for
+	// its current job, while the others steal from the back. A parked or
+	// retired worker's front goes first to the thieves.
+	size_t idx;
+	if (first && tlScheduler == this) {
+		idx = tlWorkerIdx;
+	} else {
+		idx = mNextWorker++ % mActiveLimit; // round-robin among the active deques
+		for (size_t i = 1; i < mActiveLimit && !_isActive(idx); ++i) {
+			idx = mNextWorker++ % mActiveLimit;
+		}
+	}
+	++mPending;
+	{
+		lock_guard<mutex> lk(mWorkers[idx]->mtx);
+		if (first) {
+			mWorkers[idx]->jobs.emplace_front(std::move(j));
+		} else {
+			mWorkers[idx]->jobs.emplace_back(std::move(j));
+		}
+	}
+	{
+		lock_guard<mutex> lk(mIdleMtx); // counted under the idle lock, so no wakeup is lost
+		++mQueued;
+	}
+	if (mActiveLimit < mWorkers.size() || mNumRetired) {
+		mIdleCv.notify_all(); // a single wakeup could land on a parked or retired worker
+	} else {
+		mIdleCv.notify_one();
+	}
+}
+
+void Scheduler::setActiveLimit(size_t numActive)
+{
+	if (numActive < 1) numActive = 1;
+	if (numActive > mWorkers.size()) numActive = mWorkers.size();
+	{
+		lock_guard<mutex> lk(mIdleMtx);
+		mActiveLimit = numActive; // parked workers finish their current job first
+	}
+	mIdleCv.notify_all();
+}
+
+void Scheduler::retire(size_t idx)
+{
+	{
+		lock_guard<mutex> lk(mIdleMtx);
+		if (mWorkers[idx]->retired.exchange(true)) return;
+		++mNumRetired;
+	}
+	mIdleCv.notify_all(); // whatever it had queued is for the others now
+}
+
+void Scheduler::close()
+{
+	mClosed = true; // no more jobs from outside; workers leave when everything is done
+	_wakeAll();
+}
+
+void Scheduler::cancel()
+{
+	mCancelled = true;
+	mClosed = true;
+	for (std::unique_ptr<worker>& w : mWorkers) { // drop whatever is still queued
+		lock_guard<mutex> lk(w->mtx);
+		mQueued -= w->jobs.size();
+		mPending -= w->jobs.size();
+		w->jobs.clear();
+	}
+	_wakeAll();
+}
+
+void Scheduler::join()
+{
+	for (std::unique_ptr<worker>& w : mWorkers) {
+		if (w->thr.joinable()) w->thr.join();
+	}
+	if (mFirstError) {
+		std::exception_ptr err = mFirstError;
+		mFirstError = nullptr;
+		std::rethrow_exception(err);
+	}
+}
+
+void Scheduler::_workerLoop(size_t idx)
+{
+	tlScheduler = this;
+	tlWorkerIdx = idx;
+	for (;;) {
+		job j;
+		if (_isActive(idx) && _takeJob(idx, j)) {
+			try {
+				j(idx);
+			} catch (...) {
+				lock_guard<mutex> lk(mIdleMtx);
+				if (!mFirstError) mFirstError = std::current_exception();
+			}
+			++mDone;
+			if (--mPending == 0 && mClosed) {
+				_wakeAll(); // last one out, let the idle workers leave
+			}
+			continue;
+		}
+
+		unique_lock<mutex> lk(mIdleMtx);
+		mIdleCv.wait(lk, [this, idx]() {
+			return (mQueued > 0 && _isActive(idx)) || mCancelled || (mClosed && mPending == 0);
+		});
+		if (mCancelled || (mClosed && mPending == 0 && mQueued == 0)) {
+			return;
+		}
+	}
+}
+
+bool Scheduler::_takeJob(size_t idx, job& j)
+{
+	{
+		worker& own = *mWorkers[idx];
+		lock_guard<mutex> lk(own.mtx);
+		if (!own.jobs.empty()) {
+			j = std::move(own.jobs.front());
+			own.jobs.pop_front();
+			--mQueued;
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < mWorkers.size(); ++i) { // own deque is empty, try to steal
+		size_t victimIdx = (idx + i) % mWorkers.size();
+		worker& victim = *mWorkers[victimIdx];
+		lock_guard<mutex> lk(victim.mtx);
+		if (!victim.jobs.empty()) {
+			if (_isActive(victimIdx)) {
+				j = std::move(victim.jobs.back());
+				victim.jobs.pop_back();
+			} else { // parked or retired, won't run its own deque: take what it would have taken
+				j = std::move(victim.jobs.front());
+				victim.jobs.pop_front();
+			}
+			--mQueued;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Scheduler::_wakeAll()
+{
+	{
+		lock_guard<mutex> lk(mIdleMtx);
+	}
+	mIdleCv.notify_all();
+}
\ No newline at end of file
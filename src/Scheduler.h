@@ -0,0 +1,61 @@
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads, each one owning a deque of jobs. A worker pops from
+// the front of its own deque and, when it runs dry, steals from the back of
+// the others, so all cores keep busy until the very last job finishes.
+class Scheduler final {
+public:
+	using job = std::function<void(size_t workerIdx)>;
+
+private:
+	struct worker final {
+		std::mutex      mtx;
+		std::deque<job> jobs;
+		std::thread     thr;
+		std::atomic<bool> retired{false};
+	};
+
+	std::vector<std::unique_ptr<worker>> mWorkers;
+	std::mutex              mIdleMtx;
+	std::condition_variable mIdleCv;
+	std::atomic<size_t>     mQueued{0};  // submitted but not yet taken by a worker
+	std::atomic<size_t>     mPending{0}; // queued plus running
+	std::atomic<size_t>     mDone{0}, mNextWorker{0};
+	std::atomic<size_t>     mActiveLimit; // workers from this index on are parked
+	std::atomic<size_t>     mNumRetired{0};
+	std::atomic<size_t>     mNumExited{0}; // worker threads out of their loop
+	std::atomic<bool>       mClosed{false}, mCancelled{false};
+	std::exception_ptr      mFirstError;
+
+public:
+	explicit Scheduler(size_t numWorkers);
+	~Scheduler();
+
+	void   submit(job j, bool first = false); // first: ahead of what's queued; from a job, taken next by its worker
+	void   close();
+	void   cancel();
+	void   join();
+	size_t numWorkers() const { return mWorkers.size(); }
+	size_t numDone() const    { return mDone; }
+	size_t numPending() const { return mPending; }
+	bool   finished() const   { return mNumExited == mWorkers.size(); } // all workers out, join() won't block
+	void   setActiveLimit(size_t numActive);
+	size_t activeLimit() const { return mActiveLimit; }
+	void   retire(size_t idx); // for good, its deque goes to the others; from its own job, typically
+
+private:
+	void _workerLoop(size_t idx);
+	bool _takeJob(size_t idx, job& j);
+	bool _isActive(size_t idx) const { return idx < mActiveLimit && !mWorkers[idx]->retired; }
+	void _wakeAll();
+};
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include "Socket.h"
+#include <algorithm>
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+using std::string;
+using std::unique_ptr;
+
+static const unsigned STALL_MS = 15000; // within a message, once its first byte came
+static const int BACKLOG = 64;
+
+#ifdef _WIN32
+const Socket::handle Socket::NO_HANDLE = INVALID_SOCKET;
+#else
+const Socket::handle Socket::NO_HANDLE = -1;
+#endif
+
+static void _startup()
+{
+#ifdef _WIN32
+	static bool started = []() { // once per process, never cleaned up
+		WSADATA wsa;
+		return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+	}();
+	if (!started) throw Socket::error("Winsock could not start.");
+#endif
+}
+
+static void _close(Socket::handle sock)
+{
+#ifdef _WIN32
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+static int _lastCode()
+{
+#ifdef _WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+static string _errorText(int code)
+{
+#ifdef _WIN32
+	return "error " + std::to_string(code);
+#else
+	return strerror(code);
+#endif
+}
+
+static void _setBlocking(Socket::handle sock, bool blocking)
+{
+#ifdef _WIN32
+	u_long nonBlocking = blocking ? 0 : 1;
+	ioctlsocket(sock, FIONBIO, &nonBlocking);
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+static void _tune(Socket::handle sock)
+{
+	// Small messages, beats above all, go out at once; and a peer gone
+	// without a word is found by the system too, not only by our timeouts.
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char*>(&on), sizeof(on));
+#ifdef SO_NOSIGPIPE
+	setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+static string _name(const sockaddr* addr, socklen_t len)
+{
+	char host[NI_MAXHOST] = "", port[NI_MAXSERV] = "";
+	if (getnameinfo(addr, len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) return "?";
+	return string(addr->sa_family == AF_INET6 ? "[" : "") + host + (addr->sa_family == AF_INET6 ? "]:" : ":") + port;
+}
+
+Socket::Socket(handle sock, string peer)
+	: mSock(sock), mPeer(std::move(peer))
+{
+}
+
+Socket::~Socket()
+{
+	if (mSock != NO_HANDLE) _close(mSock);
+}
+
+unique_ptr<Socket> Socket::connect(const string& host, const string& port, unsigned timeoutMs)
+{
+	_startup();
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* addrs = nullptr;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0 || !addrs) {
+		throw error("Unknown host " + host + ".");
+	}
+
+	// Not blocking while connecting, so a host which never answers costs
+	// the timeout, not the minutes the system would wait.
+	string why = "no address";
+	for (addrinfo* a = addrs; a; a = a->ai_next) {
+		handle sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (sock == NO_HANDLE) continue;
+		unique_ptr<Socket> s = std::make_unique<Socket>(sock, host + ":" + port);
+		_setBlocking(sock, false);
+		bool ok = ::connect(sock, a->ai_addr, static_cast<socklen_t>(a->ai_addrlen)) == 0;
+		int err = ok ? 0 : _lastCode();
+#ifdef _WIN32
+		bool pending = err == WSAEWOULDBLOCK;
+#else
+		bool pending = err == EINPROGRESS;
+#endif
+		if (pending && s->_poll(true, timeoutMs)) {
+			socklen_t errLen = sizeof(err);
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &errLen);
+			ok = err == 0;
+			if (!ok) why = _errorText(err);
+		} else if (pending) {
+			why = "timed out";
+		} else if (!ok) {
+			why = _errorText(err);
+		}
+		if (ok) {
+			_setBlocking(sock, true);
+			_tune(sock);
+			freeaddrinfo(addrs);
+			return s;
+		}
+	}
+	freeaddrinfo(addrs);
+	throw error("Could not connect to " + host + ":" + port + ", " + why + ".");
+}
+
+unique_ptr<Socket> Socket::listen(const string& host, const string& port)
+{
+	_startup();
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo* addrs = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addrs) != 0 || !addrs) {
+		throw error("Cannot listen on " + host + ":" + port + ", unknown address.");
+	}
+
+	// The first address which binds; an IPv6 one takes IPv4 too, where the
+	// system allows, and a farm tries each address of a name anyway.
+	string why = "no address";
+	for (addrinfo* a = addrs; a; a = a->ai_next) {
+		handle sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (sock == NO_HANDLE) continue;
+		unique_ptr<Socket> s = std::make_unique<Socket>(sock, (host.empty() ? "*" : host) + ":" + port);
+		int on = 1, off = 0;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on)); // restarts at once
+		if (a->ai_family == AF_INET6) {
+			setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&off), sizeof(off));
+		}
+		if (bind(sock, a->ai_addr, static_cast<socklen_t>(a->ai_addrlen)) == 0 && ::listen(sock, BACKLOG) == 0) {
+			freeaddrinfo(addrs);
+			return s;
+		}
+		why = _lastError();
+	}
+	freeaddrinfo(addrs);
+	throw error("Cannot listen on " + (host.empty() ? string("port ") : host + ":") + port + ", " + why + ".");
+}
+
+unique_ptr<Socket> Socket::accept(unsigned timeoutMs)
+{
+	if (!_poll(false, timeoutMs)) return nullptr;
+	sockaddr_storage addr{};
+	socklen_t len = sizeof(addr);
+	handle sock = ::accept(mSock, reinterpret_cast<sockaddr*>(&addr), &len);
+	if (sock == NO_HANDLE) return nullptr; // gone before we took it
+	_tune(sock);
+	return std::make_unique<Socket>(sock, _name(reinterpret_cast<sockaddr*>(&addr), len));
+}
+
+void Socket::send(uint8_t type, const void* data, size_t len)
+{
+	if (len > MAX_MESSAGE) throw error("Message too big for " + mPeer + ".");
+	uint8_t head[5] = {type, static_cast<uint8_t>(len), static_cast<uint8_t>(len >> 8),
+		static_cast<uint8_t>(len >> 16), static_cast<uint8_t>(len >> 24)};
+	std::lock_guard<std::mutex> lk(mSendMtx);
+	_sendAll(head, sizeof(head));
+	_sendAll(data, len);
+}
+
+bool Socket::receive(uint8_t& type, string& payload, unsigned timeoutMs)
+{
+	if (!_poll(false, timeoutMs)) return false;
+	uint8_t head[5];
+	_recvAll(head, sizeof(head));
+	size_t len = head[1] | (head[2] << 8) | (head[3] << 16) | (static_cast<size_t>(head[4]) << 24);
+	if (len > MAX_MESSAGE) throw error("Message too big from " + mPeer + ".");
+	type = head[0];
+	payload.resize(len);
+	if (len) _recvAll(&payload[0], len);
+	return true;
+}
+
+void Socket::shutdown()
+{
+#ifdef _WIN32
+	::shutdown(mSock, SD_BOTH);
+#else
+	::shutdown(mSock, SHUT_RDWR);
+#endif
+}
+
+void Socket::_sendAll(const void* data, size_t len)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL; // a peer gone is an error here, not a signal
+#else
+	const int flags = 0;
+#endif
+	const char* p = static_cast<const char*>(data);
+	while (len) {
+		if (!_poll(true, STALL_MS)) throw error("Connection to " + mPeer + " stalled.");
+		int chunk = static_cast<int>(std::min<size_t>(len, 1 << 20));
+		auto n = ::send(mSock, p, chunk, flags);
+		if (n <= 0) throw error("Connection to " + mPeer + " lost, " + _lastError() + ".");
+		p += n;
+		len -= static_cast<size_t>(n);
+	}
+}
+
+void Socket::_recvAll(void* data, size_t len)
+{
+	char* p = static_cast<char*>(data);
+	while (len) {
+		if (!_poll(false, STALL_MS)) throw error("Connection to " + mPeer + " stalled.");
+		int chunk = static_cast<int>(std::min<size_t>(len, 1 << 20));
+		auto n = ::recv(mSock, p, chunk, 0);
+		if (n == 0) throw error("Connection closed by " + mPeer + ".");
+		if (n < 0) throw error("Connection to " + mPeer + " lost, " + _lastError() + ".");
+		p += n;
+		len -= static_cast<size_t>(n);
+	}
+}
+
+bool Socket::_poll(bool forWrite, unsigned timeoutMs) const
+{
+#ifdef _WIN32
+	WSAPOLLFD pfd{};
+	pfd.fd = mSock;
+	pfd.events = forWrite ? POLLOUT : POLLRDNORM;
+	int n = WSAPoll(&pfd, 1, static_cast<int>(timeoutMs));
+#else
+	pollfd pfd{};
+	pfd.fd = mSock;
+	pfd.events = forWrite ? POLLOUT : POLLIN;
+	int n = poll(&pfd, 1, static_cast<int>(timeoutMs));
+	if (n < 0 && errno == EINTR) return false; // as a timeout, the caller looks again
+#endif
+	if (n < 0) throw error("Connection to " + mPeer + " failed, " + _lastError() + ".");
+	return n > 0; // errors and hangups come out of the next call
+}
+
+string Socket::_lastError()
+{
+	return _errorText(_lastCode());
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+// TCP connection carrying typed messages, each one a byte of type and four
+// of length ahead of its payload, and the listening end which accepts them;
+// over Winsock or BSD sockets alike. Every wait has a timeout, so a peer
+// which hangs is told from a slow one by whoever calls.
+class Socket final {
+public:
+#ifdef _WIN32
+	using handle = uintptr_t; // SOCKET, without pulling Winsock into each includer
+#else
+	using handle = int;
+#endif
+	static const handle NO_HANDLE;
+	static const size_t MAX_MESSAGE = 16 * 1024 * 1024; // bigger means a confused peer
+
+	// The connection is gone: closed, reset, or stalled within a message.
+	class error final : public std::runtime_error {
+	public:
+		explicit error(const std::string& msg) : std::runtime_error(msg) { }
+	};
+
+private:
+	handle      mSock = NO_HANDLE;
+	std::string mPeer; // host:port, for the messages
+	std::mutex  mSendMtx; // messages sent from two threads don't interleave
+
+public:
+	Socket(handle sock, std::string peer);
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+	~Socket();
+
+	static std::unique_ptr<Socket> connect(const std::string& host, const std::string& port,
+		unsigned timeoutMs); // throws error
+	static std::unique_ptr<Socket> listen(const std::string& host, const std::string& port); // any interface if no host; throws
+	std::unique_ptr<Socket> accept(unsigned timeoutMs); // null if none came
+
+	void send(uint8_t type, const std::string& payload) { send(type, payload.data(), payload.size()); }
+	void send(uint8_t type, const void* data, size_t len); // whole, or throws error
+	bool receive(uint8_t& type, std::string& payload, unsigned timeoutMs); // false if none began; throws error
+	void shutdown(); // from any thread, the calls blocked on it return
+	const std::string& peer() const { return mPeer; }
+
+private:
+	void _sendAll(const void* data, size_t len);
+	void _recvAll(void* data, size_t len);
+	bool _poll(bool forWrite, unsigned timeoutMs) const; // false on timeout
+	static std::string _lastError();
+};
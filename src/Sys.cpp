@@ -0,0 +1,498 @@
+#include "Sys.h"
+#include <algorithm>
+#include <cstdio>
+#include <cwctype>
+#include <filesystem>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#ifdef _WIN32
+#include <Windows.h>
+#include <winioctl.h>
+#else
+#include <ctime>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#endif
+#endif
+using std::string;
+using std::wstring;
+namespace fs = std::filesystem;
+
+static fs::path _native(const wstring& path)
+{
+#ifdef _WIN32
+	return fs::path(path);
+#else
+	return fs::path(Sys::toUtf8(path));
+#endif
+}
+
+static wstring _wide(const fs::path& p)
+{
+#ifdef _WIN32
+	return p.wstring();
+#else
+	return Sys::fromUtf8(p.string());
+#endif
+}
+
+static bool _isSeparator(wchar_t ch)
+{
+#ifdef _WIN32
+	return ch == L'\\' || ch == L'/';
+#else
+	return ch == L'/';
+#endif
+}
+
+string Sys::toUtf8(const wstring& s)
+{
+#ifdef _WIN32
+	if (s.empty()) return {};
+	int len = WideCharToMultiByte(CP_UTF8, 0, s.data(), static_cast<int>(s.size()), nullptr, 0, nullptr, nullptr);
+	string out(len, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, s.data(), static_cast<int>(s.size()), &out[0], len, nullptr, nullptr);
+	return out;
+#else
+	string out;
+	out.reserve(s.size());
+	for (wchar_t wc : s) { // wchar_t holds UTF-32 here
+		uint32_t c = static_cast<uint32_t>(wc);
+		if (c < 0x80) {
+			out.push_back(static_cast<char>(c));
+		} else if (c < 0x800) {
+			out.push_back(static_cast<char>(0xc0 | (c >> 6)));
+			out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+		} else if (c < 0x10000) {
+			out.push_back(static_cast<char>(0xe0 | (c >> 12)));
+			out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+		} else {
+			out.push_back(static_cast<char>(0xf0 | (c >> 18)));
+			out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+		}
+	}
+	return out;
+#endif
+}
+
+wstring Sys::fromUtf8(const string& s)
+{
+#ifdef _WIN32
+	if (s.empty()) return {};
+	int len = MultiByteToWideChar(CP_UTF8, 0, s.data(), static_cast<int>(s.size()), nullptr, 0);
+	wstring out(len, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, s.data(), static_cast<int>(s.size()), &out[0], len);
+	return out;
+#else
+	wstring out;
+	out.reserve(s.size());
+	for (size_t i = 0; i < s.size(); ) {
+		unsigned char c = s[i];
+		size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 0;
+		if (!len || i + len > s.size()) { // invalid byte, keep going
+			out.push_back(0xfffd);
+			++i;
+			continue;
+		}
+		uint32_t cp = len == 1 ? c : (c & (0x7f >> len));
+		for (size_t k = 1; k < len; ++k) {
+			cp = (cp << 6) | (s[i + k] & 0x3f);
+		}
+		out.push_back(static_cast<wchar_t>(cp));
+		i += len;
+	}
+	return out;
+#endif
+}
+
+string Sys::jsonString(const string& s)
+{
+	string out = "\"";
+	for (char ch : s) {
+		switch (ch) {
+		case '"':  out.append("\\\""); break;
+		case '\\': out.append("\\\\"); break;
+		case '\n': out.append("\\n"); break;
+		case '\r': out.append("\\r"); break;
+		case '\t': out.append("\\t"); break;
+		default:
+			if (static_cast<unsigned char>(ch) < 0x20) {
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", ch);
+				out.append(esc);
+			} else {
+				out.push_back(ch);
+			}
+		}
+	}
+	out.push_back('"');
+	return out;
+}
+
+bool Sys::hasExtension(const wstring& path, const wchar_t* ext)
+{
+	size_t extLen = wcslen(ext);
+	if (path.size() < extLen) return false;
+	return std::equal(path.end() - extLen, path.end(), ext, ext + extLen,
+		[](wchar_t a, wchar_t b) { return towlower(a) == towlower(b); });
+}
+
+bool Sys::hasExtension(const wstring& path, std::initializer_list<const wchar_t*> exts)
+{
+	for (const wchar_t* ext : exts) {
+		if (hasExtension(path, ext)) return true;
+	}
+	return false;
+}
+
+wstring Sys::changeExtension(const wstring& path, const wchar_t* ext)
+{
+	size_t nameStart = path.size() - fileFrom(path).size();
+	size_t dot = path.find_last_of(L'.');
+	return (dot == wstring::npos || dot < nameStart) ? path + ext : path.substr(0, dot) + ext;
+}
+
+wstring Sys::folderFrom(const wstring& path)
+{
+	for (size_t i = path.size(); i-- > 0; ) {
+		if (_isSeparator(path[i])) return path.substr(0, i ? i : 1);
+	}
+	return {};
+}
+
+wstring Sys::fileFrom(const wstring& path)
+{
+	for (size_t i = path.size(); i-- > 0; ) {
+		if (_isSeparator(path[i])) return path.substr(i + 1);
+	}
+	return path;
+}
+
+wstring Sys::joinPath(const wstring& folder, const wstring& file)
+{
+	if (folder.empty()) return file;
+#ifdef _WIN32
+	return _isSeparator(folder.back()) ? folder + file : folder + L'\\' + file;
+#else
+	return _isSeparator(folder.back()) ? folder + file : folder + L'/' + file;
+#endif
+}
+
+wstring Sys::trimSeparator(const wstring& path)
+{
+	wstring trimmed = path;
+	while (trimmed.size() > 1 && _isSeparator(trimmed.back())) {
+		trimmed.pop_back();
+	}
+	return trimmed;
+}
+
+wstring Sys::absolutePath(const wstring& path)
+{
+	std::error_code ec;
+	fs::path abs = fs::absolute(_native(path), ec);
+	return ec ? path : _wide(abs.lexically_normal());
+}
+
+wstring Sys::tempFolder()
+{
+	return trimSeparator(_wide(fs::temp_directory_path())); // TMP or TEMP on Windows, TMPDIR or /tmp on POSIX
+}
+
+bool Sys::isSamePath(const wstring& a, const wstring& b)
+{
+	wstring na = _wide(_native(trimSeparator(a)).lexically_normal());
+	wstring nb = _wide(_native(trimSeparator(b)).lexically_normal());
+#ifdef _WIN32
+	return na.size() == nb.size() && std::equal(na.begin(), na.end(), nb.begin(),
+		[](wchar_t x, wchar_t y) { return towlower(x) == towlower(y); });
+#else
+	return na == nb;
+#endif
+}
+
+bool Sys::exists(const wstring& path)
+{
+	std::error_code ec;
+	return fs::exists(_native(path), ec);
+}
+
+bool Sys::isDir(const wstring& path)
+{
+	std::error_code ec;
+	return fs::is_directory(_native(path), ec);
+}
+
+uint64_t Sys::fileSize(const wstring& path)
+{
+	std::error_code ec;
+	uintmax_t sz = fs::file_size(_native(path), ec);
+	return ec ? 0 : sz;
+}
+
+int64_t Sys::lastWriteTime(const wstring& path)
+{
+	std::error_code ec;
+	fs::file_time_type t = fs::last_write_time(_native(path), ec);
+	return ec ? 0 : static_cast<int64_t>(t.time_since_epoch().count());
+}
+
+Sys::device Sys::deviceOf(const wstring& path)
+{
+	// The physical disk, not the volume: partitions of one disk share its
+	// heads, so they count as one.
+	device dev;
+#ifdef _WIN32
+	wchar_t volPath[MAX_PATH] = {}, volName[MAX_PATH] = {};
+	if (!GetVolumePathNameW(path.c_str(), volPath, MAX_PATH)) return dev;
+	if (GetDriveTypeW(volPath) == DRIVE_REMOTE
+		|| !GetVolumeNameForVolumeMountPointW(volPath, volName, MAX_PATH))
+	{
+		dev.id = std::hash<wstring>()(volPath) | 1; // a share, or something without a volume GUID
+		dev.seeks = GetDriveTypeW(volPath) == DRIVE_REMOTE;
+		return dev;
+	}
+	dev.id = std::hash<wstring>()(volName) | 1;
+
+	wstring volDevice = volName;
+	volDevice.pop_back(); // without the trailing backslash it's the volume device itself
+	HANDLE hVol = CreateFileW(volDevice.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		nullptr, OPEN_EXISTING, 0, nullptr);
+	if (hVol == INVALID_HANDLE_VALUE) return dev;
+	DWORD numRet = 0;
+	STORAGE_DEVICE_NUMBER num = {};
+	if (DeviceIoControl(hVol, IOCTL_STORAGE_GET_DEVICE_NUMBER, nullptr, 0,
+		&num, sizeof(num), &numRet, nullptr)) // fails for volumes spanning several disks
+	{
+		dev.id = ((static_cast<uint64_t>(num.DeviceType) << 32) | num.DeviceNumber) + 1;
+	}
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = StorageDeviceSeekPenaltyProperty;
+	query.QueryType = PropertyStandardQuery;
+	DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+	if (DeviceIoControl(hVol, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&penalty, sizeof(penalty), &numRet, nullptr))
+	{
+		dev.seeks = penalty.IncursSeekPenalty != FALSE;
+	}
+	CloseHandle(hVol);
+#else
+	string native = toUtf8(path);
+	struct stat st;
+	if (stat(native.c_str(), &st) != 0) return dev;
+	dev.id = static_cast<uint64_t>(st.st_dev) + 1;
+#ifdef __linux__
+	if (major(st.st_dev) == 0) { // no block device behind it
+		struct statfs sfs;
+		if (statfs(native.c_str(), &sfs) == 0) {
+			switch (static_cast<unsigned long>(sfs.f_type)) {
+			case 0x6969: case 0x517b: case 0xff534d42: case 0xfe534d42: // NFS, SMB, CIFS, SMB2
+				dev.seeks = true;
+			}
+		}
+		return dev;
+	}
+	auto readSys = [](const string& file) -> string {
+		FILE* fp = fopen(file.c_str(), "r");
+		if (!fp) return {};
+		char buf[64] = {};
+		size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+		fclose(fp);
+		return string(buf, n);
+	};
+	string sysDev = "/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+	if (!readSys(sysDev + "/partition").empty()) { // the disk is the parent folder
+		unsigned maj = 0, min = 0;
+		if (sscanf(readSys(sysDev + "/../dev").c_str(), "%u:%u", &maj, &min) == 2) {
+			dev.id = static_cast<uint64_t>(makedev(maj, min)) + 1;
+			sysDev = "/sys/dev/block/" + std::to_string(maj) + ":" + std::to_string(min);
+		}
+	}
+	dev.seeks = readSys(sysDev + "/queue/rotational").compare(0, 1, "1") == 0;
+#endif
+#endif
+	return dev;
+}
+
+bool Sys::listDir(const wstring& path, const std::function<bool(const wstring&, bool)>& onEntry)
+{
+	// The entry types come with the listing itself, so nothing else is read
+	// from the disk; links to folders aren't followed, they could loop.
+	std::error_code ec;
+	fs::directory_iterator it(_native(path), fs::directory_options::skip_permission_denied, ec);
+	if (ec) return false;
+	for (fs::directory_iterator end; it != end; it.increment(ec)) {
+		std::error_code entryEc; // a vanished entry is just skipped
+		bool isDir = !it->is_symlink(entryEc) && it->is_directory(entryEc);
+		if (!onEntry(_wide(it->path()), isDir)) break;
+	}
+	return !ec;
+}
+
+void Sys::createDir(const wstring& path)
+{
+	fs::create_directories(_native(path)); // throws filesystem_error
+}
+
+void Sys::removeFile(const wstring& path)
+{
+	fs::remove(_native(path));
+}
+
+void Sys::removeTree(const wstring& path)
+{
+	fs::remove_all(_native(path));
+}
+
+void Sys::replaceFile(const wstring& from, const wstring& to)
+{
+	fs::rename(_native(from), _native(to)); // replaces an existing file on both systems
+}
+
+void Sys::copyFile(const wstring& from, const wstring& to)
+{
+	// Left to the system, which copies within the kernel, or clones the blocks
+	// on file systems which can; the data never comes through our buffers.
+	fs::copy_file(_native(from), _native(to), fs::copy_options::overwrite_existing);
+}
+
+bool Sys::moveFile(const wstring& from, const wstring& to)
+{
+	std::error_code ec;
+	fs::rename(_native(from), _native(to), ec); // same volume: only the directory entry changes
+	if (!ec) return true;
+	copyFile(from, to); // another volume
+	removeFile(from);
+	return false;
+}
+
+bool Sys::linkFile(const wstring& from, const wstring& to)
+{
+	std::error_code ec;
+	fs::remove(_native(to), ec); // a link doesn't replace
+	fs::create_hard_link(_native(from), _native(to), ec); // same volume: one file under two names
+	if (!ec) return true;
+	copyFile(from, to); // another volume, or no links there
+	return false;
+}
+
+FILE* Sys::openFile(const wstring& path, const char* mode)
+{
+#ifdef _WIN32
+	return _wfopen(path.c_str(), fromUtf8(mode).c_str());
+#else
+	return fopen(toUtf8(path).c_str(), mode);
+#endif
+}
+
+void Sys::writeFile(const wstring& path, const string& text)
+{
+	FILE* fp = openFile(path, "wb");
+	if (!fp) {
+		throw std::runtime_error("Failed to write:\n" + toUtf8(path));
+	}
+	bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) {
+		throw std::runtime_error("Failed to write:\n" + toUtf8(path));
+	}
+}
+
+size_t Sys::numProcessors()
+{
+	unsigned n = std::thread::hardware_concurrency(); // logical ones
+	return n ? n : 1;
+}
+
+bool Sys::cpuTimes(uint64_t& idle, uint64_t& total)
+{
+#ifdef _WIN32
+	FILETIME ftIdle, ftKernel, ftUser;
+	if (!GetSystemTimes(&ftIdle, &ftKernel, &ftUser)) return false;
+	auto ticks = [](const FILETIME& ft) { return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime; };
+	idle = ticks(ftIdle);
+	total = ticks(ftKernel) + ticks(ftUser); // kernel time includes idle
+	return true;
+#else
+	FILE* fp = fopen("/proc/stat", "r");
+	if (!fp) return false;
+	unsigned long long v[8] = {};
+	int n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(fp);
+	if (n < 4) return false;
+	idle = v[3] + v[4]; // iowait is idle too
+	total = 0;
+	for (unsigned long long t : v) total += t;
+	return true;
+#endif
+}
+
+double Sys::threadCpuSecs()
+{
+#ifdef _WIN32
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (!GetThreadTimes(GetCurrentThread(), &ftCreation, &ftExit, &ftKernel, &ftUser)) return 0;
+	auto ticks = [](const FILETIME& ft) { return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime; };
+	return (ticks(ftKernel) + ticks(ftUser)) / 1e7; // 100 ns units
+#else
+	timespec ts{};
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+std::vector<std::vector<unsigned>> Sys::physicalCores()
+{
+	// Hyperthreads of a core share its execution units, so two encoders on
+	// siblings run slower than on two cores; the CPUs come grouped to tell.
+	std::vector<std::vector<unsigned>> cores;
+#ifdef _WIN32
+	// Only the processor group we run in, which is all of them below 64.
+	DWORD_PTR procMask = 0, sysMask = 0;
+	GetProcessAffinityMask(GetCurrentProcess(), &procMask, &sysMask);
+	DWORD len = 0;
+	GetLogicalProcessorInformation(nullptr, &len);
+	std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> infos(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+	if (infos.empty() || !GetLogicalProcessorInformation(&infos[0], &len)) return cores;
+	for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& info : infos) {
+		if (info.Relationship != RelationProcessorCore) continue;
+		std::vector<unsigned> cpus;
+		for (unsigned cpu = 0; cpu < 8 * sizeof(ULONG_PTR); ++cpu) {
+			if (info.ProcessorMask & procMask & (static_cast<ULONG_PTR>(1) << cpu)) cpus.emplace_back(cpu);
+		}
+		if (!cpus.empty()) cores.emplace_back(std::move(cpus));
+	}
+#elif defined(__linux__)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return cores;
+	std::map<std::pair<int, int>, std::vector<unsigned>> byCore; // package and core ids
+	for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed)) continue;
+		auto readId = [cpu](const char* name) {
+			char path[96];
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, name);
+			int id = -1;
+			if (FILE* fp = fopen(path, "r")) {
+				if (fscanf(fp, "%d", &id) != 1) id = -1;
+				fclose(fp);
+			}
+			return id;
+		};
+		int core = readId("core_id");
+		byCore[{readId("physical_package_id"), core < 0 ? -1 - static_cast<int>(cpu) : core}].emplace_back(cpu);
+	}
+	for (auto& c : byCore) cores.emplace_back(std::move(c.second));
+	std::sort(cores.begin(), cores.end()); // by their first CPU, as the system numbers them
+#endif
+	return cores;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+// Portable file system and text helpers, for the code shared by the GUI and
+// the command line. Paths are wide strings everywhere; on POSIX they are
+// converted to UTF-8 only when talking to the system.
+struct Sys final {
+private:
+	Sys() = delete;
+
+public:
+	struct device final {
+		uint64_t id = 0;      // whole disk when it has partitions; 0 if unknown
+		bool     seeks = false; // spinning disk or network share, where concurrent reads fight
+	};
+
+	static std::string  toUtf8(const std::wstring& s);
+	static std::wstring fromUtf8(const std::string& s);
+	static std::string  jsonString(const std::string& s); // quoted and escaped, from UTF-8
+
+	static bool         hasExtension(const std::wstring& path, const wchar_t* ext);
+	static bool         hasExtension(const std::wstring& path, std::initializer_list<const wchar_t*> exts);
+	static std::wstring changeExtension(const std::wstring& path, const wchar_t* ext);
+	static std::wstring folderFrom(const std::wstring& path);
+	static std::wstring fileFrom(const std::wstring& path);
+	static std::wstring joinPath(const std::wstring& folder, const std::wstring& file);
+	static std::wstring trimSeparator(const std::wstring& path);
+	static std::wstring absolutePath(const std::wstring& path);
+	static std::wstring tempFolder();
+	static bool         isSamePath(const std::wstring& a, const std::wstring& b);
+
+	static bool     exists(const std::wstring& path);
+	static bool     isDir(const std::wstring& path);
+	static uint64_t fileSize(const std::wstring& path);
+	static int64_t  lastWriteTime(const std::wstring& path); // opaque ticks, only for comparison
+	static device   deviceOf(const std::wstring& path); // of an existing file or folder
+	static bool     listDir(const std::wstring& path,
+		const std::function<bool(const std::wstring& path, bool isDir)>& onEntry); // false if unreadable
+	static void     createDir(const std::wstring& path);
+	static void     removeFile(const std::wstring& path);
+	static void     removeTree(const std::wstring& path); // a folder and all it holds, if it's there
+	static void     replaceFile(const std::wstring& from, const std::wstring& to);
+	static void     copyFile(const std::wstring& from, const std::wstring& to); // replacing it
+	static bool     moveFile(const std::wstring& from, const std::wstring& to); // false if it had to be copied
+	static bool     linkFile(const std::wstring& from, const std::wstring& to); // replacing it; false if it had to be copied
+	static FILE*    openFile(const std::wstring& path, const char* mode);
+	static void     writeFile(const std::wstring& path, const std::string& text); // whole, replacing it
+
+	static size_t numProcessors();
+	static bool   cpuTimes(uint64_t& idle, uint64_t& total); // whole machine, since boot
+	static double threadCpuSecs(); // of the calling thread, since it started
+	static std::vector<std::vector<unsigned>> physicalCores(); // logical CPUs we may run on, by core; empty if unknown
+};
@@ -0,0 +1,278 @@
+#include "Tags.h"
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "Sys.h"
+using std::string;
+using std::vector;
+using std::wstring;
+
+static const size_t FLAC_PADDING = 8192; // left when the file has to be rewritten anyway
+static const size_t ID3_PADDING = 1024;
+static const size_t COPY_BUF_SZ = 1024 * 1024;
+static const uint8_t FLAC_VORBIS_COMMENT = 4, FLAC_PADDING_BLOCK = 1;
+
+using tag_list = vector<std::pair<string, string>>;
+
+static uint32_t be32(const uint8_t* p) { return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint32_t le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+static uint32_t syncsafe32(const uint8_t* p) { return (p[0] & 0x7f) << 21 | (p[1] & 0x7f) << 14 | (p[2] & 0x7f) << 7 | (p[3] & 0x7f); }
+
+static void putBe32(string& s, uint32_t v) { for (int sh = 24; sh >= 0; sh -= 8) s.push_back(static_cast<char>(v >> sh)); }
+static void putLe32(string& s, uint32_t v) { for (int sh = 0; sh < 32; sh += 8) s.push_back(static_cast<char>(v >> sh)); }
+static void putBe24(string& s, uint32_t v) { for (int sh = 16; sh >= 0; sh -= 8) s.push_back(static_cast<char>(v >> sh)); }
+static void putSyncsafe32(string& s, uint32_t v) { for (int sh = 21; sh >= 0; sh -= 7) s.push_back(static_cast<char>((v >> sh) & 0x7f)); }
+
+static bool isReplayGainKey(const string& key)
+{
+	static const char PREFIX[] = "REPLAYGAIN_";
+	if (key.size() < sizeof(PREFIX) - 1) return false;
+	for (size_t i = 0; i < sizeof(PREFIX) - 1; ++i) {
+		if (toupper(static_cast<unsigned char>(key[i])) != PREFIX[i]) return false;
+	}
+	return true;
+}
+
+static tag_list replayGainTags(const Tags::replay_gain& rg)
+{
+	auto fmt = [](const char* f, double val) {
+		if (std::fabs(val) < 0.005) val = 0; // no "-0.00 dB"
+		char buf[32];
+		snprintf(buf, sizeof(buf), f, val);
+		return string(buf);
+	};
+	tag_list tags = {
+		{"REPLAYGAIN_TRACK_GAIN", fmt("%+.2f dB", rg.trackGain)},
+		{"REPLAYGAIN_TRACK_PEAK", fmt("%.6f", rg.trackPeak)},
+	};
+	if (rg.hasAlbum) {
+		tags.emplace_back("REPLAYGAIN_ALBUM_GAIN", fmt("%+.2f dB", rg.albumGain));
+		tags.emplace_back("REPLAYGAIN_ALBUM_PEAK", fmt("%.6f", rg.albumPeak));
+	}
+	return tags;
+}
+
+static void throwWriteFailed(const wstring& path)
+{
+	throw std::runtime_error("Failed to write the tags:\n" + Sys::toUtf8(path));
+}
+
+static bool readExactly(FILE* fp, void* buf, size_t len)
+{
+	return fread(buf, 1, len, fp) == len;
+}
+
+static void overwriteHead(const wstring& path, uint64_t offset, const string& data)
+{
+	FILE* fp = Sys::openFile(path, "r+b");
+	if (!fp) throwWriteFailed(path);
+	bool ok = fseek(fp, static_cast<long>(offset), SEEK_SET) == 0
+		&& fwrite(data.data(), 1, data.size(), fp) == data.size();
+	if (fclose(fp) || !ok) throwWriteFailed(path);
+}
+
+static void rewriteWithHead(const wstring& path, FILE* in, uint64_t audioStart, const string& head)
+{
+	// The new head, then the audio as it was; written aside and swapped in,
+	// so a failure leaves the output untouched.
+	wstring tmpPath = path + L".tags";
+	FILE* out = Sys::openFile(tmpPath, "wb");
+	if (!out) {
+		fclose(in);
+		throwWriteFailed(tmpPath);
+	}
+	bool ok = fwrite(head.data(), 1, head.size(), out) == head.size()
+		&& fseek(in, static_cast<long>(audioStart), SEEK_SET) == 0;
+	vector<char> buf(COPY_BUF_SZ);
+	for (size_t n; ok && (n = fread(&buf[0], 1, buf.size(), in)) > 0; ) {
+		ok = fwrite(&buf[0], 1, n, out) == n;
+	}
+	ok = !ferror(in) && ok;
+	fclose(in);
+	if (fclose(out) || !ok) {
+		Sys::removeFile(tmpPath);
+		throwWriteFailed(path);
+	}
+	Sys::replaceFile(tmpPath, path);
+}
+
+bool Tags::writeReplayGain(const wstring& path, const replay_gain& rg)
+{
+	if (Sys::hasExtension(path, L".flac")) return _writeFlac(path, rg);
+	if (Sys::hasExtension(path, L".mp3")) return _writeMp3(path, rg);
+	return false;
+}
+
+bool Tags::_writeFlac(const wstring& path, const replay_gain& rg)
+{
+	struct block final {
+		uint8_t type;
+		string  data;
+	};
+
+	FILE* fp = Sys::openFile(path, "rb");
+	if (!fp) throwWriteFailed(path);
+	vector<block> blocks;
+	uint8_t hdr[4];
+	bool ok = readExactly(fp, hdr, 4) && !memcmp(hdr, "fLaC", 4);
+	for (bool isLast = false; ok && !isLast; ) {
+		ok = readExactly(fp, hdr, 4);
+		if (!ok) break;
+		isLast = (hdr[0] & 0x80) != 0;
+		block b{static_cast<uint8_t>(hdr[0] & 0x7f), string((hdr[1] << 16) | (hdr[2] << 8) | hdr[3], '\0')};
+		ok = b.type != 0x7f && (b.data.empty() || readExactly(fp, &b.data[0], b.data.size()));
+		blocks.emplace_back(std::move(b));
+	}
+	if (!ok || blocks.empty() || blocks[0].type != 0) { // STREAMINFO always comes first
+		fclose(fp);
+		return false;
+	}
+	uint64_t audioStart = static_cast<uint64_t>(ftell(fp));
+
+	// The comment block keeps its vendor and all but the ReplayGain entries.
+	string vendor = "flac-lame-frontend";
+	tag_list comments;
+	size_t commentAt = 1; // right after STREAMINFO, if there's none yet
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (blocks[i].type != FLAC_VORBIS_COMMENT) continue;
+		commentAt = i;
+		const string& d = blocks[i].data;
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(d.data());
+		size_t pos = 0;
+		auto take = [&](string& out) {
+			if (pos + 4 > d.size()) return false;
+			uint32_t len = le32(p + pos);
+			if (len > d.size() - pos - 4) return false;
+			out.assign(d, pos + 4, len);
+			pos += 4 + len;
+			return true;
+		};
+		if (!take(vendor) || pos + 4 > d.size()) break; // malformed, rebuilt with what was read
+		uint32_t count = le32(p + pos);
+		pos += 4;
+		for (uint32_t c = 0; c < count; ++c) {
+			string entry;
+			if (!take(entry)) break;
+			size_t eq = entry.find('=');
+			if (eq == string::npos || isReplayGainKey(entry.substr(0, eq))) continue;
+			comments.emplace_back(entry.substr(0, eq), entry.substr(eq + 1));
+		}
+		break;
+	}
+	for (const auto& t : replayGainTags(rg)) comments.emplace_back(t);
+
+	string comment;
+	putLe32(comment, static_cast<uint32_t>(vendor.size()));
+	comment.append(vendor);
+	putLe32(comment, static_cast<uint32_t>(comments.size()));
+	for (const auto& t : comments) {
+		putLe32(comment, static_cast<uint32_t>(t.first.size() + 1 + t.second.size()));
+		comment.append(t.first).append("=").append(t.second);
+	}
+
+	vector<block> kept;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (i == commentAt) kept.push_back({FLAC_VORBIS_COMMENT, comment});
+		if (blocks[i].type == FLAC_VORBIS_COMMENT || blocks[i].type == FLAC_PADDING_BLOCK) continue;
+		kept.push_back(std::move(blocks[i]));
+	}
+	if (commentAt >= blocks.size()) kept.push_back({FLAC_VORBIS_COMMENT, comment});
+
+	size_t room = static_cast<size_t>(audioStart) - 4, needed = 0;
+	for (const block& b : kept) needed += 4 + b.data.size();
+	bool fits = needed == room || needed + 4 <= room; // a padding block takes 4 bytes even if empty
+	if (!fits) {
+		kept.push_back({FLAC_PADDING_BLOCK, string(FLAC_PADDING, '\0')});
+	} else if (needed != room) {
+		kept.push_back({FLAC_PADDING_BLOCK, string(room - needed - 4, '\0')});
+	}
+
+	string head = fits ? "" : "fLaC";
+	for (size_t i = 0; i < kept.size(); ++i) {
+		head.push_back(static_cast<char>(kept[i].type | (i + 1 == kept.size() ? 0x80 : 0)));
+		putBe24(head, static_cast<uint32_t>(kept[i].data.size()));
+		head.append(kept[i].data);
+	}
+
+	if (fits) {
+		fclose(fp);
+		overwriteHead(path, 4, head);
+	} else {
+		rewriteWithHead(path, fp, audioStart, head);
+	}
+	return true;
+}
+
+bool Tags::_writeMp3(const wstring& path, const replay_gain& rg)
+{
+	FILE* fp = Sys::openFile(path, "rb");
+	if (!fp) throwWriteFailed(path);
+
+	// An ID3v2.3 or 2.4 tag is kept, frame by frame, without the ReplayGain
+	// TXXX frames; flags we'd have to undo, like unsynchronisation, leave the
+	// file alone. Without a tag, a 2.3 one is added, the most widely read.
+	uint8_t hdr[10];
+	unsigned version = 3;
+	uint32_t tagSize = 0;
+	string body;
+	if (readExactly(fp, hdr, 10) && !memcmp(hdr, "ID3", 3)) {
+		version = hdr[3];
+		tagSize = syncsafe32(hdr + 6);
+		body.resize(tagSize);
+		if ((version != 3 && version != 4) || (hdr[5] & 0xd0) || !readExactly(fp, &body[0], tagSize)) {
+			fclose(fp);
+			return false;
+		}
+	}
+	uint64_t audioStart = tagSize ? 10 + tagSize : 0;
+
+	string frames;
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(body.data());
+	for (size_t pos = 0; pos + 10 <= body.size() && p[pos]; ) { // a zero is padding
+		uint32_t len = version == 4 ? syncsafe32(p + pos + 4) : be32(p + pos + 4);
+		if (len > body.size() - pos - 10) break; // broken frame, the rest is dropped
+		bool isReplayGain = false;
+		if (!body.compare(pos, 4, "TXXX") && len > 1) {
+			// The description, as ASCII: one byte per char, or two for UTF-16.
+			uint8_t enc = p[pos + 10];
+			size_t at = pos + 11, end = pos + 10 + len, step = (enc == 1 || enc == 2) ? 2 : 1;
+			if (enc == 1 && at + 2 <= end) at += 2; // BOM
+			string desc;
+			for (; at + step <= end; at += step) {
+				uint8_t ch = step == 1 ? p[at] : (enc == 2 || (enc == 1 && p[pos + 11] == 0xfe) ? p[at + 1] : p[at]);
+				if (!ch) break;
+				desc.push_back(static_cast<char>(ch));
+			}
+			isReplayGain = isReplayGainKey(desc);
+		}
+		if (!isReplayGain) frames.append(body, pos, 10 + len);
+		pos += 10 + len;
+	}
+	for (const auto& t : replayGainTags(rg)) {
+		string content = string(1, '\0') + t.first + '\0' + t.second; // ISO-8859-1
+		frames.append("TXXX");
+		if (version == 4) putSyncsafe32(frames, static_cast<uint32_t>(content.size()));
+		else putBe32(frames, static_cast<uint32_t>(content.size()));
+		frames.append(2, '\0'); // no flags
+		frames.append(content);
+	}
+
+	if (tagSize && frames.size() <= tagSize) { // what's left is padding
+		fclose(fp);
+		frames.resize(tagSize, '\0');
+		overwriteHead(path, 10, frames);
+		return true;
+	}
+	string head = "ID3";
+	head.push_back(static_cast<char>(version));
+	head.append(2, '\0'); // revision, flags
+	putSyncsafe32(head, static_cast<uint32_t>(frames.size() + ID3_PADDING));
+	head.append(frames).append(ID3_PADDING, '\0');
+	rewriteWithHead(path, fp, audioStart, head);
+	return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+
+// ReplayGain tags written into finished outputs: a Vorbis comment in FLAC,
+// TXXX frames in an ID3v2 tag in MP3, as players read them. Only the tag is
+// rewritten when it fits in the room the file already has, padding included;
+// else the file is copied once, leaving room for next time.
+struct Tags final {
+private:
+	Tags() = delete;
+
+public:
+	struct replay_gain final {
+		double trackGain = 0, trackPeak = 0; // dB, linear
+		bool   hasAlbum = false;
+		double albumGain = 0, albumPeak = 0;
+	};
+
+	// Replaces earlier ReplayGain tags, keeps all others; false if the file
+	// isn't FLAC or MP3, or has a tag we won't touch. Throws on I/O errors.
+	static bool writeReplayGain(const std::wstring& path, const replay_gain& rg);
+
+private:
+	static bool _writeFlac(const std::wstring& path, const replay_gain& rg);
+	static bool _writeMp3(const std::wstring& path, const replay_gain& rg);
+};
@@ -0,0 +1,250 @@
+#include "Telemetry.h"
+#include <algorithm>
+#include <cstdio>
+#include "Sys.h"
+using std::string;
+using std::wstring;
+
+static const size_t NUM_STAGES = static_cast<size_t>(Telemetry::stage::COUNT);
+
+static thread_local Telemetry::job_record* tlJob = nullptr;
+static thread_local const Telemetry* tlOwner = nullptr;
+
+static string _num(double v, const char* fmt = "%.6f")
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), fmt, v);
+	return buf;
+}
+
+Telemetry::scope::scope(stage what, unsigned lane)
+	: mJob(tlJob), mWhat(what), mLane(lane)
+{
+	if (mJob) mT0 = tlOwner->now();
+}
+
+void Telemetry::scope::end()
+{
+	if (!mJob) return;
+	double t1 = tlOwner->now();
+	mJob->spans.push_back({mWhat, mLane, mT0, t1});
+	mJob->stageSecs[static_cast<size_t>(mWhat)] += t1 - mT0;
+	mJob = nullptr;
+}
+
+Telemetry::Telemetry(size_t numJobs)
+	: mTime0(std::chrono::steady_clock::now()), mJobs(numJobs)
+{
+}
+
+double Telemetry::now() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - mTime0).count();
+}
+
+void Telemetry::queued(size_t index)
+{
+	mJobs[index].queued = now(); // before submitting, so the worker sees it
+}
+
+void Telemetry::begin(size_t index, const wstring& file, size_t worker)
+{
+	job_record& job = mJobs[index];
+	job.file = file;
+	job.worker = worker;
+	job.started = now();
+	tlJob = &job;
+	tlOwner = this;
+}
+
+void Telemetry::end(size_t index, uint64_t bytesIn, uint64_t bytesOut, const char* outcome)
+{
+	job_record& job = mJobs[index];
+	job.finished = now();
+	job.bytesIn = bytesIn;
+	job.bytesOut = bytesOut;
+	job.outcome = outcome;
+	tlJob = nullptr;
+	tlOwner = nullptr;
+}
+
+void Telemetry::resume(size_t index)
+{
+	tlJob = &mJobs[index];
+	tlOwner = this;
+}
+
+void Telemetry::detach()
+{
+	tlJob = nullptr;
+	tlOwner = nullptr;
+}
+
+void Telemetry::addCpu(size_t index, double secs)
+{
+	mJobs[index].cpuSecs += secs;
+}
+
+bool Telemetry::isRecording()
+{
+	return tlJob != nullptr;
+}
+
+void Telemetry::add(stage what, double secs)
+{
+	if (tlJob) tlJob->stageSecs[static_cast<size_t>(what)] += secs;
+}
+
+void Telemetry::writeCsv(const wstring& path) const
+{
+	string csv = "index,file,worker,outcome,queued,started,finished,queue_wait";
+	for (size_t s = 0; s < NUM_STAGES; ++s) {
+		csv.append(",").append(stageName(static_cast<stage>(s)));
+	}
+	csv.append(",cpu,bytes_in,bytes_out\n");
+
+	for (size_t i = 0; i < mJobs.size(); ++i) {
+		const job_record& job = mJobs[i];
+		if (!*job.outcome) continue; // never ran, batch was cancelled
+		string file = Sys::toUtf8(job.file);
+		string quoted = "\"";
+		for (char ch : file) {
+			if (ch == '"') quoted.push_back('"'); // doubled, as CSV escapes quotes
+			quoted.push_back(ch);
+		}
+		quoted.push_back('"');
+
+		csv.append(std::to_string(i)).append(",").append(quoted)
+			.append(",").append(std::to_string(job.worker)).append(",").append(job.outcome)
+			.append(",").append(_num(job.queued)).append(",").append(_num(job.started))
+			.append(",").append(_num(job.finished)).append(",").append(_num(job.started - job.queued));
+		for (size_t s = 0; s < NUM_STAGES; ++s) {
+			csv.append(",").append(_num(job.stageSecs[s]));
+		}
+		csv.append(",").append(_num(job.cpuSecs)).append(",").append(std::to_string(job.bytesIn))
+			.append(",").append(std::to_string(job.bytesOut)).append("\n");
+	}
+	Sys::writeFile(path, csv);
+}
+
+void Telemetry::writeJson(const wstring& path) const
+{
+	// Totals first, then each job; the worker busy times show the idle ones.
+	double wall = 0, queueWait = 0, maxQueueWait = 0;
+	double stageTotals[NUM_STAGES] = {};
+	uint64_t bytesIn = 0, bytesOut = 0;
+	size_t numJobs = 0;
+	std::vector<double> busy, cpu;
+	string jobs;
+
+	for (size_t i = 0; i < mJobs.size(); ++i) {
+		const job_record& job = mJobs[i];
+		if (!*job.outcome) continue;
+		++numJobs;
+		wall = std::max(wall, job.finished);
+		queueWait += job.started - job.queued;
+		maxQueueWait = std::max(maxQueueWait, job.started - job.queued);
+		bytesIn += job.bytesIn;
+		bytesOut += job.bytesOut;
+		if (busy.size() <= job.worker) busy.resize(job.worker + 1, 0);
+		busy[job.worker] += job.finished - job.started;
+		if (cpu.size() <= job.worker) cpu.resize(job.worker + 1, 0);
+		cpu[job.worker] += job.cpuSecs;
+
+		jobs.append(jobs.empty() ? "\n" : ",\n").append("  {\"index\":").append(std::to_string(i))
+			.append(",\"file\":").append(Sys::jsonString(Sys::toUtf8(job.file)))
+			.append(",\"worker\":").append(std::to_string(job.worker))
+			.append(",\"outcome\":\"").append(job.outcome).append("\"")
+			.append(",\"queued\":").append(_num(job.queued))
+			.append(",\"started\":").append(_num(job.started))
+			.append(",\"finished\":").append(_num(job.finished));
+		for (size_t s = 0; s < NUM_STAGES; ++s) {
+			stageTotals[s] += job.stageSecs[s];
+			jobs.append(",\"").append(stageName(static_cast<stage>(s))).append("\":").append(_num(job.stageSecs[s]));
+		}
+		jobs.append(",\"cpu\":").append(_num(job.cpuSecs))
+			.append(",\"bytes_in\":").append(std::to_string(job.bytesIn))
+			.append(",\"bytes_out\":").append(std::to_string(job.bytesOut)).append("}");
+	}
+
+	string json = "{\"summary\":{\"jobs\":" + std::to_string(numJobs)
+		+ ",\"wall\":" + _num(wall)
+		+ ",\"queue_wait\":" + _num(queueWait) + ",\"max_queue_wait\":" + _num(maxQueueWait);
+	for (size_t s = 0; s < NUM_STAGES; ++s) {
+		json.append(",\"").append(stageName(static_cast<stage>(s))).append("\":").append(_num(stageTotals[s]));
+	}
+	json.append(",\"bytes_in\":").append(std::to_string(bytesIn))
+		.append(",\"bytes_out\":").append(std::to_string(bytesOut))
+		.append(",\"worker_busy\":[");
+	for (size_t w = 0; w < busy.size(); ++w) {
+		json.append(w ? "," : "").append(_num(busy[w]));
+	}
+	json.append("],\"worker_cpu\":[");
+	for (size_t w = 0; w < cpu.size(); ++w) {
+		json.append(w ? "," : "").append(_num(cpu[w]));
+	}
+	json.append("]},\n\"jobs\":[").append(jobs).append("\n]}\n");
+	Sys::writeFile(path, json);
+}
+
+void Telemetry::writeTrace(const wstring& path) const
+{
+	// Chrome trace events, for chrome://tracing or Perfetto: a row per worker
+	// with its jobs and their stages, plus a row for encoders fed by a pipe,
+	// which overlap their decoders.
+	auto us = [](double secs) { return _num(secs * 1e6, "%.1f"); };
+	string events;
+	size_t numWorkers = 0;
+
+	for (size_t i = 0; i < mJobs.size(); ++i) {
+		const job_record& job = mJobs[i];
+		if (!*job.outcome) continue;
+		numWorkers = std::max(numWorkers, job.worker + 1);
+		string name = Sys::jsonString(Sys::toUtf8(Sys::fileFrom(job.file)));
+
+		events.append(",\n{\"name\":").append(name).append(",\"cat\":\"job\",\"ph\":\"X\",\"pid\":1")
+			.append(",\"tid\":").append(std::to_string(job.worker * 2))
+			.append(",\"ts\":").append(us(job.started)).append(",\"dur\":").append(us(job.finished - job.started))
+			.append(",\"args\":{\"index\":").append(std::to_string(i))
+			.append(",\"outcome\":\"").append(job.outcome).append("\"")
+			.append(",\"queue_wait_ms\":").append(_num((job.started - job.queued) * 1000, "%.3f"))
+			.append(",\"bytes_in\":").append(std::to_string(job.bytesIn))
+			.append(",\"bytes_out\":").append(std::to_string(job.bytesOut)).append("}}");
+
+		for (const span& sp : job.spans) {
+			events.append(",\n{\"name\":\"").append(stageName(sp.what)).append("\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1")
+				.append(",\"tid\":").append(std::to_string(job.worker * 2 + sp.lane))
+				.append(",\"ts\":").append(us(sp.t0)).append(",\"dur\":").append(us(sp.t1 - sp.t0)).append("}");
+		}
+	}
+
+	string trace = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"flac-lame-frontend\"}}";
+	for (size_t w = 0; w < numWorkers; ++w) {
+		for (unsigned lane = 0; lane < 2; ++lane) {
+			trace.append(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":")
+				.append(std::to_string(w * 2 + lane)).append(",\"args\":{\"name\":\"worker ")
+				.append(std::to_string(w)).append(lane ? " encoder" : "").append("\"}}");
+		}
+	}
+	trace.append(events).append("\n]}\n");
+	Sys::writeFile(path, trace);
+}
+
+const char* Telemetry::stageName(stage what)
+{
+	switch (what) {
+	case stage::SPAWN:     return "spawn";
+	case stage::DECODE:    return "decode";
+	case stage::ENCODE:    return "encode";
+	case stage::TRANSCODE: return "transcode";
+	case stage::DELETE:    return "delete";
+	case stage::COPY:      return "copy";
+	case stage::ANALYZE:   return "analyze";
+	case stage::TAG:       return "tag";
+	case stage::VERIFY:    return "verify";
+	case stage::TRANSFER:  return "transfer";
+	case stage::REMOTE:    return "remote";
+	default:               return "";
+	}
+}
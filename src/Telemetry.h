@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Timings of each job and of its stages, recorded only when asked for, to
+// find stragglers, stalls and idle workers in big batches. Convert marks its
+// stages with scopes, which do nothing unless the running thread is recording
+// a job, so the cost when off is a thread-local check.
+class Telemetry final {
+public:
+	enum class stage { SPAWN, DECODE, ENCODE, TRANSCODE, DELETE, COPY, ANALYZE, TAG, VERIFY, TRANSFER, REMOTE, COUNT }; // REMOTE: on a node of a Farm
+
+	struct span final {
+		stage    what;
+		unsigned lane; // 1 for an encoder running alongside its decoder
+		double   t0, t1;
+	};
+
+	struct job_record final {
+		std::wstring file;
+		size_t       worker = 0;
+		double       queued = 0, started = 0, finished = 0; // seconds since the batch started
+		uint64_t     bytesIn = 0, bytesOut = 0;
+		double       stageSecs[static_cast<size_t>(stage::COUNT)] = {};
+		double       cpuSecs = 0; // of the worker and its tools, all attempts
+		std::vector<span> spans;
+		const char*  outcome = "";
+	};
+
+	class scope final {
+	private:
+		job_record* mJob;
+		stage       mWhat;
+		unsigned    mLane;
+		double      mT0 = 0;
+
+	public:
+		explicit scope(stage what, unsigned lane = 0);
+		scope(const scope&) = delete;
+		scope& operator=(const scope&) = delete;
+		~scope() { end(); }
+		void end();
+	};
+
+private:
+	std::chrono::steady_clock::time_point mTime0;
+	std::vector<job_record> mJobs; // one per file, each written only by the worker running it
+
+public:
+	explicit Telemetry(size_t numJobs);
+
+	double now() const;
+	void   queued(size_t index);
+	void   begin(size_t index, const std::wstring& file, size_t worker);
+	void   end(size_t index, uint64_t bytesIn, uint64_t bytesOut, const char* outcome);
+	void   resume(size_t index); // a job begun on another worker, for a later stage of it
+	static void detach(); // the calling thread stops recording, the job goes on elsewhere
+	void   addCpu(size_t index, double secs);
+	static bool isRecording();
+	static void add(stage what, double secs); // to the job of this thread, with no span
+
+	void writeCsv(const std::wstring& path) const;
+	void writeJson(const std::wstring& path) const;
+	void writeTrace(const std::wstring& path) const;
+
+	static const char* stageName(stage what);
+};
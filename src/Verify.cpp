@@ -0,0 +1,345 @@
+#include "Verify.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "Cancel.h"
+#include "Codec.h"
+#include "MappedFile.h"
+#include "Md5.h"
+#include "Process.h"
+#include "Sys.h"
+using std::array;
+using std::runtime_error;
+using std::string;
+using std::vector;
+using std::wstring;
+
+static const size_t WINDOW_SZ = 4 * 1024 * 1024; // mapped at once, while hashing or walking
+static const size_t DECODE_FRAMES = 4096; // per block, in-process
+static const double MIN_SLACK_SECS = 0.001; // rounding, where both lengths are counted in samples
+static const unsigned MP3_SLACK_FRAMES = 3; // encoder delay and padding, when there's no LAME tag to tell them
+
+static uint32_t be32(const uint8_t* p) { return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint32_t le32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+static uint16_t le16(const uint8_t* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+
+static thread_local bool tlDeferred = false;
+
+Verify::deferred::deferred()
+	: mPrev(tlDeferred)
+{
+	tlDeferred = true;
+}
+
+Verify::deferred::~deferred()
+{
+	tlDeferred = mPrev;
+}
+
+bool Verify::isDeferred()
+{
+	return tlDeferred;
+}
+
+Verify::reference Verify::referenceOf(const wstring& src)
+{
+	reference ref;
+	Probe::info i = Probe::read(src);
+	if (i.fmt == Probe::format::FLAC) {
+		ref.hasMd5 = _flacMd5(src, ref.md5, ref.bitsPerSample);
+		ref.durationSecs = i.durationSecs;
+	} else if (i.fmt == Probe::format::WAV) {
+		ref.hasMd5 = _wavMd5(src, ref.md5, ref.bitsPerSample);
+		ref.durationSecs = i.problem.empty() ? i.durationSecs : 0;
+	} else if (i.fmt == Probe::format::MP3) {
+		// The probe guesses the length of a VBR file with no header; the
+		// frames themselves tell it right.
+		mp3_walk w = _walkMp3(src);
+		if (w.problem.empty()) {
+			ref.durationSecs = w.durationSecs();
+			ref.slackSecs = static_cast<double>(MP3_SLACK_FRAMES) * w.samplesPerFrame / w.sampleRate;
+		}
+	}
+	return ref;
+}
+
+void Verify::output(const Convert::options& opts, const wstring& path, Probe::format fmt, const reference& ref)
+{
+	Cancel::check();
+	if (fmt == Probe::format::FLAC) {
+		_flac(opts, path, ref);
+	} else if (fmt == Probe::format::MP3) {
+		_mp3(path, ref);
+	} else {
+		_wav(path, ref);
+	}
+}
+
+wstring Verify::pendingPath(const wstring& src, const wstring& destPath)
+{
+	return Sys::isSamePath(src, destPath) ? destPath + L".tmp" : destPath; // as Convert writes it aside
+}
+
+bool Verify::pcmMd5(const wstring& path, array<uint8_t, 16>& md5, unsigned& bitsPerSample)
+{
+	Probe::format fmt = Probe::read(path).fmt;
+	if (fmt == Probe::format::FLAC) return _flacMd5(path, md5, bitsPerSample);
+	if (fmt == Probe::format::WAV) return _wavMd5(path, md5, bitsPerSample);
+	return false;
+}
+
+double Verify::mp3_walk::durationSecs() const
+{
+	uint64_t numSamples = numFrames * samplesPerFrame;
+	if (delay + padding < numSamples) numSamples -= delay + padding; // what a decoder gives back
+	return sampleRate ? static_cast<double>(numSamples) / sampleRate : 0;
+}
+
+void Verify::_flac(const Convert::options& opts, const wstring& path, const reference& ref)
+{
+	Probe::info i = Probe::read(path);
+	if (i.fmt != Probe::format::FLAC) throw _error(path, "not a FLAC file");
+	if (!i.problem.empty()) throw _error(path, i.problem);
+	array<uint8_t, 16> md5{};
+	unsigned bitsPerSample = 0;
+	bool isSigned = _flacMd5(path, md5, bitsPerSample);
+
+	// Decoded whole, each frame checked against its CRC, and the PCM against
+	// the signature; the tool does it too.
+	if (opts.inProcess && Codec::available()) {
+		try {
+			std::unique_ptr<Codec::decoder> dec = Codec::openDecoder(path);
+			const Codec::format& fmt = dec->fmt();
+			unsigned bytesPerSample = (fmt.bitsPerSample + 7) / 8;
+			vector<int32_t> buf(DECODE_FRAMES * fmt.channels);
+			vector<uint8_t> packed;
+			Md5 hash;
+			for (;;) {
+				Cancel::check();
+				size_t numFrames = dec->read(&buf[0], DECODE_FRAMES);
+				if (!numFrames) break;
+				size_t numSamples = numFrames * fmt.channels;
+				packed.resize(numSamples * bytesPerSample);
+				uint8_t* p = &packed[0];
+				for (size_t s = 0; s < numSamples; ++s) { // signature is over little-endian signed samples
+					for (unsigned b = 0; b < bytesPerSample; ++b) {
+						*p++ = static_cast<uint8_t>(static_cast<uint32_t>(buf[s]) >> (8 * b));
+					}
+				}
+				hash.update(packed.data(), packed.size());
+			}
+			if (isSigned && hash.finish() != md5) throw _error(path, "its audio doesn't match its own signature");
+		} catch (const Codec::error& e) {
+			throw _error(path, e.what());
+		}
+	} else {
+		Process tool;
+		tool.start({opts.flac, L"-t", L"-s", path}, Process::NO_HANDLE, Process::NO_HANDLE, true);
+		int exitCode = tool.wait();
+		if (exitCode && Cancel::isRequested()) throw Cancel::error();
+		if (exitCode) {
+			throw Convert::tool_error(exitCode, tool.errText(), "Output failed verification, the decoder exited with code "
+				+ std::to_string(exitCode) + ":\n" + Sys::toUtf8(path));
+		}
+	}
+
+	if (isSigned && ref.hasMd5 && bitsPerSample == ref.bitsPerSample) {
+		if (md5 != ref.md5) throw _error(path, "its audio differs from the source's");
+		return;
+	}
+	_duration(path, i.durationSecs, MIN_SLACK_SECS, ref);
+}
+
+void Verify::_mp3(const wstring& path, const reference& ref)
+{
+	mp3_walk w = _walkMp3(path);
+	if (!w.problem.empty()) throw _error(path, w.problem);
+	_duration(path, w.durationSecs(), static_cast<double>(MP3_SLACK_FRAMES) * w.samplesPerFrame / w.sampleRate, ref);
+}
+
+void Verify::_wav(const wstring& path, const reference& ref)
+{
+	Probe::info i = Probe::read(path);
+	if (i.fmt != Probe::format::WAV) throw _error(path, "not a WAV file");
+	if (!i.problem.empty()) throw _error(path, i.problem);
+
+	array<uint8_t, 16> md5{};
+	unsigned bitsPerSample = 0;
+	if (ref.hasMd5 && _wavMd5(path, md5, bitsPerSample) && bitsPerSample == ref.bitsPerSample) {
+		if (md5 != ref.md5) throw _error(path, "its audio differs from the source's");
+		return;
+	}
+	_duration(path, i.durationSecs, MIN_SLACK_SECS, ref);
+}
+
+void Verify::_duration(const wstring& path, double secs, double slackSecs, const reference& ref)
+{
+	if (ref.durationSecs <= 0) return; // nothing to hold it to
+	if (std::fabs(secs - ref.durationSecs) > std::max(slackSecs, ref.slackSecs)) {
+		char why[96];
+		snprintf(why, sizeof(why), "it lasts %.3f s, its source %.3f s", secs, ref.durationSecs);
+		throw _error(path, why);
+	}
+}
+
+bool Verify::_flacMd5(const wstring& path, array<uint8_t, 16>& md5, unsigned& bitsPerSample)
+{
+	MappedFile file;
+	if (!file.open(path)) return false;
+	size_t len = 10;
+	const uint8_t* buf = file.view(0, len);
+	uint64_t base = Probe::id3v2Size(buf, len);
+	len = 4 + 4 + 34;
+	buf = file.view(base, len);
+	if (len < 4 + 4 + 34 || memcmp(buf, "fLaC", 4) != 0) return false;
+
+	const uint8_t* si = buf + 8; // STREAMINFO is always the first block
+	bitsPerSample = (((si[12] & 0x01) << 4) | (si[13] >> 4)) + 1;
+	memcpy(md5.data(), si + 18, 16);
+	return std::any_of(md5.begin(), md5.end(), [](uint8_t b) { return b != 0; }); // zeroes when not computed
+}
+
+bool Verify::_wavMd5(const wstring& path, array<uint8_t, 16>& md5, unsigned& bitsPerSample)
+{
+	MappedFile file;
+	if (!file.open(path)) return false;
+	size_t len = 12;
+	const uint8_t* buf = file.view(0, len);
+	if (len < 12 || (memcmp(buf, "RIFF", 4) != 0 && memcmp(buf, "RF64", 4) != 0)
+		|| memcmp(buf + 8, "WAVE", 4) != 0) return false;
+
+	// FLAC signs signed samples, in whole bytes: 8-bit WAV is unsigned, so
+	// it's flipped first, and fewer valid bits than the container holds are
+	// shifted, so those can't be hashed from the file at all.
+	bool hasFmt = false;
+	for (uint64_t off = 12; off + 8 <= file.size(); ) {
+		len = 8 + 40;
+		buf = file.view(off, len);
+		if (len < 8) return false;
+		uint32_t chunkSz = le32(buf + 4);
+		if (!memcmp(buf, "fmt ", 4) && len >= 8 + 16) {
+			uint16_t tag = le16(buf + 8);
+			bitsPerSample = le16(buf + 8 + 14);
+			if (tag == 0xfffe && len >= 8 + 26) { // extensible: valid bits, then the subformat
+				if (le16(buf + 8 + 18) != bitsPerSample) return false;
+				tag = le16(buf + 8 + 24);
+			}
+			if (tag != 1 || bitsPerSample % 8 || bitsPerSample > 32) return false; // float or odd
+			hasFmt = true;
+		} else if (!memcmp(buf, "data", 4)) {
+			if (!hasFmt) return false;
+			uint64_t dataOff = off + 8, dataSz = chunkSz;
+			if (dataOff + dataSz > file.size()) dataSz = file.size() - dataOff; // streamed, or RF64
+			Md5 hash;
+			vector<uint8_t> flipped;
+			for (uint64_t pos = 0; pos < dataSz; ) {
+				Cancel::check();
+				len = static_cast<size_t>(std::min<uint64_t>(WINDOW_SZ, dataSz - pos));
+				buf = file.view(dataOff + pos, len);
+				if (!len) return false;
+				if (bitsPerSample == 8) {
+					flipped.assign(buf, buf + len);
+					for (uint8_t& b : flipped) b ^= 0x80;
+					hash.update(flipped.data(), len);
+				} else {
+					hash.update(buf, len);
+				}
+				pos += len;
+			}
+			md5 = hash.finish();
+			return true;
+		}
+		off += 8 + static_cast<uint64_t>(chunkSz) + (chunkSz & 1); // chunks are word-aligned
+	}
+	return false;
+}
+
+Verify::mp3_walk Verify::_walkMp3(const wstring& path)
+{
+	mp3_walk w;
+	MappedFile file;
+	if (!file.open(path)) {
+		w.problem = "it can't be read";
+		return w;
+	}
+	uint64_t size = file.size();
+	uint64_t winOff = 0;
+	size_t winLen = 0;
+	const uint8_t* win = nullptr;
+	auto at = [&](uint64_t off, size_t need) -> const uint8_t* { // null past the end of the file
+		if (!win || off < winOff || off + need > winOff + winLen) {
+			Cancel::check();
+			winOff = off;
+			winLen = WINDOW_SZ;
+			win = file.view(off, winLen);
+		}
+		return off + need <= winOff + winLen ? win + (off - winOff) : nullptr;
+	};
+
+	const uint8_t* head = at(0, 10);
+	uint64_t pos = head ? Probe::id3v2Size(head, 10) : 0;
+	uint8_t first[4] = {};
+	bool isFirst = true;
+	while (pos < size) {
+		// Each frame must start where the last one ended, of the same version,
+		// layer and rate; only tags may follow the last one.
+		const uint8_t* h = at(pos, 4);
+		Probe::mp3_frame f;
+		if (!h || !Probe::readMp3Frame(h, f) || (!isFirst && (((h[1] ^ first[1]) & 0xfe) || ((h[2] ^ first[2]) & 0x0c)))) {
+			uint64_t left = size - pos;
+			const uint8_t* tag = at(pos, static_cast<size_t>(std::min<uint64_t>(left, 8)));
+			if (!isFirst && tag && ((left == 128 && !memcmp(tag, "TAG", 3))
+				|| (left >= 32 && !memcmp(tag, "APETAGEX", 8)))) break;
+			w.problem = isFirst ? "no audio frame where the audio starts"
+				: "frame " + std::to_string(w.numFrames + 1) + " is broken or unlike the others";
+			return w;
+		}
+		if (pos + f.len > size) {
+			w.problem = "its last frame is cut short";
+			return w;
+		}
+
+		if (isFirst) {
+			memcpy(first, h, 4);
+			w.sampleRate = f.sampleRate;
+			w.samplesPerFrame = f.samplesPerFrame;
+			// A Xing/Info frame carries no audio, but the frame count and, from
+			// LAME, the samples its decoders drop at both ends.
+			const uint8_t* x = at(pos, f.len);
+			bool isHeader = false;
+			size_t xo = 4 + f.sideInfoLen;
+			if (x && xo + 8 <= f.len && (!memcmp(x + xo, "Xing", 4) || !memcmp(x + xo, "Info", 4))) {
+				uint32_t flags = be32(x + xo + 4);
+				size_t fieldOff = xo + 8;
+				if ((flags & 0x01) && fieldOff + 4 <= f.len) w.headerFrames = be32(x + fieldOff);
+				fieldOff += ((flags & 0x01) ? 4 : 0) + ((flags & 0x02) ? 4 : 0) + ((flags & 0x04) ? 100 : 0) + ((flags & 0x08) ? 4 : 0);
+				if (fieldOff + 24 <= f.len && !memcmp(x + fieldOff, "LAME", 4)) {
+					const uint8_t* d = x + fieldOff + 21;
+					w.delay = (d[0] << 4) | (d[1] >> 4);
+					w.padding = ((d[1] & 0x0f) << 8) | d[2];
+				}
+				isHeader = true;
+			}
+			isFirst = false;
+			if (!isHeader) ++w.numFrames;
+		} else {
+			++w.numFrames;
+		}
+		pos += f.len;
+	}
+
+	if (isFirst) {
+		w.problem = "no audio frames";
+	} else if (w.headerFrames && (w.headerFrames > w.numFrames + 1 || w.numFrames > w.headerFrames + 1)) {
+		w.problem = "it has " + std::to_string(w.numFrames) + " frames, its header says "
+			+ std::to_string(w.headerFrames);
+	}
+	return w;
+}
+
+runtime_error Verify::_error(const wstring& path, const string& why)
+{
+	return runtime_error("Output failed verification, " + why + ":\n" + Sys::toUtf8(path));
+}
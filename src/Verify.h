@@ -0,0 +1,70 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "Convert.h"
+#include "Probe.h"
+
+// Checks an output before its source can go: FLAC is decoded and matched
+// against the signature of its PCM, MP3 is walked frame by frame, WAV is
+// hashed; each one also against the length of the source. It runs after
+// the conversion, on a job of its own, so the next files encode meanwhile.
+struct Verify final {
+private:
+	Verify() = delete;
+
+public:
+	// What an output must match, read from its source.
+	struct reference final {
+		bool     hasMd5 = false; // of the PCM, as FLAC signs it
+		std::array<uint8_t, 16> md5{};
+		unsigned bitsPerSample = 0; // signatures only match at the same depth
+		double   durationSecs = 0; // 0 if unknown
+		double   slackSecs = 0; // how far off an output may be, a few frames if it's an MP3
+	};
+
+	// While in scope, the conversions of the calling thread leave checking
+	// to output(): FLAC encoders don't verify as they go, and an output which
+	// replaces its source is left aside, at pendingPath(); like Cancel,
+	// Convert needs no extra arguments.
+	class deferred final {
+	private:
+		bool mPrev;
+
+	public:
+		deferred();
+		deferred(const deferred&) = delete;
+		deferred& operator=(const deferred&) = delete;
+		~deferred();
+	};
+
+	static bool      isDeferred(); // for the calling thread
+	static reference referenceOf(const std::wstring& src); // never throws, unknown fields are left empty
+	static void      output(const Convert::options& opts, const std::wstring& path, Probe::format fmt,
+		const reference& ref); // throws if it fails
+	static std::wstring pendingPath(const std::wstring& src, const std::wstring& destPath);
+	static bool      pcmMd5(const std::wstring& path, std::array<uint8_t, 16>& md5,
+		unsigned& bitsPerSample); // as FLAC signs the PCM, of a FLAC or WAV; false if it can't tell
+
+private:
+	// Frames of an MP3, walked from the first to the last.
+	struct mp3_walk final {
+		uint64_t numFrames = 0; // of audio, a Xing/Info frame not counted
+		unsigned sampleRate = 0, samplesPerFrame = 0;
+		uint32_t headerFrames = 0; // as the Xing/Info frame tells, 0 if none
+		unsigned delay = 0, padding = 0; // samples, as the LAME tag tells
+		std::string problem; // empty if all frames are whole and alike
+
+		double durationSecs() const;
+	};
+
+	static void     _flac(const Convert::options& opts, const std::wstring& path, const reference& ref);
+	static void     _mp3(const std::wstring& path, const reference& ref);
+	static void     _wav(const std::wstring& path, const reference& ref);
+	static void     _duration(const std::wstring& path, double secs, double slackSecs, const reference& ref);
+	static bool     _flacMd5(const std::wstring& path, std::array<uint8_t, 16>& md5, unsigned& bitsPerSample); // false if unsigned
+	static bool     _wavMd5(const std::wstring& path, std::array<uint8_t, 16>& md5, unsigned& bitsPerSample); // false if FLAC would sign other bytes
+	static mp3_walk _walkMp3(const std::wstring& path);
+	static std::runtime_error _error(const std::wstring& path, const std::string& why);
+};
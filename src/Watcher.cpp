@@ -0,0 +1,485 @@
+#include "Watcher.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+#include "Sys.h"
+using std::runtime_error;
+using std::vector;
+using std::wstring;
+
+static const double BUCKETS_PER_DECADE = 20; // each about 12% wider than the last
+
+#if !defined(_WIN32) && defined(__linux__)
+static const uint32_t WATCH_MASK = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM;
+#endif
+
+Watcher::Watcher(const Runner::runnin_options& opts, const options& wopts)
+	: mOpts(opts), mWOpts(wopts)
+{
+	// Absolute everywhere, so the paths the system gives compare with ours.
+	mOpts.files.clear();
+	if (!mOpts.destFolder.empty()) mOpts.destFolder = Sys::trimSeparator(Sys::absolutePath(mOpts.destFolder));
+	for (Convert::output& o : mOpts.moreOutputs) {
+		if (!o.dest.empty()) o.dest = Sys::trimSeparator(Sys::absolutePath(o.dest));
+	}
+	for (wstring& f : mWOpts.folders) {
+		f = Sys::trimSeparator(Sys::absolutePath(f));
+	}
+	mOutputs = Runner::outputs(mOpts);
+	mBudget = mOpts.numThreads ? mOpts.numThreads : Sys::numProcessors();
+}
+
+Watcher::~Watcher()
+{
+	stop();
+	_cancelBatches();
+	_stopMonitor();
+}
+
+void Watcher::run(file_done_func onFileDone)
+{
+	mOnFileDone = std::move(onFileDone);
+	_startMonitor();
+
+	try {
+		std::unique_lock<std::mutex> lk(mMtx);
+		while (!mStop) {
+			_reapBatches(lk);
+			uint64_t changes = mChanges;
+			clock_type::time_point nextDue;
+			vector<arrival> ready = _takeReady(lk, nextDue);
+			if (!ready.empty()) {
+				_startBatch(std::move(ready), lk);
+				continue;
+			}
+			auto woken = [&]() { return mStop || mChanges != changes; };
+			if (nextDue == clock_type::time_point::max()) {
+				mCv.wait(lk, woken);
+			} else {
+				mCv.wait_until(lk, nextDue, woken);
+			}
+		}
+	} catch (...) {
+		_cancelBatches();
+		_stopMonitor();
+		throw;
+	}
+	_cancelBatches();
+	_stopMonitor();
+}
+
+void Watcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lk(mMtx);
+		mStop = true;
+		++mChanges;
+	}
+	mCv.notify_all();
+}
+
+double Watcher::latencySecs(double percentile) const
+{
+	// Nearest rank, to the upper bound of its bucket.
+	std::lock_guard<std::mutex> lk(mLatencyMtx);
+	uint64_t total = 0;
+	for (uint64_t n : mLatency) total += n;
+	if (!total) return 0;
+	uint64_t rank = static_cast<uint64_t>(std::ceil(percentile / 100 * total));
+	rank = std::min(std::max<uint64_t>(rank, 1), total);
+	size_t i = 0;
+	for (uint64_t seen = 0; (seen += mLatency[i]) < rank; ++i) ;
+	return std::pow(10, (i + 1) / BUCKETS_PER_DECADE) / 1000;
+}
+
+void Watcher::_startMonitor()
+{
+	// Watches first, then what's already there: a file landing in between is
+	// seen twice, which is harmless, instead of not at all.
+#ifdef _WIN32
+	if (mWOpts.folders.size() >= MAXIMUM_WAIT_OBJECTS) {
+		throw runtime_error("Too many folders to watch, at most "
+			+ std::to_string(MAXIMUM_WAIT_OBJECTS - 1) + " are.");
+	}
+	mWake = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	mFolders.reserve(mWOpts.folders.size()); // never moved once reading, the system writes into them
+	for (const wstring& path : mWOpts.folders) {
+		folder f;
+		f.path = path;
+		f.dir = CreateFileW(path.c_str(), FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+		if (f.dir == INVALID_HANDLE_VALUE) {
+			throw runtime_error("Failed to watch the folder:\n" + Sys::toUtf8(path));
+		}
+		f.ovl.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		f.buf.resize(64 * 1024 / sizeof(DWORD)); // the most a network share passes at once
+		mFolders.emplace_back(std::move(f));
+		_readChanges(mFolders.back());
+	}
+	for (const wstring& path : mWOpts.folders) {
+		_scan(path, false);
+	}
+#elif defined(__linux__)
+	mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (mInotify < 0 || pipe(mWake) != 0) {
+		throw runtime_error(std::string("Failed to watch the folders: ") + strerror(errno));
+	}
+	for (const wstring& path : mWOpts.folders) {
+		if (!_scan(path, true)) {
+			throw runtime_error("Failed to watch the folder, " + std::string(strerror(errno)) + ":\n"
+				+ Sys::toUtf8(path));
+		}
+	}
+#else
+	throw runtime_error("Watching folders needs Windows or Linux.");
+#endif
+	mMonitorThr = std::thread([this]() { _monitorLoop(); });
+}
+
+void Watcher::_stopMonitor()
+{
+#ifdef _WIN32
+	if (mWake) SetEvent(mWake);
+	if (mMonitorThr.joinable()) mMonitorThr.join();
+	for (folder& f : mFolders) {
+		DWORD n = 0;
+		if (CancelIoEx(f.dir, &f.ovl) || GetLastError() != ERROR_NOT_FOUND) {
+			GetOverlappedResult(f.dir, &f.ovl, &n, TRUE); // the buffer is written until then
+		}
+		CloseHandle(f.dir);
+		CloseHandle(f.ovl.hEvent);
+	}
+	mFolders.clear();
+	if (mWake) CloseHandle(mWake);
+	mWake = nullptr;
+#else
+	if (mWake[1] >= 0) {
+		char c = 0;
+		(void)!write(mWake[1], &c, 1);
+	}
+	if (mMonitorThr.joinable()) mMonitorThr.join();
+	for (int* fd : {&mInotify, &mWake[0], &mWake[1]}) {
+		if (*fd >= 0) close(*fd);
+		*fd = -1;
+	}
+	mDirs.clear();
+#endif
+}
+
+#ifdef _WIN32
+void Watcher::_readChanges(folder& f)
+{
+	ResetEvent(f.ovl.hEvent);
+	ReadDirectoryChangesW(f.dir, &f.buf[0], static_cast<DWORD>(f.buf.size() * sizeof(DWORD)), TRUE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE
+		| FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &f.ovl, nullptr);
+}
+#endif
+
+void Watcher::_monitorLoop()
+{
+#ifdef _WIN32
+	vector<HANDLE> events{mWake};
+	for (const folder& f : mFolders) events.emplace_back(f.ovl.hEvent);
+
+	for (;;) {
+		DWORD ret = WaitForMultipleObjects(static_cast<DWORD>(events.size()), &events[0], FALSE, INFINITE);
+		if (ret == WAIT_OBJECT_0 || ret >= WAIT_OBJECT_0 + events.size()) break;
+		folder& f = mFolders[ret - WAIT_OBJECT_0 - 1];
+
+		DWORD len = 0;
+		if (!GetOverlappedResult(f.dir, &f.ovl, &len, FALSE) || !len) {
+			_scan(f.path, false); // too many at once, they were lost: look at everything again
+		} else {
+			const BYTE* p = reinterpret_cast<const BYTE*>(&f.buf[0]);
+			for (;;) {
+				const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+				wstring path = Sys::joinPath(f.path,
+					wstring(info->FileName, info->FileNameLength / sizeof(wchar_t)));
+				if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_MODIFIED
+					|| info->Action == FILE_ACTION_RENAMED_NEW_NAME)
+				{
+					if (Sys::isDir(path)) {
+						if (info->Action != FILE_ACTION_MODIFIED) _scan(path, false); // moved in with its files
+					} else {
+						_touched(path, info->Action == FILE_ACTION_RENAMED_NEW_NAME);
+					}
+				}
+				if (!info->NextEntryOffset) break;
+				p += info->NextEntryOffset;
+			}
+		}
+		_readChanges(f);
+	}
+#elif defined(__linux__)
+	alignas(inotify_event) char buf[64 * 1024];
+	for (;;) {
+		pollfd fds[2] = {{mInotify, POLLIN, 0}, {mWake[0], POLLIN, 0}};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents) break;
+
+		for (ssize_t n; (n = read(mInotify, buf, sizeof(buf))) > 0; ) {
+			for (const char* p = buf; p < buf + n; ) {
+				const inotify_event* ev = reinterpret_cast<const inotify_event*>(p);
+				p += sizeof(inotify_event) + ev->len;
+
+				if (ev->mask & IN_Q_OVERFLOW) { // too many at once, they were lost: look at everything again
+					for (const wstring& path : mWOpts.folders) _scan(path, true);
+					continue;
+				}
+				auto dir = mDirs.find(ev->wd);
+				if (dir == mDirs.end()) continue;
+				if (ev->mask & IN_IGNORED) { // the folder is gone, or no longer watched
+					mDirs.erase(dir);
+					continue;
+				}
+				if (!ev->len) continue;
+
+				wstring path = Sys::joinPath(dir->second, Sys::fromUtf8(ev->name));
+				if (!(ev->mask & IN_ISDIR)) {
+					_touched(path, (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0);
+				} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					_scan(path, true); // its files may be there before its watch
+				} else if (ev->mask & IN_MOVED_FROM) {
+					// Its watches would give the old paths; the new ones come with its IN_MOVED_TO.
+					wstring under = path + L"/";
+					for (const auto& kv : mDirs) {
+						if (kv.second == path || kv.second.compare(0, under.size(), under) == 0) {
+							inotify_rm_watch(mInotify, kv.first);
+						}
+					}
+				}
+			}
+		}
+	}
+#endif
+}
+
+bool Watcher::_scan(const wstring& dir, bool addWatches)
+{
+#if !defined(_WIN32) && defined(__linux__)
+	if (addWatches) {
+		int wd = inotify_add_watch(mInotify, Sys::toUtf8(dir).c_str(), WATCH_MASK | IN_ONLYDIR);
+		if (wd < 0) return false;
+		mDirs[wd] = dir; // the same folder twice gives the same one
+	}
+#else
+	(void)addWatches;
+#endif
+	Sys::listDir(dir, [&](const wstring& path, bool isDir) {
+		if (isDir) {
+			_scan(path, addWatches);
+		} else {
+			_touched(path, true); // already there, not known to be written now
+		}
+		return true;
+	});
+	return true;
+}
+
+void Watcher::_touched(const wstring& path, bool closed)
+{
+	if (!Sys::hasExtension(path, {L".flac", L".mp3", L".wav"}) || _isOutput(path)) return;
+	uint64_t size = Sys::fileSize(path);
+	int64_t time = Sys::lastWriteTime(path);
+	auto now = clock_type::now();
+	{
+		std::lock_guard<std::mutex> lk(mMtx);
+		auto ins = mPending.emplace(path, pending());
+		pending& p = ins.first->second;
+		if (ins.second) p.landed = now;
+		p.changed = now;
+		p.size = size;
+		p.time = time;
+		p.closed = closed;
+		++mChanges;
+	}
+	mCv.notify_all();
+}
+
+bool Watcher::_isOutput(const wstring& path) const
+{
+	// Outputs are never sources, else each one would be converted into itself,
+	// over and over: a FLAC beside its source, for a FLAC target.
+	for (const Convert::output& o : mOutputs) {
+		if (Sys::hasExtension(path, o.ext) && Sys::isSamePath(Convert::destPath(path, o.dest, o.ext), path)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+vector<Watcher::arrival> Watcher::_takeReady(std::unique_lock<std::mutex>& lk, clock_type::time_point& nextDue)
+{
+	// A file is taken once it's quiet, unchanged since its last event, and no
+	// longer open for writing where the system tells; the ones taken are
+	// only as many as there's room for, the others wait in turn.
+	nextDue = clock_type::time_point::max();
+	if (mBusy >= mBudget) return {}; // when a file is done
+	auto now = clock_type::now();
+	auto settle = std::chrono::milliseconds(mWOpts.settleMs);
+
+	vector<std::pair<wstring, pending>> due;
+	for (const auto& kv : mPending) {
+		if (mConverting.count(kv.first)) continue; // again when its conversion is over
+		auto at = kv.second.changed + (kv.second.closed ? settle / 10 : settle);
+		if (at > now) {
+			nextDue = std::min(nextDue, at);
+		} else if (due.size() < mBudget - mBusy) {
+			due.emplace_back(kv);
+		}
+	}
+	if (due.empty()) return {};
+
+	enum class verdict { GONE, CHANGED, READY };
+	vector<verdict> verdicts;
+	lk.unlock(); // each one is looked at on the disk, which may be slow
+	for (auto& d : due) {
+		if (!Sys::exists(d.first)) {
+			verdicts.emplace_back(verdict::GONE);
+			continue;
+		}
+		uint64_t size = Sys::fileSize(d.first);
+		int64_t time = Sys::lastWriteTime(d.first);
+		bool same = size == d.second.size && time == d.second.time;
+		verdicts.emplace_back(same && !_isStillOpen(d.first) ? verdict::READY : verdict::CHANGED);
+		d.second.size = size;
+		d.second.time = time;
+	}
+	lk.lock();
+
+	vector<arrival> ready;
+	now = clock_type::now();
+	for (size_t i = 0; i < due.size(); ++i) {
+		auto it = mPending.find(due[i].first);
+		if (it == mPending.end() || it->second.changed != due[i].second.changed) continue; // touched meanwhile
+		if (verdicts[i] == verdict::GONE || mWriting.count(it->first)) { // or an intermediary of ours
+			mPending.erase(it);
+		} else if (verdicts[i] == verdict::CHANGED) { // written without a word, or still open
+			it->second.size = due[i].second.size;
+			it->second.time = due[i].second.time;
+			it->second.changed = now;
+			nextDue = std::min(nextDue, now + (it->second.closed ? settle / 10 : settle));
+		} else {
+			ready.emplace_back(it->first, it->second.landed);
+			mPending.erase(it);
+		}
+	}
+	return ready;
+}
+
+void Watcher::_startBatch(vector<arrival>&& files, std::unique_lock<std::mutex>& lk)
+{
+	auto b = std::make_unique<batch>();
+	b->opts = mOpts;
+	for (arrival& a : files) {
+		b->opts.files.emplace_back(std::move(a.first));
+		b->landed.emplace_back(a.second);
+	}
+	b->opts.numThreads = files.size(); // the budget already bounds them, so all start at once
+	b->filesLeft = files.size();
+	for (const wstring& src : b->opts.files) {
+		mConverting.insert(src);
+		for (const wstring& w : Runner::writtenPaths(b->opts, src)) mWriting.insert(w);
+	}
+	mBusy += files.size();
+	++mNumBatches;
+
+	batch* raw = b.get();
+	raw->runner = std::make_unique<Runner>(raw->opts);
+	mBatches.emplace_back(std::move(b));
+	lk.unlock(); // its files may finish before it returns
+	raw->runner->start([this, raw](const Runner::file_result& res) { _fileDone(*raw, res); });
+	lk.lock();
+}
+
+void Watcher::_reapBatches(std::unique_lock<std::mutex>& lk)
+{
+	vector<std::unique_ptr<batch>> done;
+	for (auto it = mBatches.begin(); it != mBatches.end(); ) {
+		if ((*it)->filesLeft) {
+			++it;
+		} else {
+			done.emplace_back(std::move(*it));
+			it = mBatches.erase(it);
+		}
+	}
+	if (done.empty()) return;
+	lk.unlock(); // the workers may still be past their last file, and lock on the way out
+	for (auto& b : done) b->runner->wait();
+	done.clear();
+	lk.lock();
+}
+
+void Watcher::_cancelBatches()
+{
+	// The tools are stopped and their outputs removed; the files come back
+	// when the watch starts again, the cache skipping the ones finished.
+	std::list<std::unique_ptr<batch>> batches;
+	{
+		std::lock_guard<std::mutex> lk(mMtx);
+		batches.swap(mBatches);
+	}
+	for (auto& b : batches) b->runner->cancel();
+	for (auto& b : batches) b->runner->wait();
+}
+
+void Watcher::_fileDone(batch& b, const Runner::file_result& res)
+{
+	const wstring& src = b.opts.files[res.index];
+	double latency = std::chrono::duration<double>(clock_type::now() - b.landed[res.index]).count();
+	if (!res.error.empty()) {
+		++mNumFailed;
+	} else if (res.cacheState == ConvCache::state::UP_TO_DATE) {
+		++mNumSkipped;
+	} else {
+		++mNumConverted;
+		double ms = latency * 1000;
+		size_t bucket = ms < 1 ? 0 : static_cast<size_t>(BUCKETS_PER_DECADE * std::log10(ms));
+		std::lock_guard<std::mutex> lk(mLatencyMtx);
+		++mLatency[std::min(bucket, mLatency.size() - 1)];
+	}
+	if (mOnFileDone) mOnFileDone(src, res, latency);
+
+	vector<wstring> written = Runner::writtenPaths(b.opts, src);
+	{
+		std::lock_guard<std::mutex> lk(mMtx);
+		mConverting.erase(mConverting.find(src));
+		for (const wstring& w : written) {
+			auto it = mWriting.find(w);
+			if (it != mWriting.end()) mWriting.erase(it);
+		}
+		--mBusy;
+		--b.filesLeft;
+		++mChanges;
+	}
+	mCv.notify_all();
+}
+
+bool Watcher::_isStillOpen(const wstring& path)
+{
+#ifdef _WIN32
+	// Denying others to write fails while a writer has it open.
+	HANDLE h = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return GetLastError() == ERROR_SHARING_VIOLATION;
+	CloseHandle(h);
+	return false;
+#else
+	(void)path;
+	return false; // the close events tell already
+#endif
+}
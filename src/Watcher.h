@@ -0,0 +1,117 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+#include "Runner.h"
+
+// Keeps converting what lands in some folders, for as long as it runs. The
+// system tells of each change, and a file is taken once its writer is done
+// with it; the files taken together make a small batch, run by a Runner with
+// the same options, while later ones start as workers free up. What it keeps
+// is bounded by the files pending and running, however long it runs.
+class Watcher final {
+public:
+	struct options final {
+		std::vector<std::wstring> folders; // subfolders included
+		unsigned settleMs = 2000; // quiet time before a file is taken; a tenth of it once its writer closed it
+	};
+
+	using file_done_func = std::function<void(const std::wstring& file,
+		const Runner::file_result& res, double latencySecs)>; // called from the workers
+
+private:
+	using clock_type = std::chrono::steady_clock;
+
+	struct pending final {
+		clock_type::time_point landed, changed; // first and last change seen
+		uint64_t size = 0;
+		int64_t  time = 0;
+		bool     closed = false; // by its writer, after the last change
+	};
+
+	struct batch final {
+		Runner::runnin_options opts; // the Runner only keeps a reference
+		std::vector<clock_type::time_point> landed; // per file
+		std::unique_ptr<Runner> runner;
+		size_t   filesLeft = 0;
+	};
+	using arrival = std::pair<std::wstring, clock_type::time_point>; // a file ready, and when it landed
+
+	Runner::runnin_options mOpts; // files aside, what every batch is given
+	options                mWOpts;
+	std::vector<Convert::output> mOutputs;
+	size_t                 mBudget = 0; // files converting at once, all batches together
+	file_done_func         mOnFileDone;
+
+	mutable std::mutex      mMtx;
+	std::condition_variable mCv;
+	bool                    mStop = false;
+	uint64_t                mChanges = 0; // anything the loop would look at again
+	std::map<std::wstring, pending> mPending;
+	std::multiset<std::wstring> mConverting, mWriting; // sources running, and what they may write
+	std::list<std::unique_ptr<batch>> mBatches;
+	size_t                  mBusy = 0;
+
+	std::atomic<size_t>     mNumConverted{0}, mNumSkipped{0}, mNumFailed{0}, mNumBatches{0};
+	mutable std::mutex      mLatencyMtx;
+	std::array<uint64_t, 160> mLatency{}; // files converted, by log-spaced bucket of 1 ms up
+
+	std::thread             mMonitorThr;
+#ifdef _WIN32
+	struct folder final {
+		std::wstring path;
+		HANDLE       dir = INVALID_HANDLE_VALUE;
+		OVERLAPPED   ovl{};
+		std::vector<DWORD> buf;
+	};
+	std::vector<folder> mFolders;
+	HANDLE              mWake = nullptr;
+
+	void _readChanges(folder& f);
+#else
+	int                 mInotify = -1, mWake[2] = {-1, -1};
+	std::map<int, std::wstring> mDirs; // by watch descriptor, only touched by the monitor
+#endif
+
+public:
+	Watcher(const Runner::runnin_options& opts, const options& wopts);
+	Watcher(const Watcher&) = delete;
+	Watcher& operator=(const Watcher&) = delete;
+	~Watcher();
+
+	void   run(file_done_func onFileDone); // until stop(), on the calling thread; throws if it can't watch
+	void   stop(); // from any thread; the running batches are cancelled
+	size_t numConverted() const { return mNumConverted; }
+	size_t numSkipped() const { return mNumSkipped; }
+	size_t numFailed() const { return mNumFailed; }
+	size_t numBatches() const { return mNumBatches; }
+	double latencySecs(double percentile) const; // from landing to output, of the files converted
+
+private:
+	void _startMonitor();
+	void _stopMonitor();
+	void _monitorLoop();
+	bool _scan(const std::wstring& dir, bool addWatches); // false if it can't be watched
+	void _touched(const std::wstring& path, bool closed);
+	bool _isOutput(const std::wstring& path) const;
+	std::vector<arrival> _takeReady(std::unique_lock<std::mutex>& lk, clock_type::time_point& nextDue);
+	void _startBatch(std::vector<arrival>&& files, std::unique_lock<std::mutex>& lk);
+	void _reapBatches(std::unique_lock<std::mutex>& lk);
+	void _cancelBatches();
+	void _fileDone(batch& b, const Runner::file_result& res);
+	static bool _isStillOpen(const std::wstring& path);
+};
@@ -0,0 +1,154 @@
+// Makespan simulation of the runner's dispatch order against FIFO, the list
+// order, over random batches shaped like real libraries: log-normal track
+// lengths, a few long live recordings, and sources spread over spinning disks
+// listed one folder after the other. Prints the gain, and the exit code is
+// nonzero if longest-first stops paying off.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <utility>
+#include <vector>
+#include "DeviceGate.h"
+#include "Runner.h"
+using std::vector;
+
+namespace {
+
+int numFailed = 0;
+
+void check(bool ok, const char* what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		++numFailed;
+	}
+}
+
+struct batch final {
+	vector<double>   costs;   // seconds of audio, which encoding time follows
+	vector<uint64_t> devices; // source disk of each file
+};
+
+batch randomBatch(std::mt19937& rng, size_t numFiles, unsigned numDisks)
+{
+	std::lognormal_distribution<double> track(std::log(240.0), 0.5); // median 4 min
+	std::uniform_real_distribution<double> live(1800, 7200), coin(0, 1);
+	batch b;
+	for (size_t i = 0; i < numFiles; ++i) {
+		b.costs.emplace_back(coin(rng) < 0.02 ? live(rng) : track(rng));
+		b.devices.emplace_back(numDisks < 2 ? 0 : 1 + i * numDisks / numFiles); // dropped folder by folder
+	}
+	return b;
+}
+
+// Each free worker takes the first file in order whose disk has a free slot,
+// as a file parked by the DeviceGate lets its worker move on to the next one.
+double makespan(const batch& b, const vector<size_t>& order, unsigned numWorkers, unsigned diskJobs)
+{
+	vector<bool> taken(order.size(), false);
+	std::map<uint64_t, unsigned> running;
+	using finish = std::pair<double, uint64_t>; // time, disk
+	std::priority_queue<finish, vector<finish>, std::greater<finish>> finishes;
+	unsigned numFree = numWorkers;
+	double now = 0;
+	size_t numLeft = order.size();
+
+	for (;;) {
+		for (size_t k = 0; k < order.size() && numFree && numLeft; ++k) {
+			size_t i = order[k];
+			uint64_t dev = b.devices[i];
+			if (taken[k] || (dev && running[dev] >= diskJobs)) continue;
+			taken[k] = true;
+			--numLeft;
+			--numFree;
+			++running[dev];
+			finishes.emplace(now + b.costs[i], dev);
+		}
+		if (finishes.empty()) return now;
+		now = finishes.top().first;
+		--running[finishes.top().second];
+		++numFree;
+		finishes.pop();
+	}
+}
+
+double lowerBound(const batch& b, unsigned numWorkers, unsigned diskJobs)
+{
+	double total = std::accumulate(b.costs.begin(), b.costs.end(), 0.0);
+	double bound = std::max(total / numWorkers, *std::max_element(b.costs.begin(), b.costs.end()));
+	std::map<uint64_t, double> perDisk;
+	for (size_t i = 0; i < b.costs.size(); ++i) perDisk[b.devices[i]] += b.costs[i];
+	for (const auto& d : perDisk) {
+		if (d.first) bound = std::max(bound, d.second / diskJobs);
+	}
+	return bound;
+}
+
+struct outcome final {
+	double meanGain, p95Gain; // FIFO makespan over the dispatch order's
+	double worstOverBound;    // dispatch order's makespan over the lower bound
+};
+
+outcome simulate(size_t numFiles, unsigned numWorkers, unsigned numDisks, unsigned diskJobs)
+{
+	const int NUM_BATCHES = 300;
+	std::mt19937 rng(12345); // same batches each run
+	vector<double> gains;
+	double worst = 0;
+	for (int n = 0; n < NUM_BATCHES; ++n) {
+		batch b = randomBatch(rng, numFiles, numDisks);
+		vector<size_t> fifo(numFiles);
+		std::iota(fifo.begin(), fifo.end(), 0);
+		double fifoSpan = makespan(b, fifo, numWorkers, diskJobs);
+		double span = makespan(b, Runner::dispatchOrder(b.costs, b.devices), numWorkers, diskJobs);
+		gains.emplace_back(fifoSpan / span);
+		worst = std::max(worst, span / lowerBound(b, numWorkers, diskJobs));
+	}
+	std::sort(gains.begin(), gains.end());
+	return {std::accumulate(gains.begin(), gains.end(), 0.0) / gains.size(),
+		gains[gains.size() * 95 / 100], worst};
+}
+
+}//namespace
+
+int main()
+{
+	struct scenario final {
+		size_t   numFiles;
+		unsigned numWorkers, numDisks, diskJobs;
+	};
+	const scenario scenarios[] = {
+		{50, 8, 1, 0},
+		{200, 8, 1, 0},
+		{200, 16, 1, 0},
+		{1000, 16, 1, 0},
+		{200, 8, 2, DeviceGate::SEEK_DEVICE_JOBS},
+		{600, 12, 3, DeviceGate::SEEK_DEVICE_JOBS},
+	};
+
+	puts(" files workers disks   FIFO/LPT mean    p95   worst LPT/bound");
+	for (const scenario& s : scenarios) {
+		unsigned diskJobs = s.diskJobs ? s.diskJobs : s.numWorkers; // one disk, no gate
+		outcome o = simulate(s.numFiles, s.numWorkers, s.numDisks, diskJobs);
+		printf("%6zu %7u %5u %14.2fx %5.2fx %16.3f\n",
+			s.numFiles, s.numWorkers, s.numDisks, o.meanGain, o.p95Gain, o.worstOverBound);
+
+		check(o.meanGain > 1.05, "longest-first beats FIFO on average");
+		if (s.numDisks == 1) {
+			check(o.worstOverBound <= 4.0 / 3, "longest-first within Graham's bound");
+		}
+	}
+
+	if (numFailed) {
+		fprintf(stderr, "%d check(s) failed\n", numFailed);
+		return 1;
+	}
+	return 0;
+}
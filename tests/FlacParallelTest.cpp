@@ -0,0 +1,187 @@
+// Equivalence of the parallel FLAC encoder with the serial one: the same PCM,
+// cut into several segments with a short last block and past frame 127, whose
+// number takes two bytes, is encoded both ways, then both are decoded and
+// compared sample by sample, along with their STREAMINFO. Built only with
+// FLE_INPROC_CODECS; the exit code is nonzero if any check fails.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+#include <FLAC/stream_decoder.h>
+#include "Codec.h"
+#include "FlacParallel.h"
+#include "Sys.h"
+using std::vector;
+using std::wstring;
+
+namespace {
+
+int numFailed = 0;
+
+void check(bool ok, const char* what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		++numFailed;
+	}
+}
+
+// A sweep with some noise, so the frames don't all compress alike; full scale
+// now and then, to reach the extremes of the bit depth.
+vector<int32_t> makePcm(const Codec::format& fmt)
+{
+	vector<int32_t> pcm(fmt.totalFrames * fmt.channels);
+	int32_t peak = (1 << (fmt.bitsPerSample - 1)) - 1;
+	uint32_t rnd = 12345;
+	for (size_t f = 0; f < fmt.totalFrames; ++f) {
+		double t = static_cast<double>(f) / fmt.sampleRate;
+		for (unsigned c = 0; c < fmt.channels; ++c) {
+			rnd = rnd * 1664525 + 1013904223;
+			double v = 0.6 * std::sin(2 * 3.14159265358979 * (110 + 40 * t) * t * (c + 1))
+				+ 0.05 * (static_cast<int32_t>(rnd >> 8) / 8388608.0 - 1);
+			int32_t s = static_cast<int32_t>(v * peak);
+			if (f % 50000 == 0) s = c ? -peak - 1 : peak;
+			pcm[f * fmt.channels + c] = s;
+		}
+	}
+	return pcm;
+}
+
+// Fed in uneven chunks, as decoders hand them, so segments fill across calls.
+void encode(Codec::encoder& enc, const vector<int32_t>& pcm, unsigned channels)
+{
+	static const size_t CHUNKS[] = {1, 4096, 10007, 333, 65536};
+	size_t pos = 0, numFrames = pcm.size() / channels;
+	for (size_t n = 0; pos < numFrames; ++n) {
+		size_t take = CHUNKS[n % (sizeof(CHUNKS) / sizeof(CHUNKS[0]))];
+		if (take > numFrames - pos) take = numFrames - pos;
+		enc.write(&pcm[pos * channels], take);
+		pos += take;
+	}
+	enc.finish();
+}
+
+struct decoded final {
+	vector<int32_t> pcm;
+	uint64_t totalSamples = 0;
+	uint8_t  md5[16] = {0};
+	unsigned blockSize = 0;
+	bool     numbersInOrder = true; // each frame starts where the previous ended
+	bool     ok = false;            // no stream error, and the MD5 matched the PCM
+};
+
+decoded decode(const wstring& path)
+{
+	decoded d;
+	FLAC__StreamDecoder* dec = FLAC__stream_decoder_new();
+	FLAC__stream_decoder_set_md5_checking(dec, true);
+	bool streamError = false;
+	struct context final {
+		decoded& d;
+		bool&    streamError;
+	} ctx = {d, streamError};
+
+	auto writeCb = [](const FLAC__StreamDecoder*, const FLAC__Frame* frame,
+		const FLAC__int32* const buffer[], void* clientData) -> FLAC__StreamDecoderWriteStatus
+	{
+		decoded& d = static_cast<context*>(clientData)->d;
+		size_t channels = frame->header.channels, samplesSoFar = d.pcm.size() / channels;
+		if (frame->header.number_type != FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER
+			|| frame->header.number.sample_number != samplesSoFar)
+		{
+			d.numbersInOrder = false;
+		}
+		for (unsigned i = 0; i < frame->header.blocksize; ++i) {
+			for (size_t c = 0; c < channels; ++c) d.pcm.emplace_back(buffer[c][i]);
+		}
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	};
+	auto metadataCb = [](const FLAC__StreamDecoder*, const FLAC__StreamMetadata* meta, void* clientData) {
+		if (meta->type != FLAC__METADATA_TYPE_STREAMINFO) return;
+		decoded& d = static_cast<context*>(clientData)->d;
+		d.totalSamples = meta->data.stream_info.total_samples;
+		d.blockSize = meta->data.stream_info.max_blocksize;
+		memcpy(d.md5, meta->data.stream_info.md5sum, 16);
+	};
+	auto errorCb = [](const FLAC__StreamDecoder*, FLAC__StreamDecoderErrorStatus, void* clientData) {
+		static_cast<context*>(clientData)->streamError = true; // bad CRC or lost sync
+	};
+
+	FILE* fp = Sys::openFile(path, "rb");
+	if (fp && FLAC__stream_decoder_init_FILE(dec, fp, writeCb, metadataCb, errorCb, &ctx)
+		== FLAC__STREAM_DECODER_INIT_STATUS_OK) // file is closed by the decoder
+	{
+		bool processed = FLAC__stream_decoder_process_until_end_of_stream(dec);
+		d.ok = FLAC__stream_decoder_finish(dec) && processed && !streamError; // finish is false on MD5 mismatch
+	} else if (fp) {
+		fclose(fp);
+	}
+	FLAC__stream_decoder_delete(dec);
+	return d;
+}
+
+void testEquivalence(const Codec::format& fmtIn, unsigned level, const char* name)
+{
+	unsigned blockSize = level <= 2 ? 1152 : 4096;
+	Codec::format fmt = fmtIn;
+	fmt.totalFrames = blockSize * (64 * 2 + 40) + 1000; // three segments, the last with a short block
+	vector<int32_t> pcm = makePcm(fmt);
+
+	wstring parPath = Sys::joinPath(Sys::tempFolder(), L"fle-parallel-test.flac");
+	wstring serPath = Sys::joinPath(Sys::tempFolder(), L"fle-serial-test.flac");
+	{
+		FlacParallel par(parPath, fmt, level, true, 4);
+		encode(par, pcm, fmt.channels);
+	}
+	encode(*Codec::openFlacEncoder(serPath, fmt, level, true), pcm, fmt.channels);
+
+	decoded par = decode(parPath), ser = decode(serPath);
+	Sys::removeFile(parPath);
+	Sys::removeFile(serPath);
+
+	printf("%s: %llu samples, %llu frames\n", name,
+		static_cast<unsigned long long>(fmt.totalFrames),
+		static_cast<unsigned long long>((fmt.totalFrames + blockSize - 1) / blockSize));
+	check(par.ok, "parallel stream decodes cleanly, MD5 matching");
+	check(ser.ok, "serial stream decodes cleanly, MD5 matching");
+	check(par.numbersInOrder, "parallel frame numbers follow on, two-byte ones too");
+	check(par.pcm == ser.pcm, "parallel and serial PCM identical");
+	check(par.pcm == pcm, "parallel PCM identical to the input");
+	check(par.totalSamples == ser.totalSamples && par.totalSamples == fmt.totalFrames,
+		"STREAMINFO total samples match");
+	check(!memcmp(par.md5, ser.md5, 16), "STREAMINFO MD5 signatures match");
+	check(par.blockSize == ser.blockSize, "STREAMINFO block sizes match");
+}
+
+}//namespace
+
+int main()
+{
+	try {
+		Codec::format cd;
+		cd.sampleRate = 44100;
+		cd.channels = 2;
+		cd.bitsPerSample = 16;
+		testEquivalence(cd, 5, "16-bit stereo, level 5");
+
+		Codec::format hiRes;
+		hiRes.sampleRate = 96000;
+		hiRes.channels = 1;
+		hiRes.bitsPerSample = 24;
+		testEquivalence(hiRes, 1, "24-bit mono, level 1");
+	} catch (const std::exception& e) {
+		fprintf(stderr, "FAILED: %s\n", e.what());
+		return 1;
+	}
+
+	if (numFailed) {
+		fprintf(stderr, "%d check(s) failed\n", numFailed);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,257 @@
+// Stress test of the scheduler: thousands of stub jobs, each one must run
+// exactly once, whatever happens to the workers meanwhile. Exit code is
+// nonzero if any check fails.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "Scheduler.h"
+#include "Sys.h"
+using std::atomic;
+
+namespace {
+
+int numFailed = 0;
+
+void check(bool ok, const char* what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		++numFailed;
+	}
+}
+
+void spin(int micros)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(micros));
+}
+
+// One counter per job; after the batch, each must be 1, or 0 when cancelled.
+struct tally final {
+	std::unique_ptr<atomic<int>[]> runs;
+	size_t count;
+
+	explicit tally(size_t count) : runs(new atomic<int>[count]), count(count) {
+		for (size_t i = 0; i < count; ++i) runs[i] = 0;
+	}
+	size_t numRan() const {
+		size_t n = 0;
+		for (size_t i = 0; i < count; ++i) n += runs[i] > 0;
+		return n;
+	}
+	bool noneTwice() const {
+		for (size_t i = 0; i < count; ++i) {
+			if (runs[i] > 1) return false;
+		}
+		return true;
+	}
+};
+
+size_t numWorkers()
+{
+	return std::max<size_t>(Sys::numProcessors(), 4); // a few even on a single core, to have something to steal
+}
+
+void testAllRunOnce()
+{
+	const size_t NUM_JOBS = 20000;
+	tally t(NUM_JOBS);
+	Scheduler sched(numWorkers());
+	for (size_t i = 0; i < NUM_JOBS; ++i) {
+		sched.submit([&t, i](size_t) { ++t.runs[i]; }, i % 7 == 0); // some ahead of the queue
+	}
+	sched.close();
+	sched.join();
+
+	check(t.numRan() == NUM_JOBS, "every job ran");
+	check(t.noneTwice(), "no job ran twice");
+	check(sched.numDone() == NUM_JOBS, "numDone counts every job");
+	check(sched.numPending() == 0, "nothing pending after join");
+}
+
+void testJobsSubmitJobs()
+{
+	const size_t NUM_PARENTS = 3000; // each one queues a child, as the verify jobs do
+	tally t(NUM_PARENTS * 2);
+	Scheduler sched(numWorkers());
+	for (size_t i = 0; i < NUM_PARENTS; ++i) {
+		sched.submit([&t, &sched, i](size_t) {
+			++t.runs[i];
+			sched.submit([&t, i](size_t) { ++t.runs[NUM_PARENTS + i]; }, true);
+		});
+	}
+	sched.close(); // children still come in, since their parents are pending
+	sched.join();
+
+	check(t.numRan() == NUM_PARENTS * 2, "children submitted after close ran");
+	check(t.noneTwice(), "no parent or child ran twice");
+	check(sched.numPending() == 0, "nothing pending after join");
+}
+
+void testFirstRunsNext()
+{
+	// A job queued ahead from a job runs next on that job's worker, not at
+	// the front of a busy one's deque, behind everything the thieves take.
+	// Submitted round-robin, job i goes to deque (i + 1) % 2, after the
+	// blocking one; the counts below would put the child behind the blocked worker.
+	Scheduler sched(2);
+	atomic<bool> release{false};
+	atomic<int> blockedIdx{-1};
+	sched.submit([&release, &blockedIdx](size_t workerIdx) {
+		blockedIdx = static_cast<int>(workerIdx);
+		while (!release) spin(100);
+	});
+	while (blockedIdx < 0) spin(100);
+	const size_t PARENT = blockedIdx == 0 ? 0 : 1; // first in the free worker's deque
+	const size_t NUM_JOBS = blockedIdx == 0 ? 21 : 20;
+
+	std::mutex mtx;
+	std::vector<size_t> order; // of the jobs, as they start
+	auto started = [&mtx, &order](size_t n) {
+		std::lock_guard<std::mutex> lk(mtx);
+		order.emplace_back(n);
+	};
+	for (size_t i = 0; i < NUM_JOBS; ++i) {
+		sched.submit([&sched, &started, i, PARENT, NUM_JOBS](size_t) {
+			started(i);
+			if (i != PARENT) return;
+			spin(5000); // the others are all queued by now, half of them behind the blocked worker
+			sched.submit([&started, NUM_JOBS](size_t) { started(NUM_JOBS); }, true);
+		});
+	}
+	while (sched.numDone() < NUM_JOBS + 1) spin(100);
+	release = true;
+	sched.close();
+	sched.join();
+
+	auto parent = std::find(order.begin(), order.end(), PARENT);
+	check(order.size() == NUM_JOBS + 1, "all jobs ran beside the blocked worker");
+	check(parent != order.end() && parent + 1 != order.end() && parent[1] == NUM_JOBS,
+		"a job queued ahead from a job runs next");
+}
+
+void testActiveLimit()
+{
+	const size_t NUM_JOBS = 4000;
+	tally t(NUM_JOBS);
+	atomic<size_t> numOutside{0}; // jobs run by a parked worker
+	Scheduler sched(numWorkers());
+
+	sched.setActiveLimit(1);
+	for (size_t i = 0; i < NUM_JOBS / 2; ++i) {
+		sched.submit([&t, &numOutside, i](size_t workerIdx) {
+			++t.runs[i];
+			if (workerIdx != 0) ++numOutside;
+		});
+	}
+	while (sched.numPending()) spin(100);
+	check(numOutside == 0, "only the active worker runs at limit 1");
+
+	for (size_t i = NUM_JOBS / 2; i < NUM_JOBS; ++i) {
+		sched.submit([&t, i](size_t) {
+			++t.runs[i];
+			spin(20);
+		});
+	}
+	for (size_t n = 0; n < 200; ++n) { // park and unpark while the deques drain
+		sched.setActiveLimit(1 + n % sched.numWorkers());
+		spin(50);
+	}
+	sched.setActiveLimit(2); // the parked ones' deques are stolen from the front
+	sched.close();
+	sched.join();
+
+	check(t.numRan() == NUM_JOBS, "every job ran across limit changes");
+	check(t.noneTwice(), "no job ran twice across limit changes");
+	check(sched.numDone() == NUM_JOBS, "numDone counts every job across limit changes");
+}
+
+void testRetire()
+{
+	const size_t NUM_JOBS = 5000;
+	tally t(NUM_JOBS);
+	Scheduler sched(numWorkers());
+	for (size_t i = 0; i < NUM_JOBS; ++i) {
+		sched.submit([&t, &sched, i](size_t workerIdx) {
+			++t.runs[i];
+			if (i == 10 && workerIdx) sched.retire(workerIdx); // as a lost node does
+		});
+	}
+	sched.close();
+	sched.join();
+
+	check(t.numRan() == NUM_JOBS, "a retired worker's deque runs on the others");
+	check(t.noneTwice(), "no job ran twice after a retire");
+}
+
+void testCancel()
+{
+	const size_t NUM_JOBS = 10000;
+	tally t(NUM_JOBS);
+	Scheduler sched(numWorkers());
+	for (size_t i = 0; i < NUM_JOBS; ++i) {
+		sched.submit([&t, i](size_t) {
+			++t.runs[i];
+			spin(50);
+		});
+	}
+	while (sched.numDone() < 200) spin(100);
+	sched.cancel();
+	sched.submit([&t](size_t) { ++t.runs[0]; }); // dropped, the batch is over
+	while (!sched.finished()) spin(100); // as a dialog polls, instead of blocking on join
+	sched.join();
+
+	check(t.noneTwice(), "no job ran twice after cancel");
+	check(t.numRan() == sched.numDone(), "numDone matches the jobs that ran after cancel");
+	check(t.numRan() < NUM_JOBS, "cancel dropped the queued jobs");
+	check(sched.numPending() == 0, "nothing pending after cancel");
+}
+
+void testFirstError()
+{
+	const size_t NUM_JOBS = 2000;
+	tally t(NUM_JOBS);
+	Scheduler sched(numWorkers());
+	for (size_t i = 0; i < NUM_JOBS; ++i) {
+		sched.submit([&t, i](size_t) {
+			++t.runs[i];
+			if (i % 500 == 0) throw std::runtime_error("stub failure");
+		});
+	}
+	sched.close();
+	bool rethrown = false;
+	try {
+		sched.join();
+	} catch (const std::runtime_error&) {
+		rethrown = true;
+	}
+
+	check(rethrown, "join rethrows the first job error");
+	check(t.numRan() == NUM_JOBS, "a failing job doesn't stop the others");
+}
+
+}//namespace
+
+int main()
+{
+	testAllRunOnce();
+	testJobsSubmitJobs();
+	testFirstRunsNext();
+	testActiveLimit();
+	testRetire();
+	testCancel();
+	testFirstError();
+
+	if (numFailed) {
+		fprintf(stderr, "%d check(s) failed\n", numFailed);
+		return 1;
+	}
+	puts("scheduler: all checks passed");
+	return 0;
+}